@@ -0,0 +1,171 @@
+# Benchmarks of node-marshal stages: parsing, dumping (NODEMARSHAL12 and
+# NODEMARSHAL11 formats), compression, base85r encoding, loading,
+# compilation and the first evaluation. Each stage is timed separately
+# (the best of N runs), throughput (nodes per second) and allocated Ruby
+# objects per node are reported. Internal phases of dumping and loading
+# (counting of nodes, dump_nodes, resolving of ordinals, load_nodes_from_str
+# etc.) are taken from NodeMarshal#stats and reported as separate rows
+# (e.g. to_hash.count_nodes, load_bin.nodes).
+#
+# Usage:
+#   ruby bench/bench.rb [--scales=1000,10000,100000] [--repeat=3]
+#     [--json=results.json] [--baseline=baseline.json] [--threshold=1.25]
+#   rake bench SCALES=1000,1000000 BASELINE=baseline.json
+#
+# --json saves the machine-readable results, --baseline compares them with
+# the saved results: the program exits with non-zero status if some stage
+# became slower than +threshold+ times.
+#
+# (C) 2015-2017 Alexey Voskov
+# License: BSD-2-Clause
+require 'json'
+require_relative 'corpus.rb'
+
+module NodeMarshalBench
+	# Stages of the benchmark: [name, code, setup, phases]. Lambdas receive
+	# the state Hash (source and results of the previous stages); setup is
+	# not timed, phases returns the NodeMarshal#stats section of the stage
+	FRESH_NODE = lambda {|st| st[:fresh] = NodeMarshal.new(:srcmemory, st[:src]) }
+	DUMP_PHASES = lambda {|st| st[:fresh].stats[:to_hash] || st[:fresh].stats[:to_bin] }
+	STAGES = [
+		# rb_compile_string (parser)
+		[:parse, lambda {|st| st[:node] = NodeMarshal.new(:srcmemory, st[:src]) }],
+		# count_num_of_nodes and dump_nodes (NODEInfo_toHash)
+		[:to_hash, lambda {|st| st[:hash] = st[:fresh].to_hash }, FRESH_NODE, DUMP_PHASES],
+		# NODEMARSHAL11 serialization
+		[:marshal_dump, lambda {|st| st[:marshal] = Marshal.dump(st[:hash]) }],
+		# The native binary container (NODEMARSHAL12)
+		[:to_bin, lambda {|st| st[:bin] = st[:fresh].to_bin }, FRESH_NODE, DUMP_PHASES],
+		[:compress, lambda {|st| st[:frame] = NodeMarshal::Codec.compress(st[:bin]) }],
+		[:base85r_encode, lambda {|st| st[:text] = NodeMarshal.base85r_encode(st[:frame]) }],
+		# base85r decoding and inflate (fused)
+		[:decode, lambda {|st| NodeMarshal::Codec.decode_base85r(st[:text]) }],
+		# Marshal.load, resolve_*_ords and load_nodes_from_str
+		[:load_marshal, lambda {|st| st[:loaded_marshal] = NodeMarshal.new(:binmemory, st[:marshal], :gc_start => false) },
+			nil, lambda {|st| st[:loaded_marshal].stats[:load] }],
+		# Native loader of the binary container
+		[:load_bin, lambda {|st| st[:loaded] = NodeMarshal.new(:binmemory, st[:bin], :gc_start => false) },
+			nil, lambda {|st| st[:loaded].stats[:load] }],
+		# NodeMarshal#compile (code generation)
+		[:compile, lambda {|st| st[:iseq] = st[:loaded].compile }],
+		# The first evaluation (only for the synthetic programs)
+		[:eval, lambda {|st| st[:iseq].eval }]
+	]
+
+	def self.allocated_objects
+		GC.stat(:total_allocated_objects)
+	end
+
+	# Keeps the result if it is the first one or faster than the saved one
+	def self.keep_best(stages, stage, time, allocs)
+		if !stages[stage] || stages[stage][:time] > time
+			stages[stage] = {:time => time, :allocs => allocs}
+		end
+	end
+
+	# call-seq:
+	#   NodeMarshalBench.run_entry(name, src, run_eval, repeat)
+	#
+	# Runs all stages for the source and returns the Hash with results
+	# (the best time of +repeat+ runs for each stage and each of its phases)
+	def self.run_entry(name, src, run_eval, repeat)
+		num_of_nodes = NodeMarshal.new(:srcmemory, src).to_hash[:num_of_nodes]
+		stages = {}
+		repeat.times do
+			st = {:src => src, :eval => run_eval}
+			STAGES.each do |stage, code, setup, phases|
+				next if stage == :eval && !run_eval
+				setup.call(st) if setup
+				GC.start
+				allocs = allocated_objects
+				t = Time.now
+				code.call(st)
+				time = Time.now - t
+				allocs = allocated_objects - allocs
+				keep_best(stages, stage, time, allocs)
+				next if !phases
+				(phases.call(st) || {}).each do |phase, res|
+					next if phase == :total
+					keep_best(stages, :"#{stage}.#{phase}", res[:time], res[:allocs])
+				end
+			end
+		end
+		stages.each_value do |res|
+			res[:nodes_per_sec] = (res[:time] > 0) ? (num_of_nodes / res[:time]).round : nil
+			res[:allocs_per_node] = (res[:allocs].to_f / num_of_nodes).round(3)
+		end
+		{:name => name, :nodes => num_of_nodes, :source_bytes => src.bytesize,
+			:bin_bytes => NodeMarshal.new(:srcmemory, src).to_bin.bytesize, :stages => stages}
+	end
+
+	# Prints the table with results
+	def self.print_results(results)
+		puts "%-24s %9s %-28s %10s %14s %12s" % ['entry', 'nodes', 'stage', 'time, ms', 'nodes/s', 'allocs/node']
+		results.each do |res|
+			res[:stages].each do |stage, st|
+				puts "%-24s %9d %-28s %10.3f %14s %12.3f" % [res[:name], res[:nodes], stage,
+					st[:time] * 1000, st[:nodes_per_sec].to_s, st[:allocs_per_node]]
+			end
+		end
+	end
+
+	# call-seq:
+	#   NodeMarshalBench.compare(results, baseline, threshold)
+	#
+	# Prints ratios of times (current / baseline). Returns the array
+	# of regressions ([entry, stage, ratio]) slower than +threshold+
+	def self.compare(results, baseline, threshold)
+		regressions = []
+		base = {}
+		baseline['results'].each {|res| base[res['name']] = res }
+		puts "%-24s %-28s %10s %10s %8s" % ['entry', 'stage', 'base, ms', 'now, ms', 'ratio']
+		results.each do |res|
+			next if !base[res[:name]]
+			res[:stages].each do |stage, st|
+				old = base[res[:name]]['stages'][stage.to_s]
+				next if old.nil? || old['time'] <= 0
+				ratio = st[:time] / old['time']
+				mark = (ratio > threshold) ? ' SLOWER' : ''
+				puts "%-24s %-28s %10.3f %10.3f %8.2f%s" % [res[:name], stage, old['time'] * 1000,
+					st[:time] * 1000, ratio, mark]
+				regressions << [res[:name], stage, ratio] if ratio > threshold
+			end
+		end
+		regressions
+	end
+
+	def self.main(argv)
+		opts = {:scales => [1000, 10000, 100000], :repeat => 3, :threshold => 1.25}
+		argv.each do |arg|
+			case arg
+			when /^--scales=([\d,]+)$/ then opts[:scales] = $1.split(',').map(&:to_i)
+			when /^--repeat=(\d+)$/ then opts[:repeat] = [$1.to_i, 1].max
+			when /^--json=(.+)$/ then opts[:json] = $1
+			when /^--baseline=(.+)$/ then opts[:baseline] = $1
+			when /^--threshold=([\d.]+)$/ then opts[:threshold] = $1.to_f
+			else
+				raise ArgumentError, "Unknown argument #{arg}"
+			end
+		end
+		results = Corpus.entries(opts[:scales]).map do |name, src, run_eval|
+			$stderr.puts "Running #{name}..."
+			run_entry(name, src, run_eval, opts[:repeat])
+		end
+		print_results(results)
+		if opts[:json]
+			File.write(opts[:json], JSON.pretty_generate({:ruby_version => RUBY_VERSION,
+				:ruby_platform => RUBY_PLATFORM, :time => Time.now.to_s,
+				:repeat => opts[:repeat], :results => results}))
+		end
+		if opts[:baseline]
+			regressions = compare(results, JSON.parse(File.read(opts[:baseline])), opts[:threshold])
+			if regressions.size > 0
+				puts "Regressions: #{regressions.size} stage(s) slower than #{opts[:threshold]}x"
+				return 1
+			end
+		end
+		0
+	end
+end
+
+exit(NodeMarshalBench.main(ARGV)) if $0 == __FILE__
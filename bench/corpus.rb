@@ -0,0 +1,73 @@
+# Corpus of Ruby sources for the benchmarks (see bench.rb): synthetic
+# programs of the given size (in nodes) and real files from the gem.
+#
+# (C) 2015-2017 Alexey Voskov
+# License: BSD-2-Clause
+require_relative '../lib/node-marshal.rb'
+
+module NodeMarshalBench
+	module Corpus
+		# Real files: test programs and the library itself
+		REAL_FILES = ['../test/lifegame.rb', '../test/tinytet.rb',
+			'../lib/node-marshal.rb', '../lib/node-marshal/batch_compiler.rb'].map {|name|
+			File.expand_path(name, File.dirname(__FILE__)) }
+
+		# Methods in one synthetic class
+		METHODS_PER_CLASS = 100
+
+		# Method with the typical constructions (arguments, literals, blocks,
+		# conditions, loops, exceptions, safe navigation)
+		def self.method_source(i)
+			<<-EOS
+	def m#{i}(a, b = #{i}, *rest, key: :k#{i % 50}, &blk)
+		x = a + b * #{i} - rest.size
+		s = "str #{i} \#{x} " + 'lit'
+		h = {:a => [1, 2.5, x], 'b' => (1..#{i})}
+		@iv#{i % 20} ||= h[:a].map { |v| v.to_s * 2 }
+		r = case x when 0 then :zero when 1..10 then s.sub(/s(t)r/, 'S') else x.abs end
+		y = 0
+		while y < 3
+			y += 1
+		end
+		begin
+			Integer(s)
+		rescue ArgumentError => e
+			e&.message
+		end
+		blk ? blk.call(x, key) : [x, y, r, s, h]
+	end
+			EOS
+		end
+
+		# Synthetic program with the given number of methods
+		def self.source_with_methods(num)
+			src = ''
+			(0...num).each_slice(METHODS_PER_CLASS) do |inds|
+				src << "class BenchCorpus#{inds.first / METHODS_PER_CLASS}\n"
+				inds.each {|i| src << method_source(i) }
+				src << "end\n"
+			end
+			src << "[#{(num + METHODS_PER_CLASS - 1) / METHODS_PER_CLASS}, #{num}]\n"
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Corpus.synthetic(num_of_nodes)
+		#
+		# Returns the synthetic program with approximately +num_of_nodes+ nodes
+		def self.synthetic(num_of_nodes)
+			per_method = NodeMarshal.new(:srcmemory, source_with_methods(10)).to_hash[:num_of_nodes] / 10.0
+			source_with_methods([(num_of_nodes / per_method).round, 1].max)
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Corpus.entries(scales)
+		#
+		# Returns the array of [name, source, eval] triplets: synthetic programs
+		# for each scale (number of nodes) and real files. Real files are not
+		# evaluated (they may require external libraries or run the program)
+		def self.entries(scales)
+			scales.map {|n| ["synthetic_#{n}", synthetic(n), true] } +
+				REAL_FILES.map {|name| [File.basename(name), File.read(name), false] }
+		end
+	end
+end
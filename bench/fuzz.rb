@@ -0,0 +1,184 @@
+# Fuzzing of node-marshal loaders: the seed dumps of all supported formats
+# (NODEMARSHAL11 Marshal hash, NODEMARSHAL12 binary container, columnar
+# layout, lazy container, compressed frames, shared dictionaries and bundles)
+# are mutated (bit flips, truncation, random bytes, splices of two dumps)
+# and loaded. Each load must either succeed or raise StandardError
+# (usually ArgumentError); the garbage collector is started after each
+# load, so broken trees are detected by its marking. Decoding throughput
+# of the valid seeds is reported too.
+#
+# Only loading is checked: NodeMarshal#compile of the untrusted dump
+# is not safe (the code generator doesn't validate the tree).
+#
+# Usage:
+#   ruby bench/fuzz.rb [--iterations=10000] [--seed=1] [--repeat=3]
+#   rake fuzz ITERATIONS=100000 SEED=5
+#
+# The program exits with non-zero status if some load raised the exception
+# that is not StandardError; the crash (e.g. segmentation fault) is
+# reproduced by the same seed and the number of iterations.
+#
+# (C) 2015-2017 Alexey Voskov
+# License: BSD-2-Clause
+require 'tmpdir'
+require_relative '../lib/node-marshal.rb'
+
+module NodeMarshalFuzz
+	# Program for seed dumps: most of the node types, literals of all types
+	# of the literals table, local ID tables and arguments info
+	PROGRAM = <<-EOS
+		$fuzz_gvar = [1, 2.5, 10**30, 'str', :sym, /re(g)/i, 1..2, nil, true]
+		class FuzzClass
+			CONST = {:a => 1, 'b' => [3, 4]}
+			def initialize(a, b = 2, *rest, key: :k, &blk)
+				@a = a; @b ||= b; @@cv = rest
+				s = "x \#{a} y" + 'z'
+				case a when 0 then :zero when 1..5 then s.sub(/(x)/, 'X') else a&.abs end
+			end
+			def each_item(list)
+				list.each_with_index {|x, i| yield(x, i) if block_given? }
+				x = 0
+				x += 1 while x < 10
+				begin; Integer('q'); rescue ArgumentError => e; e.message; ensure; x = nil; end
+				self.attr_x ||= 5 rescue nil
+			end
+		end
+		FuzzClass.new(1, 2, 3, key: :v) { |q| q }
+	EOS
+
+	# call-seq:
+	#   NodeMarshalFuzz.seeds => [[name, kind, data], ...]
+	#
+	# Returns the seed corpus: +kind+ is +:dump+ (NodeMarshal.new(:binmemory)),
+	# +:dict+ (NodeMarshal::Dictionary.load) or +:bundle+ (NodeMarshal::Bundle.new)
+	def self.seeds
+		node = lambda { NodeMarshal.new(:srcmemory, PROGRAM) }
+		dict = NodeMarshal::Dictionary.build([node.call], :min_count => 1)
+		bin = node.call.to_bin
+		seeds = [
+			[:marshal, :dump, Marshal.dump(node.call.to_hash)],
+			[:bin, :dump, bin],
+			[:columnar, :dump, node.call.to_bin(:nodes_layout => :columnar)],
+			[:lazy, :dump, node.call.to_bin(:lazy => 4)],
+			[:dedup, :dump, node.call.to_bin(:dedup_literals => true, :dedup_nodes => true)],
+			[:zlib, :dump, NodeMarshal::Codec.compress(bin)],
+			[:shared_dict, :dump, node.call.to_bin(:shared_dict => dict)],
+			[:dict, :dict, dict.to_bin]
+		]
+		tmpname = File.expand_path("_fuzz_#{$$}.bundle", Dir.tmpdir)
+		begin
+			NodeMarshal::Bundle.create(tmpname, {'fuzz/a' => node.call, 'fuzz/b' => bin})
+			seeds << [:bundle, :bundle, File.binread(tmpname)]
+		ensure
+			File.delete(tmpname) if File.exist?(tmpname)
+		end
+		seeds
+	end
+
+	# call-seq:
+	#   NodeMarshalFuzz.mutate(data, other, rng) => String
+	#
+	# Returns the mutated copy of the binary string. +other+ is the seed
+	# for splices
+	def self.mutate(data, other, rng)
+		str = data.dup.force_encoding('BINARY')
+		case rng.rand(5)
+		when 0 # Bit flips
+			(1 + rng.rand(4)).times do
+				pos = rng.rand(str.bytesize)
+				str.setbyte(pos, str.getbyte(pos) ^ (1 << rng.rand(8)))
+			end
+		when 1 # Truncation
+			str = str.byteslice(0, rng.rand(str.bytesize))
+		when 2 # Random bytes
+			(1 + rng.rand(8)).times { str.setbyte(rng.rand(str.bytesize), rng.rand(256)) }
+		when 3 # Interesting values of 32-bit lengths and ordinals
+			pos = rng.rand([str.bytesize - 4, 1].max)
+			val = [0, 1, 0x7f, 0x80, 0xff, 0x7fffffff, 0xffffffff, str.bytesize].sample(random: rng)
+			str[pos, 4] = [val].pack('V')
+		else # Splice of two dumps
+			pos = rng.rand(str.bytesize)
+			str = str.byteslice(0, pos) + other.byteslice(rng.rand(other.bytesize), other.bytesize)
+		end
+		str
+	end
+
+	# Loads the data by the loader of its kind
+	def self.load(kind, data)
+		case kind
+		when :dump then NodeMarshal.new(:binmemory, data, :gc_start => false)
+		when :dict then NodeMarshal::Dictionary.load(data)
+		when :bundle
+			bundle = NodeMarshal::Bundle.new(data)
+			bundle.each {|path, node| node }
+		end
+	end
+
+	# call-seq:
+	#   NodeMarshalFuzz.run(iterations, seed) => {:loaded, :rejected, :errors}
+	#
+	# Loads +iterations+ mutated seeds. Exceptions that are not StandardError
+	# are collected to +:errors+ as [seed name, iteration, exception]
+	def self.run(iterations, seed, corpus = seeds)
+		rng = Random.new(seed)
+		res = {:loaded => 0, :rejected => 0, :errors => []}
+		iterations.times do |i|
+			name, kind, data = corpus[rng.rand(corpus.size)]
+			str = mutate(data, corpus[rng.rand(corpus.size)][2], rng)
+			begin
+				load(kind, str)
+				res[:loaded] += 1
+			rescue StandardError
+				res[:rejected] += 1
+			rescue Exception => e
+				res[:errors] << [name, i, e]
+			end
+			GC.start if i % 16 == 0
+		end
+		GC.start
+		res
+	end
+
+	# call-seq:
+	#   NodeMarshalFuzz.throughput(corpus, repeat) => [[name, bytes/s, nodes/s], ...]
+	#
+	# Measures the loading speed of the valid seed dumps
+	def self.throughput(corpus, repeat)
+		corpus.select {|name, kind, data| kind == :dump }.map do |name, kind, data|
+			num_of_nodes = load(kind, data).stats[:tables][:nodes_len]
+			best = repeat.times.map {
+				t = Time.now
+				load(kind, data)
+				Time.now - t
+			}.min
+			[name, data.bytesize / best, num_of_nodes / best]
+		end
+	end
+
+	def self.main(argv)
+		opts = {:iterations => 10000, :seed => 1, :repeat => 3}
+		argv.each do |arg|
+			case arg
+			when /^--iterations=(\d+)$/ then opts[:iterations] = $1.to_i
+			when /^--seed=(\d+)$/ then opts[:seed] = $1.to_i
+			when /^--repeat=(\d+)$/ then opts[:repeat] = [$1.to_i, 1].max
+			else
+				raise ArgumentError, "Unknown argument #{arg}"
+			end
+		end
+		corpus = seeds
+		puts "%-12s %8s %14s %14s" % ['seed', 'bytes', 'bytes/s', 'nodes/s']
+		throughput(corpus, opts[:repeat]).each do |name, bps, nps|
+			size = corpus.assoc(name)[2].bytesize
+			puts "%-12s %8d %14d %14d" % [name, size, bps, nps]
+		end
+		t = Time.now
+		res = run(opts[:iterations], opts[:seed], corpus)
+		puts "Iterations: #{opts[:iterations]} (seed #{opts[:seed]}), %.2f s" % (Time.now - t)
+		puts "Loaded: #{res[:loaded]}, rejected: #{res[:rejected]}, errors: #{res[:errors].size}"
+		res[:errors].each {|name, i, e| puts "  #{name} at iteration #{i}: #{e.class}: #{e.message}" }
+		(res[:errors].empty?) ? 0 : 1
+	end
+end
+
+exit(NodeMarshalFuzz.main(ARGV)) if $0 == __FILE__
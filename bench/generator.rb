@@ -0,0 +1,233 @@
+# Generator of synthetic Ruby sources for stress tests and scaling
+# benchmarks (see scaling.rb): programs of the given size in nodes
+# (10^3-10^7) and shape. The +:mixed+ shape contains all node types
+# listed in nodes_child_info (nodeinfo.c) that are produced by the parser
+# of the current Ruby version (see NodeMarshalBench::Generator.node_types);
+# other shapes stress one part of the dump: deep nesting, wide arrays
+# and hashes, methods and blocks with rb_args_info, global variables
+# and distinct literals.
+#
+# Each program ends with the expression that calls the generated code,
+# so the results of the original and the loaded programs can be compared.
+# The +:mixed+ shape contains the regex literal in the condition (NODE_MATCH):
+# the parser warns about it unless $VERBOSE is +nil+.
+#
+# (C) 2015-2017 Alexey Voskov
+# License: BSD-2-Clause
+require_relative '../lib/node-marshal.rb'
+
+module NodeMarshalBench
+	module Generator
+		SHAPES = [:mixed, :deep, :wide, :args, :globals, :literals]
+
+		# Depth of nested conditions and arrays in one unit of the +:deep+ shape
+		DEPTH = 100
+		# Number of elements in one array of the +:wide+ shape
+		WIDTH = 100
+
+		# Definitions that are required by all units of the +:mixed+ shape
+		# (node types that may appear only once or only at the top level)
+		MIXED_HEADER = <<-'EOS'
+class GenBase
+	attr_accessor :attr
+	def initialize; @attr = 0; end
+	def info(*args); args.size; end
+	def gen_vcall; :vcall; end
+	def gen_match; 1 if /never/; end
+end
+module GenEmpty; end
+$gen_mixed_g0 ||= 0
+alias $gen_valias $gen_mixed_g0
+END { $gen_end = true }
+		EOS
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.unit(shape, i) => String
+		#
+		# Returns the source of the +i+-th unit of the shape (e.g. a class
+		# with methods or a constant with the wide array)
+		def self.unit(shape, i)
+			case shape
+			when :mixed then mixed_unit(i)
+			when :deep
+				<<-EOS
+def gen_deep#{i}(a)
+	x = #{'if a then ' * DEPTH}a#{' end' * DEPTH}
+	[x, #{'[' * DEPTH}a, #{i}#{']' * DEPTH}]
+end
+				EOS
+			when :wide
+				elems = (0...WIDTH).map {|j| "{:k => #{j}, 's' => [#{i}, 'v#{j}', :w#{j % 10}]}" }
+				"GEN_WIDE#{i} = [#{elems.join(', ')}] unless defined?(GEN_WIDE#{i})\n"
+			when :args
+				<<-EOS
+def gen_args#{i}(a, b = #{i}, *rest, c, d: #{i}, e:, **opts, &blk)
+	f = ->(x, y = b, *z, k: d) { [x, y, z, k] }
+	[a, b, rest, c, d, e, opts, f.call(a), [1, 2].map {|u, v = #{i}| u + v }]
+end
+				EOS
+			when :globals
+				"$gen_g#{i} = #{i}\n$gen_g#{i} += $gen_g#{i / 2} || 0\n"
+			when :literals
+				"GEN_LIT#{i} = [#{i}, #{i}.25, #{2**70 + i}, 'str#{i}', :sym#{i}, /re#{i}/i, " +
+					"#{i}..#{i + 1}, \"\\u00e9#{i}\"].freeze unless defined?(GEN_LIT#{i})\n"
+			else
+				raise ArgumentError, "Unknown shape #{shape}"
+			end
+		end
+
+		# The class with the method that contains most of the node types
+		def self.mixed_unit(i)
+			<<-EOS
+class GenMixed#{i} < GenBase
+	GEN_CONST = #{i} unless defined?(GEN_CONST)
+	@@count = 0
+	def initialize; super; @attr = GEN_CONST; end
+	def info(*args); super(*args) + 1; end
+	def run(a, b = #{i}, *rest, c, key: :k#{i % 50}, req:, **kw, &blk)
+		x = a + b
+		@@count += 1
+		$gen_mixed_g#{i % 10} = x
+		y = $gen_mixed_g#{i % 10} || ::Kernel && Math::PI
+		list = [x, y, *rest, c]
+		h = {:a => list, 'b' => (a..b), :c => (a...b), 'k' => key}
+		h[:a] += [1]
+		h[:z] = @@count
+		self.attr += 1
+		z ||= 5
+		z &&= z + @attr
+		s = "v\#{x}-\#{y}"
+		sym = :"s\#{x}"
+		re = /r\#{x}/
+		re1 = /o\#{x}/o
+		m1 = /v(\\d)/ =~ s
+		m2 = s =~ /v(\\d+)/
+		d = [$1, $&]
+		v, w = w, x
+		p1, *p2, p3 = list
+		total = 0
+		for e in list do total += e.to_i end
+		list.each { |e1| next if e1.nil?; total += 1 }
+		[1, 2].each { |e2| inner = e2; [3].each { |e3| inner = e3 } }
+		k = 0
+		while k < 3 do k += 1 end
+		until k == 0 do k -= 1 end
+		loop { break }
+		tries = 0
+		begin
+			raise ArgumentError, 'gen' if tries == 0
+		rescue ArgumentError => err
+			tries += 1
+			retry if tries < 2
+		ensure
+			k = nil
+		end
+		[1].each { |e4| redo if e4 == :never }
+		r = case x when 0 then :zero when 1..10, *[20] then :small else x.abs end
+		t = x > 0 ? true : false
+		u = defined?(zz) ? 1 : nil
+		f = ->(q) { q * 2 }
+		g = blk ? yield(x) : f.call(x)
+		qc = a&.to_s
+		ff2 = 1 if (k == 1)..(k == 2)
+		ff3 = 1 if (k == 1)...(k == 2)
+		mt = gen_match
+		`echo \#{x}` if a == :never
+		`true` if a == :never
+		vc = gen_vcall
+		arr = [format('%d', x), [], self.class, [x].map(&:to_s), info(*list, x), info(x, *list), info(*rest)]
+		return r, total if a == :never
+		[x, y, h, s, sym, re, re1, m1, m2, d, v, p1, p2, p3, total, r, t, u, g, qc, ff2, ff3, mt, vc, arr, kw, err.message, @attr]
+	end
+	def self.make; new; end
+	alias run_alias run
+	def gen_tmp; end
+	undef gen_tmp
+	class << self; def meta; :meta; end; end
+end
+module GenMod#{i}; GEN_M = #{i} unless defined?(GEN_M); end
+			EOS
+		end
+
+		# Expression that calls the first units of the shape
+		def self.result_source(shape, num_of_units)
+			inds = (0...[num_of_units, 3].min).to_a
+			case shape
+			when :mixed
+				"[" + inds.map {|i| "GenMixed#{i}.make.run(1, 2, 3, 4, req: 5) {|v| v * 3 }" }.join(', ') + "]\n"
+			when :deep then "[" + inds.map {|i| "gen_deep#{i}(#{i})" }.join(', ') + "]\n"
+			when :wide then "[" + inds.map {|i| "GEN_WIDE#{i}.size, GEN_WIDE#{i}.last" }.join(', ') + "]\n"
+			when :args then "[" + inds.map {|i| "gen_args#{i}(1, 2, 3, e: 4, z: 5)" }.join(', ') + "]\n"
+			when :globals then "[" + inds.map {|i| "$gen_g#{i}" }.join(', ') + "]\n"
+			when :literals then "[" + inds.map {|i| "GEN_LIT#{i}" }.join(', ') + "]\n"
+			end
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.units_source(shape, num_of_units) => String
+		#
+		# Returns the program with the given number of units
+		def self.units_source(shape, num_of_units)
+			src = (shape == :mixed) ? MIXED_HEADER.dup : ''
+			num_of_units.times {|i| src << unit(shape, i) }
+			src << result_source(shape, num_of_units)
+		end
+
+		@unit_nodes = {}
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.nodes_per_unit(shape) => Float
+		#
+		# Returns the average number of nodes in one unit of the shape
+		def self.nodes_per_unit(shape)
+			@unit_nodes[shape] ||= begin
+				count = lambda {|n| NodeMarshal.new(:srcmemory, units_source(shape, n)).to_hash[:num_of_nodes] }
+				(count.call(20) - count.call(10)) / 10.0
+			end
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.source(shape, num_of_nodes) => String
+		#
+		# Returns the program of the shape with approximately +num_of_nodes+ nodes
+		def self.source(shape, num_of_nodes)
+			units_source(shape, [(num_of_nodes / nodes_per_unit(shape)).round, 1].max)
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.node_types => [String, ...]
+		#
+		# Returns the names of node types listed in nodes_child_info (nodeinfo.c)
+		def self.node_types
+			src = File.read(File.expand_path('../ext/node-marshal/nodeinfo.c', File.dirname(__FILE__)))
+			src.scan(/^\s*\{(NODE_\w+),/).flatten.uniq
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.unreachable_types => [String, ...]
+		#
+		# Returns the names of node types from nodes_child_info that are
+		# not produced by the parser of the current Ruby version
+		# from the generated sources: NODE_OPT_N requires the -n command
+		# line option, NODE_ARGS_AUX is used only by Ruby 1.9.3
+		def self.unreachable_types
+			types = ['NODE_OPT_N']
+			types << 'NODE_ARGS_AUX' if RUBY_VERSION >= '2.0'
+			types
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Generator.node_header => String
+		#
+		# Returns the name of the node.h version used by the extension
+		# for the current Ruby version (see nodedump.h)
+		def self.node_header
+			case RUBY_VERSION
+			when /\A2\.3\./ then 'node230.h'
+			when /\A2\.2\./ then 'node220.h'
+			when /\A1\.9\./ then 'node193.h'
+			else 'unsupported'
+			end
+		end
+	end
+end
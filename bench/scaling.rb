@@ -0,0 +1,159 @@
+# Scaling benchmark of node-marshal: synthetic programs of all shapes
+# (see generator.rb) with the number of nodes 10^3, 10^4, ... 10^max are
+# dumped (NodeMarshal#to_hash, NodeMarshal#to_bin) and loaded (the native
+# loader of NODEMARSHAL12 dumps). The best times of N runs, times
+# per node, sizes of dumps and memory of loaded trees (NodeMarshal#stats)
+# are reported with the Ruby version and node.h header used by the extension.
+#
+# The growth exponent between the neighbouring sizes (slope of the log-log
+# plot: log(t2/t1) / log(n2/n1)) is about 1 for the linear stages; the
+# program exits with non-zero status if some slope is above the threshold
+# (superlinear behaviour, e.g. 2 for the quadratic one). Times shorter
+# than 5 ms are not checked. The per-node cost also grows when the tables
+# of nodes outgrow the CPU caches (about 10^5-10^6 nodes): slopes of
+# about 1.5 between these sizes are expected, so the default threshold is 1.75.
+#
+# Usage:
+#   ruby bench/scaling.rb [--max=6] [--shapes=mixed,deep,wide,args,globals,literals]
+#     [--repeat=3] [--threshold=1.75] [--csv=scaling.csv]
+#   rake scaling MAX=7 SHAPES=mixed,wide CSV=scaling.csv
+#
+# 10^7 nodes (--max=7) require several gigabytes of memory.
+#
+# (C) 2015-2017 Alexey Voskov
+# License: BSD-2-Clause
+require_relative 'generator.rb'
+
+module NodeMarshalBench
+	module Scaling
+		# Timed stages: [name, code, setup]. Lambdas receive the state Hash;
+		# setup (parsing) is not timed
+		FRESH_NODE = lambda {|st| st[:fresh] = NodeMarshal.new(:srcmemory, st[:src]) }
+		STAGES = [
+			[:to_hash, lambda {|st| st[:fresh].to_hash }, FRESH_NODE],
+			[:to_bin, lambda {|st| st[:fresh].to_bin }, FRESH_NODE],
+			[:load_bin, lambda {|st| st[:loaded] = NodeMarshal.new(:binmemory, st[:bin], :gc_start => false) }]
+		]
+
+		# Minimal time (in seconds) of the stage used for the slope
+		MIN_TIME = 0.005
+
+		# call-seq:
+		#   NodeMarshalBench::Scaling.run_entry(shape, num_of_nodes, repeat) => Hash
+		#
+		# Generates the program and returns the Hash with the number of nodes,
+		# best times of stages, size of the dump (+:bin_bytes+) and memory
+		# of the loaded tree (+:memory+, bytes, see NodeMarshal#stats)
+		def self.run_entry(shape, num_of_nodes, repeat)
+			st = {:src => Generator.source(shape, num_of_nodes)}
+			node = NodeMarshal.new(:srcmemory, st[:src])
+			nodes = node.to_hash[:num_of_nodes]
+			st[:bin] = node.to_bin
+			node = nil
+			times = {}
+			repeat.times do
+				STAGES.each do |stage, code, setup|
+					setup.call(st) if setup
+					GC.start
+					t = Time.now
+					code.call(st)
+					time = Time.now - t
+					times[stage] = time if !times[stage] || times[stage] > time
+				end
+				st[:fresh] = nil
+			end
+			memory = st[:loaded].stats[:memory].values.inject(0, :+)
+			{:shape => shape, :nodes => nodes, :times => times,
+				:bin_bytes => st[:bin].bytesize, :memory => memory}
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Scaling.slope(n1, v1, n2, v2) => Float
+		#
+		# Returns the growth exponent of v(n) between two points
+		def self.slope(n1, v1, n2, v2)
+			Math.log(v2.to_f / v1) / Math.log(n2.to_f / n1)
+		end
+
+		# call-seq:
+		#   NodeMarshalBench::Scaling.superlinear(results, threshold) => Array
+		#
+		# Returns [shape, stage, nodes, slope] for the neighbouring results
+		# of the same shape with the slope above +threshold+ (stages are
+		# the timed stages, +:bin_bytes+ and +:memory+)
+		def self.superlinear(results, threshold)
+			ans = []
+			results.group_by {|res| res[:shape] }.each_value do |list|
+				list.each_cons(2) do |r1, r2|
+					next if r2[:nodes] <= r1[:nodes]
+					values = r1[:times].keys.map {|stage| [stage, r1[:times][stage], r2[:times][stage]] }
+					values.reject! {|stage, v1, v2| v1 < MIN_TIME }
+					values += [:bin_bytes, :memory].map {|key| [key, r1[key], r2[key]] }
+					values.each do |stage, v1, v2|
+						k = slope(r1[:nodes], v1, r2[:nodes], v2)
+						ans << [r1[:shape], stage, r2[:nodes], k] if k > threshold
+					end
+				end
+			end
+			ans
+		end
+
+		# Prints the table with results
+		def self.print_results(results)
+			puts "Ruby #{RUBY_VERSION} (#{RUBY_PLATFORM}), #{Generator.node_header}"
+			puts "%-9s %9s %-9s %10s %9s %12s %12s" % ['shape', 'nodes', 'stage', 'time, ms', 'ns/node', 'bin, B/node', 'mem, B/node']
+			results.each do |res|
+				res[:times].each do |stage, time|
+					puts "%-9s %9d %-9s %10.3f %9.1f %12.1f %12.1f" % [res[:shape], res[:nodes], stage, time * 1000,
+						time * 1e9 / res[:nodes], res[:bin_bytes].to_f / res[:nodes], res[:memory].to_f / res[:nodes]]
+				end
+			end
+		end
+
+		# Saves the results to the CSV file (one line per entry and stage)
+		def self.write_csv(filename, results)
+			File.open(filename, 'w') do |fp|
+				fp << "ruby,header,shape,nodes,stage,time,bin_bytes,memory\n"
+				results.each do |res|
+					res[:times].each do |stage, time|
+						fp << [RUBY_VERSION, Generator.node_header, res[:shape], res[:nodes], stage,
+							time, res[:bin_bytes], res[:memory]].join(',') << "\n"
+					end
+				end
+			end
+		end
+
+		def self.main(argv)
+			opts = {:max => 6, :shapes => Generator::SHAPES, :repeat => 3, :threshold => 1.75}
+			argv.each do |arg|
+				case arg
+				when /^--max=(\d+)$/ then opts[:max] = [[$1.to_i, 3].max, 7].min
+				when /^--shapes=([\w,]+)$/ then opts[:shapes] = $1.split(',').map(&:to_sym)
+				when /^--repeat=(\d+)$/ then opts[:repeat] = [$1.to_i, 1].max
+				when /^--threshold=([\d.]+)$/ then opts[:threshold] = $1.to_f
+				when /^--csv=(.+)$/ then opts[:csv] = $1
+				else
+					raise ArgumentError, "Unknown argument #{arg}"
+				end
+			end
+			(opts[:shapes] - Generator::SHAPES).each {|shape| raise ArgumentError, "Unknown shape #{shape}" }
+			$VERBOSE = nil
+			results = []
+			opts[:shapes].each do |shape|
+				(3..opts[:max]).each do |k|
+					$stderr.puts "Running #{shape} 10^#{k}..."
+					results << run_entry(shape, 10**k, opts[:repeat])
+				end
+			end
+			print_results(results)
+			write_csv(opts[:csv], results) if opts[:csv]
+			bad = superlinear(results, opts[:threshold])
+			bad.each do |shape, stage, nodes, k|
+				puts "SUPERLINEAR: %s %s up to %d nodes, slope %.2f" % [shape, stage, nodes, k]
+			end
+			(bad.size > 0) ? 1 : 0
+		end
+	end
+end
+
+exit(NodeMarshalBench::Scaling.main(ARGV)) if $0 == __FILE__
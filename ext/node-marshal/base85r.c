@@ -10,25 +10,28 @@
  * 2) big-endian 5-byte numbers (base 85)
  * 3) empty string: arbitrary two bytes
  *
+ * Encoder and decoder are incremental (Base85rEncoder, Base85rDecoder):
+ * the data can be processed by chunks of arbitrary size, it is used
+ * by NodeMarshal::Base85r::Encoder and NodeMarshal::Base85r::Decoder
+ * classes and by NodeMarshal.base85r_encode/base85r_decode.
+ *
  * (C) 2015-2016 Alexey Voskov
  * License: BSD-2-Clause
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <inttypes.h>
 #include <ruby.h>
 #include <ruby/version.h>
+#include "nodedump.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
 
 #define BASE85R_STR_WIDTH 14 // Number of 5-byte groups in the string (12 for 60-byte string)
-
-#define D0_VAL 1 // 85**0
-#define D1_VAL 85 // 85**1
-#define D2_VAL 7225 // 85**2
-#define D3_VAL 614125 // 85**3
-#define D4_VAL 52200625 // 85**4
-
-static int di_val[5] = {D4_VAL, D3_VAL, D2_VAL, D1_VAL, D0_VAL};
-
+#define BASE85R_CHUNK 49152 // Size of input chunks for writing to IO (multiple of 4 * BASE85R_STR_WIDTH)
+#define BASE85R_BAD 0xFF // Entry of char_to_val for symbols outside of the alphabet
 
 /* Modified BASE85 digits */
 static const char val_to_char[86] = // ASCIIZ string
@@ -39,7 +42,7 @@ static const char val_to_char[86] = // ASCIIZ string
 ":;<=>?@[]^"
 ",_|";
 
-static int char_to_val[128];
+static unsigned char char_to_val[256];
 
 
 /* Initializes internal tables that are required
@@ -47,103 +50,429 @@ static int char_to_val[128];
 void base85r_init_tables()
 {
 	int i;
-	for (i = 0; i < 128; i++)
-		char_to_val[i] = -1;
+	for (i = 0; i < 256; i++)
+		char_to_val[i] = BASE85R_BAD;
 
 
 	for (i = 0; i < 85; i++)
 	{
-		if (char_to_val[(int) val_to_char[i]] != -1)
+		if (char_to_val[(unsigned char) val_to_char[i]] != BASE85R_BAD)
 			rb_raise(rb_eArgError, "Internal error");
-		char_to_val[(int) val_to_char[i]] = i;
+		char_to_val[(unsigned char) val_to_char[i]] = (unsigned char) i;
 	}
 
 	for (i = 0; i < 85; i++)
-		if (char_to_val[(int) val_to_char[i]] != i)
+		if (char_to_val[(unsigned char) val_to_char[i]] != i)
 			rb_raise(rb_eArgError, "Internal error");
 }
 
+/*
+ * Division by 85 by means of the multiplication by reciprocal:
+ * 0xC0C0C0C1 = ceil(2**38 / 85), the result is exact for all
+ * 32-bit values (85 * 0xC0C0C0C1 - 2**38 = 21 < 2**6)
+ */
+static inline uint32_t div85(uint32_t val)
+{
+	return (uint32_t) (((uint64_t) val * 0xC0C0C0C1ULL) >> 38);
+}
+
+/*
+ * Writes the 4-byte group (big-endian value) as 5 digits
+ */
+static inline void base85r_put_group(unsigned char *out, uint32_t val)
+{
+	uint32_t q;
+	q = div85(val); out[4] = val_to_char[val - q * 85]; val = q;
+	q = div85(val); out[3] = val_to_char[val - q * 85]; val = q;
+	q = div85(val); out[2] = val_to_char[val - q * 85]; val = q;
+	q = div85(val); out[1] = val_to_char[val - q * 85];
+	out[0] = val_to_char[q];
+}
+
+/*
+ * Encoder state: the total length of the input must be known in advance
+ * because it is written to the beginning of the output
+ */
+typedef struct {
+	long total_len; // Length of the input data
+	long inp_len; // Number of already processed bytes
+	unsigned char part[4]; // Incomplete group
+	int part_len;
+	int groups; // Number of groups in the current line
+	VALUE out; // Output object (NodeMarshal::Base85r::Encoder only)
+} Base85rEncoder;
+
+/*
+ * Decoder state. The last decoded group is kept in pending buffer
+ * because the number of bytes in it is known only at the end
+ */
+typedef struct {
+	int tail_len; // First digit of the stream (-1 means not read yet)
+	int shift; // Number of digits in the current group
+	uint32_t val;
+	unsigned char pending[4];
+	int has_pending;
+	long out_len; // Number of written bytes
+	VALUE out; // Output object (NodeMarshal::Base85r::Decoder only)
+} Base85rDecoder;
+
+/* Maximal size of the output for len input bytes */
+static long base85r_enc_out_len(long len)
+{
+	long groups = len / 4 + 2;
+	return groups * 5 + (groups / BASE85R_STR_WIDTH + 1) * 2 + 2;
+}
+
+static void Base85rEncoder_init(Base85rEncoder *enc, long total_len)
+{
+	enc->total_len = total_len;
+	enc->inp_len = 0;
+	enc->part_len = 0;
+	enc->groups = 0;
+	enc->out = Qnil;
+}
+
+/*
+ * Writes the header of the stream, returns number of written bytes
+ */
+static long Base85rEncoder_begin(Base85rEncoder *enc, unsigned char *out)
+{
+	out[0] = 32;
+	out[1] = val_to_char[enc->total_len % 4];
+	return 2;
+}
+
+static inline long Base85rEncoder_group(Base85rEncoder *enc, unsigned char *out, uint32_t val, int newline)
+{
+	base85r_put_group(out, val);
+	if (newline && ++enc->groups == BASE85R_STR_WIDTH)
+	{
+		enc->groups = 0;
+		out[5] = 10;
+		out[6] = 32;
+		return 7;
+	}
+	return 5;
+}
+
+/*
+ * Encodes the chunk of the input data, returns number of
+ * written bytes (see base85r_enc_out_len for output buffer size)
+ */
+static long Base85rEncoder_update(Base85rEncoder *enc, const unsigned char *inp, long len, unsigned char *out)
+{
+	unsigned char *outptr = out;
+	const unsigned char *end = inp + len;
+	if (len > enc->total_len - enc->inp_len)
+		rb_raise(rb_eArgError, "base85r_encode: input is longer than declared");
+	enc->inp_len += len;
+	// Complete the incomplete group
+	while (enc->part_len > 0 && enc->part_len < 4 && inp < end)
+		enc->part[enc->part_len++] = *inp++;
+	if (enc->part_len == 4)
+	{
+		uint32_t val = ((uint32_t) enc->part[0] << 24) | ((uint32_t) enc->part[1] << 16) |
+			((uint32_t) enc->part[2] << 8) | enc->part[3];
+		outptr += Base85rEncoder_group(enc, outptr, val, 1);
+		enc->part_len = 0;
+	}
+	// Fast path: whole 4-byte groups
+	for (; end - inp >= 4; inp += 4)
+	{
+		uint32_t val = ((uint32_t) inp[0] << 24) | ((uint32_t) inp[1] << 16) |
+			((uint32_t) inp[2] << 8) | inp[3];
+		outptr += Base85rEncoder_group(enc, outptr, val, 1);
+	}
+	// Save the tail
+	while (inp < end)
+		enc->part[enc->part_len++] = *inp++;
+	return (long) (outptr - out);
+}
+
+/*
+ * Writes the last (incomplete) group, returns number of written bytes
+ */
+static long Base85rEncoder_finish(Base85rEncoder *enc, unsigned char *out)
+{
+	uint32_t val = 0;
+	int i;
+	if (enc->inp_len != enc->total_len)
+		rb_raise(rb_eArgError, "base85r_encode: input is shorter than declared");
+	if (enc->part_len == 0)
+		return 0;
+	for (i = 0; i < enc->part_len; i++)
+		val |= (uint32_t) enc->part[i] << (24 - i * 8);
+	enc->part_len = 0;
+	return Base85rEncoder_group(enc, out, val, 0);
+}
+
+
+static void Base85rDecoder_init(Base85rDecoder *dec)
+{
+	dec->tail_len = -1;
+	dec->shift = 0;
+	dec->val = 0;
+	dec->has_pending = 0;
+	dec->out_len = 0;
+	dec->out = Qnil;
+}
+
+static inline unsigned char *Base85rDecoder_putVal(uint32_t val, unsigned char *out)
+{
+	out[0] = (val >> 24) & 0xFF;
+	out[1] = (val >> 16) & 0xFF;
+	out[2] = (val >> 8) & 0xFF;
+	out[3] = val & 0xFF;
+	return out + 4;
+}
+
+/*
+ * Decodes the chunk of the input text, returns number of written bytes.
+ * The output buffer must contain at least len / 5 * 4 + 8 bytes.
+ * Full lines (groups without separators and "\n " between lines) are
+ * decoded by the fast loop; any other symbols outside of the alphabet
+ * are skipped by the slow path. Returns BASE85R_ERR_CORRUPTED if
+ * the text is invalid (Ruby API is not used, see base85r_decode)
+ */
+static long Base85rDecoder_update(Base85rDecoder *dec, const unsigned char *inp, long len, unsigned char *out)
+{
+	const unsigned char *end = inp + len;
+	unsigned char *outptr = out;
+	// Pending group from the previous chunk
+	if (dec->has_pending)
+		outptr = Base85rDecoder_putVal(((uint32_t) dec->pending[0] << 24) | ((uint32_t) dec->pending[1] << 16) |
+			((uint32_t) dec->pending[2] << 8) | dec->pending[3], outptr);
+	while (inp < end)
+	{
+		unsigned int digit;
+		if (dec->shift == 0 && dec->tail_len != -1)
+		{	// Fast loop
+			while (end - inp >= 5)
+			{
+				unsigned int d0 = char_to_val[inp[0]], d1 = char_to_val[inp[1]],
+					d2 = char_to_val[inp[2]], d3 = char_to_val[inp[3]], d4 = char_to_val[inp[4]];
+				if ((d0 | d1 | d2 | d3 | d4) & 0x80)
+				{
+					if (inp[0] == 10 && inp[1] == 32)
+					{	// Line separator
+						inp += 2;
+						continue;
+					}
+					break;
+				}
+				outptr = Base85rDecoder_putVal(((((d0 * 85 + d1) * 85 + d2) * 85 + d3) * 85 + d4), outptr);
+				inp += 5;
+			}
+			if (inp == end)
+				break;
+		}
+		// Slow path: one symbol
+		digit = char_to_val[*inp++];
+		if (digit == BASE85R_BAD)
+			continue;
+		if (dec->tail_len == -1)
+		{
+			if (digit > 4)
+				return BASE85R_ERR_CORRUPTED;
+			dec->tail_len = (int) digit;
+			continue;
+		}
+		dec->val = dec->val * 85 + digit;
+		if (++dec->shift == 5)
+		{
+			outptr = Base85rDecoder_putVal(dec->val, outptr);
+			dec->shift = 0;
+			dec->val = 0;
+		}
+	}
+	// Keep the last group as pending
+	dec->has_pending = (outptr - out >= 4);
+	if (dec->has_pending)
+	{
+		outptr -= 4;
+		memcpy(dec->pending, outptr, 4);
+	}
+	dec->out_len += (long) (outptr - out);
+	return (long) (outptr - out);
+}
+
+/*
+ * Writes the last group (taking into account unaligned tail),
+ * returns number of written bytes or BASE85R_ERR_CORRUPTED
+ */
+static long Base85rDecoder_finish(Base85rDecoder *dec, unsigned char *out)
+{
+	long len;
+	// Check if the byte sequence was valid
+	if (dec->shift != 0 || dec->tail_len == -1)
+		return BASE85R_ERR_CORRUPTED;
+	if (!dec->has_pending)
+	{
+		if (dec->tail_len != 0)
+			return BASE85R_ERR_CORRUPTED;
+		return 0;
+	}
+	len = (dec->tail_len == 0) ? 4 : dec->tail_len;
+	memcpy(out, dec->pending, len);
+	dec->has_pending = 0;
+	dec->out_len += len;
+	return len;
+}
+
+/*
+ * Reserves the space at the end of the string, returns pointer to it
+ */
+static unsigned char *str_reserve(VALUE str, long len)
+{
+	rb_str_modify_expand(str, len);
+	return (unsigned char *) RSTRING_PTR(str) + RSTRING_LEN(str);
+}
+
+/*
+ * Writes the data to the output object: Strings are expanded directly,
+ * other objects (e.g. IO) must have the << method
+ */
+typedef long (*base85r_write_func)(void *state, const unsigned char *inp, long len, unsigned char *out);
+
+static void base85r_write(VALUE out, long out_max, base85r_write_func func,
+	void *state, const unsigned char *inp, long len)
+{
+	if (TYPE(out) == T_STRING)
+	{
+		unsigned char *ptr = str_reserve(out, out_max);
+		long n = func(state, inp, len, ptr);
+		rb_str_set_len(out, RSTRING_LEN(out) + n);
+	}
+	else
+	{
+		VALUE buf = rb_str_buf_new(out_max);
+		long n = func(state, inp, len, (unsigned char *) RSTRING_PTR(buf));
+		rb_str_set_len(buf, n);
+		if (n > 0)
+			rb_funcall(out, rb_intern("<<"), 1, buf);
+	}
+}
+
+static long enc_update_func(void *state, const unsigned char *inp, long len, unsigned char *out)
+{
+	return Base85rEncoder_update((Base85rEncoder *) state, inp, len, out);
+}
+
+static long enc_begin_func(void *state, const unsigned char *inp, long len, unsigned char *out)
+{
+	return Base85rEncoder_begin((Base85rEncoder *) state, out);
+}
 
-/* Calculate length of buffer for base85 encoding */
-static int base85_encode_buf_len(int len)
+static long enc_finish_func(void *state, const unsigned char *inp, long len, unsigned char *out)
 {
-	// Calculate aligned (32-bit alignment) size of the buffer
-	int buf_len = ((len >> 2) << 2);
-	if (len % 4) buf_len += 4;
-	// Calculate size of the output buffer
-	buf_len = (buf_len * 5) / 4;
-	buf_len = (buf_len * 105) / 100;
-	buf_len += 32;
-	// Return buffer size
-	return buf_len;
+	return Base85rEncoder_finish((Base85rEncoder *) state, out);
 }
 
-/* 
+static void base85r_raise(long err)
+{
+	if (err == BASE85R_ERR_SHORT)
+		rb_raise(rb_eArgError, "base85r_decode: input string is too short");
+	rb_raise(rb_eArgError, "base85r_decode: input string is corrupted");
+}
+
+static long dec_update_func(void *state, const unsigned char *inp, long len, unsigned char *out)
+{
+	long n = Base85rDecoder_update((Base85rDecoder *) state, inp, len, out);
+	if (n < 0)
+		base85r_raise(n);
+	return n;
+}
+
+static long dec_finish_func(void *state, const unsigned char *inp, long len, unsigned char *out)
+{
+	long n = Base85rDecoder_finish((Base85rDecoder *) state, out);
+	if (n < 0)
+		base85r_raise(n);
+	return n;
+}
+
+/*
+ * Encodes the data by chunks (the output buffer of IO is limited)
+ */
+static void base85r_encoder_write(Base85rEncoder *enc, VALUE out, const unsigned char *inp, long len)
+{
+	while (len > 0)
+	{
+		long n = (len > BASE85R_CHUNK && TYPE(out) != T_STRING) ? BASE85R_CHUNK : len;
+		base85r_write(out, base85r_enc_out_len(n), enc_update_func, enc, inp, n);
+		inp += n;
+		len -= n;
+	}
+}
+
+static void base85r_decoder_write(Base85rDecoder *dec, VALUE out, const unsigned char *inp, long len)
+{
+	while (len > 0)
+	{
+		long n = (len > BASE85R_CHUNK && TYPE(out) != T_STRING) ? BASE85R_CHUNK : len;
+		base85r_write(out, n / 5 * 4 + 8, dec_update_func, dec, inp, n);
+		inp += n;
+		len -= n;
+	}
+}
+
+/*
  * Encode string to modified BASE85 ASCII.
  * Note: call base85_init_tables before using of this function
  */
 VALUE base85r_encode(VALUE input)
 {
+	Base85rEncoder enc;
 	VALUE output;
-	int inp_len, out_len, out_buf_len;
-	int pos, outpos;
-	unsigned int val;
-	unsigned char *outptr, *inptr;
-	int i;
+	long inp_len;
 	// Check input data type and allocate string
 	if (TYPE(input) != T_STRING)
 		rb_raise(rb_eArgError, "base85r_encode: input must be a string");
 	inp_len = RSTRING_LEN(input);
-	out_buf_len = base85_encode_buf_len(inp_len);
-	output = rb_str_new(NULL, out_buf_len);
-	// Begin conversion
-	outpos = 0;
-	outptr = (unsigned char *) RSTRING_PTR(output);
-	inptr = (unsigned char *) RSTRING_PTR(input);
-	outptr[outpos++] = 32;
-	outptr[outpos++] = val_to_char[inp_len % 4];
-	out_len = 2;
-	for (pos = 0; pos < inp_len; )
-	{
-		// Get four bytes
-		val = 0;
-		for (i = 24; i >= 0; i -= 8)
-			if (pos < inp_len) val |= inptr[pos++] << i;
-		// And transform them to five bytes
-		for (i = 0; i < 5; i++)
-		{
-			int digit = (val / di_val[i]) % 85;
-			char sym = val_to_char[digit];
-			outptr[outpos++] = sym;
-		}
-		out_len += 5;
-		// Newline addition
-		if (pos % (4 * BASE85R_STR_WIDTH) == 0)
-		{
-			out_len += 2;
-			outptr[outpos++] = 10;
-			outptr[outpos++]= 32;
-		}
-	}
-	// Check the state of memory
-	if (outpos >= out_buf_len)
-		rb_raise(rb_eArgError, "base85r_encode: internal memory error");
-	// Truncate the empty "tail" of the buffer and return the string 
-	return rb_str_resize(output, out_len);
+	output = rb_str_buf_new(base85r_enc_out_len(inp_len));
+	Base85rEncoder_init(&enc, inp_len);
+	base85r_write(output, 2, enc_begin_func, &enc, NULL, 0);
+	base85r_encoder_write(&enc, output, (const unsigned char *) RSTRING_PTR(input), inp_len);
+	base85r_write(output, 8, enc_finish_func, &enc, NULL, 0);
+	return output;
 }
 
 
-/* 
- * Decode string in modified BASE85 ASCII format.
+/*
+ * Arguments of the whole text decoding (see base85r_decode)
+ */
+typedef struct {
+	const unsigned char *inp;
+	long inp_len;
+	unsigned char *out;
+	long out_len; // Result: number of written bytes or BASE85R_ERR_...
+} Base85rDecodeArgs;
+
+static void *base85r_decode_nogvl(void *arg)
+{
+	Base85rDecodeArgs *a = (Base85rDecodeArgs *) arg;
+	Base85rDecoder dec;
+	long n;
+	Base85rDecoder_init(&dec);
+	a->out_len = Base85rDecoder_update(&dec, a->inp, a->inp_len, a->out);
+	if (a->out_len < 0)
+		return NULL;
+	n = Base85rDecoder_finish(&dec, a->out + a->out_len);
+	a->out_len = (n < 0) ? n : a->out_len + n;
+	return NULL;
+}
+
+/*
+ * Decode string in modified BASE85 ASCII format. Long texts are decoded
+ * without GVL (the frozen copy of the input is used, so it cannot be
+ * changed by other threads).
  * Note: call base85_init_tables before using of this function
  */
 VALUE base85r_decode(VALUE input)
 {
-	int inp_len, out_len, pos, shift;
-	unsigned int val = 0;
+	Base85rDecodeArgs a;
 	VALUE output;
-	unsigned char *inptr, *outptr;
-	int tail_len, i;
+	long inp_len;
 	// Check input data type and allocate string
 	if (TYPE(input) != T_STRING)
 		rb_raise(rb_eArgError, "base85r_decode: input must be a string");
@@ -152,43 +481,275 @@ VALUE base85r_decode(VALUE input)
 	{	// String with 1 or more symbols
 		rb_raise(rb_eArgError, "base85r_decode: input string is too short");
 	}
-	output = rb_str_new(NULL, inp_len);
-	// Begin conversion
-	inptr = (unsigned char *) RSTRING_PTR(input);
-	outptr = (unsigned char *) RSTRING_PTR(output);
-	out_len = 0;
-	tail_len = -1;
-	shift = 0;
-	val = 0;
-	for (pos = 0; pos < inp_len; pos++)
-	{
-		int digit = char_to_val[(int) inptr[pos]];
-		if (digit != -1)
-		{
-			if (tail_len == -1)
-			{
-				tail_len = digit;
-				if (tail_len > 4)
-					rb_raise(rb_eArgError, "base85r_decode: input string is corrupted");
-				continue;
-			}
-			val +=  digit * di_val[shift++]; 
-			if (shift == 5)
-			{
-				for (i = 24; i >= 0; i -= 8)
-					*outptr++ = (val >> i) & 0xFF;
-				shift = 0; val = 0;
-				out_len += 4;
-			}
-		}
-	}
-	// Check if the byte sequence was valid
-	if (shift != 0)
-		rb_raise(rb_eArgError, "base85r_decode: input string is corrupted");
-	// Take into account unaligned "tail"
-	if (tail_len != 0)
+	input = rb_str_new_frozen(input);
+	output = rb_str_buf_new(inp_len / 5 * 4 + 8);
+	a.inp = (const unsigned char *) RSTRING_PTR(input);
+	a.inp_len = inp_len;
+	a.out = (unsigned char *) RSTRING_PTR(output);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	if (inp_len >= NOGVL_MIN_BYTES)
+		rb_thread_call_without_gvl(base85r_decode_nogvl, &a, NULL, NULL);
+	else
+#endif
+		base85r_decode_nogvl(&a);
+	RB_GC_GUARD(input);
+	if (a.out_len < 0)
+		base85r_raise(a.out_len);
+	rb_str_set_len(output, a.out_len);
+	return output;
+}
+
+/*
+ * Decodes the text by chunks: the sink function is called for each
+ * piece of the decoded data (is used for decoding without creation
+ * of the intermediate string, see compress.c). Ruby API is not used,
+ * returns 0 or the error code (BASE85R_ERR_...)
+ */
+int base85r_decode_stream(const char *text, long len, base85r_sink sink, void *arg)
+{
+	Base85rDecoder dec;
+	unsigned char buf[BASE85R_CHUNK / 5 * 4 + 8];
+	long n;
+	if (len < 6 && len != 2)
+		return BASE85R_ERR_SHORT;
+	Base85rDecoder_init(&dec);
+	while (len > 0)
 	{
-		out_len -= (4 - tail_len);
+		long inp_len = (len > BASE85R_CHUNK) ? BASE85R_CHUNK : len;
+		n = Base85rDecoder_update(&dec, (const unsigned char *) text, inp_len, buf);
+		if (n < 0)
+			return (int) n;
+		if (n > 0 && sink(arg, buf, n) != 0)
+			return BASE85R_ERR_SINK;
+		text += inp_len;
+		len -= inp_len;
 	}
-	return rb_str_resize(output, out_len);
+	n = Base85rDecoder_finish(&dec, buf);
+	if (n < 0)
+		return (int) n;
+	if (n > 0 && sink(arg, buf, n) != 0)
+		return BASE85R_ERR_SINK;
+	return 0;
+}
+
+/*
+ * Ruby classes: NodeMarshal::Base85r::Encoder and NodeMarshal::Base85r::Decoder
+ */
+static void Base85rEncoder_mark(Base85rEncoder *enc)
+{
+	rb_gc_mark(enc->out);
+}
+
+static void Base85rDecoder_mark(Base85rDecoder *dec)
+{
+	rb_gc_mark(dec->out);
+}
+
+static VALUE m_encoder_alloc(VALUE klass)
+{
+	Base85rEncoder *enc;
+	VALUE obj = Data_Make_Struct(klass, Base85rEncoder, Base85rEncoder_mark, RUBY_DEFAULT_FREE, enc);
+	Base85rEncoder_init(enc, 0);
+	return obj;
+}
+
+static VALUE m_decoder_alloc(VALUE klass)
+{
+	Base85rDecoder *dec;
+	VALUE obj = Data_Make_Struct(klass, Base85rDecoder, Base85rDecoder_mark, RUBY_DEFAULT_FREE, dec);
+	Base85rDecoder_init(dec);
+	return obj;
+}
+
+static Base85rEncoder *get_encoder(VALUE self)
+{
+	Base85rEncoder *enc;
+	Data_Get_Struct(self, Base85rEncoder, enc);
+	if (enc->out == Qnil)
+		rb_raise(rb_eArgError, "Encoder is finished or not initialized");
+	return enc;
+}
+
+static Base85rDecoder *get_decoder(VALUE self)
+{
+	Base85rDecoder *dec;
+	Data_Get_Struct(self, Base85rDecoder, dec);
+	if (dec->out == Qnil)
+		rb_raise(rb_eArgError, "Decoder is finished or not initialized");
+	return dec;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Base85r::Encoder.new(length, out = '')
+ *
+ * Creates the incremental base85r encoder. The total +length+ of the
+ * input data must be known in advance. The encoded text is appended
+ * to +out+: String or any object with the << method (e.g. IO)
+ */
+static VALUE m_encoder_init(int argc, VALUE *argv, VALUE self)
+{
+	Base85rEncoder *enc;
+	VALUE length, out;
+	long len;
+	rb_scan_args(argc, argv, "11", &length, &out);
+	len = NUM2LONG(length);
+	if (len < 0)
+		rb_raise(rb_eArgError, "Length must be non-negative");
+	Data_Get_Struct(self, Base85rEncoder, enc);
+	Base85rEncoder_init(enc, len);
+	enc->out = (out == Qnil) ? rb_str_new(NULL, 0) : out;
+	base85r_write(enc->out, 2, enc_begin_func, enc, NULL, 0);
+	return self;
+}
+
+/*
+ * call-seq:
+ *   enc << data -> enc
+ *
+ * Encodes the next chunk of the input data
+ */
+static VALUE m_encoder_push(VALUE self, VALUE data)
+{
+	Base85rEncoder *enc = get_encoder(self);
+	StringValue(data);
+	base85r_encoder_write(enc, enc->out, (const unsigned char *) RSTRING_PTR(data), RSTRING_LEN(data));
+	RB_GC_GUARD(data);
+	return self;
+}
+
+/*
+ * call-seq:
+ *   enc.finish -> out
+ *
+ * Writes the last group and returns the output object. All declared
+ * input data must be written before
+ */
+static VALUE m_encoder_finish(VALUE self)
+{
+	Base85rEncoder *enc = get_encoder(self);
+	VALUE out = enc->out;
+	base85r_write(out, 8, enc_finish_func, enc, NULL, 0);
+	enc->out = Qnil;
+	return out;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Base85r::Decoder.new(out = '')
+ *
+ * Creates the incremental base85r decoder. The decoded data is appended
+ * to +out+: String or any object with the << method (e.g. IO)
+ */
+static VALUE m_decoder_init(int argc, VALUE *argv, VALUE self)
+{
+	Base85rDecoder *dec;
+	VALUE out;
+	rb_scan_args(argc, argv, "01", &out);
+	Data_Get_Struct(self, Base85rDecoder, dec);
+	Base85rDecoder_init(dec);
+	dec->out = (out == Qnil) ? rb_str_new(NULL, 0) : out;
+	return self;
+}
+
+/*
+ * call-seq:
+ *   dec << text -> dec
+ *
+ * Decodes the next chunk of the text (chunks may be split at any position)
+ */
+static VALUE m_decoder_push(VALUE self, VALUE text)
+{
+	Base85rDecoder *dec = get_decoder(self);
+	StringValue(text);
+	base85r_decoder_write(dec, dec->out, (const unsigned char *) RSTRING_PTR(text), RSTRING_LEN(text));
+	RB_GC_GUARD(text);
+	return self;
+}
+
+/*
+ * call-seq:
+ *   dec.finish -> out
+ *
+ * Writes the last bytes and returns the output object
+ */
+static VALUE m_decoder_finish(VALUE self)
+{
+	Base85rDecoder *dec = get_decoder(self);
+	VALUE out = dec->out;
+	base85r_write(out, 4, dec_finish_func, dec, NULL, 0);
+	dec->out = Qnil;
+	return out;
+}
+
+/*
+ * Reads the next chunk from IO (nil means the end of file)
+ */
+static VALUE io_read_chunk(VALUE inp)
+{
+	VALUE chunk = rb_funcall(inp, rb_intern("read"), 1, INT2FIX(BASE85R_CHUNK));
+	if (chunk != Qnil)
+		StringValue(chunk);
+	return chunk;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Base85r.encode_io(inp, out, length = inp.size) -> length
+ *
+ * Reads the data from +inp+ IO by chunks and writes the encoded text to +out+
+ * (see NodeMarshal::Base85r::Encoder). Returns the number of read bytes
+ */
+static VALUE m_base85r_encode_io(int argc, VALUE *argv, VALUE obj)
+{
+	Base85rEncoder enc;
+	VALUE inp, out, length, chunk;
+	rb_scan_args(argc, argv, "21", &inp, &out, &length);
+	if (length == Qnil)
+		length = rb_funcall(inp, rb_intern("size"), 0);
+	Base85rEncoder_init(&enc, NUM2LONG(length));
+	base85r_write(out, 2, enc_begin_func, &enc, NULL, 0);
+	while ((chunk = io_read_chunk(inp)) != Qnil && RSTRING_LEN(chunk) > 0)
+		base85r_encoder_write(&enc, out, (const unsigned char *) RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+	base85r_write(out, 8, enc_finish_func, &enc, NULL, 0);
+	return LONG2NUM(enc.inp_len);
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Base85r.decode_io(inp, out) -> length
+ *
+ * Reads the text from +inp+ IO by chunks and writes the decoded data to +out+
+ * (see NodeMarshal::Base85r::Decoder). Returns the number of written bytes
+ */
+static VALUE m_base85r_decode_io(VALUE obj, VALUE inp, VALUE out)
+{
+	Base85rDecoder dec;
+	VALUE chunk;
+	Base85rDecoder_init(&dec);
+	while ((chunk = io_read_chunk(inp)) != Qnil && RSTRING_LEN(chunk) > 0)
+		base85r_decoder_write(&dec, out, (const unsigned char *) RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+	base85r_write(out, 4, dec_finish_func, &dec, NULL, 0);
+	return LONG2NUM(dec.out_len);
+}
+
+/*
+ * Defines NodeMarshal::Base85r module with the incremental encoder
+ * and decoder classes
+ */
+void base85r_define_classes(VALUE cNodeMarshal)
+{
+	VALUE mBase85r = rb_define_module_under(cNodeMarshal, "Base85r");
+	VALUE cEncoder = rb_define_class_under(mBase85r, "Encoder", rb_cObject);
+	VALUE cDecoder = rb_define_class_under(mBase85r, "Decoder", rb_cObject);
+	rb_define_singleton_method(mBase85r, "encode_io", RUBY_METHOD_FUNC(m_base85r_encode_io), -1);
+	rb_define_singleton_method(mBase85r, "decode_io", RUBY_METHOD_FUNC(m_base85r_decode_io), 2);
+	rb_define_alloc_func(cEncoder, m_encoder_alloc);
+	rb_define_method(cEncoder, "initialize", RUBY_METHOD_FUNC(m_encoder_init), -1);
+	rb_define_method(cEncoder, "<<", RUBY_METHOD_FUNC(m_encoder_push), 1);
+	rb_define_method(cEncoder, "finish", RUBY_METHOD_FUNC(m_encoder_finish), 0);
+	rb_define_alloc_func(cDecoder, m_decoder_alloc);
+	rb_define_method(cDecoder, "initialize", RUBY_METHOD_FUNC(m_decoder_init), -1);
+	rb_define_method(cDecoder, "<<", RUBY_METHOD_FUNC(m_decoder_push), 1);
+	rb_define_method(cDecoder, "finish", RUBY_METHOD_FUNC(m_decoder_finish), 0);
 }
@@ -0,0 +1,850 @@
+/*
+ * Compression of node dumps by native codecs (zlib and zstd if
+ * it is available at the build time), see NodeMarshal::Codec.
+ *
+ * Format of the compressed frame (all integers are little-endian):
+ *   magic    -- 4 bytes, CODEC_MAGIC
+ *   codec    -- uint8, CODEC_ZLIB or CODEC_ZSTD
+ *   level    -- uint8, compression level (informative)
+ *   reserved -- 2 bytes, zeros
+ *   dict_id  -- uint32, Adler-32 of the dictionary (0 is no dictionary)
+ *   raw_len  -- uint32, size of uncompressed data
+ *   payload  -- zlib stream or zstd frame
+ *
+ * Dictionaries are registered in the process-wide table by their
+ * identifiers (NodeMarshal::Codec.add_dictionary), so many compiled
+ * files may share one dictionary file.
+ *
+ * (C) 2015-2017 Alexey Voskov
+ * License: BSD-2-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ruby.h>
+#include <ruby/version.h>
+#include "nodedump.h"
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#endif
+
+#if defined(HAVE_ZSTD_H) && defined(HAVE_ZDICT_H)
+#define USE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+#endif
+
+#define TRAIN_GRAM 8 // Length of substrings counted by the dictionary trainer
+#define TRAIN_SEG 48 // Length of segments copied to the dictionary
+#define TRAIN_STEP 16 // Distance between candidate segments
+#define TRAIN_HASH_BITS 20 // Size of the table of substrings counters
+#define DICT_MAX_SIZE (1 << 20)
+#define CODEC_MAX_RATIO 1032 // Maximal compression ratio of deflate
+#define CODEC_MAX_RAW_LEN (1L << 30) // Maximal declared size of uncompressed data
+
+static VALUE codec_dicts = Qnil; // dict_id (Integer) => dictionary (String)
+
+static uint32_t get_u32(const unsigned char *ptr)
+{
+	return (uint32_t) ptr[0] | ((uint32_t) ptr[1] << 8) |
+		((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+static void put_u32(unsigned char *ptr, uint32_t val)
+{
+	ptr[0] = val & 0xFF;
+	ptr[1] = (val >> 8) & 0xFF;
+	ptr[2] = (val >> 16) & 0xFF;
+	ptr[3] = (val >> 24) & 0xFF;
+}
+
+/*
+ * Adler-32 checksum (is used as the dictionary identifier)
+ */
+uint32_t codec_checksum(const unsigned char *ptr, long len)
+{
+	uint32_t a = 1, b = 0;
+	long i;
+	for (i = 0; i < len; i++)
+	{
+		a = (a + ptr[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+static VALUE codec_get_dict(uint32_t dict_id)
+{
+	VALUE dict = rb_hash_lookup(codec_dicts, UINT2NUM(dict_id));
+	if (dict == Qnil)
+		rb_raise(rb_eArgError, "Compressed frame: dictionary %08X is not loaded", dict_id);
+	return dict;
+}
+
+/*
+ * Checks if the buffer begins with the compressed frame signature
+ */
+int codec_is_frame(const char *ptr, long len)
+{
+	return (len >= CODEC_HEADER_LEN && !memcmp(ptr, CODEC_MAGIC, 4));
+}
+
+static int codec_from_sym(VALUE sym)
+{
+	if (sym == Qnil || sym == Qtrue || sym == ID2SYM(rb_intern("zlib")))
+		return CODEC_ZLIB;
+	else if (sym == ID2SYM(rb_intern("zstd")))
+		return CODEC_ZSTD;
+	rb_raise(rb_eArgError, "Unknown codec %s", RSTRING_PTR(rb_inspect(sym)));
+	return CODEC_NONE;
+}
+
+static void codec_check_support(int codec)
+{
+#ifndef HAVE_ZLIB_H
+	if (codec == CODEC_ZLIB)
+		rb_raise(rb_eArgError, "zlib codec is not supported (zlib.h was not found at the build time)");
+#endif
+#ifndef USE_ZSTD
+	if (codec == CODEC_ZSTD)
+		rb_raise(rb_eArgError, "zstd codec is not supported (zstd.h was not found at the build time)");
+#endif
+}
+
+/*
+ * Compresses the data to the frame. level -1 means the default level of codec,
+ * dict is the dictionary (String) or nil
+ */
+static VALUE codec_compress(VALUE data, int codec, int level, VALUE dict)
+{
+	const unsigned char *inp = (const unsigned char *) RSTRING_PTR(data);
+	long len = RSTRING_LEN(data), out_len = 0;
+	uint32_t dict_id = 0;
+	VALUE out = Qnil;
+	unsigned char *hdr;
+	codec_check_support(codec);
+	if (len > 0xFFFFFFFFL)
+		rb_raise(rb_eArgError, "Data is too large for the compressed frame");
+	if (dict != Qnil)
+	{
+		StringValue(dict);
+		dict_id = codec_checksum((const unsigned char *) RSTRING_PTR(dict), RSTRING_LEN(dict));
+	}
+#ifdef HAVE_ZLIB_H
+	if (codec == CODEC_ZLIB)
+	{
+		z_stream zs;
+		int ret;
+		if (level < 0)
+			level = 6;
+		if (level > 9)
+			rb_raise(rb_eArgError, "zlib compression level must be from 0 to 9");
+		// The output is allocated before deflateInit: rb_str_new may raise
+		// NoMemError. The conservative bound (without the stream) is used,
+		// 4 bytes are reserved for the dictionary identifier
+		out = rb_str_new(NULL, CODEC_HEADER_LEN + (long) deflateBound(NULL, (uLong) len) + 4);
+		memset(&zs, 0, sizeof(zs));
+		if (deflateInit(&zs, level) != Z_OK)
+			rb_raise(rb_eNoMemError, "deflateInit failed");
+		if (dict != Qnil && deflateSetDictionary(&zs, (const Bytef *) RSTRING_PTR(dict),
+			(uInt) RSTRING_LEN(dict)) != Z_OK)
+		{
+			deflateEnd(&zs);
+			rb_raise(rb_eArgError, "deflateSetDictionary failed");
+		}
+		zs.next_in = (Bytef *) inp;
+		zs.avail_in = (uInt) len;
+		zs.next_out = (Bytef *) RSTRING_PTR(out) + CODEC_HEADER_LEN;
+		zs.avail_out = (uInt) (RSTRING_LEN(out) - CODEC_HEADER_LEN);
+		ret = deflate(&zs, Z_FINISH);
+		out_len = (long) zs.total_out;
+		deflateEnd(&zs);
+		if (ret != Z_STREAM_END)
+			rb_raise(rb_eArgError, "deflate failed");
+	}
+#endif
+#ifdef USE_ZSTD
+	if (codec == CODEC_ZSTD)
+	{
+		ZSTD_CCtx *cctx;
+		size_t ret;
+		if (level < 0)
+			level = 3;
+		if (level < 1 || level > ZSTD_maxCLevel())
+			rb_raise(rb_eArgError, "zstd compression level must be from 1 to %d", ZSTD_maxCLevel());
+		out = rb_str_new(NULL, CODEC_HEADER_LEN + (long) ZSTD_compressBound((size_t) len));
+		cctx = ZSTD_createCCtx();
+		if (cctx == NULL)
+			rb_raise(rb_eNoMemError, "ZSTD_createCCtx failed");
+		if (dict != Qnil)
+			ret = ZSTD_compress_usingDict(cctx, RSTRING_PTR(out) + CODEC_HEADER_LEN,
+				RSTRING_LEN(out) - CODEC_HEADER_LEN, inp, (size_t) len,
+				RSTRING_PTR(dict), RSTRING_LEN(dict), level);
+		else
+			ret = ZSTD_compressCCtx(cctx, RSTRING_PTR(out) + CODEC_HEADER_LEN,
+				RSTRING_LEN(out) - CODEC_HEADER_LEN, inp, (size_t) len, level);
+		ZSTD_freeCCtx(cctx);
+		if (ZSTD_isError(ret))
+			rb_raise(rb_eArgError, "zstd compression failed: %s", ZSTD_getErrorName(ret));
+		out_len = (long) ret;
+	}
+#endif
+	// Header
+	hdr = (unsigned char *) RSTRING_PTR(out);
+	memcpy(hdr, CODEC_MAGIC, 4);
+	hdr[4] = (unsigned char) codec;
+	hdr[5] = (unsigned char) level;
+	hdr[6] = 0; hdr[7] = 0;
+	put_u32(hdr + 8, dict_id);
+	put_u32(hdr + 12, (uint32_t) len);
+	RB_GC_GUARD(data);
+	return rb_str_resize(out, CODEC_HEADER_LEN + out_len);
+}
+
+/*
+ * Incremental decoder of the frame. Data without the frame signature
+ * is copied as is (uncompressed dumps). The payload is decoded without
+ * Ruby API (it may be called without GVL): errors are saved to the
+ * decoder and raised by CodecDecoder_finish. Only the header is
+ * processed with GVL (allocation of the output, the dictionary lookup)
+ */
+typedef struct {
+	unsigned char hdr[CODEC_HEADER_LEN];
+	int hdr_len;
+	int codec; // -1 means that the header is not read yet
+	uint32_t raw_len;
+	uint32_t dict_id;
+	VALUE out;
+	long out_len;
+	long out_max; // Capacity of the output for uncompressed data (size of the input)
+	VALUE dict; // Dictionary of the frame (nil if it is not used)
+	int done;
+	int nogvl; // 1 if the decoder is called without GVL
+	VALUE exc; // Exception raised during processing of the header
+	VALUE err_class; // Error of the payload decoding (or Qnil)
+	char err_msg[128];
+#ifdef HAVE_ZLIB_H
+	z_stream zs;
+	int zs_init;
+#endif
+#ifdef USE_ZSTD
+	ZSTD_DStream *zds;
+#endif
+} CodecDecoder;
+
+static void CodecDecoder_init(CodecDecoder *dec, long out_max)
+{
+	memset(dec, 0, sizeof(CodecDecoder));
+	dec->codec = -1;
+	dec->out = Qnil;
+	dec->out_max = out_max;
+	dec->dict = Qnil;
+	dec->exc = Qnil;
+	dec->err_class = Qnil;
+}
+
+static void CodecDecoder_free(CodecDecoder *dec)
+{
+#ifdef HAVE_ZLIB_H
+	if (dec->zs_init)
+		inflateEnd(&dec->zs);
+	dec->zs_init = 0;
+#endif
+#ifdef USE_ZSTD
+	if (dec->zds != NULL)
+		ZSTD_freeDStream(dec->zds);
+	dec->zds = NULL;
+#endif
+}
+
+/*
+ * Saves the error (only the first one is kept). Returns -1
+ */
+static int CodecDecoder_fail(CodecDecoder *dec, VALUE err_class, const char *fmt, ...)
+{
+	va_list args;
+	if (dec->err_class != Qnil || dec->exc != Qnil)
+		return -1;
+	va_start(args, fmt);
+	vsnprintf(dec->err_msg, sizeof(dec->err_msg), fmt, args);
+	va_end(args);
+	dec->err_class = err_class;
+	return -1;
+}
+
+static VALUE CodecDecoder_begin(VALUE arg)
+{
+	CodecDecoder *dec = (CodecDecoder *) arg;
+	if (memcmp(dec->hdr, CODEC_MAGIC, 4))
+	{	// Uncompressed data
+		dec->codec = CODEC_NONE;
+		if (dec->out_max < dec->hdr_len)
+			dec->out_max = dec->hdr_len;
+		dec->out = rb_str_buf_new(dec->out_max);
+		memcpy(RSTRING_PTR(dec->out), dec->hdr, dec->hdr_len);
+		dec->out_len = dec->hdr_len;
+		return Qnil;
+	}
+	dec->codec = dec->hdr[4];
+	dec->dict_id = get_u32(dec->hdr + 8);
+	dec->raw_len = get_u32(dec->hdr + 12);
+	if (dec->codec != CODEC_ZLIB && dec->codec != CODEC_ZSTD)
+		rb_raise(rb_eArgError, "Compressed frame: unknown codec %d", dec->codec);
+	codec_check_support(dec->codec);
+	if (dec->dict_id != 0)
+		dec->dict = codec_get_dict(dec->dict_id);
+	// raw_len is taken from the untrusted header: it is checked before
+	// allocation of the output (the data may be copied from the dictionary)
+	if ((long) dec->raw_len > CODEC_MAX_RAW_LEN || (long) dec->raw_len >
+		dec->out_max * CODEC_MAX_RATIO + ((dec->dict != Qnil) ? RSTRING_LEN(dec->dict) : 0))
+		rb_raise(rb_eArgError, "Compressed frame: declared size %u is too large", (unsigned int) dec->raw_len);
+	dec->out = rb_str_new(NULL, (long) dec->raw_len);
+#ifdef HAVE_ZLIB_H
+	if (dec->codec == CODEC_ZLIB)
+	{
+		if (inflateInit(&dec->zs) != Z_OK)
+			rb_raise(rb_eNoMemError, "inflateInit failed");
+		dec->zs_init = 1;
+		dec->zs.next_out = (Bytef *) RSTRING_PTR(dec->out);
+		dec->zs.avail_out = (uInt) dec->raw_len;
+	}
+#endif
+#ifdef USE_ZSTD
+	if (dec->codec == CODEC_ZSTD)
+	{
+		size_t ret;
+		dec->zds = ZSTD_createDStream();
+		if (dec->zds == NULL)
+			rb_raise(rb_eNoMemError, "ZSTD_createDStream failed");
+		if (dec->dict != Qnil)
+			ret = ZSTD_initDStream_usingDict(dec->zds, RSTRING_PTR(dec->dict), RSTRING_LEN(dec->dict));
+		else
+			ret = ZSTD_initDStream(dec->zds);
+		if (ZSTD_isError(ret))
+			rb_raise(rb_eArgError, "ZSTD_initDStream failed: %s", ZSTD_getErrorName(ret));
+	}
+#endif
+	return Qnil;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/*
+ * Processes the header when the decoder is called without GVL:
+ * the exception is saved to the decoder
+ */
+static void *CodecDecoder_beginGvl(void *arg)
+{
+	CodecDecoder *dec = (CodecDecoder *) arg;
+	int state = 0;
+	rb_protect(CodecDecoder_begin, (VALUE) dec, &state);
+	if (state)
+	{
+		dec->exc = rb_errinfo();
+		rb_set_errinfo(Qnil);
+	}
+	return NULL;
+}
+#endif
+
+/*
+ * Decodes the next chunk of the frame. Returns 0 or -1 if the error
+ * was saved to the decoder
+ */
+static int CodecDecoder_push(CodecDecoder *dec, const unsigned char *ptr, long len)
+{
+	// Header
+	while (dec->codec == -1 && len > 0)
+	{
+		dec->hdr[dec->hdr_len++] = *ptr++;
+		len--;
+		if (dec->hdr_len == CODEC_HEADER_LEN)
+		{
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+			if (dec->nogvl)
+				rb_thread_call_with_gvl(CodecDecoder_beginGvl, dec);
+			else
+#endif
+				CodecDecoder_begin((VALUE) dec);
+			if (dec->exc != Qnil)
+				return -1;
+		}
+	}
+	if (len == 0)
+		return 0;
+	if (dec->done)
+		return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame: unexpected data after the end of stream");
+	// Payload
+	if (dec->codec == CODEC_NONE)
+	{
+		if (len > dec->out_max - dec->out_len)
+			return CodecDecoder_fail(dec, rb_eArgError, "Uncompressed data is too large");
+		memcpy(RSTRING_PTR(dec->out) + dec->out_len, ptr, len);
+		dec->out_len += len;
+		return 0;
+	}
+#ifdef HAVE_ZLIB_H
+	if (dec->codec == CODEC_ZLIB)
+	{
+		dec->zs.next_in = (Bytef *) ptr;
+		dec->zs.avail_in = (uInt) len;
+		while (dec->zs.avail_in > 0 && !dec->done)
+		{
+			int ret = inflate(&dec->zs, Z_NO_FLUSH);
+			if (ret == Z_NEED_DICT)
+			{
+				if (dec->dict == Qnil || inflateSetDictionary(&dec->zs, (const Bytef *) RSTRING_PTR(dec->dict),
+					(uInt) RSTRING_LEN(dec->dict)) != Z_OK)
+					return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame: invalid dictionary");
+			}
+			else if (ret == Z_STREAM_END)
+				dec->done = 1;
+			else if (ret != Z_OK)
+				return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame is corrupted (zlib error %d)", ret);
+		}
+		if (dec->zs.avail_in > 0)
+			return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame: unexpected data after the end of stream");
+		dec->out_len = (long) dec->zs.total_out;
+	}
+#endif
+#ifdef USE_ZSTD
+	if (dec->codec == CODEC_ZSTD)
+	{
+		ZSTD_inBuffer inp = {ptr, (size_t) len, 0};
+		ZSTD_outBuffer out = {RSTRING_PTR(dec->out), (size_t) dec->raw_len, (size_t) dec->out_len};
+		while (inp.pos < inp.size)
+		{
+			size_t ret = ZSTD_decompressStream(dec->zds, &out, &inp);
+			if (ZSTD_isError(ret))
+				return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame is corrupted: %s", ZSTD_getErrorName(ret));
+			if (ret == 0)
+			{
+				dec->done = 1;
+				break;
+			}
+			if (out.pos == out.size && inp.pos < inp.size)
+				return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame: data is larger than declared");
+		}
+		if (inp.pos < inp.size)
+			return CodecDecoder_fail(dec, rb_eArgError, "Compressed frame: unexpected data after the end of stream");
+		dec->out_len = (long) out.pos;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Raises the saved error or returns the decoded data (requires GVL)
+ */
+static VALUE CodecDecoder_finish(CodecDecoder *dec)
+{
+	if (dec->exc != Qnil)
+		rb_exc_raise(dec->exc);
+	if (dec->err_class != Qnil)
+		rb_raise(dec->err_class, "%s", dec->err_msg);
+	if (dec->codec == -1)
+	{	// Short uncompressed data
+		if (dec->hdr_len >= 4 && !memcmp(dec->hdr, CODEC_MAGIC, 4))
+			rb_raise(rb_eArgError, "Compressed frame is truncated");
+		return rb_str_new((const char *) dec->hdr, dec->hdr_len);
+	}
+	if (dec->codec == CODEC_NONE)
+		rb_str_set_len(dec->out, dec->out_len);
+	else if (!dec->done || dec->out_len != (long) dec->raw_len)
+		rb_raise(rb_eArgError, "Compressed frame is truncated or corrupted");
+	return dec->out;
+}
+
+static int codec_sink(void *arg, const unsigned char *ptr, long len)
+{
+	return CodecDecoder_push((CodecDecoder *) arg, ptr, len);
+}
+
+typedef struct {
+	CodecDecoder dec;
+	const char *ptr;
+	long len;
+	int base85r;
+	int b85_err; // Result of base85r_decode_stream
+} CodecDecodeArgs;
+
+static void *codec_decode_nogvl(void *arg)
+{
+	CodecDecodeArgs *a = (CodecDecodeArgs *) arg;
+	if (a->base85r)
+		a->b85_err = base85r_decode_stream(a->ptr, a->len, codec_sink, &a->dec);
+	else
+		CodecDecoder_push(&a->dec, (const unsigned char *) a->ptr, a->len);
+	return NULL;
+}
+
+static VALUE codec_decode_body(VALUE arg)
+{
+	CodecDecodeArgs *a = (CodecDecodeArgs *) arg;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	if (a->len >= NOGVL_MIN_BYTES)
+	{
+		a->dec.nogvl = 1;
+		rb_thread_call_without_gvl(codec_decode_nogvl, a, NULL, NULL);
+		a->dec.nogvl = 0;
+	}
+	else
+#endif
+		codec_decode_nogvl(a);
+	if (a->b85_err == BASE85R_ERR_SHORT)
+		rb_raise(rb_eArgError, "base85r_decode: input string is too short");
+	else if (a->b85_err == BASE85R_ERR_CORRUPTED)
+		rb_raise(rb_eArgError, "base85r_decode: input string is corrupted");
+	return CodecDecoder_finish(&a->dec);
+}
+
+static VALUE codec_decode_ensure(VALUE arg)
+{
+	CodecDecoder_free(&((CodecDecodeArgs *) arg)->dec);
+	return Qnil;
+}
+
+/*
+ * Decodes the frame from the buffer owned by the frozen String or by
+ * the mapped file: it cannot be changed by other threads when the GVL
+ * is released (long inputs are decoded without GVL)
+ */
+static VALUE codec_decode(const char *ptr, long len, int base85r)
+{
+	CodecDecodeArgs a;
+	CodecDecoder_init(&a.dec, (base85r) ? len / 5 * 4 + 8 : len);
+	a.ptr = ptr;
+	a.len = len;
+	a.base85r = base85r;
+	a.b85_err = 0;
+	return rb_ensure(codec_decode_body, (VALUE) &a, codec_decode_ensure, (VALUE) &a);
+}
+
+/*
+ * Decompresses the frame (data without the frame signature is copied).
+ * The buffer must be owned by the frozen String or by the mapped file
+ */
+VALUE codec_decompress(const char *ptr, long len)
+{
+	return codec_decode(ptr, len, 0);
+}
+
+/*
+ * Decodes base85r text and decompresses the frame inside it. The decoded
+ * data are passed to the decompressor by small chunks, so only the output
+ * string is allocated
+ */
+VALUE codec_decode_base85r(VALUE text)
+{
+	VALUE ans;
+	StringValue(text);
+	text = rb_str_new_frozen(text);
+	ans = codec_decode(RSTRING_PTR(text), RSTRING_LEN(text), 1);
+	RB_GC_GUARD(text);
+	return ans;
+}
+
+/*
+ * Dictionary trainer for zlib: counts substrings of TRAIN_GRAM bytes
+ * that are present in several samples and copies the best segments
+ * to the dictionary (the best ones are placed to the end because zlib
+ * encodes the short distances more compactly)
+ */
+typedef struct {
+	uint64_t score;
+	long sample;
+	long offset;
+	long ind;
+} TrainSegment;
+
+static int TrainSegment_cmp(const void *a, const void *b)
+{
+	const TrainSegment *x = (const TrainSegment *) a, *y = (const TrainSegment *) b;
+	if (x->score != y->score)
+		return (x->score < y->score) ? 1 : -1;
+	return (x->ind < y->ind) ? -1 : (x->ind > y->ind);
+}
+
+static inline uint32_t train_hash(const unsigned char *ptr)
+{
+	uint64_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return (uint32_t) ((val * 0x9E3779B97F4A7C15ULL) >> (64 - TRAIN_HASH_BITS));
+}
+
+static uint64_t train_score(const unsigned char *ptr, const uint32_t *counts)
+{
+	uint64_t score = 0;
+	int i;
+	for (i = 0; i <= TRAIN_SEG - TRAIN_GRAM; i++)
+	{
+		uint32_t c = counts[train_hash(ptr + i)];
+		if (c > 1)
+			score += c - 1;
+	}
+	return score;
+}
+
+static VALUE codec_train_zlib(VALUE samples, long dict_size)
+{
+	long nsamples = RARRAY_LEN(samples), nsegs = 0, i, j, pos = dict_size;
+	// Buffers are owned by the temporary objects (ALLOCV): they are
+	// released by GC if some allocation raises NoMemError
+	VALUE counts_tmp, stamps_tmp, segs_tmp;
+	uint32_t *counts = ALLOCV_N(uint32_t, counts_tmp, 1 << TRAIN_HASH_BITS);
+	uint32_t *stamps = ALLOCV_N(uint32_t, stamps_tmp, 1 << TRAIN_HASH_BITS);
+	TrainSegment *segs;
+	VALUE dict = rb_str_new(NULL, dict_size);
+	unsigned char *dptr = (unsigned char *) RSTRING_PTR(dict);
+	MEMZERO(counts, uint32_t, 1 << TRAIN_HASH_BITS);
+	MEMZERO(stamps, uint32_t, 1 << TRAIN_HASH_BITS);
+	// Count substrings (once per sample)
+	for (i = 0; i < nsamples; i++)
+	{
+		VALUE s = RARRAY_AREF(samples, i);
+		const unsigned char *ptr = (const unsigned char *) RSTRING_PTR(s);
+		long len = RSTRING_LEN(s);
+		for (j = 0; j + TRAIN_GRAM <= len; j++)
+		{
+			uint32_t h = train_hash(ptr + j);
+			if (stamps[h] != (uint32_t) (i + 1))
+			{
+				stamps[h] = (uint32_t) (i + 1);
+				counts[h]++;
+			}
+		}
+		if (len >= TRAIN_SEG)
+			nsegs += (len - TRAIN_SEG) / TRAIN_STEP + 1;
+	}
+	ALLOCV_END(stamps_tmp);
+	// Score the segments
+	segs = ALLOCV_N(TrainSegment, segs_tmp, nsegs + 1);
+	nsegs = 0;
+	for (i = 0; i < nsamples; i++)
+	{
+		VALUE s = RARRAY_AREF(samples, i);
+		const unsigned char *ptr = (const unsigned char *) RSTRING_PTR(s);
+		long len = RSTRING_LEN(s);
+		for (j = 0; j + TRAIN_SEG <= len; j += TRAIN_STEP)
+		{
+			segs[nsegs].score = train_score(ptr + j, counts);
+			segs[nsegs].sample = i;
+			segs[nsegs].offset = j;
+			segs[nsegs].ind = nsegs;
+			if (segs[nsegs].score > 0)
+				nsegs++;
+		}
+	}
+	qsort(segs, nsegs, sizeof(TrainSegment), TrainSegment_cmp);
+	// Copy the best segments (substrings that are already in the
+	// dictionary are not counted again)
+	for (i = 0; i < nsegs && pos > 0; i++)
+	{
+		const unsigned char *ptr = (const unsigned char *)
+			RSTRING_PTR(RARRAY_AREF(samples, segs[i].sample)) + segs[i].offset;
+		uint64_t score = train_score(ptr, counts);
+		long n = (pos < TRAIN_SEG) ? pos : TRAIN_SEG;
+		if (score == 0 || score * 2 < segs[i].score)
+			continue;
+		memcpy(dptr + pos - n, ptr + TRAIN_SEG - n, n);
+		pos -= n;
+		for (j = 0; j <= TRAIN_SEG - TRAIN_GRAM; j++)
+			counts[train_hash(ptr + j)] = 0;
+	}
+	ALLOCV_END(segs_tmp);
+	ALLOCV_END(counts_tmp);
+	return rb_str_substr(dict, pos, dict_size - pos);
+}
+
+#ifdef USE_ZSTD
+static VALUE codec_train_zstd(VALUE samples, long dict_size)
+{
+	long nsamples = RARRAY_LEN(samples), total = 0, i;
+	VALUE sizes_tmp, buf, dict = rb_str_new(NULL, dict_size);
+	size_t *sizes = ALLOCV_N(size_t, sizes_tmp, nsamples + 1), ret;
+	for (i = 0; i < nsamples; i++)
+		total += RSTRING_LEN(RARRAY_AREF(samples, i));
+	buf = rb_str_buf_new(total);
+	for (i = 0; i < nsamples; i++)
+	{
+		rb_str_buf_append(buf, RARRAY_AREF(samples, i));
+		sizes[i] = (size_t) RSTRING_LEN(RARRAY_AREF(samples, i));
+	}
+	ret = ZDICT_trainFromBuffer(RSTRING_PTR(dict), (size_t) dict_size, RSTRING_PTR(buf),
+		sizes, (unsigned) nsamples);
+	ALLOCV_END(sizes_tmp);
+	if (ZDICT_isError(ret))
+		rb_raise(rb_eArgError, "zstd dictionary training failed: %s", ZDICT_getErrorName(ret));
+	return rb_str_resize(dict, (long) ret);
+}
+#endif
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.compress(data, opts = {}) -> frame
+ *
+ * Compresses the string to the frame (see NodeMarshal::Codec.decompress).
+ * Options:
+ * - <tt>:codec</tt> -- <tt>:zlib</tt> (default) or <tt>:zstd</tt>
+ *   (see NodeMarshal::Codec.codecs)
+ * - <tt>:level</tt> -- compression level (0..9 for zlib, 1..19 for zstd)
+ * - <tt>:dictionary</tt> -- dictionary (String, see
+ *   NodeMarshal::Codec.train_dictionary); it must be registered by
+ *   NodeMarshal::Codec.add_dictionary before decompression
+ */
+static VALUE m_codec_compress(int argc, VALUE *argv, VALUE obj)
+{
+	VALUE data, opts, level_val = Qnil, dict = Qnil, codec_val = Qnil;
+	rb_scan_args(argc, argv, "11", &data, &opts);
+	StringValue(data);
+	if (opts != Qnil)
+	{
+		Check_Type(opts, T_HASH);
+		codec_val = rb_hash_lookup(opts, ID2SYM(rb_intern("codec")));
+		level_val = rb_hash_lookup(opts, ID2SYM(rb_intern("level")));
+		dict = rb_hash_lookup(opts, ID2SYM(rb_intern("dictionary")));
+	}
+	return codec_compress(data, codec_from_sym(codec_val),
+		(level_val == Qnil) ? -1 : NUM2INT(level_val), dict);
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.decompress(frame) -> data
+ *
+ * Decompresses the frame made by NodeMarshal::Codec.compress. Strings
+ * without the frame signature are returned unchanged
+ */
+static VALUE m_codec_decompress(VALUE obj, VALUE frame)
+{
+	VALUE ans;
+	StringValue(frame);
+	frame = rb_str_new_frozen(frame);
+	ans = codec_decompress(RSTRING_PTR(frame), RSTRING_LEN(frame));
+	RB_GC_GUARD(frame);
+	return ans;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.decode_base85r(text) -> data
+ *
+ * Fused base85r decoding and decompression (see NodeMarshal.base85r_decode
+ * and NodeMarshal::Codec.decompress) without intermediate strings
+ */
+static VALUE m_codec_decode_base85r(VALUE obj, VALUE text)
+{
+	return codec_decode_base85r(text);
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.frame_info(frame) -> hash or nil
+ *
+ * Returns the Hash with the header of the frame (<tt>:codec</tt>,
+ * <tt>:level</tt>, <tt>:dict_id</tt>, <tt>:size</tt>) or nil if the string
+ * is not the compressed frame
+ */
+static VALUE m_codec_frame_info(VALUE obj, VALUE frame)
+{
+	const unsigned char *hdr;
+	VALUE ans;
+	StringValue(frame);
+	if (!codec_is_frame(RSTRING_PTR(frame), RSTRING_LEN(frame)))
+		return Qnil;
+	hdr = (const unsigned char *) RSTRING_PTR(frame);
+	ans = rb_hash_new();
+	rb_hash_aset(ans, ID2SYM(rb_intern("codec")), (hdr[4] == CODEC_ZLIB) ?
+		ID2SYM(rb_intern("zlib")) : ((hdr[4] == CODEC_ZSTD) ? ID2SYM(rb_intern("zstd")) : INT2FIX(hdr[4])));
+	rb_hash_aset(ans, ID2SYM(rb_intern("level")), INT2FIX(hdr[5]));
+	rb_hash_aset(ans, ID2SYM(rb_intern("dict_id")), UINT2NUM(get_u32(hdr + 8)));
+	rb_hash_aset(ans, ID2SYM(rb_intern("size")), UINT2NUM(get_u32(hdr + 12)));
+	return ans;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.codecs -> array
+ *
+ * Returns the array of codecs supported by this build of the extension
+ */
+static VALUE m_codec_codecs(VALUE obj)
+{
+	VALUE ans = rb_ary_new();
+#ifdef HAVE_ZLIB_H
+	rb_ary_push(ans, ID2SYM(rb_intern("zlib")));
+#endif
+#ifdef USE_ZSTD
+	rb_ary_push(ans, ID2SYM(rb_intern("zstd")));
+#endif
+	return ans;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.add_dictionary(dict) -> dict_id
+ *
+ * Registers the dictionary for decompression of frames and returns
+ * its identifier
+ */
+static VALUE m_codec_add_dictionary(VALUE obj, VALUE dict)
+{
+	uint32_t dict_id;
+	StringValue(dict);
+	dict_id = codec_checksum((const unsigned char *) RSTRING_PTR(dict), RSTRING_LEN(dict));
+	if (rb_hash_lookup(codec_dicts, UINT2NUM(dict_id)) == Qnil)
+		rb_hash_aset(codec_dicts, UINT2NUM(dict_id), rb_str_new_frozen(dict));
+	return UINT2NUM(dict_id);
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Codec.train_dictionary(samples, size = 32768, codec = :zlib) -> dict
+ *
+ * Makes the dictionary from the array of sample strings (e.g. node dumps
+ * of the files from one project that share symbols and literals)
+ */
+static VALUE m_codec_train_dictionary(int argc, VALUE *argv, VALUE obj)
+{
+	VALUE samples, size_val, codec_val;
+	long size, i;
+	int codec;
+	rb_scan_args(argc, argv, "12", &samples, &size_val, &codec_val);
+	Check_Type(samples, T_ARRAY);
+	for (i = 0; i < RARRAY_LEN(samples); i++)
+		Check_Type(RARRAY_AREF(samples, i), T_STRING);
+	size = (size_val == Qnil) ? 32768 : NUM2LONG(size_val);
+	if (size < 256 || size > DICT_MAX_SIZE)
+		rb_raise(rb_eArgError, "Dictionary size must be from 256 to %d", DICT_MAX_SIZE);
+	codec = codec_from_sym(codec_val);
+	codec_check_support(codec);
+#ifdef USE_ZSTD
+	if (codec == CODEC_ZSTD)
+		return codec_train_zstd(samples, size);
+#endif
+	if (size > 32768)
+		size = 32768; // Window of deflate
+	return codec_train_zlib(samples, size);
+}
+
+/*
+ * Defines NodeMarshal::Codec module
+ */
+void codec_define_module(VALUE cNodeMarshal)
+{
+	VALUE mCodec = rb_define_module_under(cNodeMarshal, "Codec");
+	rb_define_singleton_method(mCodec, "compress", RUBY_METHOD_FUNC(m_codec_compress), -1);
+	rb_define_singleton_method(mCodec, "decompress", RUBY_METHOD_FUNC(m_codec_decompress), 1);
+	rb_define_singleton_method(mCodec, "decode_base85r", RUBY_METHOD_FUNC(m_codec_decode_base85r), 1);
+	rb_define_singleton_method(mCodec, "frame_info", RUBY_METHOD_FUNC(m_codec_frame_info), 1);
+	rb_define_singleton_method(mCodec, "codecs", RUBY_METHOD_FUNC(m_codec_codecs), 0);
+	rb_define_singleton_method(mCodec, "add_dictionary", RUBY_METHOD_FUNC(m_codec_add_dictionary), 1);
+	rb_define_singleton_method(mCodec, "train_dictionary", RUBY_METHOD_FUNC(m_codec_train_dictionary), -1);
+	codec_dicts = rb_hash_new();
+	rb_gc_register_address(&codec_dicts);
+}
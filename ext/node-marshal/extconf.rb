@@ -1,3 +1,12 @@
 #!/usr/bin/ruby
 require 'mkmf'
+have_header('sys/mman.h')
+have_header('pthread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+# Instrumentation (NodeMarshal#stats)
+have_func('clock_gettime', 'time.h')
+have_func('rb_gc_stat')
+# Codecs for NodeMarshal::Codec (zstd is optional)
+have_library('z', 'deflate', 'zlib.h') && have_header('zlib.h')
+have_library('zstd', 'ZSTD_compress', 'zstd.h') && have_header('zstd.h') && have_header('zdict.h')
 create_makefile('nodemarshal')
\ No newline at end of file
@@ -0,0 +1,106 @@
+/*
+ * Read-only memory mapped files used for loading of node dumps
+ * (see :binmmap source type of NodeMarshal class). The mapping is
+ * wrapped into Ruby object and is released by the garbage collector.
+ * Platforms without sys/mman.h use the file loaded to the dynamic memory.
+ *
+ * (C) 2015-2017 Alexey Voskov
+ * License: BSD-2-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <ruby.h>
+#include <ruby/version.h>
+#include "nodedump.h"
+
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+typedef struct {
+	char *ptr; // Beginning of the file contents
+	long len; // Size of the file in bytes
+	int is_mapped; // 1 - memory mapped file, 0 - dynamic memory
+} MappedFile;
+
+static void MappedFile_free(MappedFile *mf)
+{
+#ifdef HAVE_SYS_MMAN_H
+	if (mf->is_mapped && mf->ptr != NULL)
+		munmap(mf->ptr, (size_t) mf->len);
+	else
+		xfree(mf->ptr);
+#else
+	xfree(mf->ptr);
+#endif
+	xfree(mf);
+}
+
+#ifdef HAVE_SYS_MMAN_H
+static void MappedFile_map(MappedFile *mf, const char *fname)
+{
+	struct stat st;
+	void *ptr;
+	int fd = open(fname, O_RDONLY);
+	if (fd == -1)
+		rb_sys_fail(fname);
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		rb_sys_fail(fname);
+	}
+	if (st.st_size == 0)
+	{	// Empty files cannot be mapped
+		close(fd);
+		return;
+	}
+	ptr = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED)
+		rb_sys_fail(fname);
+	mf->ptr = (char *) ptr;
+	mf->len = (long) st.st_size;
+	mf->is_mapped = 1;
+}
+#endif
+
+/*
+ * Opens the file and maps it to the memory. Returns the Ruby object
+ * that owns the mapping
+ */
+VALUE mappedfile_open(VALUE klass, VALUE filename)
+{
+	MappedFile *mf;
+	VALUE obj;
+	FilePathValue(filename);
+	obj = Data_Make_Struct(klass, MappedFile, NULL, MappedFile_free, mf);
+	mf->ptr = NULL; mf->len = 0; mf->is_mapped = 0;
+#ifdef HAVE_SYS_MMAN_H
+	MappedFile_map(mf, StringValueCStr(filename));
+#else
+	{
+		VALUE bin = rb_funcall(rb_cFile, rb_intern("binread"), 1, filename);
+		mf->len = RSTRING_LEN(bin);
+		mf->ptr = ALLOC_N(char, mf->len + 1);
+		memcpy(mf->ptr, RSTRING_PTR(bin), mf->len);
+	}
+#endif
+	return obj;
+}
+
+/*
+ * Returns the pointer to the file contents and its size
+ */
+const char *mappedfile_get_data(VALUE obj, long *len)
+{
+	MappedFile *mf;
+	Data_Get_Struct(obj, MappedFile, mf);
+	*len = mf->len;
+	return (mf->ptr != NULL) ? mf->ptr : "";
+}
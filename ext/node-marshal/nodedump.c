@@ -9,18 +9,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <string.h>
 #include <ruby.h>
 #include <ruby/version.h>
+#include <ruby/encoding.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 
 /*
  * Some global variables
  */
-static VALUE cNodeObjAddresses, cNodeInfo;
+static VALUE cNodeObjAddresses, cNodeInfo, cNodeMappedFile, cNodeDictionary;
+static VALUE nodedump_to_bin(VALUE self, int flags, VALUE dict);
+static VALUE nodedump_to_lazy_bin(VALUE self, int flags, int min_nodes, VALUE dict);
+static int lazy_read_container(VALUE dump, const char **buf, long *len);
 
 /*
  * Part 1. .H files: nodedump functions + parts of Ruby internals
  */
 #include "nodedump.h"
+static VALUE nodedump_from_buffer(VALUE self, VALUE dump, const char *buf, long len,
+	int gc_start, int nthreads, NodeStats *st);
+static VALUE m_nodedump_to_hash(VALUE self);
 
 #ifdef WITH_CUSTOM_RB_GLOBAL_ENTRY
 /* Custom (and slow) implementation of rb_global_entry internal API for Ruby 2.3
@@ -32,20 +46,34 @@ static struct rb_global_entry *rb_global_entry(ID id)
 {
 	NODE *node, *gvar_node;
 	struct rb_global_entry *gentry;
+	VALUE name = rb_id2str(id);
+	long i;
+	/* Only names of global variables are compiled ($name, $-x or special
+	   variables like $!), e.g. the corrupted dump may contain any symbol */
+	if (!name || RSTRING_LEN(name) < 2 || RSTRING_PTR(name)[0] != '$')
+	{
+		return NULL;
+	}
+	for (i = 1; RSTRING_LEN(name) > 2 && i < RSTRING_LEN(name); i++)
+	{
+		unsigned char c = (unsigned char) RSTRING_PTR(name)[i];
+		if (!(ISALNUM(c) || c == '_' || c >= 0x80 || (i == 1 && c == '-')))
+			return NULL;
+	}
 	/* a) Step 1: create node from the expression consisting only from
 	   our global variable */
-	node = rb_compile_string("<compiled>", rb_id2str(id), NUM2INT(1));
-	if (nd_type(node) != NODE_SCOPE)
+	node = rb_compile_string("<compiled>", name, NUM2INT(1));
+	if (node == NULL || nd_type(node) != NODE_SCOPE)
 	{
 		return NULL;
 	}
 	/* b) Trace the node to the NODE_GVAR */
 	gvar_node = node->u2.node;
-	if (nd_type(gvar_node) == NODE_PRELUDE) /* Present only in 2.3 */
+	if (gvar_node != NULL && nd_type(gvar_node) == NODE_PRELUDE) /* Present only in 2.3 */
 	{
 		gvar_node = gvar_node->u2.node;
 	}
-	if (nd_type(gvar_node) != NODE_GVAR) /* Error: no GVAR found */
+	if (gvar_node == NULL || nd_type(gvar_node) != NODE_GVAR) /* Error: no GVAR found */
 	{
 		return NULL;
 	}
@@ -89,18 +117,6 @@ int is_value_in_heap(VALUE val)
 }
 
 
-/*
- * Converts Ruby string with hexadecimal number 
- * to the Ruby VALUE
- */
-VALUE str_to_value(VALUE str)
-{
-	intptr_t ans = (intptr_t) Qnil;
-	sscanf(RSTRING_PTR(str), "%"PRIxPTR, &ans);
-	return (VALUE) ans;
-}
-
-
 /*
  * Converts Ruby VALUE (i.e. machine address) to the
  * hexadecimal Ruby string
@@ -147,7 +163,7 @@ int value_to_bin(VALUE val, unsigned char *buf)
  * Returns
  *   VALUE
  */
-VALUE bin_to_value(unsigned char *buf, int len)
+VALUE bin_to_value(const unsigned char *buf, int len)
 {
 	VALUE val = (VALUE) 0;
 	int i;
@@ -156,6 +172,147 @@ VALUE bin_to_value(unsigned char *buf, int len)
 	return val;
 }
 
+/*
+ * Returns 1 if the whole node record from the nodes binary dump is
+ * located before end and its values fit into VALUE (the record must
+ * be checked before read_node_record)
+ */
+static int node_record_fits(const unsigned char *bin, const unsigned char *end)
+{
+	if (end - bin < 4 || bin[3] > sizeof(VALUE) || (bin[0] >> 4) > sizeof(VALUE) ||
+		(bin[1] >> 4) > sizeof(VALUE) || (bin[2] >> 4) > sizeof(VALUE))
+		return 0;
+	return end - bin >= 4 + bin[3] + (bin[0] >> 4) + (bin[1] >> 4) + (bin[2] >> 4);
+}
+
+/*
+ * Reads one node record from the nodes binary dump (see load_nodes_from_buf
+ * for the format description). Values of children are not resolved,
+ * rtypes will contain locations of values (VL_... constants).
+ * Returns pointer to the next record
+ */
+static const unsigned char *read_node_record(const unsigned char *bin,
+	int *rtypes, VALUE *flags, VALUE *u)
+{
+	int j;
+	for (j = 0; j < 4; j++)
+		rtypes[j] = *bin++;
+	*flags = bin_to_value(bin, rtypes[3]); bin += rtypes[3];
+	for (j = 0; j < 3; j++)
+	{
+		int val_len = (rtypes[j] & 0xF0) >> 4;
+		u[j] = bin_to_value(bin, val_len);
+		bin += val_len;
+		rtypes[j] &= 0x0F;
+	}
+	return bin;
+}
+
+/*
+ * Part 2a. Iterative traversal of the node tree
+ *
+ * Functions that walk through the tree (count_num_of_nodes, print_node,
+ * m_node_to_ary) keep the work items in the explicit stack instead of
+ * the recursion, so the depth of the tree is limited only by the
+ * dynamic memory. Items are pushed in the reverse order: it gives the
+ * same pre-order of nodes and leaves as the recursive traversal.
+ * The stack is wrapped into the hidden Ruby object, so it will be
+ * freed by GC even if the traversal is interrupted by an exception.
+ */
+#define NW_NODE 0 // Node that must be visited
+#define NW_LEAF 1 // Non-node child of the node (child is an index of child)
+#define NW_ARGS 2 // Non-node part of the rb_args_info (processed after its nodes)
+
+typedef struct {
+	NODE *node; // Node or owner of the leaf
+	NODE *parent; // Parent node
+	int kind; // NW_... constant
+	int child; // Index of the child (0..2) for leaves
+	int type; // Type of the child (NT_... constant) for leaves
+	int depth; // Depth of the item (used for printing)
+	int pid; // Ordinal of the parent node (used by count_num_of_nodes)
+	VALUE data, key; // Output container and key (e.g. Hash and Symbol)
+} NodeWalkerItem;
+
+typedef struct {
+	NodeWalkerItem *items;
+	int len;
+	int capacity;
+} NodeWalker;
+
+static void NodeWalker_mark(NodeWalker *w)
+{
+	int i;
+	for (i = 0; i < w->len; i++)
+	{
+		rb_gc_mark(w->items[i].data);
+		rb_gc_mark(w->items[i].key);
+	}
+}
+
+static void NodeWalker_free(NodeWalker *w)
+{
+	xfree(w->items);
+	xfree(w);
+}
+
+/*
+ * Creates the stack wrapped into the hidden Ruby object (keep it in the
+ * local variable for protection from GC)
+ */
+static VALUE NodeWalker_new(NodeWalker **w)
+{
+	VALUE obj = Data_Make_Struct(0, NodeWalker, NodeWalker_mark, NodeWalker_free, *w);
+	(*w)->capacity = 64;
+	(*w)->len = 0;
+	(*w)->items = ALLOC_N(NodeWalkerItem, (*w)->capacity);
+	return obj;
+}
+
+/*
+ * Pushes the new item to the stack and returns pointer to it
+ * (fields that are not set by this function are zeroed)
+ */
+static NodeWalkerItem *NodeWalker_push(NodeWalker *w, int kind, NODE *node, NODE *parent, int depth)
+{
+	NodeWalkerItem *item;
+	if (w->len == w->capacity)
+	{
+		w->capacity *= 2;
+		REALLOC_N(w->items, NodeWalkerItem, w->capacity);
+	}
+	item = &w->items[w->len++];
+	item->node = node;
+	item->parent = parent;
+	item->kind = kind;
+	item->child = 0;
+	item->type = NT_NULL;
+	item->depth = depth;
+	item->pid = -1;
+	item->data = Qnil;
+	item->key = Qnil;
+	return item;
+}
+
+static NodeWalkerItem *NodeWalker_pushLeaf(NodeWalker *w, NODE *node, int child, int type, int depth)
+{
+	NodeWalkerItem *item = NodeWalker_push(w, NW_LEAF, node, node, depth);
+	item->child = child;
+	item->type = type;
+	return item;
+}
+
+/*
+ * Extracts the item from the stack. Returns 0 if the stack is empty
+ */
+static int NodeWalker_pop(NodeWalker *w, NodeWalkerItem *item)
+{
+	if (w->len == 0)
+		return 0;
+	*item = w->items[--w->len];
+	return 1;
+}
+
 #define NODES_CTBL_SIZE 256
 static int nodes_ctbl[NODES_CTBL_SIZE * 3];
 
@@ -166,84 +323,161 @@ static int nodes_ctbl[NODES_CTBL_SIZE * 3];
 
 /*
  * Keeps the information about node elements position 
- * in the memory and its IDs/ordinals for export to the file
+ * in the memory and its IDs/ordinals for export to the file.
+ *
+ * It is a native open-addressing hash table that maps raw keys
+ * (memory addresses or symbol IDs) to ordinals. Keys and values
+ * are kept in the order of insertion (i.e. ordinal is an index
+ * in keys and vals arrays). Ruby objects are created only during
+ * the export of the table to Ruby arrays.
  */
 typedef struct {
-	VALUE vals; // values: key=>val Hash
-	VALUE ids; // identifiers: key=>id Hash
-	VALUE pos; // free identifier
+	VALUE *keys; // keys (raw addresses/IDs) in the order of insertion
+	VALUE *vals; // values in the order of insertion
+	int *slots; // hash table slots: ordinal + 1 (0 means empty slot)
+	int nslots; // number of slots (power of 2)
+	int capacity; // size of keys and vals arrays
+	int pos; // free identifier
+	int ruby_vals; // 1 if vals are Ruby objects that must be marked by GC
 } LeafTableInfo;
 
-void LeafTableInfo_init(LeafTableInfo *lti)
+#define LEAFTABLE_INIT_SLOTS 64
+
+void LeafTableInfo_init(LeafTableInfo *lti, int ruby_vals)
 {
-	lti->vals = rb_hash_new();
-	lti->ids = rb_hash_new();
+	lti->nslots = LEAFTABLE_INIT_SLOTS;
+	lti->capacity = LEAFTABLE_INIT_SLOTS / 2;
 	lti->pos = 0;
+	lti->ruby_vals = ruby_vals;
+	lti->keys = ALLOC_N(VALUE, lti->capacity);
+	lti->vals = ALLOC_N(VALUE, lti->capacity);
+	lti->slots = ALLOC_N(int, lti->nslots);
+	MEMZERO(lti->slots, int, lti->nslots);
 }
 
 void LeafTableInfo_mark(LeafTableInfo *lti)
 {
-	rb_gc_mark(lti->vals);
-	rb_gc_mark(lti->ids);
+	int i;
+	if (!lti->ruby_vals || lti->vals == NULL)
+		return;
+	for (i = 0; i < lti->pos; i++)
+		rb_gc_mark(lti->vals[i]);
+}
+
+void LeafTableInfo_free(LeafTableInfo *lti)
+{
+	xfree(lti->keys);
+	xfree(lti->vals);
+	xfree(lti->slots);
+	lti->keys = NULL; lti->vals = NULL; lti->slots = NULL;
+	lti->pos = 0; lti->capacity = 0; lti->nslots = 0;
+}
+
+/*
+ * Returns the size of memory allocated for the table
+ */
+static size_t LeafTableInfo_memsize(const LeafTableInfo *lti)
+{
+	return 2 * sizeof(VALUE) * lti->capacity + sizeof(int) * lti->nslots;
+}
+
+/*
+ * Hash function for raw keys: addresses are aligned, so the lower bits
+ * are mixed with the upper ones before the multiplicative hashing
+ */
+static inline unsigned int LeafTableInfo_hash(VALUE key)
+{
+	VALUE h = key ^ (key >> 16);
+	h ^= h >> 7;
+	return (unsigned int) (h * 0x9E3779B1U);
+}
+
+/*
+ * Returns the index of the slot that either contains the key
+ * or is empty (i.e. can be used for the key insertion)
+ */
+static inline int LeafTableInfo_findSlot(LeafTableInfo *lti, VALUE key)
+{
+	unsigned int mask = (unsigned int) lti->nslots - 1;
+	unsigned int i = LeafTableInfo_hash(key) & mask;
+	while (lti->slots[i] != 0 && lti->keys[lti->slots[i] - 1] != key)
+		i = (i + 1) & mask;
+	return (int) i;
 }
 
+/*
+ * Doubles the size of the table (both slots and keys/vals arrays)
+ */
+static void LeafTableInfo_grow(LeafTableInfo *lti)
+{
+	int i;
+	lti->capacity *= 2;
+	REALLOC_N(lti->keys, VALUE, lti->capacity);
+	REALLOC_N(lti->vals, VALUE, lti->capacity);
+	xfree(lti->slots);
+	lti->nslots *= 2;
+	lti->slots = ALLOC_N(int, lti->nslots);
+	MEMZERO(lti->slots, int, lti->nslots);
+	for (i = 0; i < lti->pos; i++)
+		lti->slots[LeafTableInfo_findSlot(lti, lti->keys[i])] = i + 1;
+}
 
 int LeafTableInfo_addEntry(LeafTableInfo *lti, VALUE key, VALUE value)
 {
-	VALUE v_id = rb_hash_aref(lti->ids, key);
-	if (v_id == Qnil)
+	int slot = LeafTableInfo_findSlot(lti, key);
+	if (lti->slots[slot] == 0)
 	{
-		int id = lti->pos++;
-		rb_hash_aset(lti->vals, key, value);
-		rb_hash_aset(lti->ids, key, INT2FIX(id));
+		int id = lti->pos;
+		if (lti->pos == lti->capacity)
+		{
+			LeafTableInfo_grow(lti);
+			slot = LeafTableInfo_findSlot(lti, key);
+		}
+		lti->keys[id] = key;
+		lti->vals[id] = value;
+		lti->slots[slot] = id + 1;
+		lti->pos++;
 		return id;
 	}
 	else
 	{
-		return FIX2INT(v_id);
+		return lti->slots[slot] - 1;
 	}
 }
 
 /*
  * Adds Ruby ID data type as the entry to the LeafTableInfo struct.
- * Main features:
- * 1) ID will be converted to Fixnum
- * 2) If ID can be converted to string by rb_id2str it will be saved as
-      String object. Otherwise it will be converted to Fixnum.
+ * ID is used both as a key and as a value; its conversion to String
+ * (or Fixnum for symbols that cannot be represented as strings)
+ * is made during the export (see NODEInfo_getSymbolsTable)
  */
 int LeafTableInfo_addIDEntry(LeafTableInfo *lti, ID id)
 {
-	VALUE r_idval = rb_id2str(id);
-	if (TYPE(r_idval) != T_STRING)
-	{
-		r_idval = INT2FIX(id);
-	}
-	return LeafTableInfo_addEntry(lti, INT2FIX(id), r_idval);
+	return LeafTableInfo_addEntry(lti, (VALUE) id, (VALUE) id);
 }
 
+/*
+ * Returns Ruby array with all values of the table sorted by their ordinals
+ */
 VALUE LeafTableInfo_getLeavesTable(LeafTableInfo *lti)
 {
-	VALUE key, keys = rb_funcall(lti->vals, rb_intern("keys"), 0);
-	unsigned int i;
-	VALUE val;
-	for (i = 0; i < lti->pos; i++)
-	{
-		key = RARRAY_PTR(keys)[i];
-		val = rb_hash_aref(lti->vals, key);
-		rb_ary_store(keys, i, val);
-	}
-	return keys;
+	return rb_ary_new4(lti->pos, lti->vals);
 }
 
 int LeafTableInfo_keyToID(LeafTableInfo *lti, VALUE key)
 {
-	VALUE id = rb_hash_aref(lti->ids, key);
-	return (id == Qnil) ? -1 : FIX2INT(id);
+	int slot = LeafTableInfo_findSlot(lti, key);
+	return lti->slots[slot] - 1;
 }
 
+/*
+ * Returns the value that corresponds to the key or 0 if the key
+ * is not present in the table
+ */
 VALUE LeafTableInfo_keyToValue(LeafTableInfo *lti, VALUE key)
 {
-	return rb_hash_aref(lti->vals, key);
+	int id = LeafTableInfo_keyToID(lti, key);
+	return (id == -1) ? (VALUE) 0 : lti->vals[id];
 }
 
 /* The structure keeps information about the node
@@ -258,40 +492,69 @@ typedef struct {
 #endif
 	LeafTableInfo gentries; // Global variables table
 	LeafTableInfo nodes; // Table of nodes
-	LeafTableInfo pnodes; // Table of parent nodes
+	int *parents; // Ordinals of parent nodes (the root is its own parent)
+	unsigned char *ctypes; // Resolved types of children (NT_..., 3 per node)
+	int nodes_capacity; // Capacity of parents and ctypes arrays
 } NODEInfo;
 
 void NODEInfo_init(NODEInfo *info)
 {
-	LeafTableInfo_init(&(info->syms));
-	LeafTableInfo_init(&(info->lits));
-	LeafTableInfo_init(&(info->idtabs));
+	LeafTableInfo_init(&(info->syms), 0);
+	LeafTableInfo_init(&(info->lits), 1);
+	LeafTableInfo_init(&(info->idtabs), 0);
 #ifdef USE_RB_ARGS_INFO
-	LeafTableInfo_init(&(info->args));
+	LeafTableInfo_init(&(info->args), 0);
 #endif
-	LeafTableInfo_init(&(info->gentries));
-	LeafTableInfo_init(&(info->nodes));
-	LeafTableInfo_init(&(info->pnodes));
+	LeafTableInfo_init(&(info->gentries), 0);
+	LeafTableInfo_init(&(info->nodes), 0);
+	info->parents = NULL;
+	info->ctypes = NULL;
+	info->nodes_capacity = 0;
 }
 
+/*
+ * Only literals are kept as Ruby objects: other tables contain
+ * raw addresses, IDs or Fixnums
+ */
 void NODEInfo_mark(NODEInfo *info)
 {
-	LeafTableInfo_mark(&(info->syms));
 	LeafTableInfo_mark(&(info->lits));
-	LeafTableInfo_mark(&(info->idtabs));
-#ifdef USE_RB_ARGS_INFO
-	LeafTableInfo_mark(&(info->args));
-#endif
-	LeafTableInfo_mark(&(info->gentries));
-	LeafTableInfo_mark(&(info->nodes));
-	LeafTableInfo_mark(&(info->pnodes));
 }
 
 void NODEInfo_free(NODEInfo *info)
 {
+	LeafTableInfo_free(&(info->syms));
+	LeafTableInfo_free(&(info->lits));
+	LeafTableInfo_free(&(info->idtabs));
+#ifdef USE_RB_ARGS_INFO
+	LeafTableInfo_free(&(info->args));
+#endif
+	LeafTableInfo_free(&(info->gentries));
+	LeafTableInfo_free(&(info->nodes));
+	xfree(info->parents);
+	xfree(info->ctypes);
 	xfree(info);
 }
 
+static size_t NODEInfo_memsize(const void *ptr)
+{
+	const NODEInfo *info = (const NODEInfo *) ptr;
+	size_t size = sizeof(NODEInfo);
+	size += LeafTableInfo_memsize(&info->syms) + LeafTableInfo_memsize(&info->lits);
+	size += LeafTableInfo_memsize(&info->idtabs) + LeafTableInfo_memsize(&info->gentries);
+	size += LeafTableInfo_memsize(&info->nodes);
+	size += info->nodes_capacity * (sizeof(int) + 3);
+#ifdef USE_RB_ARGS_INFO
+	size += LeafTableInfo_memsize(&info->args);
+#endif
+	return size;
+}
+
+static const rb_data_type_t NODEInfo_type = {
+	"NodeInfo",
+	{(RUBY_DATA_FUNC) NODEInfo_mark, (RUBY_DATA_FUNC) NODEInfo_free, NODEInfo_memsize,},
+};
+
 LeafTableInfo *NODEInfo_getTableByID(NODEInfo *info, int id)
 {
 	switch (id)
@@ -332,7 +595,20 @@ LeafTableInfo *NODEInfo_getTableByID(NODEInfo *info, int id)
 #define DUMP_RAW_VALUE(vl_ans, vl) (vl_ans | (value_to_bin(vl, (unsigned char *) ptr) << 4))
 static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALUE value, int child_id)
 {
-	if (type == NT_NULL || type == NT_LONG)
+	if (type == NT_NULL && child_id == 2 && (nd_type(node) == NODE_BLOCK || nd_type(node) == NODE_LIT))
+	{	// Parser leftovers: nd_end of NODE_BLOCK and the end node of the folded
+		// range literal. Their addresses are not saved, so the same tree gives
+		// the same dump
+		return DUMP_RAW_VALUE(VL_RAW, 0);
+	}
+	else if (type == NT_LONG && child_id == 2 && nd_type(node) == NODE_ARRAY &&
+		LeafTableInfo_keyToID(&info->nodes, value) != -1)
+	{	// The second element of the list keeps nd_end (the last element)
+		// instead of nd_alen; the table of nodes is searched by the address
+		// only, the node is not dereferenced
+		return DUMP_RAW_VALUE(VL_RAW, 0);
+	}
+	else if (type == NT_NULL || type == NT_LONG)
 	{
 		return DUMP_RAW_VALUE(VL_RAW, value);
 	}
@@ -358,7 +634,7 @@ static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALU
 		}
 		else
 		{	// Variant b: not empty node
-			VALUE id = LeafTableInfo_keyToID(&info->nodes, value_to_str(value));
+			VALUE id = LeafTableInfo_keyToID(&info->nodes, value);
 			if (id == (VALUE) -1)
 			{
 				rb_raise(rb_eArgError, "dump_node_value, parent node %s (ADR 0x%s): child node %d (ADR 0x%s) not found",
@@ -381,7 +657,7 @@ static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALU
 		}
 		else
 		{	// b) value that requires reference to literals table
-			VALUE id = LeafTableInfo_keyToID(&info->lits, value_to_str(value));
+			VALUE id = LeafTableInfo_keyToID(&info->lits, value);
 			if (id == (VALUE) -1)
 				rb_raise(rb_eArgError, "Cannot find literal");
 			else
@@ -391,7 +667,7 @@ static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALU
 	else if (type == NT_ID)
 	{
 		ID sym = (VALUE) value; // We are working with RAW data from RAM!
-		VALUE id = LeafTableInfo_keyToID(&info->syms, INT2FIX(sym));
+		VALUE id = LeafTableInfo_keyToID(&info->syms, (VALUE) sym);
 		if (id == (VALUE) -1)
 		{
 			rb_raise(rb_eArgError, "Cannot find symbol ID %d (%s) (parent node %s, line %d)",
@@ -406,9 +682,8 @@ static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALU
 	}
 	else if (type == NT_ENTRY || type == NT_ARGS || type == NT_IDTABLE)
 	{
-		VALUE key = value_to_str(value);
 		LeafTableInfo *lti = NODEInfo_getTableByID(info, type);
-		VALUE id = LeafTableInfo_keyToID(lti, key);
+		VALUE id = LeafTableInfo_keyToID(lti, value);
 		if (id == (VALUE) -1)
 		{
 			rb_raise(rb_eArgError, "Cannot find some entry");
@@ -433,6 +708,7 @@ static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALU
 
 /*
  * Converts information about nodes to the binary string.
+ * Types of children are resolved by count_num_of_nodes (info->ctypes).
  * It uses dump_node_value function for the low-level conversion
  * of node "leaves" to the actual binary data.
  *
@@ -441,82 +717,20 @@ static int dump_node_value(NODEInfo *info, char *ptr, NODE *node, int type, VALU
 static VALUE dump_nodes(NODEInfo *info)
 {
 	int node_size = sizeof(int) + sizeof(VALUE) * 4;
-	int i, nt, flags_len;
+	int i, flags_len;
 	NODE *node;
 	char *bin, *ptr, *rtypes;
-	VALUE nodes_ary = rb_funcall(info->nodes.vals, rb_intern("keys"), 0);
-	VALUE nodes_bin = rb_str_new(NULL, RARRAY_LEN(nodes_ary) * node_size);
-	VALUE ut[3];
+	VALUE nodes_bin = rb_str_new(NULL, info->nodes.pos * node_size);
+	const unsigned char *ut;
 	bin = RSTRING_PTR(nodes_bin);
 
-	for (i = 0, ptr = bin; i < RARRAY_LEN(nodes_ary); i++)
+	for (i = 0, ptr = bin; i < info->nodes.pos; i++)
 	{
-		node = RNODE(str_to_value(RARRAY_PTR(nodes_ary)[i]));
-		nt = nd_type(node);
+		node = RNODE(info->nodes.keys[i]);
 		rtypes = (char *) ptr; ptr += sizeof(int);
 		flags_len = value_to_bin(node->flags >> 5, (unsigned char *) ptr); ptr += flags_len;
 
-		ut[0] = nodes_ctbl[nt * 3];
-		ut[1] = nodes_ctbl[nt * 3 + 1];
-		ut[2] = nodes_ctbl[nt * 3 + 2];
-		if ((nt == NODE_LASGN || nt == NODE_DASGN_CURR) && (void *) node->u2.value == (void *) -1) {
-			ut[1] = NT_LONG;
-		}
-		if (nt == NODE_OP_ASGN2 && LeafTableInfo_keyToID(&info->syms, INT2FIX(node->u1.value)) != -1)
-		{
-			ut[0] = NT_ID; ut[1] = NT_ID; ut[2] = NT_ID;
-		}
-
-		if (nt == NODE_ARGS_AUX)
-		{
-			ut[0] = NT_ID; ut[1] = NT_LONG; ut[2] = NT_NODE;
-			if (LeafTableInfo_keyToID(&info->syms, INT2FIX(node->u2.value)) != -1)
-			{
-				ut[1] = NT_ID;
-			}
-			else
-			{
-				ut[1] = NT_LONG;
-			}
-			if (node->u1.value == 0) ut[0] = NT_NULL;
-			if (node->u2.value == 0) ut[1] = NT_NULL;
-			if (node->u3.value == 0) ut[2] = NT_NULL;
-		}
-		
-		if (nt = NODE_ARRAY)
-		{
-			/* Special undocumented cases:
-			 * 1) the second child of the second element of an array
-			 * contains reference to the last element (NT_NODE) not
-			 * length (NT_LONG)
-			 * 2) NODE_HASH: every second element in NODE_ARRAY chain
-			 * contains pointers to NODES (instead of lengths)
-			 * 3) NODE_DSTR: first node in NODE_ARRAY chain contains
-			 * pointer to NODE (instead of lengths) */
-			NODE *pnode1, *pnode2;
-			pnode1 = (NODE *) str_to_value(LeafTableInfo_keyToValue(&info->pnodes, value_to_str((VALUE) node)));
-			if (pnode1 != NULL && nd_type(pnode1) == NODE_ARRAY &&
-				(NODE *) pnode1->u3.value == node)
-			{
-				int nt2;
-				pnode2 = (NODE *) str_to_value(LeafTableInfo_keyToValue(&info->pnodes, value_to_str((VALUE) pnode1)));
-				nt2 = nd_type(pnode2);
-				if ( (nt2 != NODE_ARRAY && nt2 != NODE_DSTR) ||
-				    (NODE *) pnode2->u1.value == pnode1 )
-				{
-					ut[1] = NT_NODE;
-				}
-				else if (pnode1->u2.value == 2 && node == (NODE *) node->u2.value)
-				{
-					ut[1] = NT_NODE;
-				}
-			}
-			else if (pnode1 != NULL && nd_type(pnode1) == NODE_DSTR)
-			{
-				ut[1] = NT_NODE;
-			}
-		}
-
+		ut = info->ctypes + i * 3;
 		rtypes[0] = dump_node_value(info, ptr, node, ut[0], node->u1.value, 1);
 		ptr += (rtypes[0] & 0xF0) >> 4;
 		rtypes[1] = dump_node_value(info, ptr, node, ut[1], node->u2.value, 2);
@@ -525,24 +739,146 @@ static VALUE dump_nodes(NODEInfo *info)
 		ptr += (rtypes[2] & 0xF0) >> 4;
 		rtypes[3] = flags_len;
 	}
+	*ptr = 0; // Trailing byte (is kept for compatibility of the format)
 	rb_str_resize(nodes_bin, (int) (ptr - bin) + 1);
 	return nodes_bin;
 }
 
 
+/*
+ * Converts the table of symbols to Ruby array. If ID can be converted
+ * to string by rb_id2str it will be saved as String object. Otherwise
+ * it will be converted to Fixnum.
+ */
+static VALUE NODEInfo_getSymbolsTable(NODEInfo *info)
+{
+	VALUE syms = rb_ary_new2(info->syms.pos);
+	int i;
+	for (i = 0; i < info->syms.pos; i++)
+	{
+		ID id = (ID) info->syms.keys[i];
+		VALUE r_idval = rb_id2str(id);
+		if (TYPE(r_idval) != T_STRING)
+		{
+			r_idval = INT2FIX(id);
+		}
+		rb_ary_push(syms, r_idval);
+	}
+	return syms;
+}
+
+/*
+ * Converts the table of local ID tables to Ruby array of arrays.
+ * RAM IDs are replaced to disk IDs (ordinals of symbols)
+ */
+static VALUE NODEInfo_getIDTablesTable(NODEInfo *info)
+{
+	VALUE idtabs = rb_ary_new2(info->idtabs.pos);
+	int i, j;
+	for (i = 0; i < info->idtabs.pos; i++)
+	{
+		ID *idtbl = (ID *) info->idtabs.keys[i];
+		int size = (idtbl) ? *idtbl++ : 0;
+		VALUE idtbl_ary = rb_ary_new2(size);
+		for (j = 0; j < size; j++)
+		{
+			int id = LeafTableInfo_keyToID(&info->syms, (VALUE) idtbl[j]);
+			if (id == -1)
+			{
+				rb_raise(rb_eArgError, "Cannot find the symbol ID %d", (int) idtbl[j]);
+			}
+			rb_ary_push(idtbl_ary, INT2FIX(id));
+		}
+		rb_ary_push(idtabs, idtbl_ary);
+	}
+	return idtabs;
+}
+
+#ifdef USE_RB_ARGS_INFO
+/*
+ * Returns ordinal of the node from rb_args_info structure
+ * (-1 for NULL pointers)
+ */
+static int NODEInfo_argsNodeToID(NODEInfo *info, NODE *node)
+{
+	int id;
+	if (node == NULL)
+		return -1;
+	id = LeafTableInfo_keyToID(&info->nodes, (VALUE) node);
+	if (id == -1)
+		rb_raise(rb_eArgError, "Unknown NODE in args tables");
+	return id;
+}
+
+/*
+ * Returns ordinal of the symbol from rb_args_info structure
+ * (-1 for empty IDs)
+ */
+static int NODEInfo_argsSymToID(NODEInfo *info, ID sym)
+{
+	int id;
+	if (sym == 0)
+		return -1;
+	id = LeafTableInfo_keyToID(&info->syms, (VALUE) sym);
+	if (id == -1)
+		rb_raise(rb_eArgError, "Unknown symbolic ID in args tables");
+	return id;
+}
+
+/*
+ * Converts rb_args_info structure with the ordinal i to the array
+ * of 10 integers with the next format:
+ *   (0) pre_init, (1) post_init, (2) pre_args_num, (3) post_args_num,
+ *   (4) first_post_arg (5) rest_arg (6) block_arg,
+ *   (7) kw_args, (8) kw_rest_arg, (9) opt_args
+ * Pointers to nodes are replaced by nodes ordinals, IDs are replaced
+ * by symbols ordinals (-1 means NULL pointer or empty ID)
+ */
+static void NODEInfo_getArgsEntry(NODEInfo *info, int i, int *entry)
+{
+	struct rb_args_info *ainfo = (struct rb_args_info *) info->args.keys[i];
+	entry[0] = NODEInfo_argsNodeToID(info, ainfo->pre_init);
+	entry[1] = NODEInfo_argsNodeToID(info, ainfo->post_init);
+	entry[2] = ainfo->pre_args_num;
+	entry[3] = ainfo->post_args_num;
+	entry[4] = NODEInfo_argsSymToID(info, ainfo->first_post_arg);
+	entry[5] = NODEInfo_argsSymToID(info, ainfo->rest_arg);
+	entry[6] = NODEInfo_argsSymToID(info, ainfo->block_arg);
+	entry[7] = NODEInfo_argsNodeToID(info, ainfo->kw_args);
+	entry[8] = NODEInfo_argsNodeToID(info, ainfo->kw_rest_arg);
+	entry[9] = NODEInfo_argsNodeToID(info, ainfo->opt_args);
+}
+
+/*
+ * Converts the table of rb_args_info structures to Ruby array of arrays.
+ * See NODEInfo_getArgsEntry for the format of entries
+ */
+static VALUE NODEInfo_getArgsTable(NODEInfo *info)
+{
+	VALUE args = rb_ary_new2(info->args.pos);
+	int i, j, entry[10];
+	for (i = 0; i < info->args.pos; i++)
+	{
+		VALUE args_entry = rb_ary_new2(10);
+		NODEInfo_getArgsEntry(info, i, entry);
+		for (j = 0; j < 10; j++)
+			rb_ary_push(args_entry, INT2FIX(entry[j]));
+		rb_ary_push(args, args_entry);
+	}
+	return args;
+}
+#endif
+
 /*
  * Transforms preprocessed node to Ruby hash that can be used
  * to load the node from disk.
  *
- * See m_nodedump_to_hash function for output hash format details
+ * See m_nodedump_to_hash function for output hash format details.
+ * Phases are saved to st (may be NULL)
  */
-VALUE NODEInfo_toHash(NODEInfo *info)
+VALUE NODEInfo_toHash(NODEInfo *info, NodeStats *st)
 {
 	VALUE ans = rb_hash_new();
-	VALUE idtbl, idtabs = LeafTableInfo_getLeavesTable(&info->idtabs);
-	VALUE syms = LeafTableInfo_getLeavesTable(&info->syms);
-	VALUE args;
-	int i, j, id;
 	// Add some signatures
 	rb_hash_aset(ans, ID2SYM(rb_intern("MAGIC")), rb_str_new2(NODEMARSHAL_MAGIC));
 	rb_hash_aset(ans, ID2SYM(rb_intern("RUBY_PLATFORM")),
@@ -551,296 +887,800 @@ VALUE NODEInfo_toHash(NODEInfo *info)
 		rb_const_get(rb_cObject, rb_intern("RUBY_VERSION")));
 	// Write literals, symbols and global_entries arrays: they don't need to be corrected
 	rb_hash_aset(ans, ID2SYM(rb_intern("literals")), LeafTableInfo_getLeavesTable(&info->lits));
-	rb_hash_aset(ans, ID2SYM(rb_intern("symbols")), syms);
+	rb_hash_aset(ans, ID2SYM(rb_intern("symbols")), NODEInfo_getSymbolsTable(info));
 	rb_hash_aset(ans, ID2SYM(rb_intern("global_entries")), LeafTableInfo_getLeavesTable(&info->gentries));
 	// Replace RAM IDs to disk IDs in id_tables
-	for (i = 0; i < RARRAY_LEN(idtabs); i++)
-	{
-		idtbl = RARRAY_PTR(idtabs)[i];
-		for (j = 0; j < RARRAY_LEN(idtbl); j++)
-		{
-			id = LeafTableInfo_keyToID(&info->syms, RARRAY_PTR(idtbl)[j]);
-
-			if (id == -1)
-			{
-				ID sym = FIX2INT(RARRAY_PTR(idtbl)[j]);
-				rb_raise(rb_eArgError, "Cannot find the symbol ID %d", (int) sym);
-			}
-			else
-			{
-				rb_ary_store(idtbl, j, INT2FIX(id));
-			}
-
-		}
-	}
-	rb_hash_aset(ans, ID2SYM(rb_intern("id_tables")), idtabs);
+	rb_hash_aset(ans, ID2SYM(rb_intern("id_tables")), NODEInfo_getIDTablesTable(info));
 	// Replace RAM IDs to disk IDs in args tables
 #ifdef USE_RB_ARGS_INFO
-	args = LeafTableInfo_getLeavesTable(&info->args);
-	for (i = 0; i < RARRAY_LEN(args); i++)
-	{
-		VALUE args_entry = RARRAY_PTR(args)[i];
-		VALUE *eptr = RARRAY_PTR(args_entry);
-		int args_vals[5] = {0, 1, 7, 8, 9};
-		int args_ids[3] = {4, 5, 6};
-		if (RARRAY_LEN(args_entry) != 10)
-			rb_raise(rb_eArgError, "Corrupted args entry");
-		// Pointer to nodes to be replaced:
-		// a) VALUES
-		//   (0) pre_init, (1) post_init,
-		//   (7) kw_args, (8) kw_rest_arg, (9) opt_args
-		for (j = 0; j < 5; j++)
-		{
-			int ind = args_vals[j];
-			VALUE key = eptr[ind];
-			if (!strcmp(RSTRING_PTR(key), "0"))
-				eptr[ind] = INT2FIX(-1);
-			else
-			{
-				eptr[ind] = INT2FIX(LeafTableInfo_keyToID(&info->nodes, key));
-				if (FIX2INT(eptr[ind]) == -1)
-					rb_raise(rb_eArgError, "Unknown NODE in args tables");
-			}
-		}
-		// b) IDs (symbols)
-		//   (4) first_post_arg (5) rest_arg (6) block_arg
-		for (j = 0; j < 3; j++)
-		{
-			int ind = args_ids[j];
-			VALUE key = eptr[ind];
-			if (FIX2INT(key) != 0)
-			{
-				eptr[ind] = INT2FIX(LeafTableInfo_keyToID(&info->syms, key));
-				if (FIX2INT(eptr[ind]) == -1)
-					rb_raise(rb_eArgError, "Unknown symbolic ID in args tables");
-			}
-			else
-				eptr[ind] = INT2FIX(-1);
-		}
-	}
+	rb_hash_aset(ans, ID2SYM(rb_intern("args")), NODEInfo_getArgsTable(info));
 #else
-	args = rb_ary_new();
+	rb_hash_aset(ans, ID2SYM(rb_intern("args")), rb_ary_new());
 #endif
-
-	rb_hash_aset(ans, ID2SYM(rb_intern("args")), args);
+	NodeStats_phase(st, "tables");
 	// Special case: NODES. Nodes are kept as binary string
 	rb_hash_aset(ans, ID2SYM(rb_intern("nodes")), dump_nodes(info));
+	NodeStats_phase(st, "dump_nodes");
 	return ans;
 }
 
 
-static void NODEInfo_addValue(NODEInfo *info, VALUE value)
+/*
+ * Part 3a. Writer of the binary container (NODEMARSHAL12 format).
+ *
+ * The container consists of the fixed header and the sequence of
+ * length-prefixed sections. All integers are saved in little-endian
+ * format, strings are saved as [uint32 length][bytes].
+ *
+ * Header:
+ *   char[16] -- NODEMARSHAL12 magic value (padded by zeros)
+ *   uint32   -- flags (BIN_FLAG_... constants)
+ *   uint32   -- number of nodes
+ *   uint32   -- number of sections
+ *   uint32   -- identifier of the shared dictionary (only if BIN_FLAG_DICT is set)
+ *   string   -- RUBY_PLATFORM
+ *   string   -- RUBY_VERSION
+ *   string   -- nodename, filename, filepath (0xFFFFFFFF length means nil)
+ * Section:
+ *   uint32   -- section identifier (SECT_... constant)
+ *   uint32   -- number of entries
+ *   uint32   -- size of the section payload in bytes
+ *   payload
+ *
+ * Sections payloads:
+ *   SECT_ENCODINGS -- names of the encodings (strings)
+ *   SECT_SYMBOLS   -- [uint8 SYMT_STRING][uint8 encoding][string],
+ *                     [uint8 SYMT_RAWID][raw ID value] or
+ *                     [uint8 SYMT_DICT][uint32 ordinal in the shared dictionary]
+ *   SECT_LITERALS  -- [uint8 LITT_STRING][uint8 encoding][uint8 frozen][string],
+ *                     [uint8 LITT_SYMBOL][uint8 encoding][string],
+ *                     [uint8 LITT_FLOAT][raw double],
+ *                     [uint8 LITT_MARSHAL][string with Marshal dump] or
+ *                     [uint8 LITT_DICT][uint32 ordinal in the shared dictionary]
+ *   SECT_GENTRIES  -- uint32 ordinals of symbols
+ *   SECT_IDTABLES  -- [uint32 number of IDs][uint32 ordinals of symbols]
+ *   SECT_ARGS      -- 10 int32 values (see NODEInfo_getArgsEntry)
+ *   SECT_NODES     -- nodes binary dump (see load_nodes_from_buf) or nodes
+ *                     in the columnar layout if BIN_FLAG_COLUMNAR is set
+ *                     (see bin_write_nodes_columnar)
+ *   SECT_ISEQ      -- [string filepath][string ISeq binary] (optional,
+ *                     present if BIN_FLAG_ISEQ is set, see nodedump_add_iseq)
+ */
+static void bin_write_u8(VALUE buf, int val)
 {
-	if (is_value_in_heap(value))
-	{
-		VALUE lkey = value_to_str(value);
-		LeafTableInfo_addEntry(&info->lits, lkey, value);
-	}
+	char b = (char) (val & 0xFF);
+	rb_str_buf_cat(buf, &b, 1);
 }
 
-/*
- * Adds the information about Ruby NODE to the NODEInfo struct.
- * It keeps the addresses of the node and its parents
- */
-static void NODEInfo_addNode(NODEInfo *info, NODE *node, NODE *pnode)
+static void bin_write_u32(VALUE buf, uint32_t val)
 {
-	VALUE node_adr = value_to_str((VALUE) node);
-	VALUE pnode_adr = value_to_str((VALUE) pnode);
-	LeafTableInfo_addEntry(&info->nodes, node_adr, node_adr);
-	LeafTableInfo_addEntry(&info->pnodes, node_adr, pnode_adr);
+	unsigned char b[4];
+	b[0] = val & 0xFF; b[1] = (val >> 8) & 0xFF;
+	b[2] = (val >> 16) & 0xFF; b[3] = (val >> 24) & 0xFF;
+	rb_str_buf_cat(buf, (const char *) b, 4);
 }
 
-/*
- * Returns ID of the node using its address (VALUE)
- * It is used during the process of dumping Ruby AST to disk
- * for replacing of memory addresses into ordinals
- */
-static int NODEInfo_nodeAdrToID(NODEInfo *info, VALUE adr)
+static uint32_t bin_peek_u32(const unsigned char *ptr)
 {
-	return LeafTableInfo_keyToID(&info->nodes, adr);
+	return (uint32_t) ptr[0] | ((uint32_t) ptr[1] << 8) |
+		((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
 }
 
 /*
- * Function counts number of nodes and fills NODEInfo struct
- * that is neccessary for the node saving to the HDD
+ * Overwrites uint32 value inside the already written buffer
  */
-static int count_num_of_nodes(NODE *node, NODE *parent, NODEInfo *info)
+static void bin_patch_u32(unsigned char *ptr, uint32_t val)
 {
-	int ut[3], num, offset;
-	if (node == 0)
-	{
-		return 0;
-	}
-	else if (TYPE((VALUE) node) != T_NODE)
-	{
-		rb_raise(rb_eArgError, "count_num_of_nodes: parent node %s: child node (ADR 0x%s) is not a node; Type: %d (%s)",
-			ruby_node_name(nd_type(parent)), RSTRING_PTR(value_to_str((VALUE) node)), TYPE((VALUE) node),
-			RSTRING_PTR(rb_funcall(rb_funcall((VALUE) node, rb_intern("class"), 0), rb_intern("to_s"), 0))
-		);
-		return 0;
-	}
-	else
-	{
-		offset = nd_type(node) * 3;
-		ut[0] = nodes_ctbl[offset++];
-		ut[1] = nodes_ctbl[offset++];
-		ut[2] = nodes_ctbl[offset];
+	ptr[0] = val & 0xFF;
+	ptr[1] = (val >> 8) & 0xFF;
+	ptr[2] = (val >> 16) & 0xFF;
+	ptr[3] = (val >> 24) & 0xFF;
+}
 
-		/* Special case: part of NODE_KW_ARG syntax in Ruby 2.x, e.g. def func(foo:, bar: 'default) */
-		if ((nd_type(node) == NODE_LASGN || nd_type(node) == NODE_DASGN_CURR) && (void *) node->u2.value == (void *) -1) {
-			ut[1] = NT_LONG; /* To keep -1 correctly */
-		}
+static void bin_write_value(VALUE buf, VALUE val)
+{
+	unsigned char b[sizeof(VALUE)];
+	int i;
+	for (i = 0; i < (int) sizeof(VALUE); i++)
+		b[i] = (unsigned char) ((val >> (i * 8)) & 0xFF);
+	rb_str_buf_cat(buf, (const char *) b, sizeof(VALUE));
+}
 
-		/* Some another special cases */
-		if (nd_type(node) == NODE_OP_ASGN2 && nd_type(parent) == NODE_OP_ASGN2)
-		{
-			ut[0] = NT_ID;
-			ut[1] = NT_ID;
-			ut[2] = NT_ID;
-		}
+static void bin_write_bytes(VALUE buf, const char *ptr, long len)
+{
+	if (len < 0 || len >= 0xFFFFFFFFL)
+		rb_raise(rb_eArgError, "Binary container: string is too long");
+	bin_write_u32(buf, (uint32_t) len);
+	rb_str_buf_cat(buf, ptr, len);
+}
 
-		/* Some Ruby 1.9.3 style function arguments (without rb_args_info) */
-		if (nd_type(node) == NODE_ARGS_AUX)
-		{
-			ut[0] = NT_ID;
-			ut[1] = (nd_type(parent) == NODE_ARGS_AUX) ? NT_LONG : NT_ID;
-			ut[2] = NT_NODE;
+static void bin_write_nstr(VALUE buf, VALUE str)
+{
+	if (str == Qnil)
+		bin_write_u32(buf, 0xFFFFFFFF);
+	else
+		bin_write_bytes(buf, RSTRING_PTR(str), RSTRING_LEN(str));
+}
 
-			if (node->u1.value == 0) ut[0] = NT_NULL;
-			if (node->u2.value == 0) ut[1] = NT_NULL;
-			if (node->u3.value == 0) ut[2] = NT_NULL;
+static void bin_write_section(VALUE buf, int id, long count, VALUE payload)
+{
+	if (RSTRING_LEN(payload) >= 0xFFFFFFFFL)
+		rb_raise(rb_eArgError, "Binary container: section %d is too large", id);
+	bin_write_u32(buf, id);
+	bin_write_u32(buf, (uint32_t) count);
+	bin_write_u32(buf, (uint32_t) RSTRING_LEN(payload));
+	rb_str_buf_append(buf, payload);
+}
+
+/*
+ * Table of encodings used by symbols and literals of the dump
+ */
+typedef struct {
+	int rb_ind[256]; // Ruby encodings indexes
+	int len;
+} BinEncTable;
+
+static int BinEncTable_getIndex(BinEncTable *tbl, VALUE str)
+{
+	int i, ind = rb_enc_get_index(str);
+	for (i = 0; i < tbl->len; i++)
+		if (tbl->rb_ind[i] == ind)
+			return i;
+	if (tbl->len == 256)
+		rb_raise(rb_eArgError, "Binary container: too many encodings");
+	tbl->rb_ind[tbl->len] = ind;
+	return tbl->len++;
+}
+
+static VALUE bin_write_encodings(BinEncTable *tbl)
+{
+	VALUE buf = rb_str_buf_new(0);
+	int i;
+	for (i = 0; i < tbl->len; i++)
+	{
+		const char *name = rb_enc_name(rb_enc_from_index(tbl->rb_ind[i]));
+		bin_write_bytes(buf, name, strlen(name));
+	}
+	return buf;
+}
+
+/*
+ * Shared dictionary of symbols and literals (NodeMarshal::Dictionary).
+ * Entries of the dump that are present in the dictionary are replaced
+ * by their ordinals (SYMT_DICT and LITT_DICT entries)
+ */
+typedef struct {
+	uint32_t id; // Checksum of the dictionary container
+	ID *syms; // Interned symbols
+	int syms_len;
+	VALUE lits; // Frozen array of literals
+	VALUE keys; // Hash: key of the entry => ordinal (see dict_sym_key, dict_lit_key)
+	VALUE bin; // Dictionary container (NODEMARSHAL12DC)
+} NodeDict;
+
+static void NodeDict_mark(NodeDict *dict)
+{
+	rb_gc_mark(dict->lits);
+	rb_gc_mark(dict->keys);
+	rb_gc_mark(dict->bin);
+}
+
+static void NodeDict_free(NodeDict *dict)
+{
+	xfree(dict->syms);
+	xfree(dict);
+}
+
+static void dict_key_cat_str(VALUE key, VALUE str)
+{
+	const char *name = rb_enc_name(rb_enc_get(str));
+	rb_str_buf_cat(key, name, strlen(name) + 1);
+	rb_str_buf_append(key, str);
+}
+
+/*
+ * Key of the symbol (String from the table of symbols)
+ */
+static VALUE dict_sym_key(VALUE str)
+{
+	VALUE key = rb_str_buf_new(RSTRING_LEN(str) + 16);
+	rb_str_buf_cat(key, "S", 1);
+	dict_key_cat_str(key, str);
+	return key;
+}
+
+/*
+ * Key of the literal: literals with equal keys are saved identically
+ * (see bin_write_literals)
+ */
+static VALUE dict_lit_key(VALUE lit)
+{
+	VALUE key = rb_str_buf_new(32);
+	if (TYPE(lit) == T_STRING && rb_obj_class(lit) == rb_cString)
+	{
+		rb_str_buf_cat(key, OBJ_FROZEN(lit) ? "LSf" : "LSm", 3);
+		dict_key_cat_str(key, lit);
+	}
+	else if (TYPE(lit) == T_SYMBOL)
+	{
+		rb_str_buf_cat(key, "LY", 2);
+		dict_key_cat_str(key, rb_sym_to_s(lit));
+	}
+	else if (TYPE(lit) == T_FLOAT)
+	{
+		double val = RFLOAT_VALUE(lit);
+		rb_str_buf_cat(key, "LF", 2);
+		rb_str_buf_cat(key, (const char *) &val, sizeof(double));
+	}
+	else
+	{
+		rb_str_buf_cat(key, "LM", 2);
+		rb_str_buf_append(key, rb_marshal_dump(lit, Qnil));
+	}
+	return key;
+}
+
+/*
+ * Returns ordinal of the entry in the dictionary or -1
+ */
+static int NodeDict_find(NodeDict *dict, VALUE key)
+{
+	VALUE ord = rb_hash_lookup2(dict->keys, key, Qnil);
+	return (ord == Qnil) ? -1 : FIX2INT(ord);
+}
+
+/*
+ * Writes the table of symbols (Ruby array of Strings and Fixnums,
+ * see NODEInfo_getSymbolsTable). Symbols from the dictionary (if it is
+ * not NULL) are replaced by their ordinals
+ */
+static VALUE bin_write_symbols(VALUE syms, BinEncTable *encs, NodeDict *dict)
+{
+	VALUE buf = rb_str_buf_new(RARRAY_LEN(syms) * 16);
+	long i;
+	for (i = 0; i < RARRAY_LEN(syms); i++)
+	{
+		VALUE sym = RARRAY_PTR(syms)[i];
+		int ord;
+		if (dict != NULL && TYPE(sym) == T_STRING &&
+			(ord = NodeDict_find(dict, dict_sym_key(sym))) >= 0)
+		{
+			bin_write_u8(buf, SYMT_DICT);
+			bin_write_u32(buf, (uint32_t) ord);
 		}
-		/* Some Ruby 1.9.3-specific code for NODE_ATTRASGN */
-		if (nd_type(node) == NODE_ATTRASGN)
+		else if (TYPE(sym) == T_STRING)
 		{
-			if (node->u1.value == 1) ut[0] = NT_LONG;
+			bin_write_u8(buf, SYMT_STRING);
+			bin_write_u8(buf, BinEncTable_getIndex(encs, sym));
+			bin_write_bytes(buf, RSTRING_PTR(sym), RSTRING_LEN(sym));
 		}
-		/* Check if there is information about child nodes types */
-		if (ut[0] == NT_UNKNOWN || ut[1] == NT_UNKNOWN || ut[2] == NT_UNKNOWN)
+		else if (TYPE(sym) == T_FIXNUM)
 		{
-			rb_raise(rb_eArgError, "Cannot interpret node %d (%s)", nd_type(node), ruby_node_name(nd_type(node)));
+			bin_write_u8(buf, SYMT_RAWID);
+			bin_write_value(buf, (VALUE) FIX2LONG(sym));
 		}
-		/* Save the ID of the node */
-		num = 1;
-		NODEInfo_addNode(info, node, parent);
-		/* Analyze node childs */
-		/* a) child 1 */
-		if (ut[0] == NT_NODE)
+		else
 		{
-			num += count_num_of_nodes(node->u1.node, node, info);
+			rb_raise(rb_eArgError, "Symbols table is corrupted");
 		}
-		else if (ut[0] == NT_ID)
+	}
+	return buf;
+}
+
+/*
+ * Writes the table of literals. Strings, symbols and floats are saved
+ * directly, Marshal is used only for other (non-trivial) objects.
+ * Literals from the dictionary (if it is not NULL) are replaced by
+ * their ordinals
+ */
+static VALUE bin_write_literals(VALUE lits, BinEncTable *encs, NodeDict *dict)
+{
+	VALUE buf = rb_str_buf_new(RARRAY_LEN(lits) * 16);
+	long i;
+	for (i = 0; i < RARRAY_LEN(lits); i++)
+	{
+		VALUE lit = RARRAY_PTR(lits)[i];
+		int ord;
+		if (dict != NULL && (ord = NodeDict_find(dict, dict_lit_key(lit))) >= 0)
 		{
-			LeafTableInfo_addIDEntry(&info->syms, node->u1.id);
+			bin_write_u8(buf, LITT_DICT);
+			bin_write_u32(buf, (uint32_t) ord);
 		}
-		else if (ut[0] == NT_VALUE)
+		else if (TYPE(lit) == T_STRING && rb_obj_class(lit) == rb_cString)
 		{
-			if (TYPE(node->u1.value) == T_NODE)
-				rb_raise(rb_eArgError, "NODE instead of VALUE in child 1 of node %s", ruby_node_name(nd_type(node)));
-			NODEInfo_addValue(info, node->u1.value);
+			bin_write_u8(buf, LITT_STRING);
+			bin_write_u8(buf, BinEncTable_getIndex(encs, lit));
+			bin_write_u8(buf, OBJ_FROZEN(lit) ? 1 : 0);
+			bin_write_bytes(buf, RSTRING_PTR(lit), RSTRING_LEN(lit));
 		}
-		else if (ut[0] == NT_IDTABLE)
+		else if (TYPE(lit) == T_SYMBOL)
 		{
-			VALUE tkey = value_to_str(node->u1.value);
-			VALUE idtbl_ary = rb_ary_new();
-			ID *idtbl = (ID *) node->u1.value;
-			int i, size = (node->u1.value) ? *idtbl++ : 0;
-			for (i = 0; i < size; i++)
-			{
-				ID sym = *idtbl++;
-				rb_ary_push(idtbl_ary, INT2FIX(sym));
-				LeafTableInfo_addIDEntry(&info->syms, sym);
-			}
-			LeafTableInfo_addEntry(&info->idtabs, tkey, idtbl_ary);
+			VALUE name = rb_sym_to_s(lit);
+			bin_write_u8(buf, LITT_SYMBOL);
+			bin_write_u8(buf, BinEncTable_getIndex(encs, name));
+			bin_write_bytes(buf, RSTRING_PTR(name), RSTRING_LEN(name));
 		}
-		else if (ut[0] != NT_LONG && ut[0] != NT_NULL)
+		else if (TYPE(lit) == T_FLOAT)
 		{
-			rb_raise(rb_eArgError, "1!");
+			double val = RFLOAT_VALUE(lit);
+			bin_write_u8(buf, LITT_FLOAT);
+			rb_str_buf_cat(buf, (const char *) &val, sizeof(double));
 		}
-		/* b) child 2 */
-		if (ut[1] == NT_NODE)
+		else
 		{
-			num += count_num_of_nodes(node->u2.node, node, info);
+			VALUE dump = rb_marshal_dump(lit, Qnil);
+			bin_write_u8(buf, LITT_MARSHAL);
+			bin_write_bytes(buf, RSTRING_PTR(dump), RSTRING_LEN(dump));
 		}
-		else if (ut[1] == NT_ID)
+	}
+	return buf;
+}
+
+static VALUE bin_write_gentries(NODEInfo *info)
+{
+	VALUE buf = rb_str_buf_new(info->gentries.pos * 4);
+	int i;
+	for (i = 0; i < info->gentries.pos; i++)
+		bin_write_u32(buf, FIX2INT(info->gentries.vals[i]));
+	return buf;
+}
+
+static VALUE bin_write_idtables(NODEInfo *info)
+{
+	VALUE buf = rb_str_buf_new(info->idtabs.pos * 8);
+	int i, j;
+	for (i = 0; i < info->idtabs.pos; i++)
+	{
+		ID *idtbl = (ID *) info->idtabs.keys[i];
+		int size = (idtbl) ? *idtbl++ : 0;
+		bin_write_u32(buf, size);
+		for (j = 0; j < size; j++)
 		{
-			LeafTableInfo_addIDEntry(&info->syms, node->u2.id);
+			int id = LeafTableInfo_keyToID(&info->syms, (VALUE) idtbl[j]);
+			if (id == -1)
+				rb_raise(rb_eArgError, "Cannot find the symbol ID %d", (int) idtbl[j]);
+			bin_write_u32(buf, id);
 		}
-		else if (ut[1] == NT_VALUE)
+	}
+	return buf;
+}
+
+/*
+ * Writes the table of arguments info structures: from NODEInfo or
+ * from the Ruby array of the preparsed Hash (if args is not nil,
+ * e.g. after NodeMarshal#dedup_nodes)
+ */
+static VALUE bin_write_args(NODEInfo *info, VALUE args)
+{
+	VALUE buf = rb_str_buf_new(0);
+#ifdef USE_RB_ARGS_INFO
+	int i, j, entry[10];
+	for (i = 0; i < info->args.pos; i++)
+	{
+		if (args != Qnil)
 		{
-			if (TYPE(node->u2.value) == T_NODE)
-				rb_raise(rb_eArgError, "NODE instead of VALUE in child 2 of node %s", ruby_node_name(nd_type(node)));
-			NODEInfo_addValue(info, node->u2.value);
+			VALUE args_entry = rb_ary_entry(args, i);
+			Check_Type(args_entry, T_ARRAY);
+			if (RARRAY_LEN(args_entry) != 10)
+				rb_raise(rb_eArgError, "Invalid entry of the arguments table");
+			for (j = 0; j < 10; j++)
+				entry[j] = NUM2INT(RARRAY_AREF(args_entry, j));
 		}
-		else if (ut[1] != NT_LONG && ut[1] != NT_NULL)
+		else
 		{
-			rb_raise(rb_eArgError, "2!");
+			NODEInfo_getArgsEntry(info, i, entry);
 		}
+		for (j = 0; j < 10; j++)
+			bin_write_u32(buf, (uint32_t) entry[j]);
+	}
+#endif
+	return buf;
+}
+
+/*
+ * Transforms the nodes binary dump (see dump_nodes) to the columnar layout
+ * (BIN_FLAG_COLUMNAR). Each field of the node is kept in a separate
+ * array of fixed-width records, so the position of any node is known
+ * without parsing of the previous nodes:
+ *
+ *   uint32        -- number of nodes (n)
+ *   uint32        -- number of wide values (m)
+ *   uint32[n]     -- node flags (shifted by 5 bits, see load_nodes_from_buf)
+ *   uint32[n] x 3 -- ordinals (or raw values) of 1st, 2nd and 3rd children
+ *   uint8[n*4]    -- tags: children values locations (VL_... constants)
+ *                    and flags; NODE_COL_WIDE bit means that the uint32
+ *                    field is an index in the table of wide values
+ *   VALUE[m]      -- wide values that don't fit in uint32
+ */
+static VALUE bin_write_nodes_columnar(VALUE nodes_bin, int num_of_nodes)
+{
+	const unsigned char *bin = (const unsigned char *) RSTRING_PTR(nodes_bin);
+	const unsigned char *end = bin + RSTRING_LEN(nodes_bin);
+	VALUE cols[4], tags, wide, buf;
+	long num_of_wide = 0;
+	int i, j;
+	for (j = 0; j < 4; j++)
+		cols[j] = rb_str_buf_new(num_of_nodes * 4);
+	tags = rb_str_buf_new(num_of_nodes * 4);
+	wide = rb_str_buf_new(0);
+	for (i = 0; i < num_of_nodes; i++)
+	{
+		int rtypes[4];
+		VALUE vals[4];
+		if (!node_record_fits(bin, end))
+			rb_raise(rb_eArgError, "Nodes binary dump is too short");
+		bin = read_node_record(bin, rtypes, &vals[0], &vals[1]);
+		rtypes[3] = 0;
+		for (j = 0; j < 4; j++)
+		{	// Order of cols: flags, u1, u2, u3
+			int tag = (j == 0) ? 0 : rtypes[j - 1];
+			if (vals[j] > 0xFFFFFFFFUL)
+			{
+				tag |= NODE_COL_WIDE;
+				bin_write_u32(cols[j], (uint32_t) num_of_wide++);
+				bin_write_value(wide, vals[j]);
+			}
+			else
+			{
+				bin_write_u32(cols[j], (uint32_t) vals[j]);
+			}
+			if (j == 0)
+				rtypes[3] = tag;
+			else
+				bin_write_u8(tags, tag);
+		}
+		bin_write_u8(tags, rtypes[3]);
+	}
+	if (num_of_wide > 0x7FFFFFFFL)
+		rb_raise(rb_eArgError, "Binary container: too many wide values");
+	buf = rb_str_buf_new(8 + num_of_nodes * 20 + RSTRING_LEN(wide));
+	bin_write_u32(buf, num_of_nodes);
+	bin_write_u32(buf, (uint32_t) num_of_wide);
+	for (j = 0; j < 4; j++)
+		rb_str_buf_append(buf, cols[j]);
+	rb_str_buf_append(buf, tags);
+	rb_str_buf_append(buf, wide);
+	return buf;
+}
+
+/*
+ * Encoded payloads of sections that don't depend on tables of symbols
+ * and literals. They are kept by the NodeMarshal object (@bin_sections)
+ * and reused, e.g. after renaming of symbols (see NodeMarshal#change_symbols)
+ */
+#define BIN_CACHE_NODES    0 // Nodes binary dump (see dump_nodes)
+#define BIN_CACHE_GENTRIES 1
+#define BIN_CACHE_IDTABLES 2
+#define BIN_CACHE_ARGS     3
+#define BIN_CACHE_COLUMNAR 4 // Nodes in the columnar layout (made on demand)
+#define BIN_CACHE_LEN      5
+
+VALUE NODEInfo_binSections(NODEInfo *info, VALUE nodes_bin, VALUE args)
+{
+	VALUE ans = rb_ary_new2(BIN_CACHE_LEN);
+	rb_ary_push(ans, nodes_bin);
+	rb_ary_push(ans, bin_write_gentries(info));
+	rb_ary_push(ans, bin_write_idtables(info));
+	rb_ary_push(ans, bin_write_args(info, args));
+	rb_ary_push(ans, Qnil);
+	return ans;
+}
+
+/*
+ * Transforms preprocessed node to the binary container.
+ *   info -- NODEInfo structure
+ *   syms -- table of symbols (see NODEInfo_getSymbolsTable)
+ *   lits -- table of literals
+ *   sects -- encoded sections (see NODEInfo_binSections)
+ *   num_of_nodes -- number of nodes
+ *   srcinfo -- array with nodename, filename and filepath
+ *   flags -- BIN_FLAG_... constants
+ */
+VALUE NODEInfo_toBin(NODEInfo *info, VALUE syms, VALUE lits, VALUE sects,
+	int num_of_nodes, VALUE srcinfo, int flags, NodeDict *dict)
+{
+	char magic[NODEMARSHAL_BIN_MAGIC_LEN];
+	VALUE buf, syms_bin, lits_bin, nodes_bin = RARRAY_AREF(sects, BIN_CACHE_NODES);
+	BinEncTable encs;
+	int i;
+	// Sections with strings also fill the table of encodings
+	encs.len = 0;
+	syms_bin = bin_write_symbols(syms, &encs, dict);
+	lits_bin = bin_write_literals(lits, &encs, dict);
+	if (dict != NULL)
+		flags |= BIN_FLAG_DICT;
+	// Header
+	buf = rb_str_buf_new(RSTRING_LEN(nodes_bin) + RSTRING_LEN(syms_bin) +
+		RSTRING_LEN(lits_bin) + 256);
+	memset(magic, 0, NODEMARSHAL_BIN_MAGIC_LEN);
+	strcpy(magic, NODEMARSHAL_BIN_MAGIC);
+	rb_str_buf_cat(buf, magic, NODEMARSHAL_BIN_MAGIC_LEN);
+	bin_write_u32(buf, flags);
+	bin_write_u32(buf, num_of_nodes);
+	bin_write_u32(buf, SECT_NUM);
+	if (dict != NULL)
+		bin_write_u32(buf, dict->id);
+	bin_write_nstr(buf, rb_const_get(rb_cObject, rb_intern("RUBY_PLATFORM")));
+	bin_write_nstr(buf, rb_const_get(rb_cObject, rb_intern("RUBY_VERSION")));
+	for (i = 0; i < 3; i++)
+		bin_write_nstr(buf, RARRAY_PTR(srcinfo)[i]);
+	// Sections
+	bin_write_section(buf, SECT_ENCODINGS, encs.len, bin_write_encodings(&encs));
+	bin_write_section(buf, SECT_SYMBOLS, RARRAY_LEN(syms), syms_bin);
+	bin_write_section(buf, SECT_LITERALS, RARRAY_LEN(lits), lits_bin);
+	bin_write_section(buf, SECT_GENTRIES, info->gentries.pos, RARRAY_AREF(sects, BIN_CACHE_GENTRIES));
+	bin_write_section(buf, SECT_IDTABLES, info->idtabs.pos, RARRAY_AREF(sects, BIN_CACHE_IDTABLES));
+#ifdef USE_RB_ARGS_INFO
+	bin_write_section(buf, SECT_ARGS, info->args.pos, RARRAY_AREF(sects, BIN_CACHE_ARGS));
+#else
+	bin_write_section(buf, SECT_ARGS, 0, RARRAY_AREF(sects, BIN_CACHE_ARGS));
+#endif
+	if (flags & BIN_FLAG_COLUMNAR)
+	{
+		if (RARRAY_AREF(sects, BIN_CACHE_COLUMNAR) == Qnil)
+			rb_ary_store(sects, BIN_CACHE_COLUMNAR, bin_write_nodes_columnar(nodes_bin, num_of_nodes));
+		nodes_bin = RARRAY_AREF(sects, BIN_CACHE_COLUMNAR);
+	}
+	bin_write_section(buf, SECT_NODES, num_of_nodes, nodes_bin);
+	return buf;
+}
+
+
+static void NODEInfo_addValue(NODEInfo *info, VALUE value)
+{
+	if (is_value_in_heap(value))
+	{
+		LeafTableInfo_addEntry(&info->lits, value, value);
+	}
+}
+
+/*
+ * Adds the information about Ruby NODE to the NODEInfo struct:
+ * its address, ordinal of its parent (pid, -1 for the root) and
+ * resolved types of its children (ct). Returns the ordinal of the node;
+ * nodes that are already present (shared by several parents) keep
+ * their first parent and types.
+ */
+static int NODEInfo_addNode(NODEInfo *info, NODE *node, int pid, const int *ct)
+{
+	int id = info->nodes.pos, found;
+	found = LeafTableInfo_addEntry(&info->nodes, (VALUE) node, (VALUE) node);
+	if (found != id)
+		return found;
+	if (id == info->nodes_capacity)
+	{
+		info->nodes_capacity = (id == 0) ? 64 : id * 2;
+		REALLOC_N(info->parents, int, info->nodes_capacity);
+		REALLOC_N(info->ctypes, unsigned char, info->nodes_capacity * 3);
+	}
+	info->parents[id] = (pid == -1) ? id : pid;
+	info->ctypes[id * 3] = (unsigned char) ct[0];
+	info->ctypes[id * 3 + 1] = (unsigned char) ct[1];
+	info->ctypes[id * 3 + 2] = (unsigned char) ct[2];
+	return id;
+}
+
+/*
+ * Returns ID of the node using its address (VALUE)
+ * It is used during the process of dumping Ruby AST to disk
+ * for replacing of memory addresses into ordinals
+ */
+static int NODEInfo_nodeAdrToID(NODEInfo *info, VALUE adr)
+{
+	return LeafTableInfo_keyToID(&info->nodes, adr);
+}
+
+/*
+ * Fills types of the node children (NT_... constants) using nodes_ctbl
+ * and special cases that depend on the values and on the parent node
+ */
+static void node_child_types(NODE *node, NODE *parent, int *ut)
+{
+	int offset = nd_type(node) * 3;
+	ut[0] = nodes_ctbl[offset++];
+	ut[1] = nodes_ctbl[offset++];
+	ut[2] = nodes_ctbl[offset];
+
+	/* Special case: part of NODE_KW_ARG syntax in Ruby 2.x, e.g. def func(foo:, bar: 'default) */
+	if ((nd_type(node) == NODE_LASGN || nd_type(node) == NODE_DASGN_CURR) && (void *) node->u2.value == (void *) -1) {
+		ut[1] = NT_LONG; /* To keep -1 correctly */
+	}
+
+	/* Some another special cases */
+	if (nd_type(node) == NODE_OP_ASGN2 && nd_type(parent) == NODE_OP_ASGN2)
+	{
+		ut[0] = NT_ID;
+		ut[1] = NT_ID;
+		ut[2] = NT_ID;
+	}
+
+	/* Some Ruby 1.9.3 style function arguments (without rb_args_info) */
+	if (nd_type(node) == NODE_ARGS_AUX)
+	{
+		ut[0] = NT_ID;
+		ut[1] = (nd_type(parent) == NODE_ARGS_AUX) ? NT_LONG : NT_ID;
+		ut[2] = NT_NODE;
+
+		if (node->u1.value == 0) ut[0] = NT_NULL;
+		if (node->u2.value == 0) ut[1] = NT_NULL;
+		if (node->u3.value == 0) ut[2] = NT_NULL;
+	}
+	/* Some Ruby 1.9.3-specific code for NODE_ATTRASGN */
+	if (nd_type(node) == NODE_ATTRASGN)
+	{
+		if (node->u1.value == 1) ut[0] = NT_LONG;
+	}
+}
 
-		/* c) child 3 */
-		if (ut[2] == NT_NODE)
+/*
+ * Resolves the second child of NODE_ARRAY using its parent and
+ * grandparent (pid is the ordinal of the parent). Special undocumented cases:
+ * 1) the second child of the second element of an array
+ * contains reference to the last element (NT_NODE) not
+ * length (NT_LONG)
+ * 2) NODE_HASH: every second element in NODE_ARRAY chain
+ * contains pointers to NODES (instead of lengths)
+ * 3) NODE_DSTR: first node in NODE_ARRAY chain contains
+ * pointer to NODE (instead of lengths)
+ * The referenced node is a part of the same chain, so the walker
+ * doesn't follow this child (only the ordinal is saved by dump_nodes).
+ */
+static void NODEInfo_arrayChildTypes(NODEInfo *info, NODE *node, NODE *parent, int pid, int *ut)
+{
+	if (nd_type(node) != NODE_ARRAY || pid == -1)
+		return;
+	if (nd_type(parent) == NODE_ARRAY && (NODE *) parent->u3.value == node)
+	{
+		NODE *gparent = RNODE(info->nodes.keys[info->parents[pid]]);
+		int nt2 = nd_type(gparent);
+		if ( (nt2 != NODE_ARRAY && nt2 != NODE_DSTR) ||
+		    (NODE *) gparent->u1.value == parent )
+		{
+			ut[1] = NT_NODE;
+		}
+		else if (parent->u2.value == 2 && node == (NODE *) node->u2.value)
 		{
-			num += count_num_of_nodes(node->u3.node, node, info);
+			ut[1] = NT_NODE;
 		}
-		else if (ut[2] == NT_ID)
+	}
+	else if (nd_type(parent) == NODE_DSTR)
+	{
+		ut[1] = NT_NODE;
+	}
+}
+
+/*
+ * Function counts number of nodes and fills NODEInfo struct
+ * that is neccessary for the node saving to the HDD
+ */
+static int count_num_of_nodes(NODE *root, NODE *root_parent, NODEInfo *info)
+{
+	NodeWalker *w;
+	NodeWalkerItem item;
+	VALUE w_obj = NodeWalker_new(&w);
+	int num = 0;
+	NodeWalker_push(w, NW_NODE, root, root_parent, 0);
+	while (NodeWalker_pop(w, &item))
+	{
+		NODE *node = item.node, *parent = item.parent;
+		int ut[3], ct[3], i, id;
+		if (item.kind == NW_LEAF)
 		{
-			LeafTableInfo_addIDEntry(&info->syms, node->u3.id);
+			VALUE value = (item.child == 0) ? node->u1.value :
+				((item.child == 1) ? node->u2.value : node->u3.value);
+			if (item.type == NT_ID)
+			{
+				LeafTableInfo_addIDEntry(&info->syms, (ID) value);
+			}
+			else if (item.type == NT_VALUE && item.child != 2)
+			{
+				if (TYPE(value) == T_NODE)
+					rb_raise(rb_eArgError, "NODE instead of VALUE in child %d of node %s",
+						item.child + 1, ruby_node_name(nd_type(node)));
+				NODEInfo_addValue(info, value);
+			}
+			else if (item.type == NT_IDTABLE && item.child == 0)
+			{
+				ID *idtbl = (ID *) value;
+				int size = (value) ? *idtbl++ : 0;
+				for (i = 0; i < size; i++)
+				{
+					LeafTableInfo_addIDEntry(&info->syms, *idtbl++);
+				}
+				LeafTableInfo_addEntry(&info->idtabs, value, value);
+			}
+			else if (item.type == NT_ENTRY && item.child == 2)
+			{
+				ID gsym = node->u3.entry->id;
+				// Save symbol to the symbol table
+				int newid = LeafTableInfo_addIDEntry(&info->syms, gsym);
+				LeafTableInfo_addEntry(&info->gentries, node->u3.value, INT2FIX(newid));
+			}
+			else if (item.type != NT_LONG && item.type != NT_NULL)
+			{
+				if (item.child == 0)
+					rb_raise(rb_eArgError, "1!");
+				else if (item.child == 1)
+					rb_raise(rb_eArgError, "2!");
+				rb_raise(rb_eArgError, "Invalid child node 3 of node %s: TYPE %d, VALUE %"PRIxPTR,
+					ruby_node_name(nd_type(node)), item.type, (uintptr_t) (node->u3.value));
+			}
+			continue;
 		}
-		else if (ut[2] == NT_ARGS)
+		else if (item.kind == NW_ARGS)
 		{
 #ifdef USE_RB_ARGS_INFO
-			VALUE varg = Qtrue;
-			struct rb_args_info *ainfo;
-			ID asym;
-			ainfo = node->u3.args;
-			// Save child nodes
-			num += count_num_of_nodes(ainfo->pre_init, node, info);
-			num += count_num_of_nodes(ainfo->post_init, node, info);
-			num += count_num_of_nodes(ainfo->kw_args, node, info);
-			num += count_num_of_nodes(ainfo->kw_rest_arg, node, info);
-			num += count_num_of_nodes(ainfo->opt_args, node, info);
-			// Save rb_args_info structure content
-			varg = rb_ary_new();
-			rb_ary_push(varg, value_to_str((VALUE) ainfo->pre_init));
-			rb_ary_push(varg, value_to_str((VALUE) ainfo->post_init));
-			rb_ary_push(varg, INT2FIX(ainfo->pre_args_num));
-			rb_ary_push(varg, INT2FIX(ainfo->post_args_num));
-
-			asym = ainfo->first_post_arg; rb_ary_push(varg, INT2FIX(asym)); // ID
-			if (asym != 0)
-				LeafTableInfo_addIDEntry(&info->syms, asym);
-
-			asym = ainfo->rest_arg; rb_ary_push(varg, INT2FIX(asym)); // ID
-			if (asym != 0)
-				LeafTableInfo_addIDEntry(&info->syms, asym);
-
-			asym = ainfo->block_arg; rb_ary_push(varg, INT2FIX(asym)); // ID
-			if (asym != 0)
-				LeafTableInfo_addIDEntry(&info->syms, asym);
-			rb_ary_push(varg, value_to_str((VALUE) ainfo->kw_args));
-			rb_ary_push(varg, value_to_str((VALUE) ainfo->kw_rest_arg));
-			rb_ary_push(varg, value_to_str((VALUE) ainfo->opt_args));
-
-			LeafTableInfo_addEntry(&info->args, value_to_str((VALUE) ainfo), varg);
-#else
-			rb_raise(rb_eArgError, "NT_ARGS entry without USE_RB_ARGS_INFO");
+			struct rb_args_info *ainfo = node->u3.args;
+			// Save symbols from rb_args_info structure (the structure itself
+			// is converted to the array by NODEInfo_getArgsTable)
+			if (ainfo->first_post_arg != 0)
+				LeafTableInfo_addIDEntry(&info->syms, ainfo->first_post_arg);
+			if (ainfo->rest_arg != 0)
+				LeafTableInfo_addIDEntry(&info->syms, ainfo->rest_arg);
+			if (ainfo->block_arg != 0)
+				LeafTableInfo_addIDEntry(&info->syms, ainfo->block_arg);
+			LeafTableInfo_addEntry(&info->args, (VALUE) ainfo, (VALUE) ainfo);
 #endif
+			continue;
 		}
-		else if (ut[2] == NT_ENTRY)
+		/* NW_NODE item */
+		if (node == 0)
 		{
-			ID gsym = node->u3.entry->id;
-			// Save symbol to the symbol table
-			int newid = LeafTableInfo_addIDEntry(&info->syms, gsym);
-			LeafTableInfo_addEntry(&info->gentries, value_to_str(node->u3.value), INT2FIX(newid));
+			continue;
 		}
-		else if (ut[2] != NT_LONG && ut[2] != NT_NULL)
+		else if (TYPE((VALUE) node) != T_NODE)
 		{
-			rb_raise(rb_eArgError, "Invalid child node 3 of node %s: TYPE %d, VALUE %"PRIxPTR,
-				ruby_node_name(nd_type(node)), ut[2], (uintptr_t) (node->u3.value));
+			rb_raise(rb_eArgError, "count_num_of_nodes: parent node %s: child node (ADR 0x%s) is not a node; Type: %d (%s)",
+				ruby_node_name(nd_type(parent)), RSTRING_PTR(value_to_str((VALUE) node)), TYPE((VALUE) node),
+				RSTRING_PTR(rb_funcall(rb_funcall((VALUE) node, rb_intern("class"), 0), rb_intern("to_s"), 0))
+			);
+		}
+		node_child_types(node, parent, ut);
+		/* Check if there is information about child nodes types */
+		if (ut[0] == NT_UNKNOWN || ut[1] == NT_UNKNOWN || ut[2] == NT_UNKNOWN)
+		{
+			rb_raise(rb_eArgError, "Cannot interpret node %d (%s)", nd_type(node), ruby_node_name(nd_type(node)));
+		}
+		/* Save the ID of the node and resolved types of its children:
+		   they are used by dump_nodes without special cases */
+		ct[0] = ut[0]; ct[1] = ut[1]; ct[2] = ut[2];
+		NODEInfo_arrayChildTypes(info, node, parent, item.pid, ct);
+		id = NODEInfo_addNode(info, node, item.pid, ct);
+		/* Nodes shared by several parents (see NodeMarshal#dedup_nodes) are saved once */
+		if (id != num)
+			continue;
+		num++;
+		/* Analyze node childs (in the reverse order) */
+		for (i = 2; i >= 0; i--)
+		{
+			VALUE value = (i == 0) ? node->u1.value : ((i == 1) ? node->u2.value : node->u3.value);
+			if (ut[i] == NT_NODE)
+			{
+				NodeWalker_push(w, NW_NODE, RNODE(value), node, 0)->pid = id;
+			}
+			else if (ut[i] == NT_ARGS && i == 2)
+			{
+#ifdef USE_RB_ARGS_INFO
+				struct rb_args_info *ainfo = node->u3.args;
+				// Child nodes are saved before symbols
+				NodeWalker_push(w, NW_ARGS, node, parent, 0);
+				NodeWalker_push(w, NW_NODE, ainfo->opt_args, node, 0)->pid = id;
+				NodeWalker_push(w, NW_NODE, ainfo->kw_rest_arg, node, 0)->pid = id;
+				NodeWalker_push(w, NW_NODE, ainfo->kw_args, node, 0)->pid = id;
+				NodeWalker_push(w, NW_NODE, ainfo->post_init, node, 0)->pid = id;
+				NodeWalker_push(w, NW_NODE, ainfo->pre_init, node, 0)->pid = id;
+#else
+				rb_raise(rb_eArgError, "NT_ARGS entry without USE_RB_ARGS_INFO");
+#endif
+			}
+			else
+			{
+				NodeWalker_pushLeaf(w, node, i, ut[i], 0);
+			}
 		}
-
-		return num;
 	}
+	RB_GC_GUARD(w_obj);
+	return num;
 }
 
 
@@ -856,6 +1696,8 @@ typedef struct {
 
 	VALUE *lits_adr; // Table of literals
 	int lits_len;
+	VALUE lits_ary; // Ruby array that keeps the literals
+	VALUE source; // Object that owns the dump memory (String or mapped file)
 
 	ID **idtbls_adr; // Table of symbols tables
 	int idtbls_len;
@@ -865,15 +1707,60 @@ typedef struct {
 
 	NODE **nodes_adr; // Table of nodes
 	int nodes_len;
+	int nodes_loaded; // 1 if all nodes are filled (and reachable from the root)
 #ifdef USE_RB_ARGS_INFO
 	struct rb_args_info **args_adr; // Table of code blocks arguments
 	int args_len;
 #endif
 } NODEObjAddresses;
 
+/*
+ * Marks the objects used by the loaded tree. Garbage collector is not
+ * disabled during the loading, so all allocated nodes are marked until
+ * the tree is complete; then only the root is marked (other nodes are
+ * reachable from it). Nodes referred by rb_args_info structures are
+ * in the table of nodes too
+ */
+void NODEObjAddresses_mark(NODEObjAddresses *obj)
+{
+	int i;
+	rb_gc_mark(obj->lits_ary);
+	rb_gc_mark(obj->source);
+	if (obj->lits_ary == Qnil && obj->lits_adr != NULL)
+	{
+		for (i = 0; i < obj->lits_len; i++)
+			rb_gc_mark(obj->lits_adr[i]);
+	}
+	if (obj->nodes_adr != NULL)
+	{
+		int len = (obj->nodes_loaded) ? 1 : obj->nodes_len;
+		for (i = 0; i < len; i++)
+		{
+			if (obj->nodes_adr[i] != NULL)
+				rb_gc_mark((VALUE) obj->nodes_adr[i]);
+		}
+	}
+}
 
+/*
+ * ID tables and rb_args_info structures are owned by the nodes that
+ * refer to them (NODE_SCOPE and NODE_ARGS, they are freed by GC together
+ * with the nodes). They are owned by the table of relocations only
+ * until the tree is complete, e.g. if the loading was interrupted by
+ * an exception (see NODEObjAddresses_release)
+ */
 void NODEObjAddresses_free(NODEObjAddresses *obj)
 {
+	int i;
+	if (!obj->nodes_loaded)
+	{
+		for (i = 0; obj->idtbls_adr != NULL && i < obj->idtbls_len; i++)
+			xfree(obj->idtbls_adr[i]);
+#ifdef USE_RB_ARGS_INFO
+		for (i = 0; obj->args_adr != NULL && i < obj->args_len; i++)
+			xfree(obj->args_adr[i]);
+#endif
+	}
 	xfree(obj->syms_adr);
 	xfree(obj->idtbls_adr);
 	xfree(obj->gvars_adr);
@@ -884,16 +1771,163 @@ void NODEObjAddresses_free(NODEObjAddresses *obj)
 	xfree(obj);
 }
 
-
-
-void rbstr_printf(VALUE str, const char *fmt, ...)
+/*
+ * Returns the size of ID tables and rb_args_info structures of the dump
+ */
+static size_t NODEObjAddresses_ownedsize(const NODEObjAddresses *obj, size_t *args_size)
 {
-	char buf[1024];
-	va_list ptr;
-
-	va_start(ptr, fmt);
-	vsprintf(buf, fmt, ptr);
-	rb_str_append(str, rb_str_new2(buf));
+	size_t size = 0;
+	int i;
+	for (i = 0; obj->idtbls_adr != NULL && i < obj->idtbls_len; i++)
+	{
+		if (obj->idtbls_adr[i] != NULL)
+			size += (obj->idtbls_adr[i][0] + 1) * sizeof(ID);
+	}
+	*args_size = 0;
+#ifdef USE_RB_ARGS_INFO
+	if (obj->args_adr != NULL)
+		*args_size = obj->args_len * sizeof(struct rb_args_info);
+#endif
+	return size;
+}
+
+/*
+ * Size of the tables of relocations (and of the ID tables and
+ * rb_args_info structures that are not passed to the nodes yet)
+ */
+static size_t NODEObjAddresses_memsize(const void *ptr)
+{
+	const NODEObjAddresses *obj = (const NODEObjAddresses *) ptr;
+	size_t size = sizeof(NODEObjAddresses);
+	if (obj->syms_adr != NULL)
+		size += obj->syms_len * sizeof(ID);
+	if (obj->idtbls_adr != NULL)
+		size += obj->idtbls_len * sizeof(ID *);
+	if (obj->gvars_adr != NULL)
+		size += obj->gvars_len * sizeof(struct rb_global_entry *);
+	if (obj->nodes_adr != NULL)
+		size += obj->nodes_len * sizeof(NODE *);
+#ifdef USE_RB_ARGS_INFO
+	if (obj->args_adr != NULL)
+		size += obj->args_len * sizeof(struct rb_args_info *);
+#endif
+	if (!obj->nodes_loaded)
+	{
+		size_t args_size;
+		size += NODEObjAddresses_ownedsize(obj, &args_size) + args_size;
+	}
+	return size;
+}
+
+static const rb_data_type_t NODEObjAddresses_type = {
+	"NodeObjAddresses",
+	{(RUBY_DATA_FUNC) NODEObjAddresses_mark, (RUBY_DATA_FUNC) NODEObjAddresses_free, NODEObjAddresses_memsize,},
+};
+
+/*
+ * Creates the empty table of relocations wrapped into Ruby object
+ */
+static VALUE NODEObjAddresses_new(NODEObjAddresses **relocs)
+{
+	VALUE obj = TypedData_Make_Struct(cNodeObjAddresses, NODEObjAddresses,
+		&NODEObjAddresses_type, *relocs);
+	(*relocs)->lits_ary = Qnil;
+	(*relocs)->source = Qnil;
+	return obj;
+}
+
+static void fill_node(NODE *node, VALUE flags, VALUE u1, VALUE u2, VALUE u3);
+
+/*
+ * Called after the loading (rb_ensure): if the tree is not complete
+ * then references from the nodes to ID tables and rb_args_info structures
+ * are removed, so they are freed only by NODEObjAddresses_free
+ */
+static VALUE NODEObjAddresses_release(VALUE arg)
+{
+	NODEObjAddresses *relocs = (NODEObjAddresses *) arg;
+	int i;
+	if (relocs->nodes_loaded || relocs->nodes_adr == NULL)
+		return Qnil;
+	for (i = 0; i < relocs->nodes_len; i++)
+	{
+		if (relocs->nodes_adr[i] != NULL)
+			fill_node(relocs->nodes_adr[i], 0, 0, 0, 0);
+	}
+	return Qnil;
+}
+
+
+static int cmp_owned_ptr(const void *a, const void *b)
+{
+	VALUE pa = *((const VALUE *) a), pb = *((const VALUE *) b);
+	return (pa < pb) ? -1 : (pa > pb);
+}
+
+/*
+ * Checks owners of ID tables and rb_args_info structures of the loaded
+ * tree: each of them is freed by GC together with the owner node, so
+ * it cannot be shared by several nodes (corrupted dump causes
+ * ArgumentError). Tables without owners are freed at once
+ */
+static void NODEObjAddresses_checkOwners(NODEObjAddresses *relocs)
+{
+	VALUE *owned, tmp = 0;
+	long num = 0, i;
+	owned = ALLOCV_N(VALUE, tmp, relocs->nodes_len + 1);
+	for (i = 0; i < relocs->nodes_len; i++)
+	{
+		NODE *node = relocs->nodes_adr[i];
+		if (node == NULL)
+			continue;
+		if (nd_type(node) == NODE_SCOPE && node->u1.value != 0)
+			owned[num++] = node->u1.value;
+#ifdef USE_RB_ARGS_INFO
+		else if (nd_type(node) == NODE_ARGS && node->u3.value != 0)
+			owned[num++] = node->u3.value;
+#endif
+	}
+	qsort(owned, num, sizeof(VALUE), cmp_owned_ptr);
+	for (i = 1; i < num; i++)
+	{
+		if (owned[i] == owned[i - 1])
+		{
+			ALLOCV_END(tmp);
+			rb_raise(rb_eArgError, "Nodes binary dump: shared ID table or arguments info");
+		}
+	}
+	for (i = 0; relocs->idtbls_adr != NULL && i < relocs->idtbls_len; i++)
+	{
+		VALUE ptr = (VALUE) relocs->idtbls_adr[i];
+		if (ptr != 0 && !bsearch(&ptr, owned, num, sizeof(VALUE), cmp_owned_ptr))
+		{
+			xfree(relocs->idtbls_adr[i]);
+			relocs->idtbls_adr[i] = NULL;
+		}
+	}
+#ifdef USE_RB_ARGS_INFO
+	for (i = 0; relocs->args_adr != NULL && i < relocs->args_len; i++)
+	{
+		VALUE ptr = (VALUE) relocs->args_adr[i];
+		if (ptr != 0 && !bsearch(&ptr, owned, num, sizeof(VALUE), cmp_owned_ptr))
+		{
+			xfree(relocs->args_adr[i]);
+			relocs->args_adr[i] = NULL;
+		}
+	}
+#endif
+	ALLOCV_END(tmp);
+}
+
+
+void rbstr_printf(VALUE str, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list ptr;
+
+	va_start(ptr, fmt);
+	vsprintf(buf, fmt, ptr);
+	rb_str_append(str, rb_str_new2(buf));
 	va_end(ptr);
 }
 
@@ -917,17 +1951,11 @@ const char *symid_to_cstr(ID symid)
 
 #define PRINT_NODE_TAB for (j = 0; j < tab; j++) rbstr_printf(str, "  ");
 /*
- * Recursively transforms node into Ruby string
- *   str -- output Ruby string
- *   node -- input Ruby NODE
- *   tab -- number of tabulations during print
- *   show_offsets -- 0/1 show/hide addresses and symbol IDs
+ * Prints the node header (type, line and optionally addresses)
  */
-static void print_node(VALUE str, NODE *node, int tab, int show_offsets)
+static void print_node_header(VALUE str, NODE *node, int tab, int show_offsets)
 {
-	int i, j, type, ut[3];
-	VALUE uref[3];
-
+	int j, type;
 	PRINT_NODE_TAB
 	if (node == NULL)
 	{
@@ -948,140 +1976,349 @@ static void print_node(VALUE str, NODE *node, int tab, int show_offsets)
 	{
 		rbstr_printf(str, "@ %s (line %d)\n", ruby_node_name(type), nd_line(node));
 	}
+}
 
-	ut[0] = nodes_ctbl[type * 3];
-	ut[1] = nodes_ctbl[type * 3 + 1];
-	ut[2] = nodes_ctbl[type * 3 + 2];
-
-	uref[0] = node->u1.value;
-	uref[1] = node->u2.value;
-	uref[2] = node->u3.value;
-
-	if ((type == NODE_LASGN || type == NODE_DASGN_CURR) && (void *) node->u2.value == (void *) -1)
-	{
-		ut[1] = NT_LONG;
+/*
+ * Prints the non-node child of the node (or NODE_OP_ASGN2 internals)
+ *   i -- index of the child
+ *   type -- type of the child (NT_... constant)
+ */
+static void print_node_leaf(VALUE str, NODE *node, int i, int type, int tab, int show_offsets)
+{
+	int j;
+	VALUE uref = (i == 0) ? node->u1.value : ((i == 1) ? node->u2.value : node->u3.value);
+	if (type == NT_NODE)
+	{	// Special case: NODE_OP_ASGN2 3rd child
+		if (uref == 0 || TYPE(uref) != T_NODE)
+			rb_raise(rb_eArgError, "print_node: broken node 0x%s", RSTRING_PTR(value_to_str(uref)));
+		PRINT_NODE_TAB;	rbstr_printf(str, "  ");
+		rbstr_printf(str, "%"PRIxPTR " %"PRIxPTR " %"PRIxPTR"\n",
+			(intptr_t) RNODE(uref)->u1.value,
+			(intptr_t) RNODE(uref)->u2.value,
+			(intptr_t) RNODE(uref)->u3.value);
 	}
-
-	for (i = 0; i < 3; i++)
+	else if (type == NT_VALUE)
 	{
-
-		if (ut[i] == NT_NODE)
+		char *class_name = RSTRING_PTR(rb_funcall(rb_funcall(uref, rb_intern("class"), 0), rb_intern("to_s"), 0));
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		if (show_offsets)
 		{
-			if (nd_type(node) != NODE_OP_ASGN2 || i != 2)
-				print_node(str, RNODE(uref[i]), tab + 1, show_offsets);
-			else
-			{
-				if (ut[i] != 0 && TYPE(ut[i]) != T_NODE)
-					rb_raise(rb_eArgError, "print_node: broken node 0x%s", RSTRING_PTR(value_to_str(ut[i])));
-				PRINT_NODE_TAB;	rbstr_printf(str, "  ");
-				rbstr_printf(str, "%"PRIxPTR " %"PRIxPTR " %"PRIxPTR"\n",
-					(intptr_t) RNODE(uref[i])->u1.value,
-					(intptr_t) RNODE(uref[i])->u2.value,
-					(intptr_t) RNODE(uref[i])->u3.value);
-			}
+			rbstr_printf(str, ">| ADR: %"PRIxPTR"; CLASS: %s (TYPE %d); VALUE: %s\n",
+				(intptr_t) uref,
+				class_name, TYPE(uref),
+				RSTRING_PTR(rb_funcall(uref, rb_intern("to_s"), 0)));
 		}
-		else if (ut[i] == NT_VALUE)
+		else
 		{
-			char *class_name = RSTRING_PTR(rb_funcall(rb_funcall(uref[i], rb_intern("class"), 0), rb_intern("to_s"), 0));
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			if (show_offsets)
-			{
-				rbstr_printf(str, ">| ADR: %"PRIxPTR"; CLASS: %s (TYPE %d); VALUE: %s\n",
-					(intptr_t) uref[i],
-					class_name, TYPE(uref[i]),
-					RSTRING_PTR(rb_funcall(uref[i], rb_intern("to_s"), 0)));
-			}
-			else
-			{
-				rbstr_printf(str, ">| CLASS: %s (TYPE %d); VALUE: %s\n",
-					class_name, TYPE(uref[i]),
-					RSTRING_PTR(rb_funcall(uref[i], rb_intern("to_s"), 0)));
-			}
+			rbstr_printf(str, ">| CLASS: %s (TYPE %d); VALUE: %s\n",
+				class_name, TYPE(uref),
+				RSTRING_PTR(rb_funcall(uref, rb_intern("to_s"), 0)));
 		}
-		else if (ut[i] == NT_ID)
+	}
+	else if (type == NT_ID)
+	{
+		const char *str_sym = symid_to_cstr(uref);
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		if (show_offsets)
+			rbstr_printf(str, ">| ID: %d; SYMBOL: :%s\n", (ID) uref, str_sym);
+		else
+			rbstr_printf(str, ">| SYMBOL: :%s\n", str_sym);
+	}
+	else if (type == NT_LONG)
+	{
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		rbstr_printf(str, ">| %"PRIxPTR "\n", (intptr_t) uref);
+	}
+	else if (type == NT_NULL)
+	{
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		rbstr_printf(str, ">| (NULL)\n");
+	}
+	else if (type == NT_ARGS)
+	{
+#ifdef USE_RB_ARGS_INFO
+		struct rb_args_info *ainfo;
+#endif
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		rbstr_printf(str, ">| ARGS\n");
+#ifdef USE_RB_ARGS_INFO
+		ainfo = node->u3.args;
+		/* Print generic info about the structure */
+		PRINT_NODE_TAB; rbstr_printf(str, "    PRE_INIT:    %16" PRIxPTR "\n", ainfo->pre_init);
+		PRINT_NODE_TAB; rbstr_printf(str, "    POST_INIT:   %16" PRIxPTR "\n", ainfo->post_init);
+		PRINT_NODE_TAB; rbstr_printf(str, "    KW_ARGS:     %16" PRIxPTR "\n", ainfo->kw_args);
+		PRINT_NODE_TAB; rbstr_printf(str, "    KW_REST_ARG: %16" PRIxPTR "\n", ainfo->kw_rest_arg);
+		PRINT_NODE_TAB; rbstr_printf(str, "    OPT_ARGS:    %16" PRIxPTR "\n", ainfo->opt_args);
+		PRINT_NODE_TAB; rbstr_printf(str, "    pre_args_num:  %d\n", ainfo->pre_args_num);
+		PRINT_NODE_TAB; rbstr_printf(str, "    post_args_num: %d\n", ainfo->post_args_num);
+		/* Print information about symbols */
+		if (show_offsets)
 		{
-			const char *str_sym = symid_to_cstr(uref[i]);
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			if (show_offsets)
-				rbstr_printf(str, ">| ID: %d; SYMBOL: :%s\n", (ID) uref[i], str_sym);
-			else
-				rbstr_printf(str, ">| SYMBOL: :%s\n", str_sym);
+			PRINT_NODE_TAB; rbstr_printf(str, "    first_post_arg: %s (ID %X)\n",
+				symid_to_cstr(ainfo->first_post_arg), ainfo->first_post_arg);
+			PRINT_NODE_TAB; rbstr_printf(str, "    rest_arg:       %s (ID %X)\n",
+				symid_to_cstr(ainfo->rest_arg), ainfo->rest_arg);
+			PRINT_NODE_TAB; rbstr_printf(str, "    block_arg:      %s (ID %X)\n",
+				symid_to_cstr(ainfo->block_arg), ainfo->block_arg);
 		}
-		else if (ut[i] == NT_LONG)
+		else 
+		{
+			PRINT_NODE_TAB; rbstr_printf(str, "    first_post_arg: %s\n",
+				symid_to_cstr(ainfo->first_post_arg));
+			PRINT_NODE_TAB; rbstr_printf(str, "    rest_arg:       %s\n",
+				symid_to_cstr(ainfo->rest_arg));
+			PRINT_NODE_TAB; rbstr_printf(str, "    block_arg:      %s\n",
+				symid_to_cstr(ainfo->block_arg));
+		}
+		/* Child nodes are printed by print_node */
+#endif
+	}
+	else if (type == NT_IDTABLE)
+	{
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		rbstr_printf(str, ">| IDTABLE\n");
+	}
+	else if (type == NT_ENTRY)
+	{
+		struct rb_global_entry *gentry;
+		gentry = (struct rb_global_entry *) uref;
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		rbstr_printf(str, ">| [GLOBAL ENTRY PTR=0x%"PRIxPTR" ID=%X]\n", (uintptr_t) gentry->var, gentry->id);
+	}
+	else
+	{
+		PRINT_NODE_TAB; rbstr_printf(str, "  ");
+		rbstr_printf(str, ">| [UNKNOWN]\n");
+	}
+}
+
+/*
+ * Transforms node into Ruby string (iterative traversal, see NodeWalker)
+ *   str -- output Ruby string
+ *   node -- input Ruby NODE
+ *   tab -- number of tabulations during print
+ *   show_offsets -- 0/1 show/hide addresses and symbol IDs
+ */
+static void print_node(VALUE str, NODE *root, int root_tab, int show_offsets)
+{
+	NodeWalker *w;
+	NodeWalkerItem item;
+	VALUE w_obj = NodeWalker_new(&w);
+	NodeWalker_push(w, NW_NODE, root, NULL, root_tab);
+	while (NodeWalker_pop(w, &item))
+	{
+		NODE *node = item.node;
+		int i, type, ut[3], tab = item.depth;
+		if (item.kind == NW_LEAF)
 		{
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			rbstr_printf(str, ">| %"PRIxPTR "\n", (intptr_t) uref[i]);
+			print_node_leaf(str, node, item.child, item.type, tab, show_offsets);
+			continue;
 		}
-		else if (ut[i] == NT_NULL)
+		print_node_header(str, node, tab, show_offsets);
+		if (node == NULL)
+			continue;
+		type = nd_type(node);
+		ut[0] = nodes_ctbl[type * 3];
+		ut[1] = nodes_ctbl[type * 3 + 1];
+		ut[2] = nodes_ctbl[type * 3 + 2];
+		if ((type == NODE_LASGN || type == NODE_DASGN_CURR) && (void *) node->u2.value == (void *) -1)
 		{
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			rbstr_printf(str, ">| (NULL)\n");
+			ut[1] = NT_LONG;
 		}
-		else if (ut[i] == NT_ARGS)
+		/* Children are pushed in the reverse order */
+		for (i = 2; i >= 0; i--)
 		{
+			VALUE uref = (i == 0) ? node->u1.value : ((i == 1) ? node->u2.value : node->u3.value);
+			if (ut[i] == NT_NODE && (type != NODE_OP_ASGN2 || i != 2))
+			{
+				NodeWalker_push(w, NW_NODE, RNODE(uref), node, tab + 1);
+			}
+			else if (ut[i] == NT_ARGS)
+			{
 #ifdef USE_RB_ARGS_INFO
-			struct rb_args_info *ainfo;
+				struct rb_args_info *ainfo = node->u3.args;
+				NodeWalker_push(w, NW_NODE, ainfo->opt_args, node, tab + 2);
+				NodeWalker_push(w, NW_NODE, ainfo->kw_rest_arg, node, tab + 2);
+				NodeWalker_push(w, NW_NODE, ainfo->kw_args, node, tab + 2);
+				NodeWalker_push(w, NW_NODE, ainfo->post_init, node, tab + 2);
+				NodeWalker_push(w, NW_NODE, ainfo->pre_init, node, tab + 2);
 #endif
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			rbstr_printf(str, ">| ARGS\n");
-#ifdef USE_RB_ARGS_INFO
-			ainfo = node->u3.args;
-			/* Print generic info about the structure */
-			PRINT_NODE_TAB; rbstr_printf(str, "    PRE_INIT:    %16" PRIxPTR "\n", ainfo->pre_init);
-			PRINT_NODE_TAB; rbstr_printf(str, "    POST_INIT:   %16" PRIxPTR "\n", ainfo->post_init);
-			PRINT_NODE_TAB; rbstr_printf(str, "    KW_ARGS:     %16" PRIxPTR "\n", ainfo->kw_args);
-			PRINT_NODE_TAB; rbstr_printf(str, "    KW_REST_ARG: %16" PRIxPTR "\n", ainfo->kw_rest_arg);
-			PRINT_NODE_TAB; rbstr_printf(str, "    OPT_ARGS:    %16" PRIxPTR "\n", ainfo->opt_args);
-			PRINT_NODE_TAB; rbstr_printf(str, "    pre_args_num:  %d\n", ainfo->pre_args_num);
-			PRINT_NODE_TAB; rbstr_printf(str, "    post_args_num: %d\n", ainfo->post_args_num);
-			/* Print information about symbols */
-			if (show_offsets)
-			{
-				PRINT_NODE_TAB; rbstr_printf(str, "    first_post_arg: %s (ID %X)\n",
-					symid_to_cstr(ainfo->first_post_arg), ainfo->first_post_arg);
-				PRINT_NODE_TAB; rbstr_printf(str, "    rest_arg:       %s (ID %X)\n",
-					symid_to_cstr(ainfo->rest_arg), ainfo->rest_arg);
-				PRINT_NODE_TAB; rbstr_printf(str, "    block_arg:      %s (ID %X)\n",
-					symid_to_cstr(ainfo->block_arg), ainfo->block_arg);
+				NodeWalker_pushLeaf(w, node, i, ut[i], tab);
 			}
-			else 
+			else
 			{
-				PRINT_NODE_TAB; rbstr_printf(str, "    first_post_arg: %s\n",
-					symid_to_cstr(ainfo->first_post_arg));
-				PRINT_NODE_TAB; rbstr_printf(str, "    rest_arg:       %s\n",
-					symid_to_cstr(ainfo->rest_arg));
-				PRINT_NODE_TAB; rbstr_printf(str, "    block_arg:      %s\n",
-					symid_to_cstr(ainfo->block_arg));
+				NodeWalker_pushLeaf(w, node, i, ut[i], tab);
 			}
-			/* Print information about child nodes */
-			print_node(str, RNODE(ainfo->pre_init), tab + 2, show_offsets);
-			print_node(str, RNODE(ainfo->post_init), tab + 2, show_offsets);
-			print_node(str, RNODE(ainfo->kw_args), tab + 2, show_offsets);
-			print_node(str, RNODE(ainfo->kw_rest_arg), tab + 2, show_offsets);
-			print_node(str, RNODE(ainfo->opt_args), tab + 2, show_offsets);
-#endif
-		}
-		else if (ut[i] == NT_IDTABLE)
-		{
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			rbstr_printf(str, ">| IDTABLE\n");
-		}
-		else if (ut[i] == NT_ENTRY)
-		{
-			struct rb_global_entry *gentry;
-			gentry = (struct rb_global_entry *) uref[i];
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			rbstr_printf(str, ">| [GLOBAL ENTRY PTR=0x%"PRIxPTR" ID=%X]\n", (uintptr_t) gentry->var, gentry->id);
 		}
-		else
+	}
+	RB_GC_GUARD(w_obj);
+}
+
+
+
+/*
+ * Process-wide memo of interned symbols: (encoding, name) -> ID.
+ * Symbols of loaded dumps are interned by rb_intern3 (with lengths, so
+ * the names may contain NUL bytes); such IDs are never collected, so
+ * they are kept by the memo and the same names from other dumps are
+ * resolved without the lookup in the global table of symbols (it hashes
+ * the name by SipHash and checks its code range on every call).
+ * Names are copied to the pool of blocks that are never freed
+ */
+typedef struct {
+	uint32_t hash;
+	int enc;
+	long len;
+	const char *name;
+	ID id;
+} SymMemoEntry;
+
+typedef struct {
+	const char *name;
+	long len;
+	int enc;
+} SymRef;
+
+#define SYM_MEMO_BLOCK 65536
+
+static struct {
+	SymMemoEntry *slots;
+	long nslots;
+	long count;
+	char *block; // Current block of the pool of names
+	long block_pos, block_len;
+	long pool_size; // Total size of blocks
+	long hits, misses;
+} sym_memo;
+
+static uint32_t sym_memo_hash(const char *name, long len, int enc)
+{
+	uint32_t h = 2166136261U ^ (uint32_t) enc;
+	long i;
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) name[i]) * 16777619U;
+	return h;
+}
+
+static SymMemoEntry *sym_memo_probe(SymMemoEntry *slots, long nslots,
+	uint32_t hash, const char *name, long len, int enc)
+{
+	long mask = nslots - 1, i = (long) (hash & mask);
+	for (;; i = (i + 1) & mask)
+	{
+		SymMemoEntry *e = &slots[i];
+		if (e->name == NULL ||
+			(e->hash == hash && e->len == len && e->enc == enc && !memcmp(e->name, name, len)))
+			return e;
+	}
+}
+
+static SymMemoEntry *sym_memo_find(uint32_t hash, const char *name, long len, int enc)
+{
+	return sym_memo_probe(sym_memo.slots, sym_memo.nslots, hash, name, len, enc);
+}
+
+static const char *sym_memo_copy(const char *name, long len)
+{
+	char *ptr;
+	if (len > sym_memo.block_len - sym_memo.block_pos)
+	{
+		long size = (len > SYM_MEMO_BLOCK) ? len : SYM_MEMO_BLOCK;
+		sym_memo.block = ALLOC_N(char, size);
+		sym_memo.block_pos = 0;
+		sym_memo.block_len = size;
+		sym_memo.pool_size += size;
+	}
+	ptr = sym_memo.block + sym_memo.block_pos;
+	memcpy(ptr, name, len);
+	sym_memo.block_pos += len;
+	return ptr;
+}
+
+/*
+ * Doubles the table of the memo. The new table is filled before it is
+ * assigned: if ALLOC_N raises NoMemoryError the memo is left untouched
+ */
+static void sym_memo_grow(void)
+{
+	SymMemoEntry *old = sym_memo.slots, *slots;
+	long i, old_len = sym_memo.nslots;
+	long nslots = (old_len == 0) ? 4096 : old_len * 2;
+	slots = ALLOC_N(SymMemoEntry, nslots);
+	MEMZERO(slots, SymMemoEntry, nslots);
+	for (i = 0; i < old_len; i++)
+		if (old[i].name != NULL)
+			*sym_memo_probe(slots, nslots, old[i].hash, old[i].name, old[i].len, old[i].enc) = old[i];
+	sym_memo.slots = slots;
+	sym_memo.nslots = nslots;
+	xfree(old);
+}
+
+/*
+ * Resolves the batch of symbol names to IDs (out): names found in the memo
+ * are not interned again, other names are interned by rb_intern3 and added
+ * to the memo
+ */
+static void intern_syms(const SymRef *refs, int n, ID *out)
+{
+	int i;
+	for (i = 0; i < n; i++)
+	{
+		const SymRef *r = &refs[i];
+		uint32_t hash = sym_memo_hash(r->name, r->len, r->enc);
+		SymMemoEntry *e;
+		if ((sym_memo.count + 1) * 2 > sym_memo.nslots)
+			sym_memo_grow();
+		e = sym_memo_find(hash, r->name, r->len, r->enc);
+		if (e->name != NULL)
 		{
-			PRINT_NODE_TAB; rbstr_printf(str, "  ");
-			rbstr_printf(str, ">| [UNKNOWN]\n");
+			out[i] = e->id;
+			sym_memo.hits++;
+			continue;
 		}
+		/* Created symbol will be immune to garbage collector */
+		out[i] = rb_intern3(r->name, r->len, rb_enc_from_index(r->enc));
+		e->name = (r->len > 0) ? sym_memo_copy(r->name, r->len) : "";
+		e->hash = hash;
+		e->len = r->len;
+		e->enc = r->enc;
+		e->id = out[i];
+		sym_memo.count++;
+		sym_memo.misses++;
 	}
 }
 
+/*
+ * Interns one symbol name (see intern_syms)
+ */
+static ID intern_sym(const char *name, long len, int enc)
+{
+	SymRef ref;
+	ID id;
+	ref.name = name; ref.len = len; ref.enc = enc;
+	intern_syms(&ref, 1, &id);
+	return id;
+}
 
+/*
+ * call-seq:
+ *   NodeMarshal.symbols_memo_stats => Hash
+ *
+ * Returns the information about the process-wide memo of interned
+ * symbols of loaded dumps: number of names (+:entries+), number of found
+ * (+:hits+) and interned (+:misses+) names and the size of the memo
+ * in bytes (+:memsize+)
+ */
+static VALUE m_symbols_memo_stats(VALUE klass)
+{
+	VALUE ans = rb_hash_new();
+	rb_hash_aset(ans, ID2SYM(rb_intern("entries")), LONG2NUM(sym_memo.count));
+	rb_hash_aset(ans, ID2SYM(rb_intern("hits")), LONG2NUM(sym_memo.hits));
+	rb_hash_aset(ans, ID2SYM(rb_intern("misses")), LONG2NUM(sym_memo.misses));
+	rb_hash_aset(ans, ID2SYM(rb_intern("memsize")),
+		LONG2NUM(sym_memo.nslots * (long) sizeof(SymMemoEntry) + sym_memo.pool_size));
+	return ans;
+}
 
 void resolve_syms_ords(VALUE data, NODEObjAddresses *relocs)
 {
@@ -1101,8 +2338,8 @@ void resolve_syms_ords(VALUE data, NODEObjAddresses *relocs)
 	{
 		VALUE r_sym = RARRAY_PTR(tbl_val)[i];
 		if (TYPE(r_sym) == T_STRING)
-		{	/* Created symbol will be immune to garbage collector */
-			relocs->syms_adr[i] = rb_intern(RSTRING_PTR(r_sym));
+		{
+			relocs->syms_adr[i] = intern_sym(RSTRING_PTR(r_sym), RSTRING_LEN(r_sym), rb_enc_get_index(r_sym));
 		}
 		else if (TYPE(r_sym) == T_FIXNUM)
 		{
@@ -1127,6 +2364,7 @@ void resolve_lits_ords(VALUE data, NODEObjAddresses *relocs)
 	{
 		rb_raise(rb_eArgError, "Literals table is not an array");
 	}
+	relocs->lits_ary = tbl_val;
 	relocs->lits_adr = RARRAY_PTR(tbl_val);
 	relocs->lits_len = RARRAY_LEN(tbl_val);
 	/* Mark all symbols as "immortal" (i.e. not collectable
@@ -1160,9 +2398,12 @@ void resolve_gvars_ords(VALUE data, NODEObjAddresses *relocs)
 	relocs->gvars_adr = ALLOC_N(struct rb_global_entry *, relocs->gvars_len);
 	for (i = 0; i < relocs->gvars_len; i++)
 	{
-		int ind = FIX2INT(RARRAY_PTR(tbl_val)[i]);
-		ID sym = relocs->syms_adr[ind];
-		relocs->gvars_adr[i] = rb_global_entry(sym);
+		int ind = NUM2INT(RARRAY_AREF(tbl_val, i));
+		if (ind < 0 || ind >= relocs->syms_len)
+			rb_raise(rb_eArgError, "Cannot resolve global entry symbol %d", ind);
+		relocs->gvars_adr[i] = rb_global_entry(relocs->syms_adr[ind]);
+		if (relocs->gvars_adr[i] == NULL)
+			rb_raise(rb_eArgError, "Cannot resolve global entry %d", i);
 	}
 }
 
@@ -1176,11 +2417,14 @@ void resolve_idtbls_ords(VALUE data, NODEObjAddresses *relocs)
 	{
 		rb_raise(rb_eArgError, "Cannot find id_tables entries");
 	}
+	Check_Type(tbl_val, T_ARRAY);
 	relocs->idtbls_len = RARRAY_LEN(tbl_val);
 	relocs->idtbls_adr = ALLOC_N(ID *, relocs->idtbls_len);
+	MEMZERO(relocs->idtbls_adr, ID *, relocs->idtbls_len);
 	for (i = 0; i < relocs->idtbls_len; i++)
 	{
-		VALUE idtbl = RARRAY_PTR(tbl_val)[i];
+		VALUE idtbl = RARRAY_AREF(tbl_val, i);
+		Check_Type(idtbl, T_ARRAY);
 		idnum = RARRAY_LEN(idtbl);
 		if (idnum == 0)
 		{	// Empty table: NULL pointer in the address table
@@ -1192,16 +2436,40 @@ void resolve_idtbls_ords(VALUE data, NODEObjAddresses *relocs)
 			relocs->idtbls_adr[i][0] = idnum;
 			for (j = 0; j < idnum; j++)
 			{
-				int ind = FIX2INT(RARRAY_PTR(idtbl)[j]);
+				int ind = NUM2INT(RARRAY_AREF(idtbl, j));
+				if (ind < 0 || ind >= relocs->syms_len)
+					rb_raise(rb_eArgError, "Cannot resolve ID table symbol %d", ind);
 				relocs->idtbls_adr[i][j+1] = relocs->syms_adr[ind];
 			}
 		}
 	}
 }
 
-void resolve_nodes_ords(VALUE data, int num_of_nodes, NODEObjAddresses *relocs)
+/*
+ * Allocates memory for all nodes in one pass before the decoding. Every
+ * NODE must be a slot of the GC heap (it is marked and swept by GC),
+ * so the slots cannot be taken from a custom memory pool. The table is
+ * zeroed before the allocation: GC may run between allocations and
+ * marks the already allocated nodes (see NODEObjAddresses_mark)
+ */
+static void alloc_nodes(int num_of_nodes, NODEObjAddresses *relocs)
 {
 	int i;
+	if (num_of_nodes <= 0)
+	{
+		rb_raise(rb_eArgError, "Invalid number of nodes %d", num_of_nodes);
+	}
+	relocs->nodes_adr = ALLOC_N(NODE *, num_of_nodes);
+	MEMZERO(relocs->nodes_adr, NODE *, num_of_nodes);
+	relocs->nodes_len = num_of_nodes;
+	for (i = 0; i < num_of_nodes; i++)
+	{
+		relocs->nodes_adr[i] = (NODE *) NEW_NODE((enum node_type) 0, 0, 0, 0);
+	}
+}
+
+void resolve_nodes_ords(VALUE data, int num_of_nodes, NODEObjAddresses *relocs)
+{
 	VALUE tbl_val = rb_hash_aref(data, ID2SYM(rb_intern("nodes")));
 	if (tbl_val == Qnil)
 	{
@@ -1211,18 +2479,62 @@ void resolve_nodes_ords(VALUE data, int num_of_nodes, NODEObjAddresses *relocs)
 	{
 		rb_raise(rb_eArgError, "Nodes description must be a string");
 	}
-	relocs->nodes_adr = ALLOC_N(NODE *, num_of_nodes);
-	relocs->nodes_len = num_of_nodes;
-	for (i = 0; i < num_of_nodes; i++)
-	{
-		relocs->nodes_adr[i] = (NODE *) NEW_NODE((enum node_type) 0, 0, 0, 0);
-	}
+	// Each record takes at least 4 bytes
+	if (num_of_nodes > RSTRING_LEN(tbl_val) / 4)
+		rb_raise(rb_eArgError, "Nodes binary dump is too short");
+	alloc_nodes(num_of_nodes, relocs);
 }
 
 #ifdef USE_RB_ARGS_INFO
+/*
+ * Resolves node ordinal from rb_args_info entry (-1 means NULL pointer)
+ */
+static NODE *resolve_args_node(NODEObjAddresses *relocs, int ord)
+{
+	if (ord < -1 || ord >= relocs->nodes_len)
+		rb_raise(rb_eArgError, "Invalid node ordinal %d", ord);
+	return (ord == -1) ? NULL : relocs->nodes_adr[ord];
+}
+
+/*
+ * Resolves symbol ordinal from rb_args_info entry (-1 means empty ID)
+ */
+static ID resolve_args_sym(NODEObjAddresses *relocs, int ord, int field)
+{
+	if (ord < -1 || ord >= relocs->syms_len)
+		rb_raise(rb_eArgError, "%d- Invalid symbol ID ordinal %d", field, ord);
+	return (ord == -1) ? 0 : relocs->syms_adr[ord];
+}
+
+/*
+ * Creates rb_args_info structure from the array of 10 integers
+ * (see NODEInfo_getArgsEntry for the format description) and saves
+ * it to the entry ind of the args table. The structure is saved before
+ * resolving, so it is freed with the table if ordinals are invalid
+ */
+static struct rb_args_info *resolve_args_entry(NODEObjAddresses *relocs, int ind, const int *entry)
+{
+	struct rb_args_info *ainfo = ALLOC(struct rb_args_info);
+	relocs->args_adr[ind] = ainfo;
+	// Resolve nodes
+	ainfo->pre_init = resolve_args_node(relocs, entry[0]);
+	ainfo->post_init = resolve_args_node(relocs, entry[1]);
+	ainfo->kw_args = resolve_args_node(relocs, entry[7]);
+	ainfo->kw_rest_arg = resolve_args_node(relocs, entry[8]);
+	ainfo->opt_args = resolve_args_node(relocs, entry[9]);
+	// No ordinal resolving
+	ainfo->pre_args_num = entry[2];
+	ainfo->post_args_num = entry[3];
+	// Resolve symbolic ordinals
+	ainfo->first_post_arg = resolve_args_sym(relocs, entry[4], 1);
+	ainfo->rest_arg = resolve_args_sym(relocs, entry[5], 2);
+	ainfo->block_arg = resolve_args_sym(relocs, entry[6], 3);
+	return ainfo;
+}
+
 void resolve_args_ords(VALUE data, NODEObjAddresses *relocs)
 {
-	int i;
+	int i, j;
 	VALUE tbl_val = rb_hash_aref(data, ID2SYM(rb_intern("args")));
 
 	if (tbl_val == Qnil)
@@ -1235,860 +2547,4195 @@ void resolve_args_ords(VALUE data, NODEObjAddresses *relocs)
 	}
 	relocs->args_len = RARRAY_LEN(tbl_val);
 	relocs->args_adr = ALLOC_N(struct rb_args_info *, relocs->args_len);
+	MEMZERO(relocs->args_adr, struct rb_args_info *, relocs->args_len);
 	for (i = 0; i < relocs->args_len; i++)
 	{
-		int ord;
-		VALUE ainfo_val, *aiptr;
-		struct rb_args_info *ainfo;
-
-		relocs->args_adr[i] = ALLOC(struct rb_args_info);
-		ainfo_val = RARRAY_PTR(tbl_val)[i];
-		aiptr = RARRAY_PTR(ainfo_val);
-		ainfo = relocs->args_adr[i];
-
+		int entry[10];
+		VALUE ainfo_val = RARRAY_PTR(tbl_val)[i];
 		if (TYPE(ainfo_val) != T_ARRAY || RARRAY_LEN(ainfo_val) != 10)
 		{
 			rb_raise(rb_eArgError, "args entry %d is corrupted", i);
 		}
-		// Load unresolved values
-		ainfo->pre_init = (NODE *) (uintptr_t) FIX2LONG(aiptr[0]); // Node ordinal
-		ainfo->post_init = (NODE *) (uintptr_t) FIX2LONG(aiptr[1]); // Node ordinal
-		ainfo->pre_args_num = FIX2INT(aiptr[2]); // No ordinal resolving
-		ainfo->post_args_num = FIX2INT(aiptr[3]); // No ordinal resolving
-		ainfo->first_post_arg = FIX2INT(aiptr[4]); // Symbolic ordinal
-		ainfo->rest_arg = FIX2INT(aiptr[5]); // Symbolic ordinal
-		ainfo->block_arg = FIX2INT(aiptr[6]); // Symbolic ordinal
-		ainfo->kw_args = (NODE *) (uintptr_t) FIX2LONG(aiptr[7]); // Node ordinal
-		ainfo->kw_rest_arg = (NODE *) (uintptr_t) FIX2LONG(aiptr[8]); // Node ordinal
-		ainfo->opt_args = (NODE *) (uintptr_t) FIX2LONG(aiptr[9]); // Node ordinal
-		// Resolve nodes
-		ord = (int) (((VALUE) ainfo->pre_init) & 0xFFFFFFFF);
-		if (ord < -1 || ord >= relocs->nodes_len)
-			rb_raise(rb_eArgError, "Invalid node ordinal %d", ord);
-		ainfo->pre_init = (ord == -1) ? NULL : relocs->nodes_adr[ord];
-
-		ord = (int) (((VALUE) ainfo->post_init) & 0xFFFFFFFF);
-		if (ord < -1 || ord >= relocs->nodes_len)
-			rb_raise(rb_eArgError, "Invalid node ordinal %d", ord);
-		ainfo->post_init = (ord == -1) ? NULL : relocs->nodes_adr[ord];
-
-		ord = (int) (((VALUE) ainfo->kw_args) & 0xFFFFFFFF);
-		if (ord < -1 || ord >= relocs->nodes_len)
-			rb_raise(rb_eArgError, "Invalid node ordinal %d", ord);
-		ainfo->kw_args = (ord == -1) ? NULL : relocs->nodes_adr[ord];
-
-		ord = (int) (((VALUE) ainfo->kw_rest_arg) & 0xFFFFFFFF);
-		if (ord < -1 || ord >= relocs->nodes_len)
-			rb_raise(rb_eArgError, "Invalid node ordinal %d", ord);
-		ainfo->kw_rest_arg = (ord == -1) ? NULL : relocs->nodes_adr[ord];
-
-		ord = (int) (((VALUE) ainfo->opt_args) & 0xFFFFFFFF);
-		if (ord < -1 || ord >= relocs->nodes_len)
-			rb_raise(rb_eArgError, "Invalid node ordinal %d", ord);
-		ainfo->opt_args = (ord == -1) ? NULL : relocs->nodes_adr[ord];
-		// Resolve symbolic ordinals
-		ord = ainfo->first_post_arg;
-		if (ord < -1 || ord >= relocs->syms_len)
-			rb_raise(rb_eArgError, "1- Invalid symbol ID ordinal %d", ord);
-		ainfo->first_post_arg = (ord == -1) ? 0 : relocs->syms_adr[ord];
-
-		ord = ainfo->rest_arg;
-		if (ord < -1 || ord >= relocs->syms_len)
-			rb_raise(rb_eArgError, "2- Invalid symbol ID ordinal %d", ord);
-		ainfo->rest_arg = (ord == -1) ? 0 : relocs->syms_adr[ord];
-
-		ord = ainfo->block_arg;
-		if (ord < -1 || ord >= relocs->syms_len)
-			rb_raise(rb_eArgError, "3- Invalid symbol ID ordinal %d", ord);
-		ainfo->block_arg = (ord == -1) ? 0 : relocs->syms_adr[ord];
+		for (j = 0; j < 10; j++)
+			entry[j] = NUM2INT(RARRAY_AREF(ainfo_val, j));
+		resolve_args_entry(relocs, i, entry);
 	}
 }
 #endif
 
 /*
- * Transforms binary data with nodes descriptions into Ruby AST (i.e. 
- * ternary tree of nodes). Each node is represented in the next binary format:
- *
- * [4 bytes -- pointers info] [node flags] [child ORD1] [child ORD2] [child ORD3]
- * 
- * Pointers info:
- *   BYTE -- child 1 info (bits 7..4 -- ordinal type, bits 3..0 -- ordinal size, bytes)
- *   BYTE -- child 2 info
- *   BYTE -- child 3 info
- *   BYTE -- node flags length, bytes
- * Node flags:
- *   node->flags field packed by bin_to_value function
- *   child ORDi  Ordinal of ith node child packed by bin_to_value_function
- *               (it will be transformed to the real address in memory, i.e. pointer
- *                or symbol ID during data loading)
+ * Transforms the ordinal of the node child to the real address in memory
+ * (pointer or symbol ID). rtype is a location of the value (VL_... constant).
+ * Doesn't call Ruby API and doesn't read the objects (may be used without GVL).
+ * Returns 0 if the value was resolved or -1 in the case of invalid ordinal or rtype
  */
-void load_nodes_from_str(VALUE data, NODEObjAddresses *relocs)
+static int resolve_node_value_nogvl(NODEObjAddresses *relocs, int rtype, VALUE *u)
 {
-	int i, j;
-	VALUE tbl_val = rb_hash_aref(data, ID2SYM(rb_intern("nodes")));
-	unsigned char *bin = (unsigned char *) RSTRING_PTR(tbl_val);
-	NODE *node = NULL;
-	for (i = 0; i < relocs->nodes_len; i++)
+	switch(rtype)
+	{
+	case VL_RAW: // Do nothing: it is raw data
+		return 0;
+	case VL_NODE:
+		if (*u >= (unsigned int) relocs->nodes_len)
+			return -1;
+		*u = (VALUE) relocs->nodes_adr[*u]; // Only T_NODE (see alloc_nodes)
+		return 0;
+	case VL_ID:
+		if (*u >= (unsigned int) relocs->syms_len)
+			return -1;
+		*u = relocs->syms_adr[*u];
+		return 0;
+	case VL_GVAR:
+		if (*u >= (unsigned int) relocs->gvars_len)
+			return -1;
+		*u = (VALUE) relocs->gvars_adr[*u];
+		return 0;
+	case VL_IDTABLE:
+		if (*u >= (unsigned int) relocs->idtbls_len)
+			return -1;
+		*u = (VALUE) relocs->idtbls_adr[*u];
+		return 0;
+#ifdef USE_RB_ARGS_INFO
+	case VL_ARGS:
+		if (*u >= (unsigned int) relocs->args_len)
+			return -1;
+		*u = (VALUE) relocs->args_adr[*u];
+		return 0;
+#endif
+	case VL_LIT:
+		if (*u >= (unsigned int) relocs->lits_len)
+			return -1;
+		*u = relocs->lits_adr[*u];
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Checks that the node with unresolved children (rtypes are VL_... constants)
+ * is safe for the garbage collector:
+ * - the node type is known (see nodes_ctbl) and cannot be NODE_ALLOCA;
+ * - children marked by GC (NT_NODE and NT_VALUE) are nodes, literals or
+ *   special constants (nested NODE_OP_ASGN2 contains IDs: it is not marked);
+ * - local ID tables and arguments info are referred only by their owners
+ *   (NODE_SCOPE and NODE_ARGS free them, see NODEObjAddresses_checkOwners).
+ * Doesn't call Ruby API (may be used without GVL). Returns 0 if the node
+ * is valid or -1 otherwise
+ */
+static int check_node_record(const int *rtypes, VALUE flags, const VALUE *u)
+{
+	int type = (int) (((flags << 5) & NODE_TYPEMASK) >> NODE_TYPESHIFT), j;
+	if (type >= NODES_CTBL_SIZE || nodes_ctbl[type * 3] == NT_UNKNOWN)
+		return -1;
+	for (j = 0; j < 3; j++)
+	{
+		int ut = nodes_ctbl[type * 3 + j], rt = rtypes[j];
+		if (ut == NT_NODE || ut == NT_VALUE)
+		{
+			if (rt == VL_RAW && is_value_in_heap(u[j]))
+				return -1;
+			if (rt != VL_RAW && rt != VL_NODE && rt != VL_LIT &&
+				!(rt == VL_ID && type == NODE_OP_ASGN2))
+				return -1;
+		}
+		else if (ut == NT_IDTABLE || ut == NT_ARGS)
+		{
+			int owned = (ut == NT_IDTABLE) ? VL_IDTABLE : VL_ARGS;
+			if (rt != owned && !(rt == VL_RAW && u[j] == 0))
+				return -1;
+		}
+		else if (rt == VL_IDTABLE || rt == VL_ARGS)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Bits of flags that are owned by the garbage collector (age of the object
+ * in RGenGC). The node may be already aged by GC runs during the loading,
+ * so these bits are kept instead of the saved ones
+ */
+#if defined(FL_PROMOTED0) && defined(FL_PROMOTED1)
+#define NODE_GC_FLAGS (FL_PROMOTED0 | FL_PROMOTED1)
+#else
+#define NODE_GC_FLAGS 0
+#endif
+
+/*
+ * Fills the node structure by flags and already resolved values of children
+ */
+static void fill_node(NODE *node, VALUE flags, VALUE u1, VALUE u2, VALUE u3)
+{
+#ifdef RESET_GC_FLAGS
+	flags = flags & (~0x3); // Ruby 1.9.x -- specific thing
+#endif
+	node->flags = (((flags << 5) | T_NODE) & ~((VALUE) NODE_GC_FLAGS)) | (node->flags & NODE_GC_FLAGS);
+	node->nd_reserved = 0;
+	node->u1.value = u1;
+	node->u2.value = u2;
+	node->u3.value = u3;
+}
+
+/*
+ * Transforms binary data with nodes descriptions into Ruby AST (i.e. 
+ * ternary tree of nodes). Each node is represented in the next binary format:
+ *
+ * [4 bytes -- pointers info] [node flags] [child ORD1] [child ORD2] [child ORD3]
+ * 
+ * Pointers info:
+ *   BYTE -- child 1 info (bits 7..4 -- ordinal type, bits 3..0 -- ordinal size, bytes)
+ *   BYTE -- child 2 info
+ *   BYTE -- child 3 info
+ *   BYTE -- node flags length, bytes
+ * Node flags:
+ *   node->flags field packed by bin_to_value function
+ *   child ORDi  Ordinal of ith node child packed by bin_to_value_function
+ *               (it will be transformed to the real address in memory, i.e. pointer
+ *                or symbol ID during data loading)
+ */
+#define NODE_NOGVL_MIN 16384 // Minimal number of nodes that are decoded without GVL
+
+/*
+ * Task of the nodes decoding (see load_nodes_from_buf)
+ */
+typedef struct {
+	const unsigned char *buf, *end;
+	NODEObjAddresses *relocs;
+	VALUE *out; // Buffer for decoded nodes (NULL: nodes are filled at once)
+	int bad_node; // Result: -1 or ordinal of the corrupted node
+	int too_short; // Result: 1 if the dump ends before the last node
+} NodeRecordsTask;
+
+/*
+ * Decodes all node records and resolves their children. Ruby API
+ * is not used, so it may be called without GVL; then nodes are written
+ * to the temporary buffer (4 values per node) instead of filling
+ */
+static void *NodeRecordsTask_run(void *arg)
+{
+	NodeRecordsTask *task = (NodeRecordsTask *) arg;
+	NODEObjAddresses *relocs = task->relocs;
+	const unsigned char *bin = task->buf;
+	int i, j;
+	for (i = 0; i < relocs->nodes_len; i++)
 	{
 		int rtypes[4];
 		VALUE u[3], flags;
-		// Read data structure info
-		for (j = 0; j < 4; j++)
-			rtypes[j] = *bin++;
-		flags = bin_to_value(bin, rtypes[3]); bin += rtypes[3];
-		for (j = 0; j < 3; j++)
+		// Read data structure info (the record is checked before reading)
+		if (!node_record_fits(bin, task->end))
 		{
-			int val_len = (rtypes[j] & 0xF0) >> 4;
-			u[j] = bin_to_value(bin, val_len);
-			bin += val_len;
-			rtypes[j] &= 0x0F;
-			
+			task->too_short = 1;
+			return NULL;
+		}
+		bin = read_node_record(bin, rtypes, &flags, u);
+		if (check_node_record(rtypes, flags, u) == -1)
+		{
+			task->bad_node = i;
+			return NULL;
 		}
-		if ((char *)bin - RSTRING_PTR(tbl_val) > RSTRING_LEN(tbl_val))
-			rb_raise(rb_eArgError, "Nodes binary dump is too short");
 		// Resolving all addresses
 		for (j = 0; j < 3; j++)
 		{
-			switch(rtypes[j])
+			if (resolve_node_value_nogvl(relocs, rtypes[j], &u[j]) == -1)
 			{
-			case VL_RAW: // Do nothing: it is raw data
-				break;
-			case VL_NODE:
-				if (u[j] >= (unsigned int) relocs->nodes_len)
-					rb_raise(rb_eArgError, "Cannot resolve VL_NODE entry %d", (int) u[j]);
-				u[j] = (VALUE) relocs->nodes_adr[u[j]];
-				if (TYPE(u[j]) != T_NODE)
-					rb_raise(rb_eArgError, "load_nodes_from_str: nodes memory corrupted");
-				break;
-			case VL_ID:
-				if (u[j] >= (unsigned int) relocs->syms_len)
-					rb_raise(rb_eArgError, "Cannot resolve VL_ID entry %d", (int) u[j]);
-				u[j] = relocs->syms_adr[u[j]];
-				break;
-			case VL_GVAR:
-				if (u[j] >= (unsigned int) relocs->gvars_len)
-					rb_raise(rb_eArgError, "Cannot resolve VL_GVAR entry %d", (int) u[j]);
-				u[j] = (VALUE) relocs->gvars_adr[u[j]];
-				break;
-			case VL_IDTABLE:
-				if (u[j] >= (unsigned int) relocs->idtbls_len)
-					rb_raise(rb_eArgError, "Cannot resolve VL_IDTABLE entry %d", (int) u[j]);
-				u[j] = (VALUE) relocs->idtbls_adr[u[j]];
-				break;
-#ifdef USE_RB_ARGS_INFO
-			case VL_ARGS:
-				if (u[j] >= (unsigned int) relocs->args_len)
-					rb_raise(rb_eArgError, "Cannot resolve VL_ARGS entry %d", (int) u[j]);
-				u[j] = (VALUE) relocs->args_adr[u[j]];
-				break;
-#endif
-			case VL_LIT:
-				if (u[j] >= (unsigned int) relocs->lits_len)
-					rb_raise(rb_eArgError, "Cannot resolve VL_LIT entry %d", (int) u[j]);
-				u[j] = (VALUE) relocs->lits_adr[u[j]];
-				break;
-			default:
-				rb_raise(rb_eArgError, "Unknown RTYPE %d", rtypes[j]);
+				task->bad_node = i;
+				return NULL;
 			}
 		}
+		// Fill classic node structure
+		if (task->out != NULL)
+		{
+			VALUE *v = task->out + 4L * i;
+			v[0] = flags; v[1] = u[0]; v[2] = u[1]; v[3] = u[2];
+		}
+		else
+		{
+			fill_node(relocs->nodes_adr[i], flags, u[0], u[1], u[2]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Loads all nodes from the buffer. Large dumps are decoded without GVL
+ * (see load_nodes_from_columns), the buffer must be owned by the frozen
+ * String or by the mapped file
+ */
+void load_nodes_from_buf(const unsigned char *buf, long buf_len, NODEObjAddresses *relocs)
+{
+	NodeRecordsTask task;
+	int i;
+	task.buf = buf;
+	task.end = buf + buf_len;
+	task.relocs = relocs;
+	task.out = NULL;
+	task.bad_node = -1;
+	task.too_short = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+	if (relocs->nodes_len >= NODE_NOGVL_MIN)
+	{
+		VALUE out_tmp, *out = ALLOCV_N(VALUE, out_tmp, 4L * relocs->nodes_len);
+		task.out = out;
+		rb_thread_call_without_gvl(NodeRecordsTask_run, &task, NULL, NULL);
+		if (task.bad_node == -1 && !task.too_short)
+		{
+			for (i = 0; i < relocs->nodes_len; i++)
+				fill_node(relocs->nodes_adr[i], out[4L * i], out[4L * i + 1], out[4L * i + 2], out[4L * i + 3]);
+		}
+		ALLOCV_END(out_tmp);
+	}
+	else
+#endif
+		NodeRecordsTask_run(&task);
+	if (task.too_short)
+		rb_raise(rb_eArgError, "Nodes binary dump is too short");
+	if (task.bad_node != -1)
+		rb_raise(rb_eArgError, "Nodes binary dump: node %d is corrupted", task.bad_node);
+}
+
+void load_nodes_from_str(VALUE data, NODEObjAddresses *relocs)
+{
+	VALUE tbl_val = rb_hash_aref(data, ID2SYM(rb_intern("nodes")));
+	load_nodes_from_buf((unsigned char *) RSTRING_PTR(tbl_val), RSTRING_LEN(tbl_val), relocs);
+}
+
+/*
+ * Returns the value of string hash field using symbolic key
+ */
+static VALUE get_hash_strfield(VALUE hash, const char *idtxt)
+{
+	VALUE str = rb_hash_aref(hash, ID2SYM(rb_intern(idtxt)));
+	if (TYPE(str) != T_STRING)
+	{
+		rb_raise(rb_eArgError, "Hash field %s is not a string", idtxt);
+		return Qnil;
+	}
+	else
+	{
+		return str;
+	}
+}
+
+/*
+ * Check that the dump was made by the same Ruby version on the same platform
+ */
+static void check_platform_signatures(VALUE platform, VALUE version)
+{
+	VALUE refval;
+	// RUBY_PLATFORM signature must match the current platform
+	refval = rb_const_get(rb_cObject, rb_intern("RUBY_PLATFORM"));
+	if (strcmp(RSTRING_PTR(refval), RSTRING_PTR(platform)))
+		rb_raise(rb_eArgError, "Incompatible RUBY_PLATFORM value %s", RSTRING_PTR(platform));
+	// RUBY_VERSION signature must match the used Ruby interpreter
+	refval = rb_const_get(rb_cObject, rb_intern("RUBY_VERSION"));
+	if (strcmp(RSTRING_PTR(refval), RSTRING_PTR(version)))
+		rb_raise(rb_eArgError, "Incompatible RUBY_VERSION value %s", RSTRING_PTR(version));
+}
+
+/* 
+ * Check validity of node hash representation signatures ("magic" values)
+ */
+static VALUE check_hash_magic(VALUE data)
+{
+	VALUE val;
+	// MAGIC signature must be valid
+	val = get_hash_strfield(data, "MAGIC");
+	if (strcmp(NODEMARSHAL_MAGIC, RSTRING_PTR(val)))
+		rb_raise(rb_eArgError, "Bad value of MAGIC signature");
+	check_platform_signatures(get_hash_strfield(data, "RUBY_PLATFORM"),
+		get_hash_strfield(data, "RUBY_VERSION"));
+	return Qtrue;
+}
+
+/*
+ * Part 4a. Reader of the binary container (NODEMARSHAL12 format).
+ * See NODEInfo_toBin for the format description.
+ */
+typedef struct {
+	const unsigned char *ptr; // Current position
+	const unsigned char *end; // End of the buffer
+} BinReader;
+
+typedef struct {
+	const unsigned char *ptr; // Section payload
+	long len; // Size of section payload in bytes
+	int count; // Number of entries
+	int present;
+} BinSection;
+
+typedef struct {
+	int flags;
+	int num_of_nodes;
+	VALUE platform, version;
+	VALUE nodename, filename, filepath;
+	BinSection sect[SECT_MAX];
+	int encs[256]; // Ruby encodings indexes
+	int encs_len;
+	uint32_t dict_id; // Identifier of the shared dictionary (if BIN_FLAG_DICT is set)
+	NodeDict *dict; // Shared dictionary (NULL if it is not used)
+} BinDumpInfo;
+
+static void BinReader_init(BinReader *r, const unsigned char *ptr, long len)
+{
+	r->ptr = ptr;
+	r->end = ptr + len;
+}
+
+static void BinReader_check(BinReader *r, long len)
+{
+	if (len < 0 || r->end - r->ptr < len)
+		rb_raise(rb_eArgError, "Binary dump is corrupted (unexpected end of data)");
+}
+
+static int BinReader_u8(BinReader *r)
+{
+	BinReader_check(r, 1);
+	return *r->ptr++;
+}
+
+static uint32_t BinReader_u32(BinReader *r)
+{
+	uint32_t val;
+	BinReader_check(r, 4);
+	val = (uint32_t) r->ptr[0] | ((uint32_t) r->ptr[1] << 8) |
+		((uint32_t) r->ptr[2] << 16) | ((uint32_t) r->ptr[3] << 24);
+	r->ptr += 4;
+	return val;
+}
+
+static VALUE BinReader_value(BinReader *r)
+{
+	VALUE val = 0;
+	int i;
+	BinReader_check(r, sizeof(VALUE));
+	for (i = 0; i < (int) sizeof(VALUE); i++)
+		val |= ((VALUE) r->ptr[i]) << (i * 8);
+	r->ptr += sizeof(VALUE);
+	return val;
+}
+
+/*
+ * Returns pointer to the string inside the buffer, its length
+ * is written to *len (-1 means nil)
+ */
+static const char *BinReader_bytes(BinReader *r, long *len)
+{
+	const char *ptr;
+	uint32_t slen = BinReader_u32(r);
+	if (slen == 0xFFFFFFFF)
+	{
+		*len = -1;
+		return NULL;
+	}
+	BinReader_check(r, slen);
+	ptr = (const char *) r->ptr;
+	r->ptr += slen;
+	*len = (long) slen;
+	return ptr;
+}
+
+static VALUE BinReader_nstr(BinReader *r)
+{
+	long len;
+	const char *ptr = BinReader_bytes(r, &len);
+	return (ptr == NULL) ? Qnil : rb_str_new(ptr, len);
+}
+
+static rb_encoding *BinDumpInfo_getEncoding(BinDumpInfo *di, int ind)
+{
+	if (ind >= di->encs_len)
+		rb_raise(rb_eArgError, "Binary dump: invalid encoding index %d", ind);
+	return rb_enc_from_index(di->encs[ind]);
+}
+
+/*
+ * Checks if the string is a binary container (NODEMARSHAL12)
+ */
+static int is_bin_dump(const char *ptr, long len)
+{
+	return (len >= NODEMARSHAL_BIN_MAGIC_LEN &&
+		!memcmp(ptr, NODEMARSHAL_BIN_MAGIC, strlen(NODEMARSHAL_BIN_MAGIC) + 1));
+}
+
+/*
+ * Reads the index of sections (unknown sections are ignored);
+ * the first num_of_required sections must be present
+ */
+static void bin_read_sections(BinReader *r, int num_of_sects, int num_of_required, BinDumpInfo *di)
+{
+	int i;
+	for (i = 0; i < SECT_MAX; i++)
+		di->sect[i].present = 0;
+	for (i = 0; i < num_of_sects; i++)
+	{
+		int id = (int) BinReader_u32(r);
+		int count = (int) BinReader_u32(r);
+		long sect_len = (long) BinReader_u32(r);
+		BinReader_check(r, sect_len);
+		if (id >= 0 && id < SECT_MAX)
+		{
+			if (di->sect[id].present)
+				rb_raise(rb_eArgError, "Binary dump: duplicated section %d", id);
+			if (count < 0 || count > sect_len)
+				rb_raise(rb_eArgError, "Binary dump: section %d is corrupted", id);
+			di->sect[id].ptr = r->ptr;
+			di->sect[id].len = sect_len;
+			di->sect[id].count = count;
+			di->sect[id].present = 1;
+		}
+		r->ptr += sect_len;
+	}
+	for (i = 0; i < num_of_required; i++)
+	{
+		if (!di->sect[i].present)
+			rb_raise(rb_eArgError, "Binary dump: section %d not found", i);
+	}
+}
+
+/*
+ * Reads the header of the binary container and the index of its sections
+ */
+static void bin_read_header(const char *buf, long len, BinDumpInfo *di)
+{
+	BinReader r;
+	int num_of_sects;
+	if (!is_bin_dump(buf, len))
+		rb_raise(rb_eArgError, "Bad value of MAGIC signature");
+	BinReader_init(&r, (const unsigned char *) buf + NODEMARSHAL_BIN_MAGIC_LEN,
+		len - NODEMARSHAL_BIN_MAGIC_LEN);
+	di->flags = (int) BinReader_u32(&r);
+	di->num_of_nodes = (int) BinReader_u32(&r);
+	num_of_sects = (int) BinReader_u32(&r);
+	di->dict_id = (di->flags & BIN_FLAG_DICT) ? BinReader_u32(&r) : 0;
+	di->dict = NULL;
+	di->platform = BinReader_nstr(&r);
+	di->version = BinReader_nstr(&r);
+	if (di->platform == Qnil || di->version == Qnil)
+		rb_raise(rb_eArgError, "Binary dump: RUBY_PLATFORM and RUBY_VERSION are required");
+	di->nodename = BinReader_nstr(&r);
+	di->filename = BinReader_nstr(&r);
+	di->filepath = BinReader_nstr(&r);
+	bin_read_sections(&r, num_of_sects, SECT_NUM, di);
+}
+
+static void bin_read_encodings(BinDumpInfo *di)
+{
+	BinSection *sect = &di->sect[SECT_ENCODINGS];
+	BinReader r;
+	int i;
+	if (sect->count > 256)
+		rb_raise(rb_eArgError, "Binary dump: too many encodings");
+	BinReader_init(&r, sect->ptr, sect->len);
+	for (i = 0; i < sect->count; i++)
+	{
+		long len;
+		const char *ptr = BinReader_bytes(&r, &len);
+		char name[64];
+		if (ptr == NULL || len >= (long) sizeof(name))
+			rb_raise(rb_eArgError, "Binary dump: invalid encoding name");
+		memcpy(name, ptr, len); name[len] = 0;
+		di->encs[i] = rb_enc_find_index(name);
+		if (di->encs[i] < 0)
+			rb_raise(rb_eArgError, "Binary dump: unknown encoding %s", name);
+	}
+	di->encs_len = sect->count;
+}
+
+static void bin_read_syms(BinDumpInfo *di, NODEObjAddresses *relocs)
+{
+	BinSection *sect = &di->sect[SECT_SYMBOLS];
+	BinReader r;
+	SymRef *refs;
+	ID *ids;
+	int i, *pos, nrefs = 0;
+	VALUE tmp;
+	BinReader_init(&r, sect->ptr, sect->len);
+	relocs->syms_len = sect->count;
+	relocs->syms_adr = ALLOC_N(ID, relocs->syms_len);
+	// Names are collected and interned by one batch (see intern_syms)
+	refs = (SymRef *) ALLOCV(tmp, relocs->syms_len * (sizeof(SymRef) + sizeof(ID) + sizeof(int)) + 1);
+	ids = (ID *) (refs + relocs->syms_len);
+	pos = (int *) (ids + relocs->syms_len);
+	for (i = 0; i < relocs->syms_len; i++)
+	{
+		int type = BinReader_u8(&r);
+		if (type == SYMT_STRING)
+		{
+			SymRef *ref = &refs[nrefs];
+			ref->enc = rb_enc_to_index(BinDumpInfo_getEncoding(di, BinReader_u8(&r)));
+			ref->name = BinReader_bytes(&r, &ref->len);
+			if (ref->name == NULL)
+				rb_raise(rb_eArgError, "Symbols table is corrupted");
+			pos[nrefs++] = i;
+			relocs->syms_adr[i] = 0;
+		}
+		else if (type == SYMT_RAWID)
+		{
+			relocs->syms_adr[i] = (ID) BinReader_value(&r);
+		}
+		else if (type == SYMT_DICT)
+		{
+			uint32_t ord = BinReader_u32(&r);
+			if (di->dict == NULL || ord >= (uint32_t) di->dict->syms_len)
+				rb_raise(rb_eArgError, "Symbols table is corrupted");
+			relocs->syms_adr[i] = di->dict->syms[ord];
+		}
+		else
+		{
+			rb_raise(rb_eArgError, "Symbols table is corrupted");
+		}
+	}
+	intern_syms(refs, nrefs, ids);
+	for (i = 0; i < nrefs; i++)
+		relocs->syms_adr[pos[i]] = ids[i];
+	ALLOCV_END(tmp);
+}
+
+static void bin_read_lits(BinDumpInfo *di, NODEObjAddresses *relocs)
+{
+	BinSection *sect = &di->sect[SECT_LITERALS];
+	BinReader r;
+	int i;
+	BinReader_init(&r, sect->ptr, sect->len);
+	relocs->lits_ary = rb_ary_new2(sect->count);
+	for (i = 0; i < sect->count; i++)
+	{
+		int type = BinReader_u8(&r);
+		VALUE lit;
+		long len;
+		const char *ptr;
+		if (type == LITT_STRING)
+		{
+			rb_encoding *enc = BinDumpInfo_getEncoding(di, BinReader_u8(&r));
+			int frozen = BinReader_u8(&r);
+			ptr = BinReader_bytes(&r, &len);
+			if (ptr == NULL)
+				rb_raise(rb_eArgError, "Literals table is corrupted");
+			lit = rb_enc_str_new(ptr, len, enc);
+			if (frozen)
+				OBJ_FREEZE(lit);
+		}
+		else if (type == LITT_SYMBOL)
+		{	/* Symbol will be immune to garbage collector (see resolve_lits_ords) */
+			rb_encoding *enc = BinDumpInfo_getEncoding(di, BinReader_u8(&r));
+			ptr = BinReader_bytes(&r, &len);
+			if (ptr == NULL)
+				rb_raise(rb_eArgError, "Literals table is corrupted");
+			lit = ID2SYM(intern_sym(ptr, len, rb_enc_to_index(enc)));
+		}
+		else if (type == LITT_FLOAT)
+		{
+			double val;
+			BinReader_check(&r, sizeof(double));
+			memcpy(&val, r.ptr, sizeof(double));
+			r.ptr += sizeof(double);
+			lit = DBL2NUM(val);
+		}
+		else if (type == LITT_MARSHAL)
+		{
+			VALUE str;
+			ptr = BinReader_bytes(&r, &len);
+			if (ptr == NULL)
+				rb_raise(rb_eArgError, "Literals table is corrupted");
+			str = rb_str_new(ptr, len);
+			lit = rb_marshal_load(str);
+			RB_GC_GUARD(str); // Marshal doesn't mark its source String
+		}
+		else if (type == LITT_DICT)
+		{
+			uint32_t ord = BinReader_u32(&r);
+			if (di->dict == NULL || ord >= (uint32_t) RARRAY_LEN(di->dict->lits))
+				rb_raise(rb_eArgError, "Literals table is corrupted");
+			lit = RARRAY_AREF(di->dict->lits, ord);
+		}
+		else
+		{
+			rb_raise(rb_eArgError, "Literals table is corrupted");
+		}
+		rb_ary_push(relocs->lits_ary, lit);
+	}
+	relocs->lits_adr = RARRAY_PTR(relocs->lits_ary);
+	relocs->lits_len = (int) RARRAY_LEN(relocs->lits_ary);
+}
+
+static void bin_read_gvars(BinDumpInfo *di, NODEObjAddresses *relocs)
+{
+	BinSection *sect = &di->sect[SECT_GENTRIES];
+	BinReader r;
+	int i;
+	BinReader_init(&r, sect->ptr, sect->len);
+	relocs->gvars_len = sect->count;
+	relocs->gvars_adr = ALLOC_N(struct rb_global_entry *, relocs->gvars_len);
+	for (i = 0; i < relocs->gvars_len; i++)
+	{
+		uint32_t ind = BinReader_u32(&r);
+		if (ind >= (uint32_t) relocs->syms_len)
+			rb_raise(rb_eArgError, "Cannot resolve global entry symbol %d", (int) ind);
+		relocs->gvars_adr[i] = rb_global_entry(relocs->syms_adr[ind]);
+		if (relocs->gvars_adr[i] == NULL)
+			rb_raise(rb_eArgError, "Cannot resolve global entry %d", i);
+	}
+}
+
+static void bin_read_idtbls(BinDumpInfo *di, NODEObjAddresses *relocs)
+{
+	BinSection *sect = &di->sect[SECT_IDTABLES];
+	BinReader r;
+	int i, j;
+	BinReader_init(&r, sect->ptr, sect->len);
+	relocs->idtbls_len = sect->count;
+	relocs->idtbls_adr = ALLOC_N(ID *, relocs->idtbls_len);
+	MEMZERO(relocs->idtbls_adr, ID *, relocs->idtbls_len);
+	for (i = 0; i < relocs->idtbls_len; i++)
+	{
+		uint32_t idnum = BinReader_u32(&r);
+		if (idnum == 0)
+		{	// Empty table: NULL pointer in the address table
+			relocs->idtbls_adr[i] = NULL;
+			continue;
+		}
+		BinReader_check(&r, (long) idnum * 4);
+		// Filled table: pointer to dynamic memory
+		relocs->idtbls_adr[i] = ALLOC_N(ID, idnum + 1);
+		relocs->idtbls_adr[i][0] = idnum;
+		for (j = 0; j < (int) idnum; j++)
+		{
+			uint32_t ind = BinReader_u32(&r);
+			if (ind >= (uint32_t) relocs->syms_len)
+				rb_raise(rb_eArgError, "Cannot resolve ID table symbol %d", (int) ind);
+			relocs->idtbls_adr[i][j+1] = relocs->syms_adr[ind];
+		}
+	}
+}
+
+#ifdef USE_RB_ARGS_INFO
+static void bin_read_args(BinDumpInfo *di, NODEObjAddresses *relocs)
+{
+	BinSection *sect = &di->sect[SECT_ARGS];
+	BinReader r;
+	int i, j;
+	BinReader_init(&r, sect->ptr, sect->len);
+	BinReader_check(&r, (long) sect->count * 40);
+	relocs->args_len = sect->count;
+	relocs->args_adr = ALLOC_N(struct rb_args_info *, relocs->args_len);
+	MEMZERO(relocs->args_adr, struct rb_args_info *, relocs->args_len);
+	for (i = 0; i < relocs->args_len; i++)
+	{
+		int entry[10];
+		for (j = 0; j < 10; j++)
+			entry[j] = (int) BinReader_u32(&r);
+		resolve_args_entry(relocs, i, entry);
+	}
+}
+#endif
+
+/*
+ * Nodes section in the columnar layout (see bin_write_nodes_columnar)
+ */
+typedef struct {
+	const unsigned char *cols[4]; // flags, u1, u2, u3 columns
+	const unsigned char *tags;
+	const unsigned char *wide;
+	int num_of_nodes;
+	int num_of_wide;
+} NodeColumns;
+
+static uint32_t get_u32le(const unsigned char *ptr)
+{
+	return (uint32_t) ptr[0] | ((uint32_t) ptr[1] << 8) |
+		((uint32_t) ptr[2] << 16) | ((uint32_t) ptr[3] << 24);
+}
+
+static void NodeColumns_init(NodeColumns *nc, const unsigned char *buf, long len, int num_of_nodes)
+{
+	BinReader r;
+	int j;
+	BinReader_init(&r, buf, len);
+	nc->num_of_nodes = (int) BinReader_u32(&r);
+	nc->num_of_wide = (int) BinReader_u32(&r);
+	if (nc->num_of_nodes != num_of_nodes || nc->num_of_wide < 0)
+		rb_raise(rb_eArgError, "Binary dump: columnar nodes section is corrupted");
+	// All columns have fixed size, so the section size must be exact
+	if ((len - 8) / 20 < num_of_nodes ||
+		(len - 8 - 20L * num_of_nodes) / (long) sizeof(VALUE) != nc->num_of_wide ||
+		(len - 8 - 20L * num_of_nodes) % (long) sizeof(VALUE) != 0)
+		rb_raise(rb_eArgError, "Binary dump: columnar nodes section has invalid size");
+	for (j = 0; j < 4; j++)
+		nc->cols[j] = r.ptr + 4L * j * num_of_nodes;
+	nc->tags = r.ptr + 16L * num_of_nodes;
+	nc->wide = nc->tags + 4L * num_of_nodes;
+}
+
+/*
+ * Returns the wide value (index must be checked by the caller)
+ */
+static VALUE NodeColumns_wide(NodeColumns *nc, uint32_t ind)
+{
+	const unsigned char *ptr;
+	VALUE val = 0;
+	int i;
+	ptr = nc->wide + ind * sizeof(VALUE);
+	for (i = 0; i < (int) sizeof(VALUE); i++)
+		val |= ((VALUE) ptr[i]) << (i * 8);
+	return val;
+}
+
+/*
+ * Loads nodes with ordinals from begin to end-1 from the columnar layout.
+ * Every node is located by its ordinal, no previous nodes are parsed.
+ * If out is not NULL then the flags and resolved children of the node i
+ * are saved to out[4 * i ... 4 * i + 3] instead of the node itself.
+ * Doesn't call Ruby API (may be used without GVL). Returns -1 if all
+ * nodes were loaded or ordinal of the first corrupted node
+ */
+static int load_nodes_from_columns_nogvl(NodeColumns *nc, int begin, int end,
+	NODEObjAddresses *relocs, VALUE *out)
+{
+	int i, j;
+	for (i = begin; i < end; i++)
+	{
+		const unsigned char *tags = nc->tags + 4L * i;
+		VALUE v[4];
+		int rtypes[3];
+		for (j = 0; j < 4; j++)
+		{
+			uint32_t val = get_u32le(nc->cols[j] + 4L * i);
+			int tag = tags[(j + 3) & 3]; // Tag of the flags is the last one
+			if (tag & NODE_COL_WIDE)
+			{
+				if (val >= (uint32_t) nc->num_of_wide)
+					return i;
+				v[j] = NodeColumns_wide(nc, val);
+			}
+			else
+			{
+				v[j] = (VALUE) val;
+			}
+			if (j > 0)
+				rtypes[j - 1] = tag & 0x7F;
+			else if (tag & 0x7F)
+				return i;
+		}
+		if (check_node_record(rtypes, v[0], v + 1) == -1)
+			return i;
+		for (j = 0; j < 3; j++)
+		{
+			if (resolve_node_value_nogvl(relocs, rtypes[j], &v[j + 1]) == -1)
+				return i;
+		}
+		if (out != NULL)
+			memcpy(out + 4L * i, v, 4 * sizeof(VALUE));
+		else
+			fill_node(relocs->nodes_adr[i], v[0], v[1], v[2], v[3]);
+	}
+	return -1;
+}
+
+#define NODE_COL_MAX_THREADS 64 // Maximal number of threads for nodes loading
+#define NODE_COL_MIN_CHUNK 16384 // Minimal number of nodes that are loaded by one thread
+
+/*
+ * Task for the thread that loads a range of nodes from the columnar layout
+ */
+typedef struct {
+	NodeColumns *nc;
+	NODEObjAddresses *relocs;
+	VALUE *out; // Buffer for decoded nodes (see load_nodes_from_columns_nogvl)
+	int begin, end;
+	int bad_node; // Result: -1 or ordinal of the corrupted node
+} NodeColumnsTask;
+
+typedef struct {
+	NodeColumnsTask tasks[NODE_COL_MAX_THREADS];
+	int num_of_tasks;
+} NodeColumnsJob;
+
+static void *NodeColumnsTask_run(void *arg)
+{
+	NodeColumnsTask *task = (NodeColumnsTask *) arg;
+	task->bad_node = load_nodes_from_columns_nogvl(task->nc, task->begin, task->end,
+		task->relocs, task->out);
+	return NULL;
+}
+
+/*
+ * Runs all tasks of the job: the first task is executed by the current
+ * thread, other ones -- by the native threads (or sequentially if threads
+ * cannot be created). Ruby API is not used, so the GVL is released
+ */
+static void *NodeColumnsJob_run(void *arg)
+{
+	NodeColumnsJob *job = (NodeColumnsJob *) arg;
+	int i;
+#if defined(HAVE_PTHREAD_H)
+	pthread_t th[NODE_COL_MAX_THREADS];
+	int th_ok[NODE_COL_MAX_THREADS];
+	memset(th, 0, sizeof(th));
+	memset(th_ok, 0, sizeof(th_ok));
+	for (i = 1; i < job->num_of_tasks; i++)
+		th_ok[i] = (pthread_create(&th[i], NULL, NodeColumnsTask_run, &job->tasks[i]) == 0);
+	NodeColumnsTask_run(&job->tasks[0]);
+	for (i = 1; i < job->num_of_tasks; i++)
+	{
+		if (th_ok[i])
+			pthread_join(th[i], NULL);
+		else
+			NodeColumnsTask_run(&job->tasks[i]);
+	}
+#else
+	for (i = 0; i < job->num_of_tasks; i++)
+		NodeColumnsTask_run(&job->tasks[i]);
+#endif
+	return NULL;
+}
+
+/*
+ * Loads all nodes from the columnar layout using nthreads threads.
+ * Symbols, literals etc. must be already resolved (it requires Ruby API
+ * and is made by the current thread), nodes are decoded without GVL.
+ * Other Ruby threads may run GC at this time, so the threads write
+ * decoded nodes to the temporary buffer and the nodes are filled
+ * by the current thread after getting the GVL back
+ */
+static void load_nodes_from_columns(NodeColumns *nc, NODEObjAddresses *relocs, int nthreads)
+{
+	NodeColumnsJob job;
+	int i, chunk, bad_node = -1;
+	if (nthreads > NODE_COL_MAX_THREADS)
+		nthreads = NODE_COL_MAX_THREADS;
+	if (nthreads > nc->num_of_nodes / NODE_COL_MIN_CHUNK)
+		nthreads = nc->num_of_nodes / NODE_COL_MIN_CHUNK;
+	if (nthreads < 1)
+		nthreads = 1;
+	chunk = (nc->num_of_nodes + nthreads - 1) / nthreads;
+	job.num_of_tasks = nthreads;
+	for (i = 0; i < nthreads; i++)
+	{
+		NodeColumnsTask *task = &job.tasks[i];
+		task->nc = nc;
+		task->relocs = relocs;
+		task->out = NULL;
+		task->begin = i * chunk;
+		task->end = (i == nthreads - 1) ? nc->num_of_nodes : (i + 1) * chunk;
+		task->bad_node = -1;
+	}
+#if defined(HAVE_PTHREAD_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL)
+	if (nthreads > 1)
+	{
+		VALUE out_tmp, *out = ALLOCV_N(VALUE, out_tmp, 4L * nc->num_of_nodes);
+		for (i = 0; i < nthreads; i++)
+			job.tasks[i].out = out;
+		rb_thread_call_without_gvl(NodeColumnsJob_run, &job, NULL, NULL);
+		for (i = 0; i < nthreads && bad_node == -1; i++)
+			bad_node = job.tasks[i].bad_node;
+		if (bad_node == -1)
+		{
+			for (i = 0; i < nc->num_of_nodes; i++)
+				fill_node(relocs->nodes_adr[i], out[4L * i], out[4L * i + 1], out[4L * i + 2], out[4L * i + 3]);
+		}
+		ALLOCV_END(out_tmp);
+	}
+	else
+		NodeColumnsJob_run(&job);
+#else
+	NodeColumnsJob_run(&job);
+#endif
+	for (i = 0; i < nthreads && bad_node == -1; i++)
+		bad_node = job.tasks[i].bad_node;
+	if (bad_node != -1)
+		rb_raise(rb_eArgError, "Binary dump: node %d in the columnar nodes section is corrupted", bad_node);
+}
+
+/*
+ * Part 4b. Shared dictionaries of symbols and literals (NodeMarshal::Dictionary)
+ *
+ * Symbols and literals that repeat in many files of the project are
+ * saved to one dictionary. Dumps made by NodeMarshal#to_bin(:shared_dict => dict)
+ * contain only ordinals of such entries and the identifier of the
+ * dictionary (BIN_FLAG_DICT). The dictionary is loaded (and its symbols
+ * are interned) once per process and is used by all such dumps.
+ *
+ * Format of the dictionary (all integers are little-endian):
+ *   magic  -- 16 bytes, NODEMARSHAL12DC and zero padding
+ *   flags  -- uint32 (reserved, 0)
+ *   id     -- uint32, Adler-32 of the rest of the container
+ *   nsects -- uint32, number of sections
+ *   string -- RUBY_PLATFORM
+ *   string -- RUBY_VERSION
+ *   sections SECT_ENCODINGS, SECT_SYMBOLS and SECT_LITERALS (see NODEInfo_toBin;
+ *   entries of the dictionary cannot refer to other dictionaries)
+ */
+
+/*
+ * Registry of loaded dictionaries: id (Integer) => NodeMarshal::Dictionary
+ */
+static VALUE dict_registry = Qnil;
+
+static NodeDict *NodeDict_get(uint32_t id)
+{
+	VALUE obj = rb_hash_lookup(dict_registry, UINT2NUM(id));
+	NodeDict *dict;
+	if (obj == Qnil)
+		rb_raise(rb_eArgError,
+			"Binary dump: shared dictionary %08X is not loaded (see NodeMarshal::Dictionary)", id);
+	Data_Get_Struct(obj, NodeDict, dict);
+	return dict;
+}
+
+/*
+ * Makes the dictionary container from the array of symbols (Strings)
+ * and the array of literals
+ */
+static VALUE NodeDict_serialize(VALUE syms, VALUE lits)
+{
+	char magic[NODEMARSHAL_BIN_MAGIC_LEN];
+	VALUE buf, body, syms_bin, lits_bin;
+	BinEncTable encs;
+	encs.len = 0;
+	syms_bin = bin_write_symbols(syms, &encs, NULL);
+	lits_bin = bin_write_literals(lits, &encs, NULL);
+	body = rb_str_buf_new(RSTRING_LEN(syms_bin) + RSTRING_LEN(lits_bin) + 256);
+	bin_write_u32(body, SECT_LITERALS + 1);
+	bin_write_nstr(body, rb_const_get(rb_cObject, rb_intern("RUBY_PLATFORM")));
+	bin_write_nstr(body, rb_const_get(rb_cObject, rb_intern("RUBY_VERSION")));
+	bin_write_section(body, SECT_ENCODINGS, encs.len, bin_write_encodings(&encs));
+	bin_write_section(body, SECT_SYMBOLS, RARRAY_LEN(syms), syms_bin);
+	bin_write_section(body, SECT_LITERALS, RARRAY_LEN(lits), lits_bin);
+	buf = rb_str_buf_new(RSTRING_LEN(body) + 32);
+	memset(magic, 0, NODEMARSHAL_BIN_MAGIC_LEN);
+	strcpy(magic, NODEMARSHAL_DICT_MAGIC);
+	rb_str_buf_cat(buf, magic, NODEMARSHAL_BIN_MAGIC_LEN);
+	bin_write_u32(buf, 0);
+	bin_write_u32(buf, codec_checksum((const unsigned char *) RSTRING_PTR(body), RSTRING_LEN(body)));
+	rb_str_buf_append(buf, body);
+	return buf;
+}
+
+/*
+ * Fills the table of keys of entries (is used by the writer of dumps)
+ */
+static void NodeDict_makeKeys(NodeDict *dict)
+{
+	long i;
+	dict->keys = rb_hash_new();
+	for (i = 0; i < dict->syms_len; i++)
+	{
+		VALUE str = rb_id2str(dict->syms[i]);
+		if (str)
+		{
+			VALUE key = dict_sym_key(str);
+			if (rb_hash_lookup2(dict->keys, key, Qnil) == Qnil)
+				rb_hash_aset(dict->keys, key, INT2FIX(i));
+		}
+	}
+	for (i = 0; i < RARRAY_LEN(dict->lits); i++)
+	{
+		VALUE key = dict_lit_key(RARRAY_AREF(dict->lits, i));
+		if (rb_hash_lookup2(dict->keys, key, Qnil) == Qnil)
+			rb_hash_aset(dict->keys, key, INT2FIX(i));
+	}
+}
+
+/*
+ * Loads the dictionary container and registers it. If the dictionary
+ * with the same identifier is already loaded then it is returned
+ */
+static VALUE NodeDict_load(VALUE bin)
+{
+	BinDumpInfo di;
+	BinReader r;
+	VALUE obj, val_relocs, platform, version;
+	NODEObjAddresses *relocs;
+	NodeDict *dict;
+	uint32_t id;
+	int num_of_sects;
+	StringValue(bin);
+	if (RSTRING_LEN(bin) < NODEMARSHAL_BIN_MAGIC_LEN ||
+		memcmp(RSTRING_PTR(bin), NODEMARSHAL_DICT_MAGIC, strlen(NODEMARSHAL_DICT_MAGIC) + 1))
+		rb_raise(rb_eArgError, "Bad value of MAGIC signature of the dictionary");
+	BinReader_init(&r, (const unsigned char *) RSTRING_PTR(bin) + NODEMARSHAL_BIN_MAGIC_LEN,
+		RSTRING_LEN(bin) - NODEMARSHAL_BIN_MAGIC_LEN);
+	if (BinReader_u32(&r) != 0)
+		rb_raise(rb_eArgError, "Dictionary: unsupported flags");
+	id = BinReader_u32(&r);
+	if (codec_checksum(r.ptr, r.end - r.ptr) != id)
+		rb_raise(rb_eArgError, "Dictionary is corrupted (checksum mismatch)");
+	// Already loaded dictionary
+	obj = rb_hash_lookup(dict_registry, UINT2NUM(id));
+	if (obj != Qnil)
+	{
+		Data_Get_Struct(obj, NodeDict, dict);
+		if (!rb_str_equal(dict->bin, bin))
+			rb_raise(rb_eArgError, "Dictionary: identifier %08X is used by other loaded dictionary", id);
+		return obj;
+	}
+	num_of_sects = (int) BinReader_u32(&r);
+	platform = BinReader_nstr(&r);
+	version = BinReader_nstr(&r);
+	if (platform == Qnil || version == Qnil)
+		rb_raise(rb_eArgError, "Dictionary: RUBY_PLATFORM and RUBY_VERSION are required");
+	check_platform_signatures(platform, version);
+	di.dict = NULL;
+	bin_read_sections(&r, num_of_sects, SECT_LITERALS + 1, &di);
+	bin_read_encodings(&di);
+	// Tables are read by the loader of dumps
+	val_relocs = NODEObjAddresses_new(&relocs);
+	bin_read_syms(&di, relocs);
+	bin_read_lits(&di, relocs);
+	obj = Data_Make_Struct(cNodeDictionary, NodeDict, NodeDict_mark, NodeDict_free, dict);
+	dict->id = id;
+	dict->syms = relocs->syms_adr;
+	dict->syms_len = relocs->syms_len;
+	relocs->syms_adr = NULL;
+	dict->lits = rb_ary_freeze(relocs->lits_ary);
+	dict->keys = Qnil;
+	dict->bin = rb_str_new_frozen(bin);
+	NodeDict_makeKeys(dict);
+	rb_hash_aset(dict_registry, UINT2NUM(id), obj);
+	RB_GC_GUARD(val_relocs);
+	return obj;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Dictionary.new(symbols, literals)
+ *
+ * Creates the dictionary from the array of symbols (Symbols or Strings)
+ * and the array of literals and registers it (see NodeMarshal::Dictionary.load).
+ * Duplicates and symbols without names are skipped.
+ * See also NodeMarshal::Dictionary.build
+ */
+static VALUE m_dict_s_new(VALUE klass, VALUE syms, VALUE lits)
+{
+	VALUE syms_tbl = rb_ary_new(), lits_tbl = rb_ary_new(), keys = rb_hash_new();
+	long i;
+	Check_Type(syms, T_ARRAY);
+	Check_Type(lits, T_ARRAY);
+	for (i = 0; i < RARRAY_LEN(syms); i++)
+	{
+		VALUE sym = RARRAY_AREF(syms, i), key;
+		if (TYPE(sym) == T_SYMBOL)
+		{
+			sym = rb_id2str(SYM2ID(sym));
+			if (!sym)
+				continue;
+		}
+		else if (TYPE(sym) == T_STRING)
+		{	/* The name of the symbol may have other encoding (e.g. US-ASCII) */
+			sym = rb_id2str(rb_intern_str(sym));
+		}
+		else
+		{
+			rb_raise(rb_eArgError, "Dictionary: symbols must be Symbols or Strings");
+		}
+		key = dict_sym_key(sym);
+		if (rb_hash_lookup2(keys, key, Qnil) == Qnil)
+		{
+			rb_hash_aset(keys, key, Qtrue);
+			rb_ary_push(syms_tbl, sym);
+		}
+	}
+	for (i = 0; i < RARRAY_LEN(lits); i++)
+	{
+		VALUE key = dict_lit_key(RARRAY_AREF(lits, i));
+		if (rb_hash_lookup2(keys, key, Qnil) == Qnil)
+		{
+			rb_hash_aset(keys, key, Qtrue);
+			rb_ary_push(lits_tbl, RARRAY_AREF(lits, i));
+		}
+	}
+	return NodeDict_load(NodeDict_serialize(syms_tbl, lits_tbl));
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Dictionary.load(bin)
+ *
+ * Loads the dictionary from the string made by NodeMarshal::Dictionary#to_bin
+ * and registers it: dumps that refer to it can be loaded after that.
+ * If the same dictionary is already loaded then the loaded one is returned
+ * (symbols are interned only once per process)
+ */
+static VALUE m_dict_s_load(VALUE klass, VALUE bin)
+{
+	return NodeDict_load(bin);
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Dictionary.load_file(filename)
+ *
+ * Loads the dictionary from the file (see NodeMarshal::Dictionary.load).
+ * It is used by compiled Ruby files (see NodeMarshal#to_compiled_rb)
+ */
+static VALUE m_dict_s_load_file(VALUE klass, VALUE filename)
+{
+	return NodeDict_load(rb_funcall(rb_cFile, rb_intern("binread"), 1, filename));
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Dictionary[id]
+ *
+ * Returns the loaded dictionary with the given identifier or nil
+ */
+static VALUE m_dict_s_aref(VALUE klass, VALUE id)
+{
+	return rb_hash_lookup(dict_registry, id);
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal::Dictionary.loaded
+ *
+ * Returns the array of the loaded dictionaries
+ */
+static VALUE m_dict_s_loaded(VALUE klass)
+{
+	return rb_funcall(dict_registry, rb_intern("values"), 0);
+}
+
+/*
+ * call-seq:
+ *   obj.id
+ *
+ * Returns the identifier of the dictionary (checksum of its contents)
+ */
+static VALUE m_dict_id(VALUE self)
+{
+	NodeDict *dict;
+	Data_Get_Struct(self, NodeDict, dict);
+	return UINT2NUM(dict->id);
+}
+
+/*
+ * call-seq:
+ *   obj.symbols
+ *
+ * Returns the array of symbols of the dictionary
+ */
+static VALUE m_dict_symbols(VALUE self)
+{
+	NodeDict *dict;
+	VALUE syms;
+	int i;
+	Data_Get_Struct(self, NodeDict, dict);
+	syms = rb_ary_new2(dict->syms_len);
+	for (i = 0; i < dict->syms_len; i++)
+		rb_ary_push(syms, ID2SYM(dict->syms[i]));
+	return syms;
+}
+
+/*
+ * call-seq:
+ *   obj.literals
+ *
+ * Returns the array of literals of the dictionary (strings are copied)
+ */
+static VALUE m_dict_literals(VALUE self)
+{
+	NodeDict *dict;
+	VALUE lits;
+	long i;
+	Data_Get_Struct(self, NodeDict, dict);
+	lits = rb_ary_new2(RARRAY_LEN(dict->lits));
+	for (i = 0; i < RARRAY_LEN(dict->lits); i++)
+	{
+		VALUE val = RARRAY_AREF(dict->lits, i);
+		if (TYPE(val) == T_STRING)
+			val = rb_str_dup(val);
+		rb_ary_push(lits, val);
+	}
+	return lits;
+}
+
+/*
+ * call-seq:
+ *   obj.to_bin
+ *
+ * Returns the binary container of the dictionary (NODEMARSHAL12DC)
+ */
+static VALUE m_dict_to_bin(VALUE self)
+{
+	NodeDict *dict;
+	Data_Get_Struct(self, NodeDict, dict);
+	return rb_str_dup(dict->bin);
+}
+
+/*
+ * Returns the dictionary structure of NodeMarshal::Dictionary object
+ * (is used by NodeMarshal#to_bin)
+ */
+static NodeDict *NodeDict_fromValue(VALUE obj)
+{
+	NodeDict *dict;
+	if (rb_obj_is_kind_of(obj, cNodeDictionary) != Qtrue)
+		rb_raise(rb_eArgError, "shared_dict must be NodeMarshal::Dictionary");
+	Data_Get_Struct(obj, NodeDict, dict);
+	return dict;
+}
+
+static void dict_define_class(VALUE cNodeMarshal)
+{
+	cNodeDictionary = rb_define_class_under(cNodeMarshal, "Dictionary", rb_cObject);
+	rb_undef_alloc_func(cNodeDictionary);
+	rb_define_singleton_method(cNodeDictionary, "new", RUBY_METHOD_FUNC(m_dict_s_new), 2);
+	rb_define_singleton_method(cNodeDictionary, "load", RUBY_METHOD_FUNC(m_dict_s_load), 1);
+	rb_define_singleton_method(cNodeDictionary, "load_file", RUBY_METHOD_FUNC(m_dict_s_load_file), 1);
+	rb_define_singleton_method(cNodeDictionary, "[]", RUBY_METHOD_FUNC(m_dict_s_aref), 1);
+	rb_define_singleton_method(cNodeDictionary, "loaded", RUBY_METHOD_FUNC(m_dict_s_loaded), 0);
+	rb_define_method(cNodeDictionary, "id", RUBY_METHOD_FUNC(m_dict_id), 0);
+	rb_define_method(cNodeDictionary, "symbols", RUBY_METHOD_FUNC(m_dict_symbols), 0);
+	rb_define_method(cNodeDictionary, "literals", RUBY_METHOD_FUNC(m_dict_literals), 0);
+	rb_define_method(cNodeDictionary, "to_bin", RUBY_METHOD_FUNC(m_dict_to_bin), 0);
+	dict_registry = rb_hash_new();
+	rb_gc_register_address(&dict_registry);
+}
+
+/*
+ * Copies information about the source file (nodename, filename, filepath)
+ * to the NodeMarshal object
+ */
+static void set_source_info(VALUE self, const char *name, VALUE val)
+{
+	char ivname[32];
+	if (val != Qnil && TYPE(val) != T_STRING)
+		rb_raise(rb_eArgError, "%s value is corrupted", name);
+	sprintf(ivname, "@%s", name);
+	rb_iv_set(self, ivname, val);
+}
+
+/*
+ * Returns the Hash with sizes of sections of the binary container
+ * (section name => bytes), see NodeMarshal#stats
+ */
+static VALUE bin_sections_stats(BinDumpInfo *di)
+{
+	static const char *names[SECT_MAX] = {"encodings", "symbols", "literals",
+		"global_entries", "id_tables", "args", "nodes", "iseq"};
+	VALUE ans = rb_hash_new();
+	int i;
+	for (i = 0; i < SECT_MAX; i++)
+	{
+		if (di->sect[i].present)
+			rb_hash_aset(ans, ID2SYM(rb_intern(names[i])), LONG2NUM(di->sect[i].len));
+	}
+	return ans;
+}
+
+/*
+ * Loads the node from the binary container (NODEMARSHAL12)
+ * Returns number of nodes. Phases are saved to st
+ */
+static int load_bin_dump(VALUE self, const char *buf, long len, NODEObjAddresses *relocs,
+	int nthreads, NodeStats *st)
+{
+	BinDumpInfo di;
+	bin_read_header(buf, len, &di);
+	if (di.flags & ~BIN_FLAGS_KNOWN)
+		rb_raise(rb_eArgError, "Binary dump: unsupported flags %X", di.flags);
+	/* Check platform identifiers */
+	check_platform_signatures(di.platform, di.version);
+	/* Get the information about the source file that was compiled to the node */
+	set_source_info(self, "nodename", di.nodename);
+	set_source_info(self, "filename", di.filename);
+	set_source_info(self, "filepath", di.filepath);
+	/* Shared dictionary of symbols and literals must be loaded before */
+	if (di.flags & BIN_FLAG_DICT)
+		di.dict = NodeDict_get(di.dict_id);
+	/* Load all required data */
+	if (di.sect[SECT_NODES].count != di.num_of_nodes)
+		rb_raise(rb_eArgError, "Binary dump: invalid number of nodes");
+	rb_iv_set(self, "@stats_sections", bin_sections_stats(&di));
+	NodeStats_phase(st, "header");
+	bin_read_encodings(&di); // Encodings of symbols and literals
+	NodeStats_phase(st, "encodings");
+	bin_read_syms(&di, relocs); // Symbols
+	NodeStats_phase(st, "symbols");
+	bin_read_lits(&di, relocs); // Literals
+	NodeStats_phase(st, "literals");
+	bin_read_gvars(&di, relocs); // Global entries (with symbol ID resolving)
+	NodeStats_phase(st, "global_entries");
+	bin_read_idtbls(&di, relocs); // Identifiers tables (with symbol ID resolving)
+	NodeStats_phase(st, "id_tables");
+	alloc_nodes(di.num_of_nodes, relocs); // Allocate memory for all nodes
+	NodeStats_phase(st, "alloc_nodes");
+#ifdef USE_RB_ARGS_INFO
+	bin_read_args(&di, relocs); // Load args entries with symbols ID and nodes resolving
+	NodeStats_phase(st, "args");
+#endif
+	if (di.flags & BIN_FLAG_COLUMNAR)
+	{
+		NodeColumns nc;
+		NodeColumns_init(&nc, di.sect[SECT_NODES].ptr, di.sect[SECT_NODES].len, di.num_of_nodes);
+		load_nodes_from_columns(&nc, relocs, nthreads);
+	}
+	else
+	{
+		load_nodes_from_buf(di.sect[SECT_NODES].ptr, di.sect[SECT_NODES].len, relocs);
+	}
+	NodeStats_phase(st, "nodes");
+	/* Companion ISeq binary (is used by NodeMarshal#compile) */
+	rb_iv_set(self, "@iseq_bin", Qnil);
+	if ((di.flags & BIN_FLAG_ISEQ) && di.sect[SECT_ISEQ].present)
+	{
+		BinReader r;
+		VALUE path, iseq_bin;
+		BinReader_init(&r, di.sect[SECT_ISEQ].ptr, di.sect[SECT_ISEQ].len);
+		path = BinReader_nstr(&r);
+		iseq_bin = BinReader_nstr(&r);
+		if (path == Qnil || iseq_bin == Qnil)
+			rb_raise(rb_eArgError, "Binary dump: ISeq section is corrupted");
+		rb_iv_set(self, "@iseq_bin", rb_assoc_new(path, iseq_bin));
+	}
+	return di.num_of_nodes;
+}
+
+/*
+ * Loads the node from the Hash serialized by Marshal (NODEMARSHAL11)
+ * Returns number of nodes. Phases are saved to st
+ */
+static int load_hash_dump(VALUE self, VALUE dump, NODEObjAddresses *relocs, NodeStats *st)
+{
+	VALUE cMarshal, data, val;
+	int num_of_nodes;
+	/* Load and unpack our dump */
+	cMarshal = rb_const_get(rb_cObject, rb_intern("Marshal"));
+	data = rb_funcall(cMarshal, rb_intern("load"), 1, dump);
+	if (TYPE(data) != T_HASH)
+	{
+		rb_raise(rb_eArgError, "Input dump is corrupted");
+	}
+	val = rb_hash_aref(data, ID2SYM(rb_intern("num_of_nodes")));
+	if (val == Qnil)
+	{
+		rb_raise(rb_eArgError, "num_of_nodes not found");
+	}
+	else
+	{
+		num_of_nodes = NUM2INT(val);
+	}
+	/* Check "magic" signature and platform identifiers */
+	check_hash_magic(data);
+	/* Get the information about the source file that was compiled to the node */
+	set_source_info(self, "nodename", rb_hash_aref(data, ID2SYM(rb_intern("nodename"))));
+	set_source_info(self, "filename", rb_hash_aref(data, ID2SYM(rb_intern("filename"))));
+	set_source_info(self, "filepath", rb_hash_aref(data, ID2SYM(rb_intern("filepath"))));
+	rb_iv_set(self, "@stats_sections", Qnil);
+	NodeStats_phase(st, "marshal_load");
+	/* Load all required data */
+	resolve_syms_ords(data, relocs); // Symbols
+	NodeStats_phase(st, "symbols");
+	resolve_lits_ords(data, relocs); // Literals
+	NodeStats_phase(st, "literals");
+	resolve_gvars_ords(data, relocs); // Global entries (with symbol ID resolving)
+	NodeStats_phase(st, "global_entries");
+	resolve_idtbls_ords(data, relocs); // Identifiers tables (with symbol ID resolving)
+	NodeStats_phase(st, "id_tables");
+	resolve_nodes_ords(data, num_of_nodes, relocs); // Allocate memory for all nodes
+	NodeStats_phase(st, "alloc_nodes");
+#ifdef USE_RB_ARGS_INFO
+	resolve_args_ords(data, relocs); // Load args entries with symbols ID and nodes resolving
+	NodeStats_phase(st, "args");
+#endif
+	load_nodes_from_str(data, relocs);
+	NodeStats_phase(st, "nodes");
+	return num_of_nodes;
+}
+
+/*
+ * Part 5. C-to-Ruby interface
+ * 
+ */
+
+/*
+ * Restore Ruby node from the binary blob (dump). Two formats are supported:
+ * binary container (NODEMARSHAL12, see NodeMarshal#to_bin) and Hash
+ * serialized by Marshal (NODEMARSHAL11, see NodeMarshal#to_hash).
+ * The dump is either a String or a memory mapped file (NodeMappedFile);
+ * the binary container is decoded directly from its memory.
+ * Garbage collector is not disabled: the partially loaded tree is
+ * marked by the relocations table (see NODEObjAddresses_mark).
+ * If gc_start is 1 then the full garbage collection is forced after
+ * the loading.
+ * nthreads is a number of threads for loading of nodes in the columnar layout.
+ * st is the started measurement of the :load operation (see NodeMarshal#stats)
+ * or NULL (it is started here)
+ */
+static VALUE m_nodedump_from_memory(VALUE self, VALUE dump, int gc_start, int nthreads, NodeStats *st)
+{
+	const char *buf;
+	long len;
+	if (rb_obj_is_kind_of(dump, cNodeMappedFile) == Qtrue)
+	{
+		buf = mappedfile_get_data(dump, &len);
+	}
+	else if (TYPE(dump) == T_STRING)
+	{	/* The frozen copy shares the memory: it is not changed by other
+		   threads when the GVL is released */
+		dump = rb_str_new_frozen(dump);
+		buf = RSTRING_PTR(dump);
+		len = RSTRING_LEN(dump);
+	}
+	else
+	{	/* Other objects (e.g. IO) are passed to Marshal */
+		buf = NULL; len = 0;
+	}
+	return nodedump_from_buffer(self, dump, buf, len, gc_start, nthreads, st);
+}
+
+/*
+ * Removes the cached table of symbols (see NodeMarshal#symbols): it must
+ * be called when the tree or the table of symbols is changed
+ */
+static void nodedump_reset_symbols_cache(VALUE self)
+{
+	rb_iv_set(self, "@symbols_cache", Qnil);
+}
+
+/*
+ * Arguments of the loader (see nodedump_from_buffer)
+ */
+typedef struct {
+	VALUE self, dump;
+	const char *buf;
+	long len;
+	int nthreads;
+	int num_of_nodes; // Result: number of loaded nodes
+	NODEObjAddresses *relocs;
+	NodeStats *st;
+} NodeLoader;
+
+static VALUE NodeLoader_run(VALUE arg)
+{
+	NodeLoader *ld = (NodeLoader *) arg;
+	VALUE dump = ld->dump;
+	const char *buf = ld->buf;
+	long len = ld->len;
+	if (buf != NULL && codec_is_frame(buf, len))
+	{	/* Compressed frame (see NodeMarshal::Codec) */
+		dump = codec_decompress(buf, len);
+		ld->relocs->source = dump;
+		buf = RSTRING_PTR(dump);
+		len = RSTRING_LEN(dump);
+		NodeStats_phase(ld->st, "decompress");
+	}
+	if (buf != NULL)
+		lazy_read_container(dump, &buf, &len); // Lazy container: load the skeleton
+	if (buf != NULL && is_bin_dump(buf, len))
+	{
+		ld->num_of_nodes = load_bin_dump(ld->self, buf, len, ld->relocs, ld->nthreads, ld->st);
+	}
+	else
+	{	/* Marshal requires a String, so old-style mapped dumps are copied */
+		if (buf != NULL && TYPE(dump) != T_STRING)
+			dump = rb_str_new(buf, len);
+		ld->num_of_nodes = load_hash_dump(ld->self, dump, ld->relocs, ld->st);
+		ld->relocs->source = Qnil;
+	}
+	NODEObjAddresses_checkOwners(ld->relocs);
+	ld->relocs->nodes_loaded = 1;
+	return Qnil;
+}
+
+/*
+ * Restore Ruby node from the part of the memory (buf, len) owned by
+ * the dump object (String or NodeMappedFile). See m_nodedump_from_memory
+ */
+static VALUE nodedump_from_buffer(VALUE self, VALUE dump, const char *buf, long len,
+	int gc_start, int nthreads, NodeStats *st)
+{
+	VALUE val_relocs;
+	NODEObjAddresses *relocs;
+	NodeLoader ld;
+	NodeStats st_local;
+	if (st == NULL)
+	{
+		st = &st_local;
+		NodeStats_init(st);
+	}
+	/* Wrap struct for relocations (it marks the tree during the loading) */
+	val_relocs = NODEObjAddresses_new(&relocs); // This data envelope cannot exist without NODE
+	relocs->source = dump;
+	/* Load our dump (the incomplete tree is released after an exception) */
+	ld.self = self;
+	ld.dump = dump;
+	ld.buf = buf;
+	ld.len = len;
+	ld.nthreads = nthreads;
+	ld.num_of_nodes = 0;
+	ld.relocs = relocs;
+	ld.st = st;
+	rb_ensure(NodeLoader_run, (VALUE) &ld, NODEObjAddresses_release, (VALUE) relocs);
+	/* Save the loaded node tree (and collect garbage if it is required) */
+	rb_iv_set(self, "@node", (VALUE) relocs->nodes_adr[0]);
+	rb_iv_set(self, "@num_of_nodes", INT2FIX(ld.num_of_nodes));
+	rb_iv_set(self, "@obj_addresses", val_relocs);
+	nodedump_reset_symbols_cache(self);
+	if (gc_start)
+	{
+		rb_gc_start();
+		NodeStats_phase(st, "gc");
+	}
+	NodeStats_save(st, self, "load");
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *   obj.symbols
+ *
+ * Return array with the list of symbols. The array is frozen and is
+ * kept until the tree or the table of symbols is changed (loading,
+ * NodeMarshal#to_hash, NodeMarshal#change_symbol(s), deduplication)
+ */
+static VALUE m_nodedump_symbols(VALUE self)
+{
+	int i;
+	VALUE val_relocs, val_nodeinfo, syms;
+	syms = rb_iv_get(self, "@symbols_cache");
+	if (syms != Qnil)
+		return syms;
+	// Variant 1: node loaded from file
+	val_relocs = rb_iv_get(self, "@obj_addresses");
+	if (val_relocs != Qnil)
+	{
+		NODEObjAddresses *relocs;
+		TypedData_Get_Struct(val_relocs, NODEObjAddresses, &NODEObjAddresses_type, relocs);
+		syms = rb_ary_new2(relocs->syms_len);
+		for (i = 0; i < relocs->syms_len; i++)
+			rb_ary_push(syms, ID2SYM(relocs->syms_adr[i]));
+		rb_iv_set(self, "@symbols_cache", rb_obj_freeze(syms));
+		return syms;
+	}
+	// Variant 2: node saved to file (parsed from memory)
+	val_nodeinfo = rb_iv_get(self, "@nodeinfo");
+	if (val_nodeinfo != Qnil)
+	{
+		NODEInfo *ninfo;
+		TypedData_Get_Struct(val_nodeinfo, NODEInfo, &NODEInfo_type, ninfo);
+		syms = rb_ary_new2(ninfo->syms.pos);
+		for (i = 0; i < ninfo->syms.pos; i++)
+			rb_ary_push(syms, ID2SYM((ID) ninfo->syms.keys[i]));
+		rb_iv_set(self, "@symbols_cache", rb_obj_freeze(syms));
+		return syms;
+	}
+	rb_raise(rb_eArgError, "Symbol information not initialized. Run to_hash before reading.");
+}
+
+/*
+ * Returns the table of symbols from the preparsed Hash (@nodehash)
+ */
+static VALUE nodedump_hash_symbols(VALUE self)
+{
+	VALUE val_nodehash = rb_iv_get(self, "@nodehash"), syms;
+	// Check if node is position-independent
+	// (i.e. with initialized NODEInfo structure that contains
+	// relocations for symbols)
+	if (val_nodehash == Qnil)
+		rb_raise(rb_eArgError, "This node is not preparsed into Hash");
+	// Get the symbol table from the Hash
+	syms = rb_hash_aref(val_nodehash, ID2SYM(rb_intern("symbols")));
+	if (syms == Qnil)
+		rb_raise(rb_eArgError, "Preparsed hash has no :symbols field");
+	Check_Type(syms, T_ARRAY);
+	return syms;
+}
+
+/*
+ * Returns the index of the table of symbols: Hash with symbol names
+ * (Strings) as keys and their ordinals as values. The index is kept
+ * in @symbols_index and is made again if the table was replaced or
+ * resized. Found entries are verified (see nodedump_symbol_ord); names
+ * added to the table directly (not by NodeMarshal#change_symbol(s))
+ * are found only after replacement of the table
+ */
+static VALUE nodedump_symbols_index(VALUE self, VALUE syms, int force)
+{
+	VALUE index = rb_iv_get(self, "@symbols_index");
+	long i;
+	if (!force && index != Qnil && rb_iv_get(self, "@symbols_index_table") == syms &&
+		FIX2LONG(rb_iv_get(self, "@symbols_index_len")) == RARRAY_LEN(syms))
+		return index;
+	index = rb_hash_new();
+	for (i = 0; i < RARRAY_LEN(syms); i++)
+	{	// The first entry is used (the same as Array#find_index)
+		VALUE name = RARRAY_AREF(syms, i);
+		if (TYPE(name) == T_STRING && rb_hash_lookup2(index, name, Qundef) == Qundef)
+			rb_hash_aset(index, name, LONG2FIX(i));
+	}
+	rb_iv_set(self, "@symbols_index", index);
+	rb_iv_set(self, "@symbols_index_table", syms);
+	rb_iv_set(self, "@symbols_index_len", LONG2FIX(RARRAY_LEN(syms)));
+	return index;
+}
+
+/*
+ * Returns the ordinal of the symbol (or -1 if it is absent)
+ * by the index of the table of symbols
+ */
+static long nodedump_symbol_ord(VALUE self, VALUE syms, VALUE *index, VALUE name)
+{
+	VALUE ord = rb_hash_lookup(*index, name);
+	if (ord != Qnil && rb_str_equal(RARRAY_AREF(syms, FIX2LONG(ord)), name) != Qtrue)
+	{	// The table was changed directly: make the index again
+		*index = nodedump_symbols_index(self, syms, 1);
+		ord = rb_hash_lookup(*index, name);
+	}
+	return (ord == Qnil) ? -1 : FIX2LONG(ord);
+}
+
+/*
+ * call-seq:
+ *   obj.change_symbol(old_sym, new_sym)
+ *
+ * Replace one symbol by another (to be used for code obfuscation)
+ * - +old_sym+ -- String that contains symbol name to be replaced 
+ * - +new_sym+ -- String that contains new name of the symbol
+ *
+ * Symbols are found by the index of the table (see NodeMarshal#change_symbols)
+ */
+static VALUE m_nodedump_change_symbol(VALUE self, VALUE old_sym, VALUE new_sym)
+{
+	VALUE syms, index;
+	long ord;
+	// Check data types of the input array
+	syms = nodedump_hash_symbols(self);
+	if (TYPE(old_sym) != T_STRING)
+	{
+		rb_raise(rb_eArgError, "old_sym argument must be a string");
+	}
+	if (TYPE(new_sym) != T_STRING)
+	{
+		rb_raise(rb_eArgError, "new_sym argument must be a string");
+	}
+	index = nodedump_symbols_index(self, syms, 0);
+	// Check if new_sym is present in the symbol table
+	if (nodedump_symbol_ord(self, syms, &index, new_sym) != -1)
+	{
+		rb_raise(rb_eArgError, "new_sym value must be absent in table of symbols");
+	}
+	// Change the symbol in the preparsed Hash
+	ord = nodedump_symbol_ord(self, syms, &index, old_sym);
+	if (ord == -1)
+		return Qnil;
+	rb_ary_store(syms, ord, new_sym);
+	rb_hash_delete(index, old_sym);
+	rb_hash_aset(index, new_sym, LONG2FIX(ord));
+	nodedump_reset_symbols_cache(self);
+	return self;
+}
+
+/*
+ * call-seq:
+ *   obj.change_symbols(syms_subs)
+ *
+ * Replaces many symbols at once (to be used for code obfuscation).
+ * - +syms_subs+ -- Hash with the table of aliases: keys are the original
+ *   names, values are new names (Strings)
+ *
+ * New names must be unique and absent in the table of symbols (except
+ * the names that are renamed too, e.g. two symbols may be swapped).
+ * Absent original names are ignored. Returns the number of changed symbols.
+ * Unlike the sequence of NodeMarshal#change_symbol calls it takes
+ * O(n) time. The next NodeMarshal#to_bin call encodes only symbols
+ * and literals again (other sections are reused).
+ */
+static VALUE m_nodedump_change_symbols(VALUE self, VALUE subs)
+{
+	VALUE syms, index, pairs, values, ords;
+	long i, num_of_changes = 0;
+	syms = nodedump_hash_symbols(self);
+	Check_Type(subs, T_HASH);
+	pairs = rb_funcall(subs, rb_intern("to_a"), 0);
+	values = rb_hash_new();
+	index = nodedump_symbols_index(self, syms, 0);
+	ords = rb_ary_new2(RARRAY_LEN(pairs)); // Ordinals of the original names
+	for (i = 0; i < RARRAY_LEN(pairs); i++)
+	{
+		VALUE old_sym = RARRAY_AREF(RARRAY_AREF(pairs, i), 0);
+		VALUE new_sym = RARRAY_AREF(RARRAY_AREF(pairs, i), 1);
+		long new_ord;
+		if (TYPE(old_sym) != T_STRING || TYPE(new_sym) != T_STRING)
+			rb_raise(rb_eArgError, "Names of symbols must be strings");
+		if (rb_hash_lookup2(values, new_sym, Qundef) != Qundef)
+			rb_raise(rb_eArgError, "New names of symbols must be unique");
+		rb_hash_aset(values, new_sym, Qtrue);
+		rb_ary_push(ords, LONG2FIX(nodedump_symbol_ord(self, syms, &index, old_sym)));
+		new_ord = nodedump_symbol_ord(self, syms, &index, new_sym);
+		if (new_ord != -1 && rb_hash_lookup2(subs, RARRAY_AREF(syms, new_ord), Qundef) == Qundef)
+			rb_raise(rb_eArgError, "New name %s is present in table of symbols", StringValueCStr(new_sym));
+	}
+	// Replace names in the table and in the index
+	for (i = 0; i < RARRAY_LEN(pairs); i++)
+	{
+		if (FIX2LONG(RARRAY_AREF(ords, i)) != -1)
+			rb_hash_delete(index, RARRAY_AREF(RARRAY_AREF(pairs, i), 0));
+	}
+	for (i = 0; i < RARRAY_LEN(pairs); i++)
+	{
+		long ord = FIX2LONG(RARRAY_AREF(ords, i));
+		if (ord != -1)
+		{
+			VALUE new_sym = RARRAY_AREF(RARRAY_AREF(pairs, i), 1);
+			rb_ary_store(syms, ord, new_sym);
+			rb_hash_aset(index, new_sym, LONG2FIX(ord));
+			num_of_changes++;
+		}
+	}
+	nodedump_reset_symbols_cache(self);
+	return LONG2FIX(num_of_changes);
+}
+
+/*
+ * Return array with the list of literals
+ */
+static VALUE m_nodedump_literals(VALUE self)
+{
+	int i;
+	VALUE val_relocs, val_nodeinfo, lits;
+	// Variant 1: node loaded from file. It uses NODEObjAddresses struct
+	// with the results of Ruby NODE structure parsing.
+	val_relocs = rb_iv_get(self, "@obj_addresses");
+	if (val_relocs != Qnil)
+	{
+		NODEObjAddresses *relocs;
+
+		TypedData_Get_Struct(val_relocs, NODEObjAddresses, &NODEObjAddresses_type, relocs);
+		lits = rb_ary_new();
+		for (i = 0; i < relocs->lits_len; i++)
+		{
+			VALUE val = relocs->lits_adr[i];
+			int t = TYPE(val);
+			if (t != T_SYMBOL && t != T_FLOAT && t != T_FIXNUM)
+				val = rb_funcall(val, rb_intern("dup"), 0);
+			rb_ary_push(lits, val);
+		}
+		return lits;
+	}
+	// Variant 2: node saved to file (parsed from memory). It uses
+	// NODEInfo struct that is initialized during node dump parsing.
+	val_nodeinfo = rb_iv_get(self, "@nodeinfo");
+	if (val_nodeinfo != Qnil)
+	{
+		NODEInfo *ninfo;
+		VALUE *ary;
+		TypedData_Get_Struct(val_nodeinfo, NODEInfo, &NODEInfo_type, ninfo);
+		lits = LeafTableInfo_getLeavesTable(&ninfo->lits);
+		ary = RARRAY_PTR(lits);
+		for (i = 0; i < RARRAY_LEN(lits); i++)
+		{
+			int t = TYPE(ary[i]);
+			if (t != T_SYMBOL && t != T_FLOAT && t != T_FIXNUM)
+				ary[i] = rb_funcall(ary[i], rb_intern("dup"), 0);
+		}
+		return lits;
+	}
+	rb_raise(rb_eArgError, "Literals information not initialized. Run to_hash before reading.");
+}
+
+/*
+ * Returns the table of literals from the preparsed Hash (@nodehash);
+ * the Hash is created if it is not present
+ */
+static VALUE nodedump_hash_literals(VALUE self)
+{
+	VALUE lits = rb_hash_aref(m_nodedump_to_hash(self), ID2SYM(rb_intern("literals")));
+	if (lits == Qnil)
+		rb_raise(rb_eArgError, "Preparsed hash has no :literals field");
+	Check_Type(lits, T_ARRAY);
+	return lits;
+}
+
+/*
+ * call-seq:
+ *   obj.change_literals(lits_subs)
+ *   obj.change_literals {|lit, ord| new_lit }
+ *
+ * Replaces literals of the node (e.g. for encryption of strings).
+ * Each entry of the table of literals is replaced by the value of
+ * +lits_subs+ Hash (entries are compared by <tt>eql?</tt>) or by the
+ * result of the block (the entry and its ordinal are passed). New
+ * literals must be of the same class as the original ones. Returns
+ * the number of changed entries.
+ *
+ * The table is kept in the preparsed Hash (see NodeMarshal#to_hash),
+ * so the changes are saved by NodeMarshal#to_bin and NodeMarshal#to_hash
+ * (but not by the lazy container, see <tt>to_bin(:lazy => true)</tt>)
+ */
+static VALUE m_nodedump_change_literals(int argc, VALUE *argv, VALUE self)
+{
+	VALUE subs, lits;
+	long i, num_of_changes = 0;
+	rb_scan_args(argc, argv, "01", &subs);
+	if (subs == Qnil && !rb_block_given_p())
+		rb_raise(rb_eArgError, "Hash or block is required");
+	if (subs != Qnil)
+		Check_Type(subs, T_HASH);
+	lits = nodedump_hash_literals(self);
+	for (i = 0; i < RARRAY_LEN(lits); i++)
+	{
+		VALUE old_lit = RARRAY_AREF(lits, i), new_lit;
+		if (subs != Qnil)
+			new_lit = rb_hash_lookup2(subs, old_lit, Qundef);
+		else
+			new_lit = rb_yield_values(2, old_lit, LONG2FIX(i));
+		if (new_lit == Qundef || new_lit == old_lit)
+			continue;
+		if (rb_obj_class(new_lit) != rb_obj_class(old_lit))
+			rb_raise(rb_eArgError, "Literal of class %s cannot be replaced by %s",
+				rb_obj_classname(old_lit), rb_obj_classname(new_lit));
+		rb_ary_store(lits, i, new_lit);
+		num_of_changes++;
+	}
+	return LONG2FIX(num_of_changes);
+}
+
+/*
+ * call-seq:
+ *   obj.change_literal(old_lit, new_lit)
+ *
+ * Replaces all entries of the table of literals that are equal
+ * (<tt>eql?</tt>) to +old_lit+ by +new_lit+ (see NodeMarshal#change_literals).
+ * Returns +nil+ if +old_lit+ is absent
+ */
+static VALUE m_nodedump_change_literal(VALUE self, VALUE old_lit, VALUE new_lit)
+{
+	VALUE subs = rb_hash_new();
+	rb_hash_aset(subs, old_lit, new_lit);
+	return (m_nodedump_change_literals(1, &subs, self) == INT2FIX(0)) ? Qnil : self;
+}
+
+/*
+ * Appends one node record to the nodes binary dump (the reverse
+ * of read_node_record)
+ */
+static void write_node_record(VALUE buf, const int *rtypes, VALUE flags, const VALUE *u)
+{
+	unsigned char rec[4 + sizeof(VALUE) * 4], *ptr = rec + 4;
+	int j;
+	rec[3] = (unsigned char) value_to_bin(flags, ptr);
+	ptr += rec[3];
+	for (j = 0; j < 3; j++)
+	{
+		int len = value_to_bin(u[j], ptr);
+		rec[j] = (unsigned char) (rtypes[j] | (len << 4));
+		ptr += len;
+	}
+	rb_str_buf_cat(buf, (const char *) rec, ptr - rec);
+}
+
+/*
+ * Rewrites ordinals of literals (VL_LIT values) in the nodes binary dump
+ * (see load_nodes_from_buf) by the map (Array of new ordinals)
+ */
+static VALUE nodes_remap_literals(VALUE nodes_bin, VALUE map)
+{
+	const unsigned char *bin = (const unsigned char *) RSTRING_PTR(nodes_bin);
+	const unsigned char *end = bin + RSTRING_LEN(nodes_bin) - 1; // Dump has 1 extra byte
+	VALUE ans = rb_str_buf_new(RSTRING_LEN(nodes_bin));
+	while (bin < end)
+	{
+		int rtypes[4], j;
+		VALUE flags, u[3];
+		if (!node_record_fits(bin, end))
+			rb_raise(rb_eArgError, "Nodes binary dump is corrupted");
+		bin = read_node_record(bin, rtypes, &flags, u);
+		for (j = 0; j < 3; j++)
+		{
+			if (rtypes[j] == VL_LIT)
+			{
+				if ((long) u[j] >= RARRAY_LEN(map))
+					rb_raise(rb_eArgError, "Nodes binary dump: invalid literal ordinal");
+				u[j] = (VALUE) FIX2LONG(RARRAY_AREF(map, u[j]));
+			}
+		}
+		write_node_record(ans, rtypes, flags, u);
+	}
+	rb_str_buf_cat(ans, "", 1);
+	return ans;
+}
+
+/*
+ * Returns the key for comparison of literals by dedup_literals
+ * (nil if the literal cannot be merged with others)
+ */
+static VALUE dedup_literal_key(VALUE lit)
+{
+	if (TYPE(lit) == T_STRING)
+		return rb_ary_new3(3, lit, INT2FIX(ENCODING_GET(lit)), OBJ_FROZEN(lit) ? Qtrue : Qfalse);
+	else if (TYPE(lit) == T_REGEXP)
+		return rb_ary_new3(2, rb_cRegexp, lit);
+	else if (rb_obj_class(lit) == rb_cRange)
+		return rb_ary_new3(2, rb_cRange, lit);
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   obj.dedup_literals
+ *
+ * Merges equal String, Range and Regexp literals: nodes refer to one
+ * entry of the table of literals instead of the copies. It makes the dump
+ * smaller and reduces the number of objects kept by the loaded node.
+ * Strings are merged if they have the same content, encoding and the
+ * frozen state (string literals are copied at runtime, frozen ones are
+ * immutable); merged Range and Regexp literals become the same object
+ * (it is visible only by <tt>equal?</tt> and +object_id+).
+ *
+ * The preparsed Hash (see NodeMarshal#to_hash) is changed: the
+ * table of literals and the nodes binary dump. Changes are saved by
+ * NodeMarshal#to_bin (except the lazy container). Returns the number
+ * of removed entries.
+ */
+static VALUE m_nodedump_dedup_literals(VALUE self)
+{
+	VALUE hash, lits, new_lits, keys, map, nodes_bin;
+	long i;
+	lits = nodedump_hash_literals(self);
+	hash = rb_iv_get(self, "@nodehash");
+	nodes_bin = rb_hash_aref(hash, ID2SYM(rb_intern("nodes")));
+	Check_Type(nodes_bin, T_STRING);
+	nodedump_reset_symbols_cache(self);
+	keys = rb_hash_new();
+	map = rb_ary_new2(RARRAY_LEN(lits));
+	new_lits = rb_ary_new();
+	for (i = 0; i < RARRAY_LEN(lits); i++)
+	{
+		VALUE lit = RARRAY_AREF(lits, i), key = dedup_literal_key(lit), ord;
+		ord = (key == Qnil) ? Qnil : rb_hash_lookup(keys, key);
+		if (ord == Qnil)
+		{
+			ord = LONG2FIX(RARRAY_LEN(new_lits));
+			rb_ary_push(new_lits, lit);
+			if (key != Qnil)
+				rb_hash_aset(keys, key, ord);
+		}
+		rb_ary_push(map, ord);
+	}
+	if (RARRAY_LEN(new_lits) == RARRAY_LEN(lits))
+		return INT2FIX(0);
+	rb_hash_aset(hash, ID2SYM(rb_intern("nodes")), nodes_remap_literals(nodes_bin, map));
+	rb_ary_replace(lits, new_lits);
+	return LONG2FIX(RARRAY_LEN(map) - RARRAY_LEN(new_lits));
+}
+
+
+/*
+ * Returns 1 if nodes of the type can be shared by several parents
+ * after NodeMarshal#dedup_nodes: literals and arrays of literals are
+ * not changed by the compiler and cannot raise exceptions
+ */
+static int dedup_node_type_ok(int type)
+{
+	switch (type)
+	{
+	case NODE_LIT: case NODE_STR: case NODE_ARRAY: case NODE_ZARRAY:
+	case NODE_NIL: case NODE_TRUE: case NODE_FALSE:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+typedef struct {
+	int rtypes[4];
+	VALUE flags;
+	VALUE u[3];
+} NodeRecord;
+
+#define DEDUP_SELF_REF 0x10 // Fingerprint: the child refers to the node itself
+
+/*
+ * Fills ordinals of canonical nodes (canon) for the records of the nodes
+ * binary dump. Fingerprints are made bottom-up (children of the node have
+ * greater ordinals): type and flags of the node, locations and values of
+ * children where child nodes are replaced by ordinals of their canonical
+ * nodes. Line numbers and GC flags are not compared; nodes with
+ * NODE_FL_NEWLINE (statements) are never merged. References to the node
+ * itself and to the last element from the NODE_ARRAY chain (see dump_nodes)
+ * are shared together with the whole chain
+ */
+static void dedup_nodes_fingerprints(NodeRecord *recs, int num_of_nodes, int *canon)
+{
+	VALUE keys = rb_hash_new();
+	char *shared = ALLOC_N(char, num_of_nodes + 1);
+	int i, j;
+	for (i = num_of_nodes - 1; i >= 0; i--)
+	{
+		NodeRecord *r = &recs[i];
+		VALUE full_flags = r->flags << 5, key[7];
+		canon[i] = i;
+		shared[i] = dedup_node_type_ok((int) ((full_flags & NODE_TYPEMASK) >> NODE_TYPESHIFT)) &&
+			!(full_flags & NODE_FL_NEWLINE);
+		key[0] = full_flags & ~((VALUE) -1 << NODE_LSHIFT) & ~((VALUE) 0x7F);
+		for (j = 0; j < 3; j++)
+		{
+			key[1 + 2 * j] = (VALUE) r->rtypes[j];
+			key[2 + 2 * j] = r->u[j];
+			if (r->rtypes[j] == VL_NODE)
+			{
+				if (r->u[j] >= (VALUE) num_of_nodes)
+				{
+					xfree(shared);
+					rb_raise(rb_eArgError, "Nodes binary dump: invalid node ordinal");
+				}
+				if (r->u[j] == (VALUE) i)
+					key[1 + 2 * j] = VL_NODE | DEDUP_SELF_REF;
+				else if (r->u[j] > (VALUE) i && shared[r->u[j]])
+					key[2 + 2 * j] = (VALUE) canon[r->u[j]];
+				else
+					shared[i] = 0;
+			}
+			else if (r->rtypes[j] != VL_RAW && r->rtypes[j] != VL_LIT)
+			{
+				shared[i] = 0;
+			}
+		}
+		if (shared[i])
+		{
+			VALUE key_str = rb_str_new((const char *) key, sizeof(key));
+			VALUE ord = rb_hash_lookup(keys, key_str);
+			if (ord == Qnil)
+				rb_hash_aset(keys, key_str, INT2FIX(i));
+			else
+				canon[i] = FIX2INT(ord);
+		}
+	}
+	xfree(shared);
+	RB_GC_GUARD(keys);
+}
+
+/*
+ * call-seq:
+ *   obj.dedup_nodes
+ *
+ * Merges identical literal-only subtrees (NODE_LIT, NODE_STR, NODE_NIL,
+ * NODE_TRUE, NODE_FALSE, NODE_ZARRAY and NODE_ARRAY chains of them): the
+ * subtree is saved once and all parents refer to its ordinal, so the loaded
+ * tree has less nodes. Literals are compared by ordinals in the table of
+ * literals, so NodeMarshal#dedup_literals should be called before (e.g.
+ * <tt>to_bin(:dedup_literals => true, :dedup_nodes => true)</tt>). Line
+ * numbers of merged nodes are taken from one of them; statements
+ * (nodes that start a new line) are not merged.
+ *
+ * The preparsed Hash (see NodeMarshal#to_hash) is changed: the nodes
+ * binary dump, the number of nodes and the table of arguments. Changes are
+ * saved by NodeMarshal#to_bin (except the lazy container). Returns the
+ * number of removed nodes; the ratio is reported by NodeMarshal#stats
+ */
+static VALUE m_nodedump_dedup_nodes(VALUE self)
+{
+	VALUE hash, nodes_bin, args, ans, tmp;
+	NodeRecord *recs;
+	int *canon, *newid, num_of_nodes, num_of_unique, i, j;
+	const unsigned char *bin, *end;
+	long k;
+	hash = m_nodedump_to_hash(self);
+	nodedump_reset_symbols_cache(self);
+	nodes_bin = rb_hash_aref(hash, ID2SYM(rb_intern("nodes")));
+	args = rb_hash_aref(hash, ID2SYM(rb_intern("args")));
+	Check_Type(nodes_bin, T_STRING);
+	Check_Type(args, T_ARRAY);
+	num_of_nodes = NUM2INT(rb_hash_aref(hash, ID2SYM(rb_intern("num_of_nodes"))));
+	if (num_of_nodes <= 0)
+		return INT2FIX(0);
+	recs = (NodeRecord *) ALLOCV(tmp, num_of_nodes * (sizeof(NodeRecord) + 2 * sizeof(int)));
+	canon = (int *) (recs + num_of_nodes);
+	newid = canon + num_of_nodes;
+	bin = (const unsigned char *) RSTRING_PTR(nodes_bin);
+	end = bin + RSTRING_LEN(nodes_bin) - 1; // Dump has 1 extra byte
+	for (i = 0; i < num_of_nodes; i++)
+	{
+		if (!node_record_fits(bin, end))
+			rb_raise(rb_eArgError, "Nodes binary dump is corrupted");
+		bin = read_node_record(bin, recs[i].rtypes, &recs[i].flags, recs[i].u);
+	}
+	dedup_nodes_fingerprints(recs, num_of_nodes, canon);
+	// The first node of each group is saved (the root keeps the ordinal 0)
+	for (i = 0; i < num_of_nodes; i++)
+		newid[i] = -1;
+	for (i = 0; i < num_of_nodes; i++)
+	{
+		if (newid[canon[i]] == -1)
+			newid[canon[i]] = i;
+		canon[i] = newid[canon[i]];
+	}
+	for (i = 0, num_of_unique = 0; i < num_of_nodes; i++)
+		newid[i] = (canon[i] == i) ? num_of_unique++ : -1;
+	rb_iv_set(self, "@stats_dedup", rb_ary_new3(2, INT2FIX(num_of_nodes), INT2FIX(num_of_unique)));
+	if (num_of_unique == num_of_nodes)
+	{
+		ALLOCV_END(tmp);
+		return INT2FIX(0);
+	}
+	// Records of canonical nodes refer to canonical children
+	ans = rb_str_buf_new(RSTRING_LEN(nodes_bin));
+	for (i = 0; i < num_of_nodes; i++)
+	{
+		NodeRecord *r = &recs[i];
+		if (canon[i] != i)
+			continue;
+		for (j = 0; j < 3; j++)
+		{
+			if (r->rtypes[j] == VL_NODE)
+				r->u[j] = (VALUE) newid[canon[r->u[j]]];
+		}
+		write_node_record(ans, r->rtypes, r->flags, r->u);
+	}
+	rb_str_buf_cat(ans, "", 1);
+	// Nodes of arguments info structures (see NODEInfo_getArgsEntry)
+	for (k = 0; k < RARRAY_LEN(args); k++)
+	{
+		static const int node_fields[] = {0, 1, 7, 8, 9};
+		VALUE args_entry = RARRAY_AREF(args, k);
+		Check_Type(args_entry, T_ARRAY);
+		for (j = 0; j < 5; j++)
+		{
+			int ord = NUM2INT(rb_ary_entry(args_entry, node_fields[j]));
+			if (ord >= num_of_nodes)
+				rb_raise(rb_eArgError, "Invalid node ordinal in the arguments table");
+			if (ord >= 0)
+				rb_ary_store(args_entry, node_fields[j], INT2FIX(newid[canon[ord]]));
+		}
+	}
+	ALLOCV_END(tmp);
+	rb_hash_aset(hash, ID2SYM(rb_intern("nodes")), ans);
+	rb_hash_aset(hash, ID2SYM(rb_intern("num_of_nodes")), INT2FIX(num_of_unique));
+	return INT2FIX(num_of_nodes - num_of_unique);
+}
+
+/*
+ * Creates the RubyVM::InstructionSequence object from the node
+ */
+static VALUE nodedump_compile_node(VALUE self)
+{
+	NODE *node = RNODE(rb_iv_get(self, "@node"));
+	VALUE nodename = rb_iv_get(self, "@nodename");
+	VALUE filename = rb_iv_get(self, "@filename");
+	VALUE filepath = rb_iv_get(self, "@filepath");
+#ifndef WITH_RB_ISEQW_NEW
+	/* For Pre-2.3 */
+	return rb_iseq_new_top(node, nodename, filename, filepath, Qfalse);
+#else
+	/* For Ruby 2.3 */
+	return rb_iseqw_new(rb_iseq_new_top(node, nodename, filename, filepath, Qfalse));
+#endif
+}
+
+static VALUE iseq_load_from_binary(VALUE iseq_bin)
+{
+	VALUE cISeq = rb_path2class("RubyVM::InstructionSequence");
+	return rb_funcall(cISeq, rb_intern("load_from_binary"), 1, iseq_bin);
+}
+
+static VALUE iseq_load_failed(VALUE arg, VALUE exc)
+{
+	return Qnil;
+}
+
+/*
+ * Loads the companion ISeq binary saved by to_bin(:iseq => ...).
+ * Returns nil if there is no ISeq binary, if it was compiled for another
+ * file path or if it cannot be loaded by the current interpreter
+ * (e.g. another revision of Ruby or no RubyVM::InstructionSequence.load_from_binary)
+ */
+static VALUE nodedump_load_iseq(VALUE self)
+{
+	VALUE iseq_info = rb_iv_get(self, "@iseq_bin"), cISeq;
+	if (iseq_info == Qnil)
+		return Qnil;
+	if (!rb_equal(RARRAY_AREF(iseq_info, 0), rb_iv_get(self, "@filepath")))
+		return Qnil;
+	cISeq = rb_path2class("RubyVM::InstructionSequence");
+	if (!rb_respond_to(cISeq, rb_intern("load_from_binary")))
+		return Qnil;
+	return rb_rescue2(iseq_load_from_binary, RARRAY_AREF(iseq_info, 1),
+		iseq_load_failed, Qnil, rb_eStandardError, (VALUE) 0);
+}
+
+/*
+ * call-seq:
+ *   obj.compile
+ *
+ * Creates the RubyVM::InstructionSequence object from the node. If the dump
+ * contains the companion ISeq binary (see NodeMarshal#to_bin) that
+ * matches the interpreter and the file path then it is loaded instead
+ * of the code generation.
+ */
+static VALUE m_nodedump_compile(VALUE self)
+{
+	VALUE iseq = nodedump_load_iseq(self);
+	rb_iv_set(self, "@iseq_used", (iseq != Qnil) ? Qtrue : Qfalse);
+	return (iseq != Qnil) ? iseq : nodedump_compile_node(self);
+}
+
+/*
+ * Adds the companion ISeq binary (SECT_ISEQ) to the binary container.
+ * The ISeq is compiled for the given file path (nil means the current
+ * filepath of the node). The code generator may change some nodes, so
+ * the ISeq is made from the copy of the tree loaded from the container
+ */
+static VALUE nodedump_add_iseq(VALUE self, VALUE bin, VALUE path)
+{
+	VALUE tmp, iseq_bin, sect;
+	unsigned char *ptr;
+	if (!rb_method_boundp(rb_path2class("RubyVM::InstructionSequence"), rb_intern("to_binary"), 0))
+		rb_raise(rb_eArgError, "RubyVM::InstructionSequence#to_binary is not supported by this Ruby version");
+	if (path == Qnil)
+		path = rb_iv_get(self, "@filepath");
+	if (path != Qnil)
+		StringValue(path);
+	tmp = rb_obj_alloc(rb_obj_class(self));
+	rb_iv_set(tmp, "@show_offsets", Qfalse);
+	m_nodedump_from_memory(tmp, bin, 0, 1, NULL);
+	rb_iv_set(tmp, "@filename", path);
+	rb_iv_set(tmp, "@filepath", path);
+	iseq_bin = rb_funcall(nodedump_compile_node(tmp), rb_intern("to_binary"), 0);
+	StringValue(iseq_bin);
+	sect = rb_str_buf_new(RSTRING_LEN(iseq_bin) + 256);
+	bin_write_nstr(sect, path);
+	bin_write_nstr(sect, iseq_bin);
+	// Update flags and number of sections in the header
+	rb_str_modify(bin);
+	ptr = (unsigned char *) RSTRING_PTR(bin) + NODEMARSHAL_BIN_MAGIC_LEN;
+	bin_patch_u32(ptr, bin_peek_u32(ptr) | BIN_FLAG_ISEQ); // flags
+	bin_patch_u32(ptr + 8, bin_peek_u32(ptr + 8) + 1); // number of sections
+	bin_write_section(bin, SECT_ISEQ, 1, sect);
+	return bin;
+}
+
+/*
+ * Parses Ruby file with the source code and saves the node
+ * (the full garbage collection is forced if gc_start is not 0)
+ */
+static VALUE m_nodedump_from_source(VALUE self, VALUE file, int gc_start)
+{
+	VALUE line = INT2FIX(1), f, node, filepath;
+	const char *fname;
+	NodeStats st;
+
+	NodeStats_init(&st);
+	rb_secure(1);
+	FilePathValue(file);
+	fname = StringValueCStr(file);
+	/* Remember information about the file */
+	rb_iv_set(self, "@nodename", rb_str_new2("<main>"));
+	rb_iv_set(self, "@filename", file);
+	filepath = rb_funcall(rb_cFile, rb_intern("realpath"), 1, file); // Envelope for rb_realpath_internal
+	rb_iv_set(self, "@filepath", filepath);
+	/* Create node from the source */
+	f = rb_file_open_str(file, "r");
+	node = (VALUE) rb_compile_file(fname, f, NUM2INT(line));
+	rb_iv_set(self, "@node", node);
+	nodedump_reset_symbols_cache(self);
+	if ((void *) node == NULL)
+	{
+		rb_raise(rb_eArgError, "Error during string parsing");
+	}
+	NodeStats_phase(&st, "parse");
+	if (gc_start)
+	{
+		rb_gc_start();
+		NodeStats_phase(&st, "gc");
+	}
+	NodeStats_save(&st, self, "parse");
+	return self;
+}
+
+/*
+ * Parses the source code (String) read from the Ruby file and saves the node
+ * with the file name (as m_nodedump_from_source). The string must have
+ * the encoding of the IO opened by m_nodedump_from_source (default external),
+ * so the node is the same
+ */
+static VALUE m_nodedump_from_file_source(VALUE self, VALUE file, VALUE src, int gc_start)
+{
+	VALUE node, filepath;
+	NodeStats st;
+
+	NodeStats_init(&st);
+	rb_secure(1);
+	FilePathValue(file);
+	Check_Type(src, T_STRING);
+	/* Remember information about the file */
+	rb_iv_set(self, "@nodename", rb_str_new2("<main>"));
+	rb_iv_set(self, "@filename", file);
+	filepath = rb_funcall(rb_cFile, rb_intern("realpath"), 1, file);
+	rb_iv_set(self, "@filepath", filepath);
+	/* Create node from the source */
+	node = (VALUE) rb_compile_string(StringValueCStr(file), src, 1);
+	rb_iv_set(self, "@node", node);
+	nodedump_reset_symbols_cache(self);
+	if ((void *) node == NULL)
+	{
+		rb_raise(rb_eArgError, "Error during string parsing");
+	}
+	NodeStats_phase(&st, "parse");
+	if (gc_start)
+	{
+		rb_gc_start();
+		NodeStats_phase(&st, "gc");
+	}
+	NodeStats_save(&st, self, "parse");
+	return self;
+}
+
+/*
+ * Arguments of the loader of the cached dump (see m_nodedump_from_cached_source)
+ */
+typedef struct {
+	VALUE self, bin;
+	int gc_start, nthreads;
+} CachedLoader;
+
+static VALUE CachedLoader_run(VALUE arg)
+{
+	CachedLoader *cl = (CachedLoader *) arg;
+	Check_Type(cl->bin, T_STRING);
+	m_nodedump_from_memory(cl->self, cl->bin, cl->gc_start, cl->nthreads, NULL);
+	return Qtrue;
+}
+
+static VALUE CachedLoader_rescue(VALUE arg, VALUE exc)
+{
+	return Qfalse;
+}
+
+/*
+ * Loads the node for the Ruby file from the compile cache
+ * (NodeMarshal::CompileCache object, see compile_cache.rb). If there is
+ * no suitable entry the file is parsed and its dump is saved to the cache.
+ * Truncated or corrupted entries (the loader raises ArgumentError or
+ * TypeError) are deleted and treated as missing ones. The file is read
+ * only once: the key is computed from the same bytes that are parsed.
+ * The dump is kept in @bin_cache and returned by NodeMarshal#to_bin
+ */
+static VALUE m_nodedump_from_cached_source(VALUE self, VALUE file, VALUE cache, int gc_start, int nthreads)
+{
+	VALUE key, bin, src;
+	CachedLoader cl;
+	FilePathValue(file);
+	src = rb_funcall(rb_cFile, rb_intern("binread"), 1, file);
+	rb_enc_associate(src, rb_default_external_encoding());
+	key = rb_funcall(cache, rb_intern("file_key"), 2, file, src);
+	bin = rb_funcall(cache, rb_intern("[]"), 1, key);
+	if (bin != Qnil)
+	{
+		cl.self = self;
+		cl.bin = bin;
+		cl.gc_start = gc_start;
+		cl.nthreads = nthreads;
+		if (rb_rescue2(CachedLoader_run, (VALUE) &cl, CachedLoader_rescue, Qnil,
+			rb_eArgError, rb_eTypeError, (VALUE) 0) == Qfalse)
+		{	/* Remove the state of the partially loaded dump */
+			VALUE ivars = rb_obj_instance_variables(self);
+			long i;
+			for (i = 0; i < RARRAY_LEN(ivars); i++)
+				rb_funcall(self, rb_intern("remove_instance_variable"), 1, RARRAY_AREF(ivars, i));
+			rb_iv_set(self, "@show_offsets", Qfalse);
+			rb_funcall(cache, rb_intern("delete"), 1, key);
+			bin = Qnil;
+		}
+	}
+	if (bin == Qnil)
+	{
+		m_nodedump_from_file_source(self, file, src, gc_start);
+		bin = nodedump_to_bin(self, 0, Qnil);
+		rb_funcall(cache, rb_intern("[]="), 2, key, bin);
+	}
+	rb_iv_set(self, "@bin_cache", bin);
+	return self;
+}
+
+/*
+ * Parses Ruby string with the source code and saves the node
+ */
+static VALUE m_nodedump_from_string(VALUE self, VALUE str, int gc_start)
+{
+	VALUE line = INT2FIX(1), node;
+	const char *fname = "STRING";
+	NodeStats st;
+	Check_Type(str, T_STRING);
+	NodeStats_init(&st);
+	rb_secure(1);
+	/* Create empty information about the file */
+	rb_iv_set(self, "@nodename", rb_str_new2("<main>"));
+	if (RUBY_API_VERSION_MAJOR == 1)
+	{	/* For Ruby 1.9.x */
+		rb_iv_set(self, "@filename", Qnil);
+		rb_iv_set(self, "@filepath", Qnil);
+	}
+	else
+	{	/* For Ruby 2.x */
+		rb_iv_set(self, "@filename", rb_str_new2("<compiled>"));
+		rb_iv_set(self, "@filepath", rb_str_new2("<compiled>"));
+	}
+	/* Create node from the string */
+	node = (VALUE) rb_compile_string(fname, str, NUM2INT(line));
+	rb_iv_set(self, "@node", node);
+	nodedump_reset_symbols_cache(self);
+	NodeStats_phase(&st, "parse");
+	if (gc_start)
+	{
+		rb_gc_start();
+		NodeStats_phase(&st, "gc");
+	}
+	if ((void *) node == NULL)
+	{
+		rb_raise(rb_eArgError, "Error during string parsing");
+	}
+	NodeStats_save(&st, self, "parse");
+	return self;
+}
+
+/*
+ * call-seq:
+ *   obj.new(:srcfile, filename) # Will load source file from the disk
+ *   obj.new(:binfile, filename) # Will load file with node binary dump from the disk
+ *   obj.new(:srcmemory, srcstr) # Will load source code from the string
+ *   obj.new(:binmemory, binstr) # Will load node binary dump from the string
+ *   obj.new(:binmmap, filename) # Will map file with node binary dump to the memory
+ *   obj.new(:binfile, [filename, offset, length]) # Will load the part of the file
+ *   obj.new(:binmmap, [filename, offset, length])
+ *   obj.new(:base85r, text) # Will decode and decompress base85r text with node dump
+ *   obj.new(source, info, opts)
+ * 
+ * Creates NodeMarshal class example from the source code or dumped
+ * syntax tree (NODEs), i.e. preparsed and packed source code. Created
+ * object can be used either for code execution or for saving it
+ * in the preparsed form (useful for code obfuscation/protection)
+ *
+ * Binary dumps may be compressed by NodeMarshal::Codec.compress.
+ * The <tt>:base85r</tt> source decodes the text (see NodeMarshal.base85r_encode)
+ * and decompresses the frame inside it by small chunks: the decoded
+ * text is not kept in the memory (it is used by compiled Ruby files).
+ * <tt>:binfile</tt> and <tt>:binmmap</tt> sources may be given as
+ * <tt>[filename, offset, length]</tt>: the dump is a part of the file,
+ * e.g. the raw payload of the compiled Ruby file after <tt>__END__</tt>
+ * (see NodeMarshal#to_compiled_rb).
+ *
+ * Options (+opts+ Hash):
+ * - <tt>:gc_start</tt> -- if +true+ then the full garbage collection
+ *   is forced after the node loading or parsing (default is +false+).
+ *   Garbage collector is not disabled during the loading (the partially
+ *   loaded tree is marked), so garbage is collected by regular GC runs.
+ * - <tt>:threads</tt> -- number of native threads used for loading of
+ *   nodes saved in the columnar layout (see NodeMarshal#to_bin). Nodes
+ *   are filled without GVL, each thread processes at least 16384 nodes.
+ *   Default is 1.
+ * - <tt>:cache_dir</tt> -- directory of the compile cache for the
+ *   <tt>:srcfile</tt> source type (see NodeMarshal::CompileCache).
+ *   If the cache contains the dump of the same source it is loaded
+ *   without parsing, otherwise the dump is saved to the cache
+ *   (truncated or corrupted entries are replaced by the new dump).
+ *   NodeMarshal#to_bin returns the cached dump.
+ * - <tt>:cache</tt> -- NodeMarshal::CompileCache object (instead of
+ *   <tt>:cache_dir</tt>)
+ */
+/*
+ * Returns the file name of :binfile and :binmmap sources. The part
+ * of the file is given as [filename, offset, length], otherwise
+ * offset is -1
+ */
+static VALUE get_file_part(VALUE info, long *offset, long *length)
+{
+	*offset = -1;
+	*length = 0;
+	if (TYPE(info) != T_ARRAY)
+		return info;
+	if (RARRAY_LEN(info) != 3)
+		rb_raise(rb_eArgError, "Part of the file must be [filename, offset, length]");
+	*offset = NUM2LONG(RARRAY_AREF(info, 1));
+	*length = NUM2LONG(RARRAY_AREF(info, 2));
+	if (*offset < 0 || *length < 0)
+		rb_raise(rb_eArgError, "Offset and length of the dump must be non-negative");
+	return RARRAY_AREF(info, 0);
+}
+
+static VALUE m_nodedump_init(int argc, VALUE *argv, VALUE self)
+{
+	ID id_usr;
+	VALUE source, info, opts, cache = Qnil, cache_dir;
+	int gc_start = 0, nthreads = 1;
+	NodeStats st;
+	rb_scan_args(argc, argv, "21", &source, &info, &opts);
+	NodeStats_init(&st);
+	if (opts != Qnil)
+	{
+		Check_Type(opts, T_HASH);
+		gc_start = RTEST(rb_hash_lookup2(opts, ID2SYM(rb_intern("gc_start")), Qfalse));
+		nthreads = NUM2INT(rb_hash_lookup2(opts, ID2SYM(rb_intern("threads")), INT2FIX(1)));
+		if (nthreads < 1)
+			rb_raise(rb_eArgError, "Number of threads must be positive");
+		cache = rb_hash_lookup2(opts, ID2SYM(rb_intern("cache")), Qnil);
+		cache_dir = rb_hash_lookup2(opts, ID2SYM(rb_intern("cache_dir")), Qnil);
+		if (cache == Qnil && cache_dir != Qnil)
+			cache = rb_funcall(rb_path2class("NodeMarshal::CompileCache"), rb_intern("new"), 1, cache_dir);
+	}
+	rb_iv_set(self, "@show_offsets", Qfalse);
+	Check_Type(source, T_SYMBOL);
+	id_usr = SYM2ID(source);
+	if (id_usr == rb_intern("srcfile"))
+	{
+		if (cache != Qnil)
+			return m_nodedump_from_cached_source(self, info, cache, gc_start, nthreads);
+		return m_nodedump_from_source(self, info, gc_start);
+	}
+	else if (id_usr == rb_intern("srcmemory"))
+	{
+		return m_nodedump_from_string(self, info, gc_start);
+	}
+	else if (id_usr == rb_intern("binmemory"))
+	{
+		return m_nodedump_from_memory(self, info, gc_start, nthreads, &st);
+	}
+	else if (id_usr == rb_intern("binfile"))
+	{
+		VALUE cFile = rb_const_get(rb_cObject, rb_intern("File")), bin;
+		long offset, length;
+		VALUE filename = get_file_part(info, &offset, &length);
+		if (offset == -1)
+			bin = rb_funcall(cFile, rb_intern("binread"), 1, filename);
+		else
+			bin = rb_funcall(cFile, rb_intern("binread"), 3, filename, LONG2NUM(length), LONG2NUM(offset));
+		if (offset != -1 && (bin == Qnil || RSTRING_LEN(bin) != length))
+			rb_raise(rb_eArgError, "Node dump is outside of the file");
+		NodeStats_phase(&st, "read");
+		return m_nodedump_from_memory(self, bin, gc_start, nthreads, &st);
+	}
+	else if (id_usr == rb_intern("binmmap"))
+	{
+		long offset, length, len;
+		const char *buf;
+		VALUE mf = mappedfile_open(cNodeMappedFile, get_file_part(info, &offset, &length));
+		NodeStats_phase(&st, "mmap");
+		if (offset == -1)
+			return m_nodedump_from_memory(self, mf, gc_start, nthreads, &st);
+		buf = mappedfile_get_data(mf, &len);
+		if (length > len - offset)
+			rb_raise(rb_eArgError, "Node dump is outside of the file");
+		return nodedump_from_buffer(self, mf, buf + offset, length, gc_start, nthreads, &st);
+	}
+	else if (id_usr == rb_intern("base85r"))
+	{
+		VALUE bin = codec_decode_base85r(info);
+		NodeStats_phase(&st, "decode");
+		return m_nodedump_from_memory(self, bin, gc_start, nthreads, &st);
+	}
+	else
+	{
+		rb_raise(rb_eArgError, "Invalid source type (it must be :srcfile, :srcmemory, :binmemory, :binfile, :binmmap or :base85r)");
+	}
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *   obj.dump_tree
+ * 
+ * Transforms Ruby syntax tree (NODE) to the String using
+ * +rb_parser_dump_tree+ function from +node.c+ (see Ruby source code).
+ */
+static VALUE m_nodedump_parser_dump_tree(VALUE self)
+{
+	NODE *node = RNODE(rb_iv_get(self, "@node"));
+	return rb_parser_dump_tree(node, 0);
+}
+
+/*
+ * call-seq:
+ *   obj.dump_tree_short
+ *
+ * Transforms Ruby syntax tree (NODE) to the String using custom function
+ * instead of +rb_parser_dump_tree+ function.
+ *
+ * See also #show_offsets, #show_offsets=
+ */
+static VALUE m_nodedump_dump_tree_short(VALUE self)
+{
+	VALUE str = rb_str_new2(""); // Output string
+	NODE *node = RNODE(rb_iv_get(self, "@node"));
+	int show_offsets = (rb_iv_get(self, "@show_offsets") == Qtrue) ? 1 : 0;
+	print_node(str, node, 0, show_offsets);
+	return str;
+}
+
+/*
+ * call-seq:
+ *   obj.show_offsets
+ *
+ * Returns show_offsets property (used by NodeMarshal#dump_tree_short)
+ * It can be either true or false
+ */
+static VALUE m_nodedump_show_offsets(VALUE self)
+{
+	return rb_iv_get(self, "@show_offsets");
+}
+
+/*
+ * call-seq:
+ *   obj.show_offsets=
+ *
+ * Sets show_offsets property (used by NodeMarshal#dump_tree_short)
+ * It can be either true or false
+ */
+static VALUE m_nodedump_set_show_offsets(VALUE self, VALUE value)
+{
+	if (value != Qtrue && value != Qfalse)
+	{
+		rb_raise(rb_eArgError, "show_offsets property must be either true or false");
+	}
+	return rb_iv_set(self, "@show_offsets", value);
+}
+
+
+/*
+ * Returns the NODEInfo structure with the relocations information
+ * about the node (creates it if it is not present). Return value is
+ * the number of nodes (Fixnum). Phases are saved to st (may be NULL)
+ */
+static VALUE nodedump_get_nodeinfo(VALUE self, NODEInfo **info, NodeStats *st)
+{
+	VALUE val_info = rb_iv_get(self, "@nodeinfo");
+	if (val_info == Qnil)
+	{
+		NODE *node = RNODE(rb_iv_get(self, "@node"));
+		VALUE num;
+		val_info = TypedData_Make_Struct(cNodeInfo, NODEInfo,
+			&NODEInfo_type, *info); // This data envelope cannot exist without NODE
+		NODEInfo_init(*info);
+		rb_iv_set(self, "@nodeinfo", val_info);
+		nodedump_reset_symbols_cache(self);
+		num = INT2FIX(count_num_of_nodes(node, node, *info));
+		rb_iv_set(self, "@nodeinfo_num_of_nodes", num);
+		NodeStats_phase(st, "count_nodes");
+		return num;
+	}
+	TypedData_Get_Struct(val_info, NODEInfo, &NODEInfo_type, *info);
+	return rb_iv_get(self, "@nodeinfo_num_of_nodes");
+}
+
+/*
+ * call-seq:
+ *   obj.to_hash
+ * 
+ * Converts NodeMarshal class example to the hash that contains full
+ * and independent from data structures memory addresses information.
+ * Format of the obtained hash depends on used platform (especially
+ * size of the pointer) and Ruby version.
+ *
+ * <b>Format of the hash</b>
+ * 
+ * <i>Part 1: Signatures</i>
+ *
+ * - <tt>MAGIC</tt> -- NODEMARSHAL11
+ * - <tt>RUBY_PLATFORM</tt> -- saved <tt>RUBY_PLATFORM</tt> constant value
+ * - <tt>RUBY_VERSION</tt>  -- saved <tt>RUBY_VERSION</tt> constant value
+ *
+ * <i>Part 2: Program loadable elements.</i>
+ *
+ * All loadable elements are arrays. Index of the array element means
+ * its identifier that is used in the node tree.
+ *
+ * - <tt>literals</tt> -- program literals (strings, ranges etc.)
+ * - <tt>symbols</tt> -- program symbols (values have either String or Fixnum
+ *   data type; numbers are used for symbols that cannot be represented as strings)
+ * - <tt>global_entries</tt> -- global variables information
+ * - <tt>id_tables</tt> -- array of arrays. Each array contains symbols IDs
+ * - <tt>args</tt> -- information about code block argument(s)
+ * 
+ * <i>Part 3: Nodes information</i>
+ * - <tt>nodes</tt> -- string that contains binary encoded information
+ *   about the nodes
+ * - <tt>num_of_nodes</tt> -- number of nodes in the <tt>nodes</tt> field
+ * - <tt>nodename</tt> -- name of the node (usually "<main>")
+ * - <tt>filename</tt> -- name (without path) of .rb file used for the node generation
+ * - <tt>filepath</tt> -- name (with full path) of .rb file used for the node generation
+ */
+static VALUE m_nodedump_to_hash(VALUE self)
+{
+	NODEInfo *info;
+	VALUE ans;
+	NodeStats st;
+	NodeStats_init(&st);
+	// Convert the node to the form with relocs (i.e. the information about node)
+	// if such form is not present
+	ans = rb_iv_get(self, "@nodehash");
+	if (ans == Qnil)
+	{
+		VALUE num = nodedump_get_nodeinfo(self, &info, &st);
+		ans = NODEInfo_toHash(info, &st);
+		rb_hash_aset(ans, ID2SYM(rb_intern("num_of_nodes")), num);
+		rb_hash_aset(ans, ID2SYM(rb_intern("nodename")), rb_iv_get(self, "@nodename"));
+		rb_hash_aset(ans, ID2SYM(rb_intern("filename")), rb_iv_get(self, "@filename"));
+		rb_hash_aset(ans, ID2SYM(rb_intern("filepath")), rb_iv_get(self, "@filepath"));
+		rb_iv_set(self, "@nodehash", ans);
+		nodedump_reset_symbols_cache(self);
+		NodeStats_save(&st, self, "to_hash");
+	}
+	return ans;
+}
+
+
+/*
+ * Adds the number of nodes of each type to the histogram
+ */
+static void stats_count_node_types(VALUE hist, NODE **nodes, int num_of_nodes)
+{
+	int counts[256], i;
+	MEMZERO(counts, int, 256);
+	for (i = 0; i < num_of_nodes; i++)
+		counts[nd_type(nodes[i]) & 0xFF]++;
+	for (i = 0; i < 256; i++)
+	{
+		if (counts[i] > 0)
+			rb_hash_aset(hist, ID2SYM(rb_intern(ruby_node_name(i))), INT2FIX(counts[i]));
+	}
+}
+
+/*
+ * Makes the Hash with sizes of memory used by the node (see NodeMarshal#stats)
+ */
+static VALUE stats_memory(size_t tables, size_t idtbls, size_t args, int num_of_nodes)
+{
+	VALUE ans = rb_hash_new();
+	rb_hash_aset(ans, ID2SYM(rb_intern("tables")), SIZET2NUM(tables));
+	rb_hash_aset(ans, ID2SYM(rb_intern("id_tables")), SIZET2NUM(idtbls));
+	rb_hash_aset(ans, ID2SYM(rb_intern("args")), SIZET2NUM(args));
+	rb_hash_aset(ans, ID2SYM(rb_intern("nodes")), SIZET2NUM(num_of_nodes * sizeof(NODE)));
+	return ans;
+}
+
+/*
+ * call-seq:
+ *   obj.stats
+ *
+ * Returns the Hash with statistics of the node:
+ * - <tt>:load</tt>, <tt>:parse</tt>, <tt>:to_hash</tt>, <tt>:to_bin</tt> --
+ *   phases of the last operation of each kind (if it was made). Each
+ *   phase is <tt>{:time => seconds, :allocs => number}</tt> (wall time
+ *   and the number of allocated Ruby objects); <tt>:total</tt> is
+ *   the whole operation. Phases of loading are <tt>:read</tt>,
+ *   <tt>:mmap</tt> or <tt>:decode</tt> (depend on the source),
+ *   <tt>:decompress</tt>, <tt>:header</tt> or <tt>:marshal_load</tt>,
+ *   <tt>:encodings</tt>, <tt>:symbols</tt>, <tt>:literals</tt>,
+ *   <tt>:global_entries</tt>, <tt>:id_tables</tt>, <tt>:alloc_nodes</tt>,
+ *   <tt>:args</tt>, <tt>:nodes</tt> and <tt>:gc</tt>.
+ * - <tt>:tables</tt> -- sizes of tables (<tt>:syms_len</tt>, <tt>:lits_len</tt>,
+ *   <tt>:idtbls_len</tt>, <tt>:gvars_len</tt>, <tt>:args_len</tt>, <tt>:nodes_len</tt>)
+ * - <tt>:sections</tt> -- sizes of sections (in bytes) of the last loaded
+ *   or written binary container (NODEMARSHAL12)
+ * - <tt>:node_types</tt> -- number of nodes of each type (e.g. <tt>:NODE_CALL</tt>)
+ * - <tt>:memory</tt> -- sizes of memory in bytes: <tt>:tables</tt> (native tables
+ *   of relocations or of the dumper, see ObjectSpace.memsize_of), <tt>:id_tables</tt>
+ *   and <tt>:args</tt> (local ID tables and arguments info structures owned by
+ *   the nodes), <tt>:nodes</tt> (slots of nodes in the Ruby heap)
+ * - <tt>:dedup_nodes</tt> -- results of the last NodeMarshal#dedup_nodes (if it
+ *   was made): <tt>:nodes</tt> and <tt>:unique</tt> (number of nodes before and
+ *   after merging), <tt>:ratio</tt> (share of removed nodes)
+ *
+ * See also NodeMarshal::Stats for the global collector of statistics
+ */
+static VALUE m_nodedump_stats(VALUE self)
+{
+	VALUE ans = rb_hash_new(), tables = rb_hash_new(), hist = rb_hash_new(), memory;
+	VALUE stats = rb_iv_get(self, "@stats"), val_relocs = rb_iv_get(self, "@obj_addresses");
+	if (stats != Qnil)
+	{
+		VALUE ops = rb_funcall(stats, rb_intern("keys"), 0);
+		long i;
+		for (i = 0; i < RARRAY_LEN(ops); i++)
+		{
+			VALUE op = RARRAY_AREF(ops, i);
+			rb_hash_aset(ans, op, NodeStats_toHash(rb_hash_aref(stats, op)));
+		}
+	}
+	if (val_relocs != Qnil)
+	{	// Loaded node
+		NODEObjAddresses *relocs;
+		TypedData_Get_Struct(val_relocs, NODEObjAddresses, &NODEObjAddresses_type, relocs);
+		rb_hash_aset(tables, ID2SYM(rb_intern("syms_len")), INT2FIX(relocs->syms_len));
+		rb_hash_aset(tables, ID2SYM(rb_intern("lits_len")), INT2FIX(relocs->lits_len));
+		rb_hash_aset(tables, ID2SYM(rb_intern("idtbls_len")), INT2FIX(relocs->idtbls_len));
+		rb_hash_aset(tables, ID2SYM(rb_intern("gvars_len")), INT2FIX(relocs->gvars_len));
+#ifdef USE_RB_ARGS_INFO
+		rb_hash_aset(tables, ID2SYM(rb_intern("args_len")), INT2FIX(relocs->args_len));
+#else
+		rb_hash_aset(tables, ID2SYM(rb_intern("args_len")), INT2FIX(0));
+#endif
+		rb_hash_aset(tables, ID2SYM(rb_intern("nodes_len")), INT2FIX(relocs->nodes_len));
+		stats_count_node_types(hist, relocs->nodes_adr, relocs->nodes_len);
+		{
+			size_t args_size, idtbls_size = NODEObjAddresses_ownedsize(relocs, &args_size);
+			memory = stats_memory(NODEObjAddresses_memsize(relocs), idtbls_size, args_size, relocs->nodes_len);
+		}
+	}
+	else
+	{	// Parsed node: tables are made by the preparation for dumping
+		NODEInfo *info;
+		nodedump_get_nodeinfo(self, &info, NULL);
+		rb_hash_aset(tables, ID2SYM(rb_intern("syms_len")), INT2FIX(info->syms.pos));
+		rb_hash_aset(tables, ID2SYM(rb_intern("lits_len")), INT2FIX(info->lits.pos));
+		rb_hash_aset(tables, ID2SYM(rb_intern("idtbls_len")), INT2FIX(info->idtabs.pos));
+		rb_hash_aset(tables, ID2SYM(rb_intern("gvars_len")), INT2FIX(info->gentries.pos));
+#ifdef USE_RB_ARGS_INFO
+		rb_hash_aset(tables, ID2SYM(rb_intern("args_len")), INT2FIX(info->args.pos));
+#else
+		rb_hash_aset(tables, ID2SYM(rb_intern("args_len")), INT2FIX(0));
+#endif
+		rb_hash_aset(tables, ID2SYM(rb_intern("nodes_len")), INT2FIX(info->nodes.pos));
+		stats_count_node_types(hist, (NODE **) info->nodes.keys, info->nodes.pos);
+		{
+			size_t idtbls_size = 0, args_size = 0;
+			int i;
+			for (i = 0; i < info->idtabs.pos; i++)
+			{
+				ID *idtbl = (ID *) info->idtabs.keys[i];
+				if (idtbl != NULL)
+					idtbls_size += (idtbl[0] + 1) * sizeof(ID);
+			}
+#ifdef USE_RB_ARGS_INFO
+			args_size = info->args.pos * sizeof(struct rb_args_info);
+#endif
+			memory = stats_memory(NODEInfo_memsize(info), idtbls_size, args_size, info->nodes.pos);
+		}
+	}
+	rb_hash_aset(ans, ID2SYM(rb_intern("tables")), tables);
+	rb_hash_aset(ans, ID2SYM(rb_intern("sections")), rb_iv_get(self, "@stats_sections"));
+	rb_hash_aset(ans, ID2SYM(rb_intern("node_types")), hist);
+	rb_hash_aset(ans, ID2SYM(rb_intern("memory")), memory);
+	if (rb_iv_get(self, "@stats_dedup") != Qnil)
+	{
+		VALUE dedup = rb_iv_get(self, "@stats_dedup"), dedup_hash = rb_hash_new();
+		int num = FIX2INT(RARRAY_AREF(dedup, 0)), unique = FIX2INT(RARRAY_AREF(dedup, 1));
+		rb_hash_aset(dedup_hash, ID2SYM(rb_intern("nodes")), INT2FIX(num));
+		rb_hash_aset(dedup_hash, ID2SYM(rb_intern("unique")), INT2FIX(unique));
+		rb_hash_aset(dedup_hash, ID2SYM(rb_intern("ratio")), DBL2NUM((num > 0) ? (double) (num - unique) / num : 0.0));
+		rb_hash_aset(ans, ID2SYM(rb_intern("dedup_nodes")), dedup_hash);
+	}
+	return ans;
+}
+
+/*
+ * Saves the value to the output container of the walker item (Array or Hash)
+ */
+static void node_to_ary_save(NodeWalkerItem *item, VALUE val)
+{
+	if (item->key == Qnil)
+		rb_ary_push(item->data, val);
+	else
+		rb_hash_aset(item->data, item->key, val);
+}
+
+/*
+ * Converts the non-node child of the node (or NODE_OP_ASGN2 internals)
+ * to Ruby object
+ */
+static VALUE node_leaf_to_value(NODE *node, int i, int type)
+{
+	VALUE uref = (i == 0) ? node->u1.value : ((i == 1) ? node->u2.value : node->u3.value);
+	if (type == NT_NODE)
+	{	// Special case: NODE_OP_ASGN2 3rd child
+		VALUE child = rb_ary_new();
+		if (uref == 0 || TYPE(uref) != T_NODE)
+			rb_raise(rb_eArgError, "print_node: broken node 0x%s", RSTRING_PTR(value_to_str(uref)));
+		rb_ary_push(child, ID2SYM(rb_intern("NODE_OP_ASGN2")));
+		rb_ary_push(child, LONG2NUM((intptr_t) RNODE(uref)->u1.value));
+		rb_ary_push(child, LONG2NUM((intptr_t) RNODE(uref)->u2.value));
+		rb_ary_push(child, LONG2NUM((intptr_t) RNODE(uref)->u3.value));
+		return child;
+	}
+	else if (type == NT_VALUE)
+	{
+		return uref;
+	}
+	else if (type == NT_ID)
+	{
+		return ID2SYM( (ID) uref);
+	}
+	else if (type == NT_LONG)
+	{
+		return LONG2NUM( (intptr_t) uref);
+	}
+	else if (type == NT_NULL)
+	{
+		return Qnil;
+	}
+	else if (type == NT_IDTABLE)
+	{
+		VALUE ridtbl = rb_ary_new();
+		VALUE idtbl_ary = rb_ary_new();
+		int j, len;
+
+		ID *idtbl = (ID *) uref;
+		len = (uref) ? *idtbl++ : 0;
+		for (j = 0; j < len; j++)
+		{
+			ID sym = *idtbl++;
+			VALUE val = ID2SYM(sym);
+			rb_ary_push(idtbl_ary, val);
+		}
+		rb_ary_push(ridtbl, ID2SYM(rb_intern("IDTABLE")));
+		rb_ary_push(ridtbl, idtbl_ary);
+		return ridtbl;
+	}
+	else if (type == NT_ENTRY)
+	{
+		struct rb_global_entry *gentry;
+		gentry = (struct rb_global_entry *) uref;
+		return ID2SYM(gentry->id);
+	}
+	else
+	{
+		return ID2SYM(rb_intern("UNKNOWN"));
+	}
+}
+
+/*
+ * Converts node to the tree of Ruby arrays (iterative traversal,
+ * see NodeWalker)
+ */
+VALUE m_node_to_ary(NODE *root)
+{
+	NodeWalker *w;
+	NodeWalkerItem item, *child;
+	VALUE w_obj = NodeWalker_new(&w);
+	VALUE out = rb_ary_new();
+	child = NodeWalker_push(w, NW_NODE, root, NULL, 0);
+	child->data = out;
+	while (NodeWalker_pop(w, &item))
+	{
+		NODE *node = item.node;
+		int i, type, ut[3];
+		VALUE entry;
+		if (item.kind == NW_LEAF)
+		{
+			node_to_ary_save(&item, node_leaf_to_value(node, item.child, item.type));
+			continue;
+		}
+		else if (item.kind == NW_ARGS)
+		{	/* ARGS envelope is saved before its nodes (they are kept in the Hash) */
+			rb_ary_push(item.data, item.key);
+			continue;
+		}
+		/* Special case: NULL node */
+		if (node == NULL)
+		{
+			node_to_ary_save(&item, Qnil);
+			continue;
+		}
+		/* Save node name */
+		entry = rb_ary_new();
+		node_to_ary_save(&item, entry);
+		type = nd_type(node);
+		rb_ary_push(entry, ID2SYM(rb_intern(ruby_node_name(type))));
+
+		ut[0] = nodes_ctbl[type * 3];
+		ut[1] = nodes_ctbl[type * 3 + 1];
+		ut[2] = nodes_ctbl[type * 3 + 2];
+		/* Children are pushed in the reverse order */
+		for (i = 2; i >= 0; i--)
+		{
+			VALUE uref = (i == 0) ? node->u1.value : ((i == 1) ? node->u2.value : node->u3.value);
+			if (ut[i] == NT_NODE && (type != NODE_OP_ASGN2 || i != 2))
+			{
+				child = NodeWalker_push(w, NW_NODE, RNODE(uref), node, 0);
+				child->data = entry;
+			}
+			else if (ut[i] == NT_ARGS)
+			{	/* Element of entry is reserved for ARGS */
+				VALUE rargs = rb_hash_new();
+				VALUE rargs_env = rb_ary_new();
+#ifdef USE_RB_ARGS_INFO
+				static const char *keys[] = {"pre_init", "post_init", "first_post_arg",
+					"rest_arg", "block_arg", "kw_args", "kw_rest_arg", "opt_args"};
+				struct rb_args_info *args = (void *) uref;
+				NODE *args_nodes[] = {args->pre_init, args->post_init, args->kw_args,
+					args->kw_rest_arg, args->opt_args};
+				int args_nodes_keys[] = {0, 1, 5, 6, 7}, j;
+				ID id;
+				/* Preserve the order of keys in the Hash */
+				for (j = 0; j < 8; j++)
+					rb_hash_aset(rargs, ID2SYM(rb_intern(keys[j])), Qnil);
+				id = args->first_post_arg;
+				rb_hash_aset(rargs, ID2SYM(rb_intern("first_post_arg")), (id) ? ID2SYM(id) : Qnil);
+				id = args->rest_arg;
+				rb_hash_aset(rargs, ID2SYM(rb_intern("rest_arg")), (id) ? ID2SYM(id) : Qnil);
+				id = args->block_arg;
+				rb_hash_aset(rargs, ID2SYM(rb_intern("block_arg")), (id) ? ID2SYM(id) : Qnil);
+				for (j = 4; j >= 0; j--)
+				{
+					child = NodeWalker_push(w, NW_NODE, args_nodes[j], node, 0);
+					child->data = rargs;
+					child->key = ID2SYM(rb_intern(keys[args_nodes_keys[j]]));
+				}
+#endif
+				rb_ary_push(rargs_env, ID2SYM(rb_intern("ARGS")));
+				rb_ary_push(rargs_env, rargs);
+				child = NodeWalker_push(w, NW_ARGS, node, node, 0);
+				child->data = entry;
+				child->key = rargs_env;
+			}
+			else
+			{
+				child = NodeWalker_pushLeaf(w, node, i, ut[i], 0);
+				child->data = entry;
+			}
+		}
+	}
+	RB_GC_GUARD(w_obj);
+	return rb_ary_entry(out, 0);
+}
+
+/*
+ * call-seq:
+ *   obj.to_a
+ *
+ * Converts node to the array (mainly to allow exploration of AST
+ * by the user). It shows information about rb_args_info and
+ * ID *tbl that are not displayed by NodeMarshal#dump_tree and
+ * NodeMarshal#dump_tree_short.
+ */
+static VALUE m_nodedump_to_a(VALUE self)
+{
+	NODE *node = RNODE(rb_iv_get(self, "@node"));
+	return m_node_to_ary(node);
+}
+
+/*
+ * Queries of the syntax tree (NodeMarshal#node_type_counts,
+ * NodeMarshal#each_node, NodeMarshal#find_calls, NodeMarshal#max_depth)
+ *
+ * The tree is walked by NodeWalker using the types of children from
+ * nodes_ctbl (see node_child_types); only nodes are visited and Ruby
+ * objects are created only for the results.
+ */
+typedef void (*node_visitor)(NODE *node, int depth, void *arg);
+
+/*
+ * Visits all nodes of the tree in the pre-order (the depth of the root is 1)
+ */
+static void node_query_walk(NODE *root, node_visitor visit, void *arg)
+{
+	NodeWalker *w;
+	NodeWalkerItem item;
+	VALUE w_obj = NodeWalker_new(&w);
+	NodeWalker_push(w, NW_NODE, root, root, 1);
+	while (NodeWalker_pop(w, &item))
+	{
+		NODE *node = item.node;
+		int i, ut[3];
+		if (node == NULL)
+			continue;
+		if (TYPE((VALUE) node) != T_NODE)
+			rb_raise(rb_eArgError, "Child of node %s is not a node", ruby_node_name(nd_type(item.parent)));
+		node_child_types(node, item.parent, ut);
+		visit(node, item.depth, arg);
+		for (i = 2; i >= 0; i--)
+		{
+			VALUE value = (i == 0) ? node->u1.value : ((i == 1) ? node->u2.value : node->u3.value);
+			if (ut[i] == NT_NODE)
+			{
+				NodeWalker_push(w, NW_NODE, RNODE(value), node, item.depth + 1);
+			}
+#ifdef USE_RB_ARGS_INFO
+			else if (ut[i] == NT_ARGS && i == 2)
+			{
+				struct rb_args_info *ainfo = node->u3.args;
+				NodeWalker_push(w, NW_NODE, ainfo->opt_args, node, item.depth + 1);
+				NodeWalker_push(w, NW_NODE, ainfo->kw_rest_arg, node, item.depth + 1);
+				NodeWalker_push(w, NW_NODE, ainfo->kw_args, node, item.depth + 1);
+				NodeWalker_push(w, NW_NODE, ainfo->post_init, node, item.depth + 1);
+				NodeWalker_push(w, NW_NODE, ainfo->pre_init, node, item.depth + 1);
+			}
+#endif
+		}
+	}
+	RB_GC_GUARD(w_obj);
+}
+
+/*
+ * Returns the root node of the NodeMarshal object
+ */
+static NODE *node_query_root(VALUE self)
+{
+	VALUE node = rb_iv_get(self, "@node");
+	if (node == Qnil)
+		rb_raise(rb_eArgError, "Node is not loaded");
+	return RNODE(node);
+}
 
-		// Fill classic node structure
-		node = relocs->nodes_adr[i];
-#ifdef RESET_GC_FLAGS
-		flags = flags & (~0x3); // Ruby 1.9.x -- specific thing
-#endif
-		node->flags = (flags << 5) | T_NODE;
-		node->nd_reserved = 0;
-		node->u1.value = u[0];
-		node->u2.value = u[1];
-		node->u3.value = u[2];
-	}	
+/*
+ * Converts the name of the node type (e.g. :NODE_CALL or :CALL)
+ * to its number
+ */
+static int node_type_from_value(VALUE name)
+{
+	const char *str, *type_name;
+	int i;
+	if (SYMBOL_P(name))
+		name = rb_sym_to_s(name);
+	str = StringValueCStr(name);
+	for (i = 0; i < NODE_LAST; i++)
+	{
+		type_name = ruby_node_name(i);
+		if (type_name == NULL)
+			continue;
+		if (!strcmp(str, type_name) || (!strncmp(type_name, "NODE_", 5) && !strcmp(str, type_name + 5)))
+			return i;
+	}
+	rb_raise(rb_eArgError, "Unknown node type %s", str);
+	return -1;
+}
+
+static VALUE node_type_to_sym(int type)
+{
+	return ID2SYM(rb_intern(ruby_node_name(type)));
+}
+
+static void node_query_count(NODE *node, int depth, void *arg)
+{
+	((int *) arg)[nd_type(node)]++;
 }
 
 /*
- * Returns the value of string hash field using symbolic key
+ * call-seq:
+ *   obj.node_type_counts
+ *
+ * Returns the Hash with the number of nodes of each type in the tree,
+ * e.g. <tt>{:NODE_CALL => 10, :NODE_LIT => 5}</tt>. Unlike NodeMarshal#to_a
+ * and NodeMarshal#dump_tree_short the tree is not converted to Ruby objects.
  */
-static VALUE get_hash_strfield(VALUE hash, const char *idtxt)
+static VALUE m_nodedump_node_type_counts(VALUE self)
 {
-	VALUE str = rb_hash_aref(hash, ID2SYM(rb_intern(idtxt)));
-	if (TYPE(str) != T_STRING)
+	int counts[NODE_LAST], i;
+	VALUE ans = rb_hash_new();
+	MEMZERO(counts, int, NODE_LAST);
+	node_query_walk(node_query_root(self), node_query_count, counts);
+	for (i = 0; i < NODE_LAST; i++)
 	{
-		rb_raise(rb_eArgError, "Hash field %s is not a string", idtxt);
-		return Qnil;
+		if (counts[i] > 0)
+			rb_hash_aset(ans, node_type_to_sym(i), INT2FIX(counts[i]));
 	}
-	else
+	return ans;
+}
+
+typedef struct {
+	int type; // Type of nodes (-1 means all nodes)
+	VALUE ans; // Output array (or nil if values are yielded)
+	ID mid; // Name of the called method (for find_calls)
+	int max_depth;
+} NodeQuery;
+
+static void node_query_yield(NODE *node, int depth, void *arg)
+{
+	NodeQuery *q = (NodeQuery *) arg;
+	if (q->type == -1 || nd_type(node) == q->type)
+		rb_yield_values(3, node_type_to_sym(nd_type(node)), INT2FIX(nd_line(node)), INT2FIX(depth));
+}
+
+/*
+ * call-seq:
+ *   obj.each_node {|type, line, depth| ... }
+ *   obj.each_node(type) {|type, line, depth| ... }
+ *   obj.each_node(type)
+ *
+ * Iterates over nodes of the tree (in the pre-order) and yields the type
+ * of the node (e.g. <tt>:NODE_CALL</tt>), its line number and depth (1 for
+ * the root node). If +type+ (Symbol or String, with or without the
+ * <tt>NODE_</tt> prefix) is given then only nodes of this type are yielded.
+ * Returns the Enumerator if the block is not given.
+ */
+static VALUE m_nodedump_each_node(int argc, VALUE *argv, VALUE self)
+{
+	NodeQuery q;
+	VALUE type;
+	RETURN_ENUMERATOR(self, argc, argv);
+	rb_scan_args(argc, argv, "01", &type);
+	q.type = (type == Qnil) ? -1 : node_type_from_value(type);
+	node_query_walk(node_query_root(self), node_query_yield, &q);
+	return self;
+}
+
+static void node_query_find_call(NODE *node, int depth, void *arg)
+{
+	NodeQuery *q = (NodeQuery *) arg;
+	switch (nd_type(node))
 	{
-		return str;
+	case NODE_CALL:
+	case NODE_FCALL:
+	case NODE_VCALL:
+#ifdef NODE_QCALL
+	case NODE_QCALL:
+#endif
+	case NODE_ATTRASGN:
+		if (node->u2.id == q->mid)
+			rb_ary_push(q->ans, rb_ary_new3(2, node_type_to_sym(nd_type(node)), INT2FIX(nd_line(node))));
+		break;
 	}
 }
 
-/* 
- * Check validity of node hash representation signatures ("magic" values)
+/*
+ * call-seq:
+ *   obj.find_calls(name)
+ *
+ * Returns the array of calls of +name+ method (Symbol or String) in
+ * the tree: <tt>[[type, line], ...]</tt>, where +type+ is
+ * <tt>:NODE_CALL</tt>, <tt>:NODE_FCALL</tt>, <tt>:NODE_VCALL</tt>,
+ * <tt>:NODE_QCALL</tt> or <tt>:NODE_ATTRASGN</tt>.
  */
-static VALUE check_hash_magic(VALUE data)
+static VALUE m_nodedump_find_calls(VALUE self, VALUE name)
 {
-	VALUE val, refval;
-	// MAGIC signature must be valid
-	val = get_hash_strfield(data, "MAGIC");
-	if (strcmp(NODEMARSHAL_MAGIC, RSTRING_PTR(val)))
-		rb_raise(rb_eArgError, "Bad value of MAGIC signature");
-	// RUBY_PLATFORM signature must match the current platform
-	val = get_hash_strfield(data, "RUBY_PLATFORM"); 
-	refval = rb_const_get(rb_cObject, rb_intern("RUBY_PLATFORM"));
-	if (strcmp(RSTRING_PTR(refval), RSTRING_PTR(val)))
-		rb_raise(rb_eArgError, "Incompatible RUBY_PLATFORM value %s", RSTRING_PTR(val));
-	// RUBY_VERSION signature must match the used Ruby interpreter
-	val = get_hash_strfield(data, "RUBY_VERSION");
-	refval = rb_const_get(rb_cObject, rb_intern("RUBY_VERSION"));
-	if (strcmp(RSTRING_PTR(refval), RSTRING_PTR(val)))
-		rb_raise(rb_eArgError, "Incompatible RUBY_VERSION value %s", RSTRING_PTR(val));
-	return Qtrue;
+	NodeQuery q;
+	q.ans = rb_ary_new();
+	q.mid = rb_check_id(&name);
+	if (q.mid == 0) // Symbol is absent, so there are no calls
+		return q.ans;
+	node_query_walk(node_query_root(self), node_query_find_call, &q);
+	return q.ans;
+}
+
+static void node_query_depth(NODE *node, int depth, void *arg)
+{
+	NodeQuery *q = (NodeQuery *) arg;
+	if (depth > q->max_depth)
+		q->max_depth = depth;
 }
 
 /*
- * Part 5. C-to-Ruby interface
- * 
+ * call-seq:
+ *   obj.max_depth
+ *
+ * Returns the maximal depth of the tree (1 for the tree of one node)
  */
+static VALUE m_nodedump_max_depth(VALUE self)
+{
+	NodeQuery q;
+	q.max_depth = 0;
+	node_query_walk(node_query_root(self), node_query_depth, &q);
+	return INT2FIX(q.max_depth);
+}
+
 
 /*
- * Restore Ruby node from the binary blob (dump)
+ * call-seq:
+ *   obj.to_bin
+ *   obj.to_bin(opts)
+ * 
+ * Converts NodeMarshal class example to the binary string that
+ * can be saved to the file and used for loading the node from the file.
+ * Format of the obtained binary dump depends on used platform (especially
+ * size of the pointer) and Ruby version.
+ *
+ * The dump is a binary container (NODEMARSHAL12) with length-prefixed
+ * sections for symbols, literals, global entries, ID tables, arguments
+ * information and nodes. Marshal is used only for non-trivial literals.
+ * If the node was converted to the hash by NodeMarshal#to_hash then
+ * the data from the hash (e.g. changed symbols) is used.
+ * Dumps made by NodeMarshal#to_hash and serialized by Marshal (NODEMARSHAL11)
+ * are still accepted by the loader.
+ *
+ * Options (+opts+ Hash):
+ * - <tt>:nodes_layout</tt> -- <tt>:varlen</tt> (default, variable-length
+ *   records) or <tt>:columnar</tt> (arrays of fixed-width records; any node
+ *   can be decoded without parsing of the previous ones)
+ * - <tt>:lazy</tt> -- +true+ or minimal number of nodes in the method (default
+ *   is 16): bodies of methods are saved to separate sections that are loaded
+ *   and compiled only at the first call (see NodeMarshal::LazyLoader)
+ * - <tt>:iseq</tt> -- +true+ or file path: the companion binary of the compiled
+ *   RubyVM::InstructionSequence (see RubyVM::InstructionSequence#to_binary) is
+ *   saved to the dump. NodeMarshal#compile loads it instead of the code generation
+ *   if the interpreter is the same and the filepath of the node is equal to the
+ *   given path (default is the current filepath). Cannot be used with <tt>:lazy</tt>
+ * - <tt>:shared_dict</tt> -- NodeMarshal::Dictionary: symbols and literals present
+ *   in the dictionary are saved as its ordinals. The dictionary must be
+ *   loaded before loading of the dump (see NodeMarshal::Dictionary.load)
+ * - <tt>:dedup_literals</tt> -- if +true+ then equal literals are merged before
+ *   dumping (see NodeMarshal#dedup_literals). Cannot be used with <tt>:lazy</tt>
+ * - <tt>:dedup_nodes</tt> -- if +true+ then identical literal-only subtrees are
+ *   saved once (see NodeMarshal#dedup_nodes; it is made after <tt>:dedup_literals</tt>).
+ *   Cannot be used with <tt>:lazy</tt>
  */
-static VALUE m_nodedump_from_memory(VALUE self, VALUE dump)
+static VALUE m_nodedump_to_bin(int argc, VALUE *argv, VALUE self)
 {
-	VALUE cMarshal, data, val, val_relocs;
-	VALUE gc_was_disabled;
-	int num_of_nodes;
-	NODEObjAddresses *relocs;
-	/* DISABLE GARBAGE COLLECTOR (required for stable loading
-	   of large node trees */
-	gc_was_disabled = rb_gc_disable();
-	/* Wrap struct for relocations */
-	val_relocs = Data_Make_Struct(cNodeObjAddresses, NODEObjAddresses,
-		NULL, NODEObjAddresses_free, relocs); // This data envelope cannot exist without NODE
-	/* Load and unpack our dump */
-	cMarshal = rb_const_get(rb_cObject, rb_intern("Marshal"));
-	data = rb_funcall(cMarshal, rb_intern("load"), 1, dump);
-	if (TYPE(data) != T_HASH)
+	VALUE opts, lazy = Qnil, iseq = Qnil, dict = Qnil, dedup = Qnil, dedup_nodes = Qnil;
+	int flags = 0;
+	rb_scan_args(argc, argv, "01", &opts);
+	if (opts != Qnil)
 	{
-		rb_raise(rb_eArgError, "Input dump is corrupted");
+		VALUE layout;
+		Check_Type(opts, T_HASH);
+		layout = rb_hash_lookup2(opts, ID2SYM(rb_intern("nodes_layout")), Qnil);
+		if (layout == ID2SYM(rb_intern("columnar")))
+			flags |= BIN_FLAG_COLUMNAR;
+		else if (layout != Qnil && layout != ID2SYM(rb_intern("varlen")))
+			rb_raise(rb_eArgError, "nodes_layout must be either :varlen or :columnar");
+		lazy = rb_hash_lookup2(opts, ID2SYM(rb_intern("lazy")), Qnil);
+		iseq = rb_hash_lookup2(opts, ID2SYM(rb_intern("iseq")), Qnil);
+		dict = rb_hash_lookup2(opts, ID2SYM(rb_intern("shared_dict")), Qnil);
+		if (dict != Qnil)
+			NodeDict_fromValue(dict);
+		dedup = rb_hash_lookup2(opts, ID2SYM(rb_intern("dedup_literals")), Qnil);
+		dedup_nodes = rb_hash_lookup2(opts, ID2SYM(rb_intern("dedup_nodes")), Qnil);
 	}
-	val = rb_hash_aref(data, ID2SYM(rb_intern("num_of_nodes")));
-	if (val == Qnil)
+	if (RTEST(dedup))
 	{
-		rb_raise(rb_eArgError, "num_of_nodes not found");
+		if (RTEST(lazy))
+			rb_raise(rb_eArgError, ":dedup_literals and :lazy options cannot be used together");
+		m_nodedump_dedup_literals(self);
 	}
-	else
+	if (RTEST(dedup_nodes))
 	{
-		num_of_nodes = FIX2INT(val);
+		if (RTEST(lazy))
+			rb_raise(rb_eArgError, ":dedup_nodes and :lazy options cannot be used together");
+		m_nodedump_dedup_nodes(self);
 	}
-	/* Check "magic" signature and platform identifiers */
-	check_hash_magic(data);
-	/* Get the information about the source file that was compiled to the node */
-	// a) node name
-	val = rb_hash_aref(data, ID2SYM(rb_intern("nodename")));
-	if (val == Qnil || TYPE(val) == T_STRING)
-		rb_iv_set(self, "@nodename", val);
-	else
-		rb_raise(rb_eArgError, "nodename value is corrupted");
-	// b) file name
-	val = rb_hash_aref(data, ID2SYM(rb_intern("filename")));
-	if (val == Qnil || TYPE(val) == T_STRING)
-		rb_iv_set(self, "@filename", val);
-	else
-		rb_raise(rb_eArgError, "filename value is corrupted");
-	// c) file path
-	val = rb_hash_aref(data, ID2SYM(rb_intern("filepath")));
-	if (val == Qnil || TYPE(val) == T_STRING)
-		rb_iv_set(self, "@filepath", val);
-	else
-		rb_raise(rb_eArgError, "filepath value is corrupted");
-	/* Load all required data */
-	resolve_syms_ords(data, relocs); // Symbols
-	resolve_lits_ords(data, relocs); // Literals
-	resolve_gvars_ords(data, relocs); // Global entries (with symbol ID resolving)
-	resolve_idtbls_ords(data, relocs); // Identifiers tables (with symbol ID resolving)
-	resolve_nodes_ords(data, num_of_nodes, relocs); // Allocate memory for all nodes
-#ifdef USE_RB_ARGS_INFO
-	resolve_args_ords(data, relocs); // Load args entries with symbols ID and nodes resolving
-#endif
-	load_nodes_from_str(data, relocs);
-	/* Save the loaded node tree and collect garbage */
-	rb_iv_set(self, "@node", (VALUE) relocs->nodes_adr[0]);
-	rb_iv_set(self, "@num_of_nodes", INT2FIX(num_of_nodes));
-	rb_iv_set(self, "@obj_addresses", val_relocs);
-	if (gc_was_disabled == Qfalse)
+	if (RTEST(lazy))
 	{
-		rb_gc_enable();
-		rb_gc_start();
+		int min_nodes = (lazy == Qtrue) ? LAZY_MIN_NODES : NUM2INT(lazy);
+		if (RTEST(iseq))
+			rb_raise(rb_eArgError, ":iseq and :lazy options cannot be used together");
+		return nodedump_to_lazy_bin(self, flags, min_nodes, dict);
 	}
-	return self;
+	if (RTEST(iseq))
+		return nodedump_add_iseq(self, nodedump_to_bin(self, flags, dict), (iseq == Qtrue) ? Qnil : iseq);
+	return nodedump_to_bin(self, flags, dict);
 }
 
-
 /*
- * call-seq:
- *   obj.symbols
- *
- * Return array with the list of symbols
+ * Makes the binary container (NODEMARSHAL12) with the given flags
+ * (BIN_FLAG_... constants) and the shared dictionary (NodeMarshal::Dictionary
+ * or nil), see NodeMarshal#to_bin
  */
-static VALUE m_nodedump_symbols(VALUE self)
+static VALUE nodedump_to_bin(VALUE self, int flags, VALUE dict)
 {
-	int i;
-	VALUE val_relocs, val_nodeinfo, syms;
-	// Variant 1: node loaded from file
-	val_relocs = rb_iv_get(self, "@obj_addresses");
-	if (val_relocs != Qnil)
+	NODEInfo *info;
+	VALUE num, hash, syms, lits, nodes_bin, args, srcinfo, sects, ans;
+	NodeStats st;
+	BinDumpInfo di;
+	// Dump from the compile cache (is valid until the preparsed hash is created)
+	if (flags == 0 && dict == Qnil && rb_iv_get(self, "@nodehash") == Qnil)
 	{
-		NODEObjAddresses *relocs;
-		Data_Get_Struct(val_relocs, NODEObjAddresses, relocs);
-		syms = rb_ary_new();
-		for (i = 0; i < relocs->syms_len; i++)
-			rb_ary_push(syms, ID2SYM(relocs->syms_adr[i]));
-		return syms;
+		VALUE bin_cache = rb_iv_get(self, "@bin_cache");
+		if (bin_cache != Qnil)
+			return rb_str_dup(bin_cache);
 	}
-	// Variant 2: node saved to file (parsed from memory)
-	val_nodeinfo = rb_iv_get(self, "@nodeinfo");
-	if (val_nodeinfo != Qnil)
+	NodeStats_init(&st);
+	num = nodedump_get_nodeinfo(self, &info, &st);
+	hash = rb_iv_get(self, "@nodehash");
+	if (hash != Qnil)
+	{	// Preparsed hash may contain changed symbols and literals
+		syms = rb_hash_aref(hash, ID2SYM(rb_intern("symbols")));
+		lits = rb_hash_aref(hash, ID2SYM(rb_intern("literals")));
+		nodes_bin = rb_hash_aref(hash, ID2SYM(rb_intern("nodes")));
+		args = rb_hash_aref(hash, ID2SYM(rb_intern("args")));
+		num = rb_hash_aref(hash, ID2SYM(rb_intern("num_of_nodes"))); // Changed by dedup_nodes
+		srcinfo = rb_ary_new3(3,
+			rb_hash_aref(hash, ID2SYM(rb_intern("nodename"))),
+			rb_hash_aref(hash, ID2SYM(rb_intern("filename"))),
+			rb_hash_aref(hash, ID2SYM(rb_intern("filepath"))));
+		Check_Type(syms, T_ARRAY);
+		Check_Type(lits, T_ARRAY);
+		Check_Type(nodes_bin, T_STRING);
+		Check_Type(args, T_ARRAY);
+	}
+	else
 	{
-		NODEInfo *ninfo;
-		VALUE *ary;
-		Data_Get_Struct(val_nodeinfo, NODEInfo, ninfo);
-		syms = rb_funcall(ninfo->syms.vals, rb_intern("values"), 0);
-		ary = RARRAY_PTR(syms);
-		for (i = 0; i < RARRAY_LEN(syms); i++)
+		syms = NODEInfo_getSymbolsTable(info);
+		lits = LeafTableInfo_getLeavesTable(&info->lits);
+		nodes_bin = Qnil;
+		args = Qnil;
+		srcinfo = rb_ary_new3(3, rb_iv_get(self, "@nodename"),
+			rb_iv_get(self, "@filename"), rb_iv_get(self, "@filepath"));
+	}
+	// Encoded sections are reused while the nodes dump is the same
+	// (only symbols, literals and encodings are written again)
+	sects = rb_iv_get(self, "@bin_sections");
+	if (sects == Qnil || (nodes_bin != Qnil && RARRAY_AREF(sects, BIN_CACHE_NODES) != nodes_bin))
+	{
+		if (nodes_bin == Qnil)
 		{
-			ary[i] = rb_funcall(ary[i], rb_intern("to_sym"), 0);
+			nodes_bin = dump_nodes(info);
+			NodeStats_phase(&st, "dump_nodes");
 		}
-		return syms;
+		sects = NODEInfo_binSections(info, nodes_bin, args);
+		rb_iv_set(self, "@bin_sections", sects);
 	}
-	rb_raise(rb_eArgError, "Symbol information not initialized. Run to_hash before reading.");
+	ans = NODEInfo_toBin(info, syms, lits, sects, FIX2INT(num), srcinfo, flags,
+		(dict == Qnil) ? NULL : NodeDict_fromValue(dict));
+	NodeStats_phase(&st, "encode");
+	// Sizes of sections (see NodeMarshal#stats)
+	bin_read_header(RSTRING_PTR(ans), RSTRING_LEN(ans), &di);
+	rb_iv_set(self, "@stats_sections", bin_sections_stats(&di));
+	NodeStats_save(&st, self, "to_bin");
+	return ans;
 }
 
 /*
- * call-seq:
- *   obj.change_symbol(old_sym, new_sym)
+ * Part 5a. Lazy container (NodeMarshal#to_bin(:lazy => true))
  *
- * Replace one symbol by another (to be used for code obfuscation)
- * - +old_sym+ -- String that contains symbol name to be replaced 
- * - +new_sym+ -- String that contains new name of the symbol
+ * Methods defined directly in the bodies of classes, modules and at the
+ * top level (NODE_DEFN and NODE_DEFS with self receiver) are moved to
+ * separate binary dumps (sections). The skeleton (the rest of the tree)
+ * contains stubs instead of them:
+ *
+ *   ::NodeMarshal::LazyLoader.register(:id, index, self, singleton)
+ *   def name(*args, &blk)
+ *     ::NodeMarshal::LazyLoader.invoke(:id, index, self, __method__, args, blk)
+ *   end
+ *
+ * The section is the program that reopens the same classes and modules
+ * (for the same constants lookup) and defines the original method.
+ * It is loaded and compiled at the first call of the stub.
+ *
+ * Limitations: methods inside other methods, blocks and conditions are
+ * not deferred; the stub has arity -1 and defines the method twice
+ * (method_added is called twice); aliases made before the first call
+ * keep the stub (it calls the current method with the original name);
+ * backtraces contain the frame of the stub.
+ *
+ * Format of the container (all integers are little-endian):
+ *   magic  -- 16 bytes, NODEMARSHAL12LZ and zero padding
+ *   flags  -- uint32 (reserved, 0)
+ *   id     -- uint32 length + bytes, name of the container (derived from
+ *             its content, see lazy_container_id)
+ *   nparts -- uint32, number of parts (skeleton and sections)
+ *   index  -- nparts pairs of uint32 (offset from the beginning of
+ *             the container, length)
+ *   parts  -- NODEMARSHAL12 dumps; the first one is the skeleton
  */
-static VALUE m_nodedump_change_symbol(VALUE self, VALUE old_sym, VALUE new_sym)
+typedef struct {
+	VALUE *slot; // Child of the parent node that contains the method
+	NODE *defn; // NODE_DEFN or NODE_DEFS
+	int chain_begin; // Enclosing classes and modules (in LazyBuilder.chains)
+	int chain_len;
+} LazyMethod;
+
+typedef struct {
+	LazyMethod *methods;
+	int len;
+	int capacity;
+	NODE **chains; // Saved chains of NODE_CLASS/NODE_MODULE (for each method)
+	int chains_len;
+	int chains_capacity;
+	NODE **chain; // Current chain (during the scan)
+	int chain_len;
+	int chain_capacity;
+	int min_nodes;
+	VALUE self, flags_val;
+	VALUE dict; // Shared dictionary (NodeMarshal::Dictionary or nil)
+	VALUE id;
+	VALUE parts;
+	VALUE gc_was_disabled; // Result of rb_gc_disable (see LazyBuilder_restore)
+} LazyBuilder;
+
+/*
+ * Counts nodes of the subtree (but not more than limit)
+ */
+static int count_nodes_limited(NODE *root, int limit)
 {
-	VALUE val_nodehash = rb_iv_get(self, "@nodehash");
-	VALUE syms, key;
-	// Check if node is position-independent
-	// (i.e. with initialized NODEInfo structure that contains
-	// relocations for symbols)
-	if (val_nodehash == Qnil)
-		rb_raise(rb_eArgError, "This node is not preparsed into Hash");
-	// Check data types of the input array
-	if (TYPE(old_sym) != T_STRING)
+	NodeWalker *w;
+	NodeWalkerItem item;
+	VALUE w_obj = NodeWalker_new(&w);
+	int num = 0;
+	NodeWalker_push(w, NW_NODE, root, root, 0);
+	while (num < limit && NodeWalker_pop(w, &item))
 	{
-		rb_raise(rb_eArgError, "old_sym argument must be a string");
+		int i, type;
+		if (item.node == NULL || TYPE((VALUE) item.node) != T_NODE)
+			continue;
+		num++;
+		type = nd_type(item.node);
+		for (i = 0; i < 3; i++)
+		{
+			if (nodes_ctbl[type * 3 + i] == NT_NODE)
+			{
+				VALUE value = (i == 0) ? item.node->u1.value :
+					((i == 1) ? item.node->u2.value : item.node->u3.value);
+				NodeWalker_push(w, NW_NODE, RNODE(value), item.node, 0);
+			}
+		}
 	}
-	if (TYPE(new_sym) != T_STRING)
+	RB_GC_GUARD(w_obj);
+	return num;
+}
+
+static void LazyBuilder_addMethod(LazyBuilder *b, VALUE *slot)
+{
+	LazyMethod *m;
+	NODE *defn = RNODE(*slot);
+	if (count_nodes_limited(defn, b->min_nodes) < b->min_nodes)
+		return;
+	if (b->len == b->capacity)
 	{
-		rb_raise(rb_eArgError, "new_sym argument must be a string");
+		b->capacity = (b->capacity) ? b->capacity * 2 : 64;
+		REALLOC_N(b->methods, LazyMethod, b->capacity);
 	}
-	// Get the symbol table from the Hash
-	syms = rb_hash_aref(val_nodehash, ID2SYM(rb_intern("symbols")));
-	if (syms == Qnil)
-		rb_raise(rb_eArgError, "Preparsed hash has no :symbols field");
-	// Check if new_sym is present in the symbol table
-	key = rb_funcall(syms, rb_intern("find_index"), 1, new_sym);
-	if (key != Qnil)
+	if (b->chains_len + b->chain_len > b->chains_capacity)
 	{
-		rb_raise(rb_eArgError, "new_sym value must be absent in table of symbols");
+		b->chains_capacity = (b->chains_capacity + b->chain_len) * 2;
+		REALLOC_N(b->chains, NODE *, b->chains_capacity);
 	}
-	// Change the symbol in the preparsed Hash
-	key = rb_funcall(syms, rb_intern("find_index"), 1, old_sym);
-	if (key == Qnil)
-		return Qnil;
-	RARRAY_PTR(syms)[FIX2INT(key)] = new_sym;
-	return self;
+	m = &b->methods[b->len++];
+	m->slot = slot;
+	m->defn = defn;
+	m->chain_begin = b->chains_len;
+	m->chain_len = b->chain_len;
+	if (b->chain_len > 0)
+		memcpy(b->chains + b->chains_len, b->chain, b->chain_len * sizeof(NODE *));
+	b->chains_len += b->chain_len;
 }
 
 /*
- * Return array with the list of literals
+ * Finds the methods that can be moved to the sections. Only bodies of
+ * classes and modules are scanned, so the recursion depth is
+ * the depth of classes nesting
  */
-static VALUE m_nodedump_literals(VALUE self)
+static void LazyBuilder_scan(LazyBuilder *b, VALUE *slot)
 {
-	int i;
-	VALUE val_relocs, val_nodeinfo, lits;
-	// Variant 1: node loaded from file. It uses NODEObjAddresses struct
-	// with the results of Ruby NODE structure parsing.
-	val_relocs = rb_iv_get(self, "@obj_addresses");
-	if (val_relocs != Qnil)
+	NODE *node;
+	while ((node = RNODE(*slot)) != NULL && TYPE((VALUE) node) == T_NODE)
 	{
-		NODEObjAddresses *relocs;
-
-		Data_Get_Struct(val_relocs, NODEObjAddresses, relocs);
-		lits = rb_ary_new();
-		for (i = 0; i < relocs->lits_len; i++)
+		switch (nd_type(node))
 		{
-			VALUE val = relocs->lits_adr[i];
-			int t = TYPE(val);
-			if (t != T_SYMBOL && t != T_FLOAT && t != T_FIXNUM)
-				val = rb_funcall(val, rb_intern("dup"), 0);
-			rb_ary_push(lits, val);
+		case NODE_BLOCK:
+			LazyBuilder_scan(b, &node->u1.value);
+			slot = &node->u3.value;
+			break;
+		case NODE_PRELUDE:
+		case NODE_SCOPE:
+			slot = &node->u2.value;
+			break;
+		case NODE_CLASS:
+		case NODE_MODULE:
+			if (b->chain_len == b->chain_capacity)
+			{
+				b->chain_capacity = (b->chain_capacity) ? b->chain_capacity * 2 : 16;
+				REALLOC_N(b->chain, NODE *, b->chain_capacity);
+			}
+			b->chain[b->chain_len++] = node;
+			LazyBuilder_scan(b, &node->u2.value);
+			b->chain_len--;
+			return;
+		case NODE_DEFS:
+			if (node->u1.node == NULL || nd_type(node->u1.node) != NODE_SELF)
+				return;
+			/* fall through */
+		case NODE_DEFN:
+			LazyBuilder_addMethod(b, slot);
+			return;
+		default:
+			return;
 		}
-		return lits;
 	}
-	// Variant 2: node saved to file (parsed from memory). It uses
-	// NODEInfo struct that is initialized during node dump parsing.
-	val_nodeinfo = rb_iv_get(self, "@nodeinfo");
-	if (val_nodeinfo != Qnil)
+}
+
+static NODE *lazy_new_node(int type, VALUE u1, VALUE u2, VALUE u3, int line)
+{
+	NODE *node = NEW_NODE((enum node_type) type, u1, u2, u3);
+	nd_set_line(node, line);
+	return node;
+}
+
+/*
+ * Makes the tree of the section: the method inside the copies of
+ * its enclosing classes and modules (without superclasses)
+ */
+static NODE *LazyBuilder_sectionTree(LazyBuilder *b, LazyMethod *m)
+{
+	NODE *defn = m->defn, *inner;
+	int i;
+	inner = lazy_new_node(nd_type(defn), defn->u1.value, defn->u2.value, defn->u3.value, nd_line(defn));
+	for (i = m->chain_len - 1; i >= 0; i--)
 	{
-		NODEInfo *ninfo;
-		VALUE *ary;
-		Data_Get_Struct(val_nodeinfo, NODEInfo, ninfo);
-		lits = rb_funcall(ninfo->lits.vals, rb_intern("values"), 0);
-		ary = RARRAY_PTR(lits);
-		for (i = 0; i < RARRAY_LEN(lits); i++)
+		NODE *mod = b->chains[m->chain_begin + i];
+		NODE *scope = lazy_new_node(NODE_SCOPE, 0, (VALUE) inner, 0, nd_line(mod));
+		inner = lazy_new_node(nd_type(mod), mod->u1.value, (VALUE) scope, 0, nd_line(mod));
+	}
+	return lazy_new_node(NODE_SCOPE, 0, (VALUE) inner, 0, nd_line(defn));
+}
+
+/*
+ * Parses the stub of the method and returns its NODE_BLOCK
+ */
+static NODE *LazyBuilder_stubTree(LazyBuilder *b, int ind, NODE *defn)
+{
+	NodeWalker *w;
+	NodeWalkerItem item;
+	VALUE w_obj, src;
+	NODE *root, *blk, *stub;
+	int is_defs = (nd_type(defn) == NODE_DEFS);
+	src = rb_sprintf("::NodeMarshal::LazyLoader.register(:%s, %d, self, %s)\n"
+		"def %s__nm_stub(*__nm_args, &__nm_blk)\n"
+		"  ::NodeMarshal::LazyLoader.invoke(:%s, %d, self, __method__, __nm_args, __nm_blk)\n"
+		"end\n",
+		RSTRING_PTR(b->id), ind, (is_defs) ? "true" : "false", (is_defs) ? "self." : "",
+		RSTRING_PTR(b->id), ind);
+	root = rb_compile_string("<lazy>", src, 1);
+	if (root == NULL)
+		rb_raise(rb_eArgError, "Cannot parse the method stub");
+	blk = root->u2.node;
+	if (nd_type(blk) == NODE_PRELUDE)
+		blk = blk->u2.node;
+	if (nd_type(blk) != NODE_BLOCK || blk->u3.node == NULL)
+		rb_raise(rb_eArgError, "Unexpected tree of the method stub");
+	stub = blk->u3.node->u1.node;
+	stub->u2.id = defn->u2.id; // Name of the method
+	if (is_defs)
+		stub->u1.value = defn->u1.value;
+	// Line numbers of the original method
+	w_obj = NodeWalker_new(&w);
+	NodeWalker_push(w, NW_NODE, blk, blk, 0);
+	while (NodeWalker_pop(w, &item))
+	{
+		int i, type;
+		if (item.node == NULL || TYPE((VALUE) item.node) != T_NODE)
+			continue;
+		nd_set_line(item.node, nd_line(defn));
+		type = nd_type(item.node);
+		for (i = 0; i < 3; i++)
 		{
-			int t = TYPE(ary[i]);
-			if (t != T_SYMBOL && t != T_FLOAT && t != T_FIXNUM)
-				ary[i] = rb_funcall(ary[i], rb_intern("dup"), 0);
+			if (nodes_ctbl[type * 3 + i] == NT_NODE)
+			{
+				VALUE value = (i == 0) ? item.node->u1.value :
+					((i == 1) ? item.node->u2.value : item.node->u3.value);
+				if (value != defn->u1.value) // Receiver of NODE_DEFS
+					NodeWalker_push(w, NW_NODE, RNODE(value), item.node, 0);
+			}
 		}
-		return lits;
 	}
-	rb_raise(rb_eArgError, "Literals information not initialized. Run to_hash before reading.");
+	RB_GC_GUARD(w_obj);
+	return blk;
 }
 
 /*
- * Update the array with the list of literals
- * (to be used for code obfuscation)
- * Warning! This function is a stub!
+ * Makes a dump of the tree with the source information of the node
  */
-static VALUE m_nodedump_change_literal(VALUE self, VALUE old_lit, VALUE new_lit)
+static VALUE LazyBuilder_dump(LazyBuilder *b, NODE *root)
 {
-    /* TO BE IMPLEMENTED */
-    return self;
+	VALUE obj = rb_obj_alloc(rb_obj_class(b->self));
+	rb_iv_set(obj, "@show_offsets", Qfalse);
+	rb_iv_set(obj, "@node", (VALUE) root);
+	rb_iv_set(obj, "@nodename", rb_iv_get(b->self, "@nodename"));
+	rb_iv_set(obj, "@filename", rb_iv_get(b->self, "@filename"));
+	rb_iv_set(obj, "@filepath", rb_iv_get(b->self, "@filepath"));
+	return nodedump_to_bin(obj, FIX2INT(b->flags_val), b->dict);
 }
 
-
 /*
- * call-seq:
- *   obj.compile
- *
- * Creates the RubyVM::InstructionSequence object from the node
+ * Makes dumps of sections, replaces methods by stubs and dumps
+ * the skeleton (see LazyBuilder_restore)
  */
-static VALUE m_nodedump_compile(VALUE self)
+static VALUE LazyBuilder_build(VALUE arg)
 {
-	NODE *node = RNODE(rb_iv_get(self, "@node"));
-	VALUE nodename = rb_iv_get(self, "@nodename");
-	VALUE filename = rb_iv_get(self, "@filename");
-	VALUE filepath = rb_iv_get(self, "@filepath");
-#ifndef WITH_RB_ISEQW_NEW
-	/* For Pre-2.3 */
-	return rb_iseq_new_top(node, nodename, filename, filepath, Qfalse);
-#else
-	/* For Ruby 2.3 */
-	return rb_iseqw_new(rb_iseq_new_top(node, nodename, filename, filepath, Qfalse));
-#endif
+	LazyBuilder *b = (LazyBuilder *) arg;
+	NODE *root = RNODE(rb_iv_get(b->self, "@node"));
+	int i;
+	LazyBuilder_scan(b, (VALUE *) &root);
+	rb_ary_push(b->parts, Qnil);
+	for (i = 0; i < b->len; i++)
+		rb_ary_push(b->parts, LazyBuilder_dump(b, LazyBuilder_sectionTree(b, &b->methods[i])));
+	for (i = 0; i < b->len; i++)
+		*(b->methods[i].slot) = (VALUE) LazyBuilder_stubTree(b, i, b->methods[i].defn);
+	rb_ary_store(b->parts, 0, LazyBuilder_dump(b, root));
+	return Qnil;
 }
 
 /*
- * Parses Ruby file with the source code and saves the node
+ * Returns the original methods to the tree, frees the memory and
+ * enables the garbage collector (also after exceptions in LazyBuilder_build)
  */
-static VALUE m_nodedump_from_source(VALUE self, VALUE file)
+static VALUE LazyBuilder_restore(VALUE arg)
 {
-	VALUE line = INT2FIX(1), f, node, filepath, gc_was_disabled;
-	const char *fname;
+	LazyBuilder *b = (LazyBuilder *) arg;
+	int i;
+	for (i = 0; i < b->len; i++)
+		*(b->methods[i].slot) = (VALUE) b->methods[i].defn;
+	xfree(b->methods);
+	xfree(b->chains);
+	xfree(b->chain);
+	b->methods = NULL; b->chains = NULL; b->chain = NULL;
+	if (b->gc_was_disabled == Qfalse)
+		rb_gc_enable();
+	return Qnil;
+}
 
-	gc_was_disabled = rb_gc_disable();
-	rb_secure(1);
-	FilePathValue(file);
-	fname = StringValueCStr(file);
-	/* Remember information about the file */
-	rb_iv_set(self, "@nodename", rb_str_new2("<main>"));
-	rb_iv_set(self, "@filename", file);
-	filepath = rb_funcall(rb_cFile, rb_intern("realpath"), 1, file); // Envelope for rb_realpath_internal
-	rb_iv_set(self, "@filepath", filepath);
-	/* Create node from the source */
-	f = rb_file_open_str(file, "r");
-	node = (VALUE) rb_compile_file(fname, f, NUM2INT(line));
-	rb_iv_set(self, "@node", node);	
-	if ((void *) node == NULL)
-	{
-		rb_raise(rb_eArgError, "Error during string parsing");
+/*
+ * Returns the name of the container derived from its content: 64-bit
+ * FNV-1a hash of the dump of the whole tree and the options of the
+ * container. The same tree gives the same container
+ */
+static VALUE lazy_container_id(VALUE base, int flags, int min_nodes)
+{
+	const unsigned char *ptr = (const unsigned char *) RSTRING_PTR(base);
+	uint64_t h = 14695981039346656037ULL;
+	long i, len = RSTRING_LEN(base);
+	h = (h ^ (uint32_t) flags) * 1099511628211ULL;
+	h = (h ^ (uint32_t) min_nodes) * 1099511628211ULL;
+	for (i = 0; i < len; i++)
+		h = (h ^ ptr[i]) * 1099511628211ULL;
+	return rb_sprintf("nmlazy_%08x%08x", (unsigned int) (h >> 32), (unsigned int) (h & 0xFFFFFFFFU));
+}
+
+/*
+ * Makes the lazy container (see the format description above)
+ */
+static VALUE nodedump_to_lazy_bin(VALUE self, int flags, int min_nodes, VALUE dict)
+{
+	LazyBuilder b;
+	VALUE buf, base;
+	char magic[NODEMARSHAL_BIN_MAGIC_LEN];
+	long offset;
+	int i, nparts;
+	base = nodedump_to_bin(self, 0, Qnil);
+	if (rb_iv_get(self, "@nodehash") != Qnil)
+	{	// Changed symbols and literals must be applied to the tree
+		VALUE obj = rb_obj_alloc(rb_obj_class(self));
+		m_nodedump_from_memory(obj, base, 0, 1, NULL);
+		self = obj;
 	}
-	if (gc_was_disabled == Qfalse)
+	memset(&b, 0, sizeof(b));
+	b.self = self;
+	b.flags_val = INT2FIX(flags);
+	b.dict = dict;
+	b.min_nodes = (min_nodes < 1) ? 1 : min_nodes;
+	b.id = lazy_container_id(base, flags, b.min_nodes);
+	b.parts = rb_ary_new();
+	// Temporary nodes are not referenced from Ruby objects
+	// (the collector is enabled again by LazyBuilder_restore)
+	b.gc_was_disabled = rb_gc_disable();
+	rb_ensure(LazyBuilder_build, (VALUE) &b, LazyBuilder_restore, (VALUE) &b);
+	RB_GC_GUARD(base);
+	// Write the container
+	nparts = (int) RARRAY_LEN(b.parts);
+	buf = rb_str_buf_new(1024);
+	memset(magic, 0, NODEMARSHAL_BIN_MAGIC_LEN);
+	strcpy(magic, NODEMARSHAL_LAZY_MAGIC);
+	rb_str_buf_cat(buf, magic, NODEMARSHAL_BIN_MAGIC_LEN);
+	bin_write_u32(buf, 0);
+	bin_write_nstr(buf, b.id);
+	bin_write_u32(buf, nparts);
+	offset = RSTRING_LEN(buf) + 8 * nparts;
+	for (i = 0; i < nparts; i++)
 	{
-		rb_gc_enable();
+		long len = RSTRING_LEN(RARRAY_AREF(b.parts, i));
+		if (offset + len >= 0xFFFFFFFFL)
+			rb_raise(rb_eArgError, "Lazy container is too large");
+		bin_write_u32(buf, (uint32_t) offset);
+		bin_write_u32(buf, (uint32_t) len);
+		offset += len;
 	}
-	return self;
+	for (i = 0; i < nparts; i++)
+		rb_str_buf_append(buf, RARRAY_AREF(b.parts, i));
+	RB_GC_GUARD(b.parts);
+	return buf;
 }
 
 /*
- * Parses Ruby string with the source code and saves the node
+ * Checks if the buffer is the lazy container
  */
-static VALUE m_nodedump_from_string(VALUE self, VALUE str)
+static int is_lazy_dump(const char *ptr, long len)
 {
-	VALUE line = INT2FIX(1), node, gc_was_disabled;
-	const char *fname = "STRING";
-	Check_Type(str, T_STRING);
-	gc_was_disabled = rb_gc_disable();	
-	rb_secure(1);
-	/* Create empty information about the file */
-	rb_iv_set(self, "@nodename", rb_str_new2("<main>"));
-	if (RUBY_API_VERSION_MAJOR == 1)
-	{	/* For Ruby 1.9.x */
-		rb_iv_set(self, "@filename", Qnil);
-		rb_iv_set(self, "@filepath", Qnil);
-	}
+	return (len >= NODEMARSHAL_BIN_MAGIC_LEN &&
+		!memcmp(ptr, NODEMARSHAL_LAZY_MAGIC, strlen(NODEMARSHAL_LAZY_MAGIC) + 1));
+}
+
+/*
+ * Registry of loaded lazy containers: id (Symbol) => Array with
+ * the dump (String or NodeMappedFile), Array of sections [offset, length],
+ * Array of owners (classes and modules), Array of visibilities and
+ * Array of loaded methods (UnboundMethod). Entries are kept until
+ * NodeMarshal::LazyLoader.release (the dump is released after loading
+ * of all sections)
+ */
+static VALUE lazy_registry = Qnil;
+#define LAZY_DUMP 0
+#define LAZY_SECTIONS 1
+#define LAZY_OWNERS 2
+#define LAZY_VISI 3
+#define LAZY_LOADED 4
+
+/*
+ * Reads the index of the lazy container and registers it in the
+ * NodeMarshal::LazyLoader. Pointer and length of the skeleton dump
+ * are written to *buf and *len. Returns 0 if the dump is not the
+ * lazy container
+ */
+static int lazy_read_container(VALUE dump, const char **buf, long *len)
+{
+	BinReader r;
+	VALUE id, sections, entry;
+	long base, dump_len;
+	int i, nparts;
+	if (!is_lazy_dump(*buf, *len))
+		return 0;
+	// Offset of the container inside the dump (e.g. inside NodeMarshal::Bundle)
+	if (TYPE(dump) == T_STRING)
+		base = *buf - RSTRING_PTR(dump);
 	else
-	{	/* For Ruby 2.x */
-		rb_iv_set(self, "@filename", rb_str_new2("<compiled>"));
-		rb_iv_set(self, "@filepath", rb_str_new2("<compiled>"));
-	}
-	/* Create node from the string */
-	node = (VALUE) rb_compile_string(fname, str, NUM2INT(line));
-	rb_iv_set(self, "@node", node);
-	if (gc_was_disabled == Qfalse)
-	{
-		rb_gc_enable();
-		rb_gc_start();
-	}
-	if ((void *) node == NULL)
+		base = *buf - mappedfile_get_data(dump, &dump_len);
+	BinReader_init(&r, (const unsigned char *) *buf + NODEMARSHAL_BIN_MAGIC_LEN,
+		*len - NODEMARSHAL_BIN_MAGIC_LEN);
+	if (BinReader_u32(&r) != 0)
+		rb_raise(rb_eArgError, "Lazy container: unsupported flags");
+	id = BinReader_nstr(&r);
+	if (id == Qnil)
+		rb_raise(rb_eArgError, "Lazy container: invalid id");
+	nparts = (int) BinReader_u32(&r);
+	if (nparts < 1 || nparts > (*len) / 8)
+		rb_raise(rb_eArgError, "Lazy container: invalid number of parts");
+	sections = rb_ary_new2(nparts);
+	for (i = 0; i < nparts; i++)
 	{
-		rb_raise(rb_eArgError, "Error during string parsing");
+		uint32_t offset = BinReader_u32(&r), plen = BinReader_u32(&r);
+		if ((long) offset > *len || (long) plen > *len - (long) offset)
+			rb_raise(rb_eArgError, "Lazy container: part %d is out of bounds", i);
+		rb_ary_push(sections, rb_assoc_new(LONG2NUM(base + (long) offset), UINT2NUM(plen)));
 	}
-	return self;
+	// The skeleton
+	entry = rb_ary_entry(sections, 0);
+	*buf += NUM2LONG(RARRAY_AREF(entry, 0)) - base;
+	*len = NUM2LONG(RARRAY_AREF(entry, 1));
+	rb_ary_shift(sections);
+	// Register the container (the same container may be loaded several times)
+	entry = rb_ary_new3(5, dump, sections, rb_ary_new(), rb_ary_new(), rb_ary_new());
+	rb_hash_aset(lazy_registry, rb_str_intern(id), entry);
+	return 1;
+}
+
+static VALUE lazy_get_entry(VALUE id, VALUE ind_val, int *ind)
+{
+	VALUE entry = rb_hash_lookup(lazy_registry, id);
+	if (entry == Qnil)
+		rb_raise(rb_eArgError, "Lazy container %s is not loaded", RSTRING_PTR(rb_inspect(id)));
+	*ind = NUM2INT(ind_val);
+	if (*ind < 0 || *ind >= RARRAY_LEN(RARRAY_AREF(entry, LAZY_SECTIONS)))
+		rb_raise(rb_eArgError, "Lazy container: invalid section %d", *ind);
+	return entry;
 }
 
 /*
  * call-seq:
- *   obj.new(:srcfile, filename) # Will load source file from the disk
- *   obj.new(:binfile, filename) # Will load file with node binary dump from the disk
- *   obj.new(:srcmemory, srcstr) # Will load source code from the string
- *   obj.new(:binmemory, binstr) # Will load node binary dump from the string
- * 
- * Creates NodeMarshal class example from the source code or dumped
- * syntax tree (NODEs), i.e. preparsed and packed source code. Created
- * object can be used either for code execution or for saving it
- * in the preparsed form (useful for code obfuscation/protection)
+ *   NodeMarshal::LazyLoader.register(id, index, obj, singleton)
+ *
+ * Saves the owner of the method stub (is called by the skeleton before
+ * the stub definition)
  */
-static VALUE m_nodedump_init(VALUE self, VALUE source, VALUE info)
+static VALUE m_lazy_register(VALUE obj, VALUE id, VALUE ind_val, VALUE owner, VALUE singleton)
 {
-	ID id_usr;
-	rb_iv_set(self, "@show_offsets", Qfalse);
-	Check_Type(source, T_SYMBOL);
-	id_usr = SYM2ID(source);
-	if (id_usr == rb_intern("srcfile"))
-	{
-		return m_nodedump_from_source(self, info);
-	}
-	else if (id_usr == rb_intern("srcmemory"))
-	{
-		return m_nodedump_from_string(self, info);
-	}
-	else if (id_usr == rb_intern("binmemory"))
+	int ind;
+	VALUE entry = lazy_get_entry(id, ind_val, &ind);
+	if (RTEST(singleton))
+		owner = rb_singleton_class(owner);
+	else if (!RB_TYPE_P(owner, T_CLASS) && !RB_TYPE_P(owner, T_MODULE))
+		owner = rb_cObject; // Top level methods
+	rb_ary_store(RARRAY_AREF(entry, LAZY_OWNERS), ind, owner);
+	return Qnil;
+}
+
+/*
+ * Loads and compiles the section (if it was not loaded before) and
+ * returns UnboundMethod of the original method
+ */
+static VALUE lazy_load_section(VALUE entry, int ind, VALUE mid)
+{
+	VALUE owner, visi, dump, part, node, opts, argv[3], um;
+	long offset, len;
+	um = rb_ary_entry(RARRAY_AREF(entry, LAZY_LOADED), ind);
+	if (um != Qnil)
+		return um;
+	owner = rb_ary_entry(RARRAY_AREF(entry, LAZY_OWNERS), ind);
+	if (owner == Qnil)
+		rb_raise(rb_eArgError, "Lazy container: owner of the method %s is unknown",
+			RSTRING_PTR(rb_inspect(mid)));
+	// Visibility of the stub (e.g. it may be changed by private)
+	visi = rb_ary_entry(RARRAY_AREF(entry, LAZY_VISI), ind);
+	if (visi == Qnil)
 	{
-		return m_nodedump_from_memory(self, info);
+		if (RTEST(rb_funcall(owner, rb_intern("private_method_defined?"), 1, mid)))
+			visi = ID2SYM(rb_intern("private"));
+		else if (RTEST(rb_funcall(owner, rb_intern("protected_method_defined?"), 1, mid)))
+			visi = ID2SYM(rb_intern("protected"));
+		else
+			visi = ID2SYM(rb_intern("public"));
+		rb_ary_store(RARRAY_AREF(entry, LAZY_VISI), ind, visi);
 	}
-	else if (id_usr == rb_intern("binfile"))
+	// Load and run the section
+	part = rb_ary_entry(RARRAY_AREF(entry, LAZY_SECTIONS), ind);
+	offset = NUM2LONG(RARRAY_AREF(part, 0));
+	len = NUM2LONG(RARRAY_AREF(part, 1));
+	dump = RARRAY_AREF(entry, LAZY_DUMP);
+	if (TYPE(dump) == T_STRING)
 	{
-		VALUE cFile = rb_const_get(rb_cObject, rb_intern("File"));
-		VALUE bin = rb_funcall(cFile, rb_intern("binread"), 1, info);
-		return m_nodedump_from_memory(self, bin);
+		dump = rb_str_substr(dump, offset, len);
 	}
 	else
 	{
-		rb_raise(rb_eArgError, "Invalid source type (it must be :srcfile, :srcmemory, :binmemory of :binfile)");
+		long dump_len;
+		const char *ptr = mappedfile_get_data(dump, &dump_len);
+		dump = rb_str_new(ptr + offset, len);
 	}
-	return Qnil;
+	opts = rb_hash_new();
+	rb_hash_aset(opts, ID2SYM(rb_intern("gc_start")), Qfalse);
+	argv[0] = ID2SYM(rb_intern("binmemory")); argv[1] = dump; argv[2] = opts;
+	node = rb_class_new_instance(3, argv, rb_path2class("NodeMarshal"));
+	rb_funcall(rb_funcall(node, rb_intern("compile"), 0), rb_intern("eval"), 0);
+	// Restore visibility and save the method
+	rb_funcall(owner, SYM2ID(visi), 1, mid);
+	um = rb_funcall(owner, rb_intern("instance_method"), 1, mid);
+	rb_ary_store(RARRAY_AREF(entry, LAZY_LOADED), ind, um);
+	// The dump is not required after loading of all sections
+	if (rb_ary_includes(RARRAY_AREF(entry, LAZY_LOADED), Qnil) == Qfalse &&
+		RARRAY_LEN(RARRAY_AREF(entry, LAZY_LOADED)) == RARRAY_LEN(RARRAY_AREF(entry, LAZY_SECTIONS)))
+		rb_ary_store(entry, LAZY_DUMP, Qnil);
+	return um;
 }
 
 /*
  * call-seq:
- *   obj.dump_tree
- * 
- * Transforms Ruby syntax tree (NODE) to the String using
- * +rb_parser_dump_tree+ function from +node.c+ (see Ruby source code).
+ *   NodeMarshal::LazyLoader.invoke(id, index, obj, name, args, blk)
+ *
+ * Is called by the method stub: loads the original method by
+ * lazy_load_section (if it was not loaded before) and calls it
  */
-static VALUE m_nodedump_parser_dump_tree(VALUE self)
+static VALUE m_lazy_invoke(VALUE obj, VALUE id, VALUE ind_val, VALUE recv, VALUE mid, VALUE args, VALUE blk)
 {
-	NODE *node = RNODE(rb_iv_get(self, "@node"));
-	return rb_parser_dump_tree(node, 0);
+	int ind;
+	VALUE entry = lazy_get_entry(id, ind_val, &ind), um, meth;
+	Check_Type(args, T_ARRAY);
+	um = lazy_load_section(entry, ind, mid);
+	meth = rb_funcall(um, rb_intern("bind"), 1, recv);
+	return rb_funcall_with_block(meth, rb_intern("call"), (int) RARRAY_LEN(args), RARRAY_CONST_PTR(args), blk);
 }
 
 /*
  * call-seq:
- *   obj.dump_tree_short
- *
- * Transforms Ruby syntax tree (NODE) to the String using custom function
- * instead of +rb_parser_dump_tree+ function.
+ *   NodeMarshal::LazyLoader.load(id, index, name)
  *
- * See also #show_offsets, #show_offsets=
+ * Loads the original method from the section of the lazy container
+ * (if it was not loaded before) and returns it as UnboundMethod
  */
-static VALUE m_nodedump_dump_tree_short(VALUE self)
+static VALUE m_lazy_load(VALUE obj, VALUE id, VALUE ind_val, VALUE mid)
 {
-	VALUE str = rb_str_new2(""); // Output string
-	NODE *node = RNODE(rb_iv_get(self, "@node"));
-	int show_offsets = (rb_iv_get(self, "@show_offsets") == Qtrue) ? 1 : 0;
-	print_node(str, node, 0, show_offsets);
-	return str;
+	int ind;
+	VALUE entry = lazy_get_entry(id, ind_val, &ind);
+	return lazy_load_section(entry, ind, mid);
 }
 
 /*
  * call-seq:
- *   obj.show_offsets
+ *   NodeMarshal::LazyLoader.release(id) => true or false
  *
- * Returns show_offsets property (used by NodeMarshal#dump_tree_short)
- * It can be either true or false
+ * Removes the lazy container from the registry (the dump and the loaded
+ * methods are not referenced by the loader any more). Methods that were
+ * already loaded keep working; stubs of methods that were not loaded
+ * raise ArgumentError. Returns false if the container is not loaded
  */
-static VALUE m_nodedump_show_offsets(VALUE self)
+static VALUE m_lazy_release(VALUE obj, VALUE id)
 {
-	return rb_iv_get(self, "@show_offsets");
+	if (RB_TYPE_P(id, T_STRING))
+		id = rb_str_intern(id);
+	return (rb_hash_delete(lazy_registry, id) != Qnil) ? Qtrue : Qfalse;
 }
 
 /*
  * call-seq:
- *   obj.show_offsets=
+ *   NodeMarshal::LazyLoader.stats
  *
- * Sets show_offsets property (used by NodeMarshal#dump_tree_short)
- * It can be either true or false
+ * Returns the Hash with the number of sections and loaded sections
+ * for each loaded lazy container: { id => [sections, loaded] }
  */
-static VALUE m_nodedump_set_show_offsets(VALUE self, VALUE value)
+static VALUE m_lazy_stats(VALUE obj)
 {
-	if (value != Qtrue && value != Qfalse)
+	VALUE ans = rb_hash_new(), keys = rb_funcall(lazy_registry, rb_intern("keys"), 0);
+	long i;
+	for (i = 0; i < RARRAY_LEN(keys); i++)
 	{
-		rb_raise(rb_eArgError, "show_offsets property must be either true or false");
+		VALUE entry = rb_hash_aref(lazy_registry, RARRAY_AREF(keys, i));
+		VALUE loaded = RARRAY_AREF(entry, LAZY_LOADED);
+		long j, nloaded = 0;
+		for (j = 0; j < RARRAY_LEN(loaded); j++)
+			if (RARRAY_AREF(loaded, j) != Qnil)
+				nloaded++;
+		rb_hash_aset(ans, RARRAY_AREF(keys, i), rb_assoc_new(
+			LONG2NUM(RARRAY_LEN(RARRAY_AREF(entry, LAZY_SECTIONS))), LONG2NUM(nloaded)));
 	}
-	return rb_iv_set(self, "@show_offsets", value);
+	return ans;
 }
 
+/*
+ * Part 5b. Bundles: many node dumps in one indexed file (NodeMarshal::Bundle)
+ *
+ * Format of the bundle (all integers are little-endian):
+ *   magic    -- 16 bytes, NODEMARSHAL12BN and zero padding
+ *   flags    -- uint32 (reserved, 0)
+ *   nentries -- uint32, number of entries
+ *   dict     -- uint32 offset and uint32 length of the shared dictionary
+ *               (see NodeMarshal::Dictionary#to_bin; zero length means
+ *               no dictionary)
+ *   toc      -- nentries records: [string logical path][uint32 offset][uint32 length]
+ *   data     -- dumps accepted by NodeMarshal#new(:binmemory, ...): binary
+ *               containers, lazy containers or compressed frames
+ * Offsets are counted from the beginning of the bundle. Entries are loaded
+ * directly from the bundle memory (e.g. from the memory mapped file).
+ * The writer is NodeMarshal::Bundle.create (lib/node-marshal/bundle.rb)
+ */
+static VALUE cNodeBundle;
 
 /*
  * call-seq:
- *   obj.to_hash
- * 
- * Converts NodeMarshal class example to the hash that contains full
- * and independent from data structures memory addresses information.
- * Format of the obtained hash depends on used platform (especially
- * size of the pointer) and Ruby version.
- *
- * <b>Format of the hash</b>
- * 
- * <i>Part 1: Signatures</i>
- *
- * - <tt>MAGIC</tt> -- NODEMARSHAL11
- * - <tt>RUBY_PLATFORM</tt> -- saved <tt>RUBY_PLATFORM</tt> constant value
- * - <tt>RUBY_VERSION</tt>  -- saved <tt>RUBY_VERSION</tt> constant value
- *
- * <i>Part 2: Program loadable elements.</i>
- *
- * All loadable elements are arrays. Index of the array element means
- * its identifier that is used in the node tree.
+ *   NodeMarshal::Bundle.new(bin)
  *
- * - <tt>literals</tt> -- program literals (strings, ranges etc.)
- * - <tt>symbols</tt> -- program symbols (values have either String or Fixnum
- *   data type; numbers are used for symbols that cannot be represented as strings)
- * - <tt>global_entries</tt> -- global variables information
- * - <tt>id_tables</tt> -- array of arrays. Each array contains symbols IDs
- * - <tt>args</tt> -- information about code block argument(s)
- * 
- * <i>Part 3: Nodes information</i>
- * - <tt>nodes</tt> -- string that contains binary encoded information
- *   about the nodes
- * - <tt>num_of_nodes</tt> -- number of nodes in the <tt>nodes</tt> field
- * - <tt>nodename</tt> -- name of the node (usually "<main>")
- * - <tt>filename</tt> -- name (without path) of .rb file used for the node generation
- * - <tt>filepath</tt> -- name (with full path) of .rb file used for the node generation
+ * Reads the table of contents of the bundle from the String or
+ * NodeMappedFile and loads the shared dictionary (if it is present).
+ * See also NodeMarshal::Bundle.open
  */
-static VALUE m_nodedump_to_hash(VALUE self)
+static VALUE m_bundle_init(VALUE self, VALUE source)
 {
-	NODE *node = RNODE(rb_iv_get(self, "@node"));
-	NODEInfo *info;
-	VALUE ans, num, val_info, gc_was_disabled;
-	// DISABLE GARBAGE COLLECTOR (important for dumping)
-	gc_was_disabled = rb_gc_disable();
-	// Convert the node to the form with relocs (i.e. the information about node)
-	// if such form is not present
-	val_info = rb_iv_get(self, "@nodeinfo");
-	if (val_info == Qnil)
+	BinReader r;
+	VALUE toc = rb_hash_new(), paths = rb_ary_new(), dict = Qnil;
+	const char *buf;
+	long len;
+	uint32_t i, num, dict_offset, dict_len;
+	if (rb_obj_is_kind_of(source, cNodeMappedFile) == Qtrue)
 	{
-		val_info = Data_Make_Struct(cNodeInfo, NODEInfo,
-			NODEInfo_mark, NODEInfo_free, info); // This data envelope cannot exist without NODE
-		NODEInfo_init(info);
-		rb_iv_set(self, "@nodeinfo", val_info);
-		num = INT2FIX(count_num_of_nodes(node, node, info));
-		rb_iv_set(self, "@nodeinfo_num_of_nodes", num);
-		// Convert node to NODEInfo structure
-		ans = NODEInfo_toHash(info);
-		rb_hash_aset(ans, ID2SYM(rb_intern("num_of_nodes")), num);
-		rb_hash_aset(ans, ID2SYM(rb_intern("nodename")), rb_iv_get(self, "@nodename"));
-		rb_hash_aset(ans, ID2SYM(rb_intern("filename")), rb_iv_get(self, "@filename"));
-		rb_hash_aset(ans, ID2SYM(rb_intern("filepath")), rb_iv_get(self, "@filepath"));
-		rb_iv_set(self, "@nodehash", ans);
+		buf = mappedfile_get_data(source, &len);
 	}
 	else
 	{
-		ans = rb_iv_get(self, "@nodehash");
+		StringValue(source);
+		source = rb_str_new_frozen(source);
+		buf = RSTRING_PTR(source);
+		len = RSTRING_LEN(source);
 	}
-	// ENABLE GARBAGE COLLECTOR (important for dumping)
-	if (gc_was_disabled == Qfalse)
+	if (len < NODEMARSHAL_BIN_MAGIC_LEN ||
+		memcmp(buf, NODEMARSHAL_BUNDLE_MAGIC, strlen(NODEMARSHAL_BUNDLE_MAGIC) + 1))
+		rb_raise(rb_eArgError, "Bad value of MAGIC signature of the bundle");
+	BinReader_init(&r, (const unsigned char *) buf + NODEMARSHAL_BIN_MAGIC_LEN,
+		len - NODEMARSHAL_BIN_MAGIC_LEN);
+	if (BinReader_u32(&r) != 0)
+		rb_raise(rb_eArgError, "Bundle: unsupported flags");
+	num = BinReader_u32(&r);
+	dict_offset = BinReader_u32(&r);
+	dict_len = BinReader_u32(&r);
+	if ((long) dict_offset > len || (long) dict_len > len - (long) dict_offset)
+		rb_raise(rb_eArgError, "Bundle: dictionary is out of bounds");
+	if (num > (uint32_t) (len / 12))
+		rb_raise(rb_eArgError, "Bundle: invalid number of entries");
+	for (i = 0; i < num; i++)
 	{
-		rb_gc_enable();
+		VALUE path = BinReader_nstr(&r);
+		uint32_t offset = BinReader_u32(&r), elen = BinReader_u32(&r);
+		if (path == Qnil)
+			rb_raise(rb_eArgError, "Bundle: invalid path of the entry %u", i);
+		if ((long) offset > len || (long) elen > len - (long) offset)
+			rb_raise(rb_eArgError, "Bundle: entry %u is out of bounds", i);
+		rb_enc_associate(path, rb_utf8_encoding());
+		OBJ_FREEZE(path);
+		if (rb_hash_lookup2(toc, path, Qnil) != Qnil)
+			rb_raise(rb_eArgError, "Bundle: duplicated entry %s", RSTRING_PTR(path));
+		rb_hash_aset(toc, path, rb_assoc_new(UINT2NUM(offset), UINT2NUM(elen)));
+		rb_ary_push(paths, path);
 	}
-	return ans;
+	if (dict_len > 0)
+		dict = NodeDict_load(rb_str_new(buf + dict_offset, dict_len));
+	rb_iv_set(self, "@source", source);
+	rb_iv_set(self, "@toc", toc);
+	rb_iv_set(self, "@paths", rb_ary_freeze(paths));
+	rb_iv_set(self, "@dictionary", dict);
+	rb_iv_set(self, "@filename", Qnil);
+	return self;
 }
 
+/*
+ * call-seq:
+ *   NodeMarshal::Bundle.open(filename)
+ *
+ * Maps the bundle file to the memory (see <tt>:binmmap</tt> source type
+ * of NodeMarshal#new) and reads its table of contents
+ */
+static VALUE m_bundle_s_open(VALUE klass, VALUE filename)
+{
+	VALUE mf = mappedfile_open(cNodeMappedFile, filename);
+	VALUE obj = rb_class_new_instance(1, &mf, klass);
+	rb_iv_set(obj, "@filename", rb_str_new_frozen(filename));
+	return obj;
+}
 
-VALUE m_node_to_ary(NODE *node)
+/*
+ * call-seq:
+ *   obj[path]
+ *
+ * Loads the entry with the given logical path (e.g. <tt>'foo/bar'</tt>)
+ * and returns the NodeMarshal object or nil if the entry is absent.
+ * The garbage collection is not forced after the loading
+ */
+static VALUE m_bundle_aref(VALUE self, VALUE path)
 {
-	int i, type, ut[3];
-	VALUE uref[3];
-	VALUE entry = rb_ary_new();
-	/* Special case: NULL node */
-	if (node == NULL)
-	{
+	VALUE entry, source, node;
+	const char *buf;
+	long len;
+	entry = rb_hash_lookup2(rb_iv_get(self, "@toc"), rb_obj_as_string(path), Qnil);
+	if (entry == Qnil)
 		return Qnil;
-	}
-	/* Save node name */
-	type = nd_type(node);
-	rb_ary_push(entry, ID2SYM(rb_intern(ruby_node_name(type))));
-
-	ut[0] = nodes_ctbl[type * 3];
-	ut[1] = nodes_ctbl[type * 3 + 1];
-	ut[2] = nodes_ctbl[type * 3 + 2];
-
-	uref[0] = node->u1.value;
-	uref[1] = node->u2.value;
-	uref[2] = node->u3.value;
-
-
-	for (i = 0; i < 3; i++)
-	{
-		if (ut[i] == NT_NODE)
-		{
-			if (nd_type(node) != NODE_OP_ASGN2 || i != 2)
-			{
-				rb_ary_push(entry, m_node_to_ary(RNODE(uref[i])));
-			}
-			else
-			{
-				VALUE child = rb_ary_new();
-				if (ut[i] != 0 && TYPE(ut[i]) != T_NODE)
-					rb_raise(rb_eArgError, "print_node: broken node 0x%s", RSTRING_PTR(value_to_str(ut[i])));
-				rb_ary_push(child, ID2SYM(rb_intern("NODE_OP_ASGN2")));
-				rb_ary_push(child, LONG2NUM((intptr_t) RNODE(uref[i])->u1.value));
-				rb_ary_push(child, LONG2NUM((intptr_t) RNODE(uref[i])->u2.value));
-				rb_ary_push(child, LONG2NUM((intptr_t) RNODE(uref[i])->u3.value));
-				rb_ary_push(entry, child);
-			}
-		}
-		else if (ut[i] == NT_VALUE)
-		{
-			rb_ary_push(entry, uref[i]);
-		}
-		else if (ut[i] == NT_ID)
-		{
-			rb_ary_push(entry, ID2SYM( (ID) uref[i]));
-		}
-		else if (ut[i] == NT_LONG)
-		{
-			rb_ary_push(entry, LONG2NUM( (intptr_t) uref[i]));
-		}
-		else if (ut[i] == NT_NULL)
-		{
-			rb_ary_push(entry, Qnil);
-		}
-		else if (ut[i] == NT_ARGS)
-		{
-			VALUE rargs = rb_hash_new();
-			VALUE rargs_env = rb_ary_new();
-#ifdef USE_RB_ARGS_INFO
-			ID id;
-			struct rb_args_info *args = (void *) uref[i];
-
-			rb_hash_aset(rargs, ID2SYM(rb_intern("pre_init")), m_node_to_ary(args->pre_init));
-			rb_hash_aset(rargs, ID2SYM(rb_intern("post_init")), m_node_to_ary(args->post_init));
-
-			id = args->first_post_arg;
-			rb_hash_aset(rargs, ID2SYM(rb_intern("first_post_arg")), (id) ? ID2SYM(id) : Qnil);
-			id = args->rest_arg;
-			rb_hash_aset(rargs, ID2SYM(rb_intern("rest_arg")), (id) ? ID2SYM(id) : Qnil);
-			id = args->block_arg;
-			rb_hash_aset(rargs, ID2SYM(rb_intern("block_arg")), (id) ? ID2SYM(id) : Qnil);
-
-			rb_hash_aset(rargs, ID2SYM(rb_intern("kw_args")), m_node_to_ary(args->kw_args));
-			rb_hash_aset(rargs, ID2SYM(rb_intern("kw_rest_arg")), m_node_to_ary(args->kw_rest_arg));
-			rb_hash_aset(rargs, ID2SYM(rb_intern("opt_args")), m_node_to_ary(args->opt_args));
-#endif
-			rb_ary_push(rargs_env, ID2SYM(rb_intern("ARGS")));
-			rb_ary_push(rargs_env, rargs);
-			rb_ary_push(entry, rargs_env);
-		}
-		else if (ut[i] == NT_IDTABLE)
-		{
-			VALUE ridtbl = rb_ary_new();
-			VALUE idtbl_ary = rb_ary_new();
-			int j, len;
-
-			ID *idtbl = (ID *) uref[i];
-			len = (uref[i]) ? *idtbl++ : 0;
-			for (j = 0; j < len; j++)
-			{
-				ID sym = *idtbl++;
-				VALUE val = ID2SYM(sym);
-				rb_ary_push(idtbl_ary, val);
-			}
-			rb_ary_push(ridtbl, ID2SYM(rb_intern("IDTABLE")));
-			rb_ary_push(ridtbl, idtbl_ary);
-			rb_ary_push(entry, ridtbl);
-		}
-		else if (ut[i] == NT_ENTRY)
-		{
-			struct rb_global_entry *gentry;
-			gentry = (struct rb_global_entry *) uref[i];
-			rb_ary_push(entry, ID2SYM(gentry->id));
-		}
-		else
-		{
-			rb_ary_push(entry, ID2SYM(rb_intern("UNKNOWN")));
-		}
-	}
-	return entry;
+	source = rb_iv_get(self, "@source");
+	if (TYPE(source) == T_STRING)
+		buf = RSTRING_PTR(source);
+	else
+		buf = mappedfile_get_data(source, &len);
+	node = rb_obj_alloc(rb_path2class("NodeMarshal"));
+	rb_iv_set(node, "@show_offsets", Qfalse);
+	return nodedump_from_buffer(node, source, buf + NUM2LONG(RARRAY_AREF(entry, 0)),
+		NUM2LONG(RARRAY_AREF(entry, 1)), 0, 1, NULL);
 }
 
 /*
  * call-seq:
- *   obj.to_a
+ *   obj.each { |path, node| block }
  *
- * Converts node to the array (mainly to allow exploration of AST
- * by the user). It shows information about rb_args_info and
- * ID *tbl that are not displayed by NodeMarshal#dump_tree and
- * NodeMarshal#dump_tree_short.
+ * Loads all entries in the order of the table of contents
  */
-static VALUE m_nodedump_to_a(VALUE self)
+static VALUE m_bundle_each(VALUE self)
 {
-	NODE *node = RNODE(rb_iv_get(self, "@node"));
-	VALUE gc_was_disabled = rb_gc_disable();
-	VALUE ary = m_node_to_ary(node);
-	if (gc_was_disabled == Qfalse)
+	VALUE paths;
+	long i;
+	RETURN_ENUMERATOR(self, 0, 0);
+	paths = rb_iv_get(self, "@paths");
+	for (i = 0; i < RARRAY_LEN(paths); i++)
 	{
-		rb_gc_enable();
+		VALUE path = RARRAY_AREF(paths, i);
+		rb_yield(rb_assoc_new(path, m_bundle_aref(self, path)));
 	}
-	return ary;
+	return self;
 }
 
-
 /*
  * call-seq:
- *   obj.to_bin
- * 
- * Converts NodeMarshal class example to the binary string that
- * can be saved to the file and used for loading the node from the file.
- * Format of the obtained binary dump depends on used platform (especially
- * size of the pointer) and Ruby version.
+ *   obj.include?(path)
+ *
+ * Checks if the entry with the given logical path is present
  */
-static VALUE m_nodedump_to_bin(VALUE self)
+static VALUE m_bundle_include(VALUE self, VALUE path)
+{
+	return (rb_hash_lookup2(rb_iv_get(self, "@toc"), rb_obj_as_string(path), Qnil) != Qnil) ?
+		Qtrue : Qfalse;
+}
+
+static void bundle_define_class(VALUE cNodeMarshal)
 {
-	VALUE hash = m_nodedump_to_hash(self);
-	VALUE cMarshal = rb_const_get(rb_cObject, rb_intern("Marshal"));
-	return rb_funcall(cMarshal, rb_intern("dump"), 1, hash);
+	cNodeBundle = rb_define_class_under(cNodeMarshal, "Bundle", rb_cObject);
+	rb_include_module(cNodeBundle, rb_mEnumerable);
+	rb_define_const(cNodeBundle, "MAGIC", rb_obj_freeze(rb_str_new2(NODEMARSHAL_BUNDLE_MAGIC)));
+	rb_define_singleton_method(cNodeBundle, "open", RUBY_METHOD_FUNC(m_bundle_s_open), 1);
+	rb_define_method(cNodeBundle, "initialize", RUBY_METHOD_FUNC(m_bundle_init), 1);
+	rb_define_method(cNodeBundle, "[]", RUBY_METHOD_FUNC(m_bundle_aref), 1);
+	rb_define_method(cNodeBundle, "each", RUBY_METHOD_FUNC(m_bundle_each), 0);
+	rb_define_method(cNodeBundle, "include?", RUBY_METHOD_FUNC(m_bundle_include), 1);
 }
 
 /*
@@ -2131,28 +6778,23 @@ static VALUE m_nodedump_inspect(VALUE self)
 	else
 	{
 		NODEInfo *ninfo;
-		Data_Get_Struct(val_nodeinfo, NODEInfo, ninfo);
+		TypedData_Get_Struct(val_nodeinfo, NODEInfo, &NODEInfo_type, ninfo);
 		sprintf(buf, 
 			"    NODEInfo struct:\n"
-			"      syms hash len (Symbols):         %d\n"
-			"      lits hash len (Literals):        %d\n"
-			"      idtabs hash len (ID tables):     %d\n"
-			"      gentries hash len (Global vars): %d\n"
-			"      nodes hash len (Nodes):          %d\n"
-			"      pnodes hash len (Parent nodes):  %d\n"			
+			"      syms table len (Symbols):         %d\n"
+			"      lits table len (Literals):        %d\n"
+			"      idtabs table len (ID tables):     %d\n"
+			"      gentries table len (Global vars): %d\n"
+			"      nodes table len (Nodes):          %d\n"
+			"      parents capacity (Parent nodes):  %d\n"
 #ifdef USE_RB_ARGS_INFO
-			"      args hash len (args info):       %d\n"
+			"      args table len (args info):       %d\n"
 #endif
 			,
-			FIX2INT(rb_funcall(ninfo->syms.vals, rb_intern("length"), 0)),
-			FIX2INT(rb_funcall(ninfo->lits.vals, rb_intern("length"), 0)),
-			FIX2INT(rb_funcall(ninfo->idtabs.vals, rb_intern("length"), 0)),
-			FIX2INT(rb_funcall(ninfo->gentries.vals, rb_intern("length"), 0)),
-			FIX2INT(rb_funcall(ninfo->nodes.vals, rb_intern("length"), 0)),
-			FIX2INT(rb_funcall(ninfo->pnodes.vals, rb_intern("length"), 0))			
+			ninfo->syms.pos, ninfo->lits.pos, ninfo->idtabs.pos,
+			ninfo->gentries.pos, ninfo->nodes.pos, ninfo->nodes_capacity
 #ifdef USE_RB_ARGS_INFO
-			,
-			FIX2INT(rb_funcall(ninfo->args.vals, rb_intern("length"), 0))
+			, ninfo->args.pos
 #endif
 		);
 	}
@@ -2165,7 +6807,7 @@ static VALUE m_nodedump_inspect(VALUE self)
 	else
 	{
 		NODEObjAddresses *objadr;
-		Data_Get_Struct(val_obj_addresses, NODEObjAddresses, objadr);
+		TypedData_Get_Struct(val_obj_addresses, NODEObjAddresses, &NODEObjAddresses_type, objadr);
 		sprintf(buf, 
 			"    NODEObjAddresses struct:\n"
 			"      syms_len (Num of symbols):      %d\n"
@@ -2213,6 +6855,7 @@ static VALUE m_nodedump_filename(VALUE self)
  */
 static VALUE m_nodedump_set_filename(VALUE self, VALUE val)
 {
+	rb_iv_set(self, "@bin_cache", Qnil); // Cached dump contains the old name
 	if (val != Qnil)
 	{
 		Check_Type(val, T_STRING);
@@ -2243,6 +6886,7 @@ static VALUE m_nodedump_filepath(VALUE self)
  */
 static VALUE m_nodedump_set_filepath(VALUE self, VALUE val)
 {
+	rb_iv_set(self, "@bin_cache", Qnil); // Cached dump contains the old name
 	if (val != Qnil)
 	{
 		Check_Type(val, T_STRING);
@@ -2291,7 +6935,7 @@ static VALUE m_base85r_decode(VALUE obj, VALUE input)
  */
 static VALUE m_nodedump_to_text(VALUE self)
 {
-	VALUE bin = m_nodedump_to_bin(self);
+	VALUE bin = nodedump_to_bin(self, 0, Qnil);
 	return base85r_encode(bin);
 }
 
@@ -2316,20 +6960,33 @@ static VALUE m_nodedump_node(VALUE self)
  */
 void Init_nodemarshal()
 {
-	static VALUE cNodeMarshal;
+	static VALUE cNodeMarshal, mLazyLoader;
 	init_nodes_table(nodes_ctbl, NODES_CTBL_SIZE);
 	base85r_init_tables();
 
 	cNodeMarshal = rb_define_class("NodeMarshal", rb_cObject);
+	// Version of the format of dumps made by NodeMarshal#to_bin
+	rb_define_const(cNodeMarshal, "MAGIC", rb_obj_freeze(rb_str_new2(NODEMARSHAL_BIN_MAGIC)));
 	rb_define_singleton_method(cNodeMarshal, "base85r_encode", RUBY_METHOD_FUNC(m_base85r_encode), 1);
 	rb_define_singleton_method(cNodeMarshal, "base85r_decode", RUBY_METHOD_FUNC(m_base85r_decode), 1);
-
-	rb_define_method(cNodeMarshal, "initialize", RUBY_METHOD_FUNC(m_nodedump_init), 2);
+	rb_define_singleton_method(cNodeMarshal, "symbols_memo_stats", RUBY_METHOD_FUNC(m_symbols_memo_stats), 0);
+	base85r_define_classes(cNodeMarshal);
+	codec_define_module(cNodeMarshal);
+	stats_define_methods(cNodeMarshal);
+	dict_define_class(cNodeMarshal);
+	bundle_define_class(cNodeMarshal);
+
+	rb_define_method(cNodeMarshal, "initialize", RUBY_METHOD_FUNC(m_nodedump_init), -1);
 	rb_define_method(cNodeMarshal, "to_hash", RUBY_METHOD_FUNC(m_nodedump_to_hash), 0);
 	rb_define_method(cNodeMarshal, "to_h", RUBY_METHOD_FUNC(m_nodedump_to_hash), 0);
-	rb_define_method(cNodeMarshal, "to_bin", RUBY_METHOD_FUNC(m_nodedump_to_bin), 0);
+	rb_define_method(cNodeMarshal, "stats", RUBY_METHOD_FUNC(m_nodedump_stats), 0);
+	rb_define_method(cNodeMarshal, "to_bin", RUBY_METHOD_FUNC(m_nodedump_to_bin), -1);
 	rb_define_method(cNodeMarshal, "to_text", RUBY_METHOD_FUNC(m_nodedump_to_text), 0);
 	rb_define_method(cNodeMarshal, "to_a", RUBY_METHOD_FUNC(m_nodedump_to_a), 0);
+	rb_define_method(cNodeMarshal, "node_type_counts", RUBY_METHOD_FUNC(m_nodedump_node_type_counts), 0);
+	rb_define_method(cNodeMarshal, "each_node", RUBY_METHOD_FUNC(m_nodedump_each_node), -1);
+	rb_define_method(cNodeMarshal, "find_calls", RUBY_METHOD_FUNC(m_nodedump_find_calls), 1);
+	rb_define_method(cNodeMarshal, "max_depth", RUBY_METHOD_FUNC(m_nodedump_max_depth), 0);
 	rb_define_method(cNodeMarshal, "to_ary", RUBY_METHOD_FUNC(m_nodedump_to_a), 0);
 	rb_define_method(cNodeMarshal, "dump_tree", RUBY_METHOD_FUNC(m_nodedump_parser_dump_tree), 0);
 	rb_define_method(cNodeMarshal, "dump_tree_short", RUBY_METHOD_FUNC(m_nodedump_dump_tree_short), 0);
@@ -2340,8 +6997,12 @@ void Init_nodemarshal()
 	// a) literals, symbols, generic information
 	rb_define_method(cNodeMarshal, "symbols", RUBY_METHOD_FUNC(m_nodedump_symbols), 0);
 	rb_define_method(cNodeMarshal, "change_symbol", RUBY_METHOD_FUNC(m_nodedump_change_symbol), 2);
+	rb_define_method(cNodeMarshal, "change_symbols", RUBY_METHOD_FUNC(m_nodedump_change_symbols), 1);
 	rb_define_method(cNodeMarshal, "literals", RUBY_METHOD_FUNC(m_nodedump_literals), 0);
 	rb_define_method(cNodeMarshal, "change_literal", RUBY_METHOD_FUNC(m_nodedump_change_literal), 2);
+	rb_define_method(cNodeMarshal, "change_literals", RUBY_METHOD_FUNC(m_nodedump_change_literals), -1);
+	rb_define_method(cNodeMarshal, "dedup_literals", RUBY_METHOD_FUNC(m_nodedump_dedup_literals), 0);
+	rb_define_method(cNodeMarshal, "dedup_nodes", RUBY_METHOD_FUNC(m_nodedump_dedup_nodes), 0);
 	rb_define_method(cNodeMarshal, "inspect", RUBY_METHOD_FUNC(m_nodedump_inspect), 0);
 	rb_define_method(cNodeMarshal, "node", RUBY_METHOD_FUNC(m_nodedump_node), 0);
 	// b) node and file names
@@ -2350,7 +7011,17 @@ void Init_nodemarshal()
 	rb_define_method(cNodeMarshal, "filename=", RUBY_METHOD_FUNC(m_nodedump_set_filename), 1);
 	rb_define_method(cNodeMarshal, "filepath", RUBY_METHOD_FUNC(m_nodedump_filepath), 0);
 	rb_define_method(cNodeMarshal, "filepath=", RUBY_METHOD_FUNC(m_nodedump_set_filepath), 1);
+	// Loader of methods from the lazy containers
+	mLazyLoader = rb_define_module_under(cNodeMarshal, "LazyLoader");
+	rb_define_singleton_method(mLazyLoader, "register", RUBY_METHOD_FUNC(m_lazy_register), 4);
+	rb_define_singleton_method(mLazyLoader, "invoke", RUBY_METHOD_FUNC(m_lazy_invoke), 6);
+	rb_define_singleton_method(mLazyLoader, "load", RUBY_METHOD_FUNC(m_lazy_load), 3);
+	rb_define_singleton_method(mLazyLoader, "stats", RUBY_METHOD_FUNC(m_lazy_stats), 0);
+	rb_define_singleton_method(mLazyLoader, "release", RUBY_METHOD_FUNC(m_lazy_release), 1);
+	lazy_registry = rb_hash_new();
+	rb_gc_register_address(&lazy_registry);
 	// C structure wrappers
 	cNodeObjAddresses = rb_define_class("NodeObjAddresses", rb_cObject);
 	cNodeInfo = rb_define_class("NodeInfo", rb_cObject);
+	cNodeMappedFile = rb_define_class("NodeMappedFile", rb_cObject);
 }
@@ -16,6 +16,15 @@
 /* Some constants */
 // Magic value with the version of the format
 #define NODEMARSHAL_MAGIC "NODEMARSHAL11"
+// Magic value of the binary container format (NodeMarshal#to_bin)
+#define NODEMARSHAL_BIN_MAGIC "NODEMARSHAL12"
+#define NODEMARSHAL_BIN_MAGIC_LEN 16
+// Magic value of the lazy container (NodeMarshal#to_bin(:lazy => true))
+#define NODEMARSHAL_LAZY_MAGIC "NODEMARSHAL12LZ"
+// Magic value of the shared dictionary (NodeMarshal::Dictionary#to_bin)
+#define NODEMARSHAL_DICT_MAGIC "NODEMARSHAL12DC"
+// Magic value of the bundle of many dumps (NodeMarshal::Bundle)
+#define NODEMARSHAL_BUNDLE_MAGIC "NODEMARSHAL12BN"
 // Type of the node "Child"
 #define NT_NULL 0
 #define NT_UNKNOWN 1
@@ -38,10 +47,85 @@
 #define VL_ARGS 5 // Global table of arguments info structures
 #define VL_LIT  6 // Global table of literals
 
+/* Sections of the binary container (NODEMARSHAL12) */
+#define SECT_ENCODINGS 0 // Names of encodings used by symbols and literals
+#define SECT_SYMBOLS   1 // Global table of identifiers
+#define SECT_LITERALS  2 // Global table of literals
+#define SECT_GENTRIES  3 // Global variables table
+#define SECT_IDTABLES  4 // Global table of local ID tables
+#define SECT_ARGS      5 // Global table of arguments info structures
+#define SECT_NODES     6 // Global table of nodes
+#define SECT_NUM       7 // Number of required sections
+#define SECT_ISEQ      7 // Compiled InstructionSequence (optional, see BIN_FLAG_ISEQ)
+#define SECT_MAX       8 // Number of known sections
+
+/* Flags of the binary container (NODEMARSHAL12) */
+#define BIN_FLAG_COLUMNAR 0x1 // Nodes section uses the columnar layout
+#define BIN_FLAG_ISEQ     0x2 // Container has the companion ISeq binary (SECT_ISEQ)
+#define BIN_FLAG_DICT     0x4 // Container refers to the shared dictionary (NodeMarshal::Dictionary)
+#define BIN_FLAGS_KNOWN   0x7 // All flags supported by the loader
+#define NODE_COL_WIDE     0x80 // Columnar layout: value is in the table of wide values
+
+/* Lazy container */
+#define LAZY_MIN_NODES 16 // Smaller methods are not moved to separate sections
+
+/* Types of the symbols table entries */
+#define SYMT_STRING 0 // Symbol name with encoding
+#define SYMT_RAWID  1 // Symbol that cannot be represented as String
+#define SYMT_DICT   2 // Ordinal of the symbol in the shared dictionary
+
+/* Types of the literals table entries */
+#define LITT_STRING  0 // String with encoding
+#define LITT_SYMBOL  1 // Symbol name with encoding
+#define LITT_FLOAT   2 // Float that is not embedded into VALUE
+#define LITT_MARSHAL 3 // Any other object serialized by Marshal
+#define LITT_DICT    4 // Ordinal of the literal in the shared dictionary
+
+/* Minimal size of the data (bytes) that is decoded without GVL */
+#define NOGVL_MIN_BYTES 65536
+
 /* base85r.c */
+#define BASE85R_ERR_CORRUPTED -1 // Invalid text
+#define BASE85R_ERR_SHORT -2 // Text is too short
+#define BASE85R_ERR_SINK -3 // Decoding is stopped by the sink
 void base85r_init_tables();
 VALUE base85r_encode(VALUE input);
 VALUE base85r_decode(VALUE input);
+void base85r_define_classes(VALUE cNodeMarshal);
+typedef int (*base85r_sink)(void *arg, const unsigned char *ptr, long len);
+int base85r_decode_stream(const char *text, long len, base85r_sink sink, void *arg);
+
+/* compress.c */
+#define CODEC_MAGIC "NMZ1" // Signature of the compressed frame
+#define CODEC_HEADER_LEN 16 // Size of the frame header
+#define CODEC_NONE 0
+#define CODEC_ZLIB 1
+#define CODEC_ZSTD 2
+int codec_is_frame(const char *ptr, long len);
+VALUE codec_decompress(const char *ptr, long len);
+VALUE codec_decode_base85r(VALUE text);
+uint32_t codec_checksum(const unsigned char *ptr, long len);
+void codec_define_module(VALUE cNodeMarshal);
+
+/* nodestats.c */
+#define STATS_MAX_PHASES 24 // Maximal number of phases of one operation
+typedef struct {
+	const char *names[STATS_MAX_PHASES]; // Names of the finished phases
+	double times[STATS_MAX_PHASES]; // Wall time of phases, seconds
+	size_t allocs[STATS_MAX_PHASES]; // Number of allocated Ruby objects
+	int len;
+	double t_begin, t_mark; // Beginning of the operation and of the current phase
+	size_t a_begin, a_mark;
+} NodeStats;
+void NodeStats_init(NodeStats *st);
+void NodeStats_phase(NodeStats *st, const char *name);
+void NodeStats_save(NodeStats *st, VALUE self, const char *op);
+VALUE NodeStats_toHash(VALUE flat);
+void stats_define_methods(VALUE cNodeMarshal);
+
+/* mmapfile.c */
+VALUE mappedfile_open(VALUE klass, VALUE filename);
+const char *mappedfile_get_data(VALUE obj, long *len);
 
 /* nodechk.c */
 void check_nodes_child_info(int pos);
@@ -0,0 +1,177 @@
+/*
+ * Instrumentation of node loading and dumping (see NodeMarshal#stats
+ * and NodeMarshal::Stats).
+ *
+ * Each operation (load, parse, to_hash, to_bin) is divided into phases.
+ * Wall time and the number of allocated Ruby objects are saved for each
+ * phase to the C structure (NodeStats) without creation of Ruby objects;
+ * only the final results are saved to the NodeMarshal object as the flat
+ * array: [phase1, time1, allocs1, phase2, time2, allocs2, ..., :total, time, allocs].
+ * If the listener is set (NodeMarshal.stats_listener=) it is called
+ * after each operation as listener.call(operation, node, phases_hash).
+ *
+ * (C) 2015-2017 Alexey Voskov
+ * License: BSD-2-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/time.h>
+#include <ruby.h>
+#include <ruby/version.h>
+#include "nodedump.h"
+
+static VALUE stats_listener = Qnil;
+static ID id_total_allocated_objects;
+
+/*
+ * Returns the monotonic time in seconds
+ */
+static double stats_clock(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + ts.tv_nsec * 1e-9;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double) tv.tv_sec + tv.tv_usec * 1e-6;
+#endif
+}
+
+/*
+ * Returns the total number of allocated Ruby objects (0 if it is
+ * not available, e.g. in Ruby 1.9.x)
+ */
+static size_t stats_allocs(void)
+{
+#ifdef HAVE_RB_GC_STAT
+	return rb_gc_stat(ID2SYM(id_total_allocated_objects));
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Starts the measurement of the operation (and of its first phase)
+ */
+void NodeStats_init(NodeStats *st)
+{
+	st->len = 0;
+	st->t_begin = st->t_mark = stats_clock();
+	st->a_begin = st->a_mark = stats_allocs();
+}
+
+/*
+ * Finishes the current phase of the operation and starts the next one.
+ * st may be NULL (statistics are not collected)
+ */
+void NodeStats_phase(NodeStats *st, const char *name)
+{
+	double t;
+	size_t a;
+	if (st == NULL)
+		return;
+	t = stats_clock();
+	a = stats_allocs();
+	if (st->len < STATS_MAX_PHASES)
+	{
+		st->names[st->len] = name;
+		st->times[st->len] = t - st->t_mark;
+		st->allocs[st->len] = a - st->a_mark;
+		st->len++;
+	}
+	st->t_mark = t;
+	st->a_mark = a;
+}
+
+/*
+ * Converts the flat array of the phases to the Hash:
+ * {phase => {:time => seconds, :allocs => number}}
+ */
+VALUE NodeStats_toHash(VALUE flat)
+{
+	VALUE ans = rb_hash_new();
+	long i;
+	Check_Type(flat, T_ARRAY);
+	for (i = 0; i + 2 < RARRAY_LEN(flat); i += 3)
+	{
+		VALUE phase = rb_hash_new();
+		rb_hash_aset(phase, ID2SYM(rb_intern("time")), RARRAY_AREF(flat, i + 1));
+		rb_hash_aset(phase, ID2SYM(rb_intern("allocs")), RARRAY_AREF(flat, i + 2));
+		rb_hash_aset(ans, RARRAY_AREF(flat, i), phase);
+	}
+	return ans;
+}
+
+/*
+ * Finishes the operation: saves its phases (and the total) to the @stats
+ * Hash of the object (by the operation name) and calls the listener
+ */
+void NodeStats_save(NodeStats *st, VALUE self, const char *op)
+{
+	VALUE flat, stats, op_sym = ID2SYM(rb_intern(op));
+	int i;
+	double t = stats_clock();
+	size_t a = stats_allocs();
+	flat = rb_ary_new2((st->len + 1) * 3);
+	for (i = 0; i < st->len; i++)
+	{
+		rb_ary_push(flat, ID2SYM(rb_intern(st->names[i])));
+		rb_ary_push(flat, DBL2NUM(st->times[i]));
+		rb_ary_push(flat, SIZET2NUM(st->allocs[i]));
+	}
+	rb_ary_push(flat, ID2SYM(rb_intern("total")));
+	rb_ary_push(flat, DBL2NUM(t - st->t_begin));
+	rb_ary_push(flat, SIZET2NUM(a - st->a_begin));
+	stats = rb_iv_get(self, "@stats");
+	if (stats == Qnil)
+	{
+		stats = rb_hash_new();
+		rb_iv_set(self, "@stats", stats);
+	}
+	rb_hash_aset(stats, op_sym, flat);
+	if (stats_listener != Qnil)
+		rb_funcall(stats_listener, rb_intern("call"), 3, op_sym, self, NodeStats_toHash(flat));
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal.stats_listener = obj
+ *
+ * Sets the object that receives statistics of all operations:
+ * <tt>obj.call(operation, node, phases)</tt> is called after
+ * loading (<tt>:load</tt>), parsing (<tt>:parse</tt>) and dumping
+ * (<tt>:to_hash</tt>, <tt>:to_bin</tt>) of the node. +phases+ has
+ * the same format as the operations in NodeMarshal#stats.
+ * +nil+ disables the listener. Usually it is used by NodeMarshal::Stats
+ */
+static VALUE m_stats_set_listener(VALUE obj, VALUE listener)
+{
+	if (listener != Qnil && !rb_respond_to(listener, rb_intern("call")))
+		rb_raise(rb_eArgError, "Listener must respond to call");
+	stats_listener = listener;
+	return listener;
+}
+
+/*
+ * call-seq:
+ *   NodeMarshal.stats_listener
+ *
+ * Returns the listener of statistics (see NodeMarshal.stats_listener=)
+ */
+static VALUE m_stats_listener(VALUE obj)
+{
+	return stats_listener;
+}
+
+void stats_define_methods(VALUE cNodeMarshal)
+{
+	id_total_allocated_objects = rb_intern("total_allocated_objects");
+	rb_define_singleton_method(cNodeMarshal, "stats_listener=", RUBY_METHOD_FUNC(m_stats_set_listener), 1);
+	rb_define_singleton_method(cNodeMarshal, "stats_listener", RUBY_METHOD_FUNC(m_stats_listener), 0);
+	rb_gc_register_address(&stats_listener);
+}
@@ -1,10 +1,11 @@
 require_relative '../ext/node-marshal/nodemarshal.so'
-begin
-	require 'zlib'
-rescue LoadError
-	# If zlib library is absent in the system no support for
-	# compression will be provided in 
-end
+require 'pathname'
+require_relative 'node-marshal/compile_cache.rb'
+require_relative 'node-marshal/batch_compiler.rb'
+require_relative 'node-marshal/dictionary.rb'
+require_relative 'node-marshal/bundle.rb'
+require_relative 'node-marshal/stats.rb'
+require_relative 'node-marshal/preload.rb'
 
 # Implementation of Array::to_h method for Ruby 1.9 (and probably 2.0)
 # Don't use for Ruby 2.2.x and Ruby 2.3.x
@@ -26,17 +27,119 @@ class NodeMarshal
 	# call-seq:
 	#   obj.to_compiled_rb(outfile, opts)
 	#
-	# Transforms node to the Ruby file
-	# - +outfile+ -- name of the output file
-	# - +opts+ -- Hash with options (+:compress+, +:so_path+)
-	#   +:compress+ can be +true+ or +false+, +:so_path+ is a test string 
+	# Transforms node to the Ruby file. Returns the text of the file
+	# (it is also written to +outfile+ if it is not +nil+).
+	# - +outfile+ -- name of the output file (the text is written directly
+	#   to the file and is read back, see NodeMarshal#write_compiled_rb_file)
+	# - +opts+ -- Hash with options (+:compress+, +:level+, +:dictionary+, +:so_path+,
+	#   +:shared_dict+, +:gc_start+, +:nodes_layout+, +:lazy+, +:iseq+,
+	#   +:dedup_literals+, +:dedup_nodes+)
+	#   +:compress+ can be +true+ (zlib), +false+, +:zlib+ or +:zstd+ (see
+	#   NodeMarshal::Codec.codecs), +:level+ is the compression level,
+	#   +:dictionary+ is the name of the file with the compression dictionary
+	#   (see NodeMarshal::train_dictionary; the file is loaded by the compiled
+	#   file from the same relative path), +:shared_dict+ is the name of the
+	#   file with the shared dictionary of symbols and literals (see
+	#   NodeMarshal::Dictionary; it is also loaded from the same relative
+	#   path), +:so_path+ is a test string 
 	#   with the command for nodemarshal.so inclusion (default is 
-	#   <tt>require_relative '../ext/node-marshal/nodemarshal.so'</tt>)
+	#   <tt>require_relative '../ext/node-marshal/nodemarshal.so'</tt>),
+	#   +:gc_start+ is +true+ if the loader must force the garbage
+	#   collection after the node loading (see NodeMarshal#new),
+	#   +:nodes_layout+ is the layout of nodes in the dump (see NodeMarshal#to_bin),
+	#   +:lazy+ enables the lazy loading of methods (see NodeMarshal#to_bin),
+	#   +:iseq+ adds the compiled instruction sequence for the +outfile+ path
+	#   (it is used instead of the code generation if the Ruby version and
+	#   the path of the loaded file are the same; see NodeMarshal#to_bin),
+	#   +:dedup_literals+ merges equal literals (see NodeMarshal#dedup_literals),
+	#   +:dedup_nodes+ merges identical literal-only subtrees (see NodeMarshal#dedup_nodes),
+	#   +:payload+ is +:base85r+ (default: the dump is encoded to the ASCII text
+	#   inside the file) or +:raw+ (the dump is written as is after <tt>__END__</tt>
+	#   and the loader maps the file to the memory, see NodeMarshal#new); raw
+	#   files are smaller and are loaded without parsing and decoding of the text
 	#
 	# See also NodeMarshal::compile_rb_file
 	def to_compiled_rb(outfile, *args)
+		if outfile != nil
+			write_compiled_rb_file(outfile, *args)
+			return File.binread(outfile)
+		end
+		return NodeMarshal.bin_to_compiled_rb(compiled_rb_dump(outfile, *args), *args)
+	end
+
+	# call-seq:
+	#   obj.write_compiled_rb_file(outfile, opts)
+	#
+	# Writes the Ruby file (see NodeMarshal#to_compiled_rb) without creation
+	# of the whole text in the memory. Returns the name of the file
+	def write_compiled_rb_file(outfile, *args)
+		NodeMarshal.save_compiled_rb(outfile, compiled_rb_dump(outfile, *args), *args)
+	end
+
+	# Returns the dump for the compiled Ruby file (options of to_bin
+	# are taken from the options of NodeMarshal#to_compiled_rb)
+	def compiled_rb_dump(outfile, *args)
+		bin_opts = {}
+		if args.length > 0
+			[:nodes_layout, :lazy, :dedup_literals, :dedup_nodes].each do |key|
+				bin_opts[key] = args[0][key] if args[0].has_key?(key)
+			end
+			if args[0][:iseq]
+				bin_opts[:iseq] = (outfile != nil) ? File.expand_path(outfile) : true
+			end
+			if args[0][:shared_dict]
+				bin_opts[:shared_dict] = NodeMarshal::Dictionary.load_file(args[0][:shared_dict])
+			end
+		end
+		self.to_bin(bin_opts)
+	end
+	private :compiled_rb_dump
+
+	# call-seq:
+	#   NodeMarshal::bin_to_compiled_rb(bin, opts)
+	#
+	# Transforms the node dump (see NodeMarshal#to_bin) to the text of
+	# the Ruby file. Options are the same as for NodeMarshal#to_compiled_rb
+	# (+:nodes_layout+, +:lazy+ and +:iseq+ are ignored). If the dump refers
+	# to the shared dictionary then its file must be given by +:shared_dict+.
+	def self.bin_to_compiled_rb(bin, *args)
+		write_compiled_rb(String.new, bin, *args)
+	end
+
+	# call-seq:
+	#   NodeMarshal::save_compiled_rb(outfile, bin, opts)
+	#
+	# Writes the Ruby file with the node dump (see NodeMarshal::write_compiled_rb).
+	# The text is written to the temporary file that is renamed to +outfile+
+	# after success, so errors (e.g. invalid options) don't damage the existing
+	# file. Returns +outfile+
+	def self.save_compiled_rb(outfile, bin, *args)
+		tmp = "#{outfile}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+		begin
+			# Binary mode: offset of the raw payload must not be changed
+			# by newlines conversion
+			File.open(tmp, 'wb') {|fp| write_compiled_rb(fp, bin, *args) }
+			File.rename(tmp, outfile)
+		ensure
+			File.delete(tmp) if File.exist?(tmp)
+		end
+		outfile
+	end
+
+	# call-seq:
+	#   NodeMarshal::write_compiled_rb(out, bin, opts)
+	#
+	# Writes the text of the Ruby file with the node dump (see
+	# NodeMarshal::bin_to_compiled_rb) to +out+ (IO or String). The encoded
+	# data is written by chunks (see NodeMarshal::Base85r::Encoder) without
+	# creation of the whole text in the memory. Returns +out+.
+	def self.write_compiled_rb(out, bin, *args)
 		compress = true
+		payload = :base85r
 		so_path = "require_relative '../ext/node-marshal/nodemarshal.so'"
+		load_opts = ""
+		codec_opts = {}
+		dict_file, shared_dict_file = nil, nil
 		if args.length > 0
 			opts = args[0]
 			if opts.has_key?(:compress)
@@ -45,41 +148,118 @@ class NodeMarshal
 			if opts.has_key?(:so_path)
 				so_path = opts[:so_path]
 			end
+			if opts[:gc_start]
+				load_opts = ", :gc_start => true"
+			end
+			codec_opts[:level] = opts[:level] if opts.has_key?(:level)
+			dict_file = opts[:dictionary]
+			shared_dict_file = opts[:shared_dict]
+			payload = opts[:payload] if opts.has_key?(:payload)
 		end
-		# Compression
+		if ![:base85r, :raw].include?(payload)
+			raise ArgumentError, "Unknown payload #{payload.inspect} (it must be :base85r or :raw)"
+		end
+		# Shared dictionary is loaded before the dump
+		if shared_dict_file != nil
+			shared_dict_include = "NodeMarshal::Dictionary.load_file(" +
+				"File.expand_path(#{dict_relative_path(out, shared_dict_file).dump}, File.dirname(__FILE__)))"
+		else
+			shared_dict_include = "# No shared dictionary"
+		end
+		# Compression (by the native codec, see NodeMarshal::Codec)
+		dict_include = "# No dictionary"
 		if compress
-			if !defined?(Zlib)
-				raise "Compression is not supported: Zlib is absent"
+			codec_opts[:codec] = (compress == true) ? :zlib : compress.to_sym
+			if dict_file != nil
+				codec_opts[:dictionary] = File.binread(dict_file)
+				dict_include = "NodeMarshal::Codec.add_dictionary(File.binread(" +
+					"File.expand_path(#{dict_relative_path(out, dict_file).dump}, File.dirname(__FILE__))))"
 			end
-			zlib_include = "require 'zlib'"
-			data_txt = NodeMarshal.base85r_encode(Zlib::deflate(self.to_bin))
-			data_bin = "Zlib::inflate(NodeMarshal.base85r_decode(data_txt))"
+			data = NodeMarshal::Codec.compress(bin, codec_opts)
 		else
-			zlib_include = "# No compression"
-			data_txt = self.to_text
-			data_bin = "NodeMarshal.base85r_decode(data_txt)"
+			data = bin
 		end
 		# Document header
-		txt = <<EOS
+		header = <<EOS
 # Ruby compressed source code
 # RUBY_PLATFORM: #{RUBY_PLATFORM}
 # RUBY_VERSION: #{RUBY_VERSION}
-#{zlib_include}
 #{so_path}
-data_txt = <<DATABLOCK
-#{data_txt}
+#{dict_include}
+#{shared_dict_include}
+EOS
+		if payload == :raw
+			out << raw_payload_stub(header, data.bytesize, load_opts)
+			out << data
+			return out
+		end
+		out << header
+		out << "data_txt = <<DATABLOCK\n"
+		# Encoded data
+		encoder = NodeMarshal::Base85r::Encoder.new(data.bytesize, out)
+		encoder << data
+		encoder.finish
+		# Loader: decoding, decompression and loading are fused
+		# (intermediate strings are not created)
+		out << <<EOS
+
 DATABLOCK
-data_bin = #{data_bin}
-node = NodeMarshal.new(:binmemory, data_bin)
+node = NodeMarshal.new(:base85r, data_txt#{load_opts})
 node.filename = __FILE__
 node.filepath = File.expand_path(node.filename)
 node.compile.eval
 EOS
-		# Process input arguments
-		if outfile != nil
-			File.open(outfile, 'w') {|fp| fp << txt}
+		out
+	end
+
+	# Loader of the compiled file with the raw payload after __END__. The dump
+	# is read from the offset of the payload that is written to the loader
+	# itself, so the offset is found iteratively (the length of the number
+	# changes the length of the text). DATA is not used: it is defined only
+	# for the main script
+	def self.raw_payload_stub(header, data_len, load_opts)
+		offset = 0
+		loop do
+			stub = header + <<EOS
+node = NodeMarshal.new(:binmmap, [__FILE__, #{offset}, #{data_len}]#{load_opts})
+node.filename = __FILE__
+node.filepath = File.expand_path(node.filename)
+node.compile.eval
+__END__
+EOS
+			stub.force_encoding('BINARY')
+			return stub if stub.bytesize == offset
+			offset = stub.bytesize
 		end
-		return txt
+	end
+	private_class_method :raw_payload_stub
+
+	# Path of the dictionary file relative to the directory of the
+	# written file (+out+ may be File or String)
+	def self.dict_relative_path(out, dict_file)
+		dir = (out.respond_to?(:path) && out.path) ? File.dirname(out.path) : Dir.pwd
+		dir = File.expand_path(dir)
+		path = File.expand_path(dict_file)
+		begin
+			Pathname.new(path).relative_path_from(Pathname.new(dir)).to_s
+		rescue ArgumentError
+			path # Different drives (Windows)
+		end
+	end
+	private_class_method :dict_relative_path
+
+	# call-seq:
+	#   NodeMarshal::train_dictionary(dictfile, inpfiles, size = 32768, codec = :zlib)
+	#
+	# Trains the compression dictionary (see NodeMarshal::Codec.train_dictionary)
+	# by the node dumps of +inpfiles+ (Ruby sources) and writes it to +dictfile+.
+	# The dictionary is used by the <tt>:dictionary => dictfile</tt> option
+	# of NodeMarshal#to_compiled_rb. Returns the dictionary id.
+	def self.train_dictionary(dictfile, inpfiles, size = 32768, codec = :zlib)
+		samples = inpfiles.map {|name| NodeMarshal.new(:srcfile, name).to_bin }
+		dict = NodeMarshal::Codec.train_dictionary(samples, size, codec)
+		File.binwrite(dictfile, dict)
+		NodeMarshal::Codec.add_dictionary(dict)
 	end
 
 	# call-seq:
@@ -87,10 +267,18 @@ EOS
 	#
 	# Reads +.rb+ file (Ruby source) and compiles it to .rb file containing
 	# compressed AST node and its loader. This functions is an envelope for
-	# NodeMarshal#to_compiled_rb
+	# NodeMarshal#to_compiled_rb. Additional options:
+	# - +:cache_dir+ or +:cache+ -- compile cache used for the source
+	#   file loading (see NodeMarshal::CompileCache)
 	def self.compile_rb_file(outfile, inpfile, *args)
-		node = NodeMarshal.new(:srcfile, inpfile)
-		node.to_compiled_rb(outfile, *args)
+		load_opts = {}
+		if args.length > 0
+			[:cache_dir, :cache].each do |key|
+				load_opts[key] = args[0][key] if args[0].has_key?(key)
+			end
+		end
+		node = NodeMarshal.new(:srcfile, inpfile, load_opts)
+		node.write_compiled_rb_file(outfile, *args)
 		return true
 	end
 
@@ -114,13 +302,10 @@ EOS
 		if values.size != values.uniq.size
 			raise ArgumentError, "values (new names) must be unique"
 		end
-		# c) uniqueness of values after replacement
-		# TODO: MAKE IT!!!
-		# Use NodeMarshal C part to replace the symbols
+		# c) uniqueness of values after replacement is checked by
+		# NodeMarshal C part that replaces the symbols
 		self.to_hash # To initialize Hash with preparsed Ruby AST NODE
-		syms_subs.each do |key, value|
-			change_symbol(key, value)
-		end
+		change_symbols(syms_subs)
 		self
 	end
 
@@ -0,0 +1,216 @@
+require 'fileutils'
+require 'thread'
+
+class NodeMarshal
+	# Compiles all Ruby files from the directory tree (see
+	# NodeMarshal::compile_rb_file) by one or several worker processes.
+	# The parser requires GVL, so the parallelism is achieved by
+	# the forked workers that share the loaded extension. Each worker is
+	# a pipeline: the main thread parses the file k+1 and makes its dump
+	# (NodeMarshal#to_bin) while the second thread compresses, encodes
+	# and writes the file k.
+	#
+	# Usage:
+	#   bc = NodeMarshal::BatchCompiler.new('src', 'out', :jobs => 4)
+	#   bc.run {|res| puts "#{res.inpfile}: #{res.total_time}" }
+	class BatchCompiler
+		# Result of the file compilation
+		# - +inpfile+ -- name of the file relative to the source directory
+		# - +parse_time+ -- time of parsing and dumping (seconds)
+		# - +encode_time+ -- time of compression, encoding and writing (seconds)
+		# - +error+ -- error message or +nil+
+		Result = Struct.new(:inpfile, :parse_time, :encode_time, :error) do
+			def total_time
+				parse_time + encode_time
+			end
+		end
+
+		attr_reader :src_dir, :out_dir, :files, :jobs, :results, :total_time
+
+		# call-seq:
+		#   NodeMarshal::BatchCompiler.new(src_dir, out_dir, opts)
+		#
+		# - +src_dir+ -- directory with the source files (<tt>**/*.rb</tt>)
+		# - +out_dir+ -- output directory (the structure of subdirectories
+		#   is preserved)
+		# - +opts+ -- Hash with options: +:jobs+ is the number of worker
+		#   processes (default is 1, workers are not used on platforms without
+		#   fork), other options are the same as for NodeMarshal::compile_rb_file
+		def initialize(src_dir, out_dir, opts = {})
+			@src_dir, @out_dir = src_dir.to_s, out_dir.to_s
+			@jobs = opts.fetch(:jobs, 1).to_i
+			raise ArgumentError, "Number of jobs must be positive" if @jobs < 1
+			@jobs = 1 if !Process.respond_to?(:fork)
+			@opts = opts.reject {|key, value| key == :jobs }
+			@load_opts = {}
+			[:cache_dir, :cache].each do |key|
+				@load_opts[key] = @opts[key] if @opts.has_key?(key)
+			end
+			@bin_opts = {}
+			[:nodes_layout, :lazy, :dedup_literals, :dedup_nodes].each do |key|
+				@bin_opts[key] = @opts[key] if @opts.has_key?(key)
+			end
+			if @opts[:shared_dict]
+				@bin_opts[:shared_dict] = NodeMarshal::Dictionary.load_file(@opts[:shared_dict])
+			end
+			@files = Dir.chdir(@src_dir) { Dir.glob('**/*.rb').sort }
+			@results = []
+			@total_time = 0.0
+		end
+
+		# call-seq:
+		#   obj.run { |result| block }
+		#
+		# Compiles the files and returns the array of NodeMarshal::BatchCompiler::Result
+		# structures. The block (optional) is called for each compiled file
+		# in the order of completion.
+		def run(&block)
+			t = Time.now
+			@results = []
+			on_result = lambda do |res|
+				@results << res
+				block.call(res) if block
+			end
+			if @jobs == 1 || @files.size < 2
+				compile_pipeline(@files, &on_result)
+			else
+				run_workers(on_result)
+			end
+			@total_time = Time.now - t
+			@results
+		end
+
+		# call-seq:
+		#   obj.errors
+		#
+		# Returns results of the files that were not compiled
+		def errors
+			@results.select {|res| res.error }
+		end
+
+	private
+		# Parsing stage (requires GVL)
+		def parse_stage(inpfile)
+			t = Time.now
+			node = NodeMarshal.new(:srcfile, File.join(@src_dir, inpfile), @load_opts)
+			bin_opts = @bin_opts
+			if @opts[:iseq]
+				bin_opts = bin_opts.merge(:iseq => File.expand_path(File.join(@out_dir, inpfile)))
+			end
+			[inpfile, node.to_bin(bin_opts), Time.now - t, nil]
+		rescue StandardError, ScriptError => e
+			[inpfile, nil, Time.now - t, "#{e.class}: #{e.message}"]
+		end
+
+		# Compression, encoding and writing stage
+		def encode_stage(inpfile, bin, parse_time, error)
+			t = Time.now
+			if error.nil?
+				begin
+					outfile = File.join(@out_dir, inpfile)
+					FileUtils.mkdir_p(File.dirname(outfile))
+					NodeMarshal.save_compiled_rb(outfile, bin, @opts)
+				rescue StandardError => e
+					error = "#{e.class}: #{e.message}"
+				end
+			end
+			Result.new(inpfile, parse_time, Time.now - t, error)
+		end
+
+		# Two-stage pipeline: files are parsed by the current thread and
+		# encoded by the second one
+		def compile_pipeline(inpfiles)
+			queue = SizedQueue.new(2)
+			encoder = Thread.new do
+				while (item = queue.pop)
+					yield encode_stage(*item)
+				end
+			end
+			begin
+				inpfiles.each {|inpfile| queue << parse_stage(inpfile) }
+			ensure
+				queue << nil
+				encoder.join
+			end
+		end
+
+		# Worker process: reads indexes of files from the pipe and writes
+		# lines with the serialized results
+		def worker_loop(jobs_rd, res_wr)
+			inpfiles = Enumerator.new do |y|
+				while (line = jobs_rd.gets)
+					y << @files[line.to_i]
+				end
+			end
+			compile_pipeline(inpfiles) do |res|
+				res_wr.write([Marshal.dump(res.to_a)].pack('m0') + "\n")
+				res_wr.flush
+			end
+		end
+
+		Worker = Struct.new(:pid, :jobs_wr, :res_rd, :buf, :pending)
+
+		# Distributes the files between the workers: each worker has
+		# two files in the queue (for the pipeline), the next file is
+		# sent after receiving the result
+		def run_workers(on_result)
+			next_file = 0
+			workers = []
+			[@jobs, @files.size].min.times do
+				jobs_rd, jobs_wr = IO.pipe
+				res_rd, res_wr = IO.pipe
+				pid = fork do
+					workers.each {|w| w.jobs_wr.close; w.res_rd.close }
+					jobs_wr.close; res_rd.close
+					begin
+						worker_loop(jobs_rd, res_wr)
+					ensure
+						res_wr.close
+						exit!(0) # Skip at_exit handlers of the parent
+					end
+				end
+				jobs_rd.close; res_wr.close
+				workers << Worker.new(pid, jobs_wr, res_rd, '', [])
+			end
+			send_job = lambda do |w|
+				if next_file < @files.size
+					w.pending << next_file
+					w.jobs_wr.puts(next_file)
+					next_file += 1
+				end
+				if next_file == @files.size && !w.jobs_wr.closed?
+					w.jobs_wr.close
+				end
+			end
+			workers.each {|w| 2.times { send_job.call(w) } }
+			active = workers.dup
+			while active.size > 0
+				IO.select(active.map(&:res_rd))[0].each do |io|
+					w = active.find {|x| x.res_rd == io }
+					begin
+						w.buf << io.readpartial(65536)
+					rescue EOFError
+						# Worker has finished (or crashed before sending all results)
+						w.pending.each do |ind|
+							on_result.call(Result.new(@files[ind], 0.0, 0.0, "Worker process failed"))
+						end
+						io.close
+						active.delete(w)
+						next
+					end
+					while (pos = w.buf.index("\n"))
+						res = Result.new(*Marshal.load(w.buf[0, pos].unpack('m0')[0]))
+						w.buf = w.buf[pos + 1..-1]
+						w.pending.shift # Files are processed in the order of sending
+						on_result.call(res)
+						send_job.call(w)
+					end
+				end
+			end
+			workers.each do |w|
+				w.jobs_wr.close if !w.jobs_wr.closed?
+				Process.wait(w.pid)
+			end
+		end
+	end
+end
@@ -0,0 +1,232 @@
+require 'monitor'
+
+class NodeMarshal
+	# Bundle of many node dumps in one indexed file (the reader is implemented
+	# in the C extension). The table of contents maps logical paths
+	# (e.g. <tt>'foo/bar'</tt> for <tt>foo/bar.rb</tt>) to the dumps; the file is
+	# mapped to the memory and dumps are loaded from it directly. The bundle
+	# may contain the shared dictionary of symbols and literals
+	# (NodeMarshal::Dictionary) that is loaded by NodeMarshal::Bundle.open.
+	#
+	# Usage:
+	#   NodeMarshal::Bundle.build('app.nmbundle', 'lib', :shared_dict => true)
+	#   ...
+	#   NodeMarshal::Bundle.open('app.nmbundle').install
+	#   require 'foo/bar' # Is loaded from the bundle without the file system access
+	class Bundle
+		attr_reader :filename, :paths, :dictionary
+
+		# Installed bundles (see NodeMarshal::Bundle#install)
+		@installed = []
+		# Features loaded from the bundles
+		@loaded = {}
+		# Load locks of features (see NodeMarshal::Bundle.require)
+		@load_locks = {}
+		@load_locks_guard = Mutex.new
+
+		class << self
+			attr_reader :installed
+		end
+
+		# call-seq:
+		#   NodeMarshal::Bundle.create(filename, entries, opts)
+		#
+		# Writes the bundle file.
+		# - +entries+ -- Hash or array of pairs: logical path => NodeMarshal
+		#   object or dump (see NodeMarshal#to_bin)
+		# - +opts+ -- Hash with options: +:shared_dict+ is NodeMarshal::Dictionary
+		#   saved to the bundle (NodeMarshal objects are dumped with it),
+		#   +:compress+ (+true+, +:zlib+ or +:zstd+) and +:level+ are the
+		#   compression options (see NodeMarshal::Codec.compress), other options
+		#   are passed to NodeMarshal#to_bin (e.g. +:lazy+, +:nodes_layout+)
+		def self.create(filename, entries, opts = {})
+			dict = opts[:shared_dict]
+			bin_opts = opts.reject {|key, val| [:shared_dict, :compress, :level].include?(key) }
+			bin_opts[:shared_dict] = dict if dict
+			codec_opts = {:codec => (opts[:compress] == true) ? :zlib : opts[:compress]}
+			codec_opts[:level] = opts[:level] if opts.has_key?(:level)
+			dumps = entries.map do |path, obj|
+				bin = (obj.is_a?(NodeMarshal)) ? obj.to_bin(bin_opts) : obj.to_str
+				bin = NodeMarshal::Codec.compress(bin, codec_opts) if codec_opts[:codec]
+				[path.to_s.encode('UTF-8').b, bin]
+			end
+			dict_bin = (dict) ? dict.to_bin : ''
+			toc_len = dumps.inject(0) {|sum, (path, bin)| sum + path.bytesize + 12 }
+			offset = 32 + toc_len
+			toc = ''.b
+			dumps.each do |path, bin|
+				toc << [path.bytesize].pack('L<') << path << [offset + dict_bin.bytesize, bin.bytesize].pack('L<L<')
+				offset += bin.bytesize
+			end
+			if offset + dict_bin.bytesize >= 2**32
+				raise ArgumentError, "Bundle is too large"
+			end
+			File.open(filename, 'wb') do |fp|
+				fp << MAGIC.ljust(16, "\0").b
+				fp << [0, dumps.size, (dict) ? 32 + toc_len : 0, dict_bin.bytesize].pack('L<4')
+				fp << toc << dict_bin
+				dumps.each {|path, bin| fp << bin }
+			end
+			true
+		end
+
+		# call-seq:
+		#   NodeMarshal::Bundle.build(filename, src_dir, opts)
+		#
+		# Compiles all <tt>**/*.rb</tt> files of +src_dir+ to the bundle;
+		# logical paths are relative names without the <tt>.rb</tt> extension.
+		# <tt>:shared_dict => true</tt> makes the dictionary from the sources
+		# (see NodeMarshal::Dictionary.build), other options are the same
+		# as for NodeMarshal::Bundle.create. Returns the list of logical paths
+		def self.build(filename, src_dir, opts = {})
+			files = Dir.chdir(src_dir) { Dir.glob('**/*.rb').sort }
+			nodes = files.map {|name| NodeMarshal.new(:srcfile, File.join(src_dir, name)) }
+			opts = opts.dup
+			if opts[:shared_dict] == true
+				opts[:shared_dict] = NodeMarshal::Dictionary.build(nodes)
+			elsif opts[:shared_dict].is_a?(String)
+				opts[:shared_dict] = NodeMarshal::Dictionary.load_file(opts[:shared_dict])
+			end
+			paths = files.map {|name| name.sub(/\.rb\z/, '') }
+			create(filename, paths.zip(nodes), opts)
+			paths
+		end
+
+		# call-seq:
+		#   obj.size
+		#
+		# Returns the number of entries
+		def size
+			@paths.size
+		end
+
+		# call-seq:
+		#   obj.feature_path(path)
+		#
+		# Returns the virtual file name of the entry (the name of the bundle file
+		# with the logical path). It is used by the require hook as the name
+		# of loaded feature and as <tt>__FILE__</tt>
+		def feature_path(path)
+			File.join(root_path, path.to_s.sub(/\.rb\z/, '') + '.rb')
+		end
+
+		# call-seq:
+		#   obj.root_path
+		#
+		# Returns the virtual directory of entries (see NodeMarshal::Bundle#feature_path)
+		def root_path
+			(@filename) ? File.expand_path(@filename) : "nodemarshal-bundle-#{object_id}"
+		end
+
+		# call-seq:
+		#   obj.load_entry(path)
+		#
+		# Loads and executes the entry (with <tt>__FILE__</tt> equal to its
+		# feature path). Entries compiled by NodeMarshal.preload are not loaded
+		# again. Returns the result of the evaluation
+		def load_entry(path)
+			feature = feature_path(path)
+			return NodeMarshal::Preload.eval(feature) if NodeMarshal::Preload.include?(feature)
+			node = self[path]
+			raise LoadError, "Cannot find #{path} in the bundle" if node.nil?
+			node.filename = node.filepath = feature
+			node.compile.eval
+		end
+
+		# call-seq:
+		#   obj.install
+		#
+		# Adds the bundle to the require hook: <tt>require 'foo/bar'</tt>
+		# and <tt>require_relative</tt> inside the bundle entries find the entry
+		# by the table of contents. Bundles installed earlier have higher priority.
+		def install
+			Bundle.install_hook
+			Bundle.installed << self if !Bundle.installed.include?(self)
+			self
+		end
+
+		# call-seq:
+		#   obj.uninstall
+		#
+		# Removes the bundle from the require hook
+		def uninstall
+			Bundle.installed.delete(self)
+			self
+		end
+
+		# call-seq:
+		#   NodeMarshal::Bundle.require(path)
+		#
+		# Loads the entry from the installed bundles. Returns +true+ if it was
+		# loaded, +false+ if it was already loaded and +nil+ if it is absent.
+		# Other threads that require the same feature wait until the end
+		# of its loading (as Kernel#require does)
+		def self.require(path)
+			key = path.to_s.sub(/\.rb\z/, '')
+			bundle = @installed.find {|b| b.include?(key) }
+			return nil if bundle.nil?
+			feature = bundle.feature_path(key)
+			load_lock(feature).synchronize do
+				return false if @loaded[feature]
+				# The feature is marked before the loading: circular requires
+				# in the same thread return false (the lock is reentrant)
+				@loaded[feature] = true
+				begin
+					bundle.load_entry(key)
+				rescue Exception
+					@loaded.delete(feature)
+					raise
+				end
+				$LOADED_FEATURES << feature
+			end
+			true
+		end
+
+		# Returns the reentrant lock of the feature (it is created once)
+		def self.load_lock(feature)
+			@load_locks_guard.synchronize { @load_locks[feature] ||= Monitor.new }
+		end
+
+		# call-seq:
+		#   NodeMarshal::Bundle.require_relative(path, base)
+		#
+		# Loads the entry by the path relative to the feature path +base+
+		# (see NodeMarshal::Bundle.require)
+		def self.require_relative(path, base)
+			fullpath = File.expand_path(path, File.dirname(base))
+			@installed.each do |bundle|
+				root = bundle.root_path + '/'
+				if fullpath.start_with?(root) && bundle.include?(fullpath[root.size..-1].sub(/\.rb\z/, ''))
+					return require(fullpath[root.size..-1])
+				end
+			end
+			nil
+		end
+
+		# Overrides Kernel#require and Kernel#require_relative
+		# (once, in the same way as RubyGems)
+		def self.install_hook
+			return if Kernel.private_method_defined?(:nodemarshal_original_require)
+			Kernel.module_eval do
+				alias_method :nodemarshal_original_require, :require
+				alias_method :nodemarshal_original_require_relative, :require_relative
+
+				def require(path)
+					ans = NodeMarshal::Bundle.require(path)
+					(ans.nil?) ? nodemarshal_original_require(path) : ans
+				end
+
+				def require_relative(path)
+					base = caller_locations(1, 1)[0].absolute_path
+					raise LoadError, "cannot infer basepath" if base.nil?
+					ans = NodeMarshal::Bundle.require_relative(path, base)
+					# The original method takes the path relative to its caller (this file),
+					# so the absolute path is passed
+					(ans.nil?) ? nodemarshal_original_require_relative(File.expand_path(path, File.dirname(base))) : ans
+				end
+
+				private :require, :require_relative
+			end
+		end
+	end
+end
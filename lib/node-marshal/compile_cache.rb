@@ -0,0 +1,180 @@
+require 'digest/sha2'
+require 'fileutils'
+
+class NodeMarshal
+	# Persistent on-disk cache of node dumps made from Ruby source files.
+	# Each entry is the binary dump (see NodeMarshal#to_bin) saved to
+	# the file named by SHA256 digest of the source code, Ruby version
+	# and platform, format version (NodeMarshal::MAGIC) and the names
+	# of the source file (they are embedded into the node, e.g. by
+	# +__FILE__+). Changed sources get new keys; old entries are removed
+	# by the size-bounded eviction (least recently used first).
+	#
+	# Usage:
+	#   node = NodeMarshal.new(:srcfile, 'file.rb', :cache_dir => 'cache')
+	#   NodeMarshal.compile_rb_file('out.rb', 'file.rb', :cache_dir => 'cache')
+	#
+	# The cache directory may be shared by several processes: entries are
+	# written to temporary files and renamed, so readers never see
+	# partially written dumps.
+	class CompileCache
+		# Extension of the cache entries
+		EXT = '.nmbin'
+		attr_reader :dir, :max_size
+
+		# call-seq:
+		#   NodeMarshal::CompileCache.new(dir, opts)
+		#
+		# Opens (and creates if necessary) the cache directory
+		# - +dir+ -- name of the cache directory
+		# - +opts+ -- Hash with options: +:max_size+ is the maximal total
+		#   size of entries in bytes (+nil+ means unlimited, default),
+		#   +:atomic+ is +false+ if entries must be written directly
+		#   without temporary files (default is +true+)
+		def initialize(dir, opts = {})
+			@dir = dir.to_s
+			@max_size = opts[:max_size]
+			@atomic = opts.fetch(:atomic, true)
+			@total_size = nil
+			FileUtils.mkdir_p(@dir)
+		end
+
+		# call-seq:
+		#   obj.key(source, *names)
+		#
+		# Returns the key (hexadecimal SHA256 digest) of the source code
+		# (String) compiled by the current Ruby. +names+ are additional
+		# strings that affect the dump, e.g. name of the source file.
+		def key(source, *names)
+			digest = Digest::SHA256.new
+			[NodeMarshal::MAGIC, RUBY_VERSION, RUBY_PLATFORM, *names].each do |str|
+				digest << str.to_s << "\0"
+			end
+			digest << source
+			digest.hexdigest
+		end
+
+		# call-seq:
+		#   obj.file_key(filename, source = File.binread(filename))
+		#
+		# Returns the key of the Ruby source file (see NodeMarshal::CompileCache#key).
+		# +source+ is the content of the file that was already read (the caller
+		# parses the same bytes)
+		def file_key(filename, source = nil)
+			source = File.binread(filename) if source.nil?
+			key(source, filename, File.realpath(filename))
+		end
+
+		# call-seq:
+		#   obj[key]
+		#
+		# Returns the cached dump (String) or +nil+ if there is no such entry
+		def [](key)
+			path = entry_path(key)
+			bin = File.binread(path)
+			now = Time.now
+			File.utime(now, now, path) rescue nil # For LRU eviction
+			bin
+		rescue Errno::ENOENT
+			nil
+		end
+
+		# call-seq:
+		#   obj[key] = bin
+		#
+		# Saves the dump to the cache and evicts the old entries if
+		# the total size exceeds the limit
+		def []=(key, bin)
+			path = entry_path(key)
+			if @atomic
+				tmp = "#{path}.#{Process.pid}.#{Thread.current.object_id}.tmp"
+				begin
+					File.binwrite(tmp, bin)
+					File.rename(tmp, path)
+				ensure
+					File.delete(tmp) if File.exist?(tmp)
+				end
+			else
+				File.binwrite(path, bin)
+			end
+			if @max_size
+				@total_size = total_size if @total_size.nil?
+				@total_size += bin.bytesize
+				evict if @total_size > @max_size
+			end
+			bin
+		end
+
+		# call-seq:
+		#   obj.delete(key)
+		#
+		# Removes the entry (e.g. truncated or corrupted one). Returns +true+
+		# if the entry was removed
+		def delete(key)
+			path = entry_path(key)
+			size = File.size(path)
+			File.delete(path)
+			@total_size -= size if @total_size
+			true
+		rescue Errno::ENOENT
+			false
+		end
+
+		# call-seq:
+		#   obj.fetch(key) { block }
+		#
+		# Returns the cached dump; if it is absent the result of the block
+		# is saved to the cache and returned
+		def fetch(key)
+			bin = self[key]
+			if bin.nil?
+				bin = yield
+				self[key] = bin
+			end
+			bin
+		end
+
+		# call-seq:
+		#   obj.total_size
+		#
+		# Returns the total size of entries in bytes
+		def total_size
+			entries.inject(0) {|sum, path| sum + (File.size(path) rescue 0) }
+		end
+
+		# call-seq:
+		#   obj.evict(max_size = self.max_size)
+		#
+		# Removes the least recently used entries until their total size
+		# is not greater than +max_size+
+		def evict(max_size = @max_size)
+			list = entries.map {|path| [path, (File.stat(path) rescue nil)] }
+			list = list.select {|path, st| st }.sort_by {|path, st| st.mtime }
+			size = list.inject(0) {|sum, (path, st)| sum + st.size }
+			list.each do |path, st|
+				break if size <= max_size
+				File.delete(path) rescue nil
+				size -= st.size
+			end
+			@total_size = size
+			self
+		end
+
+		# call-seq:
+		#   obj.clear
+		#
+		# Removes all entries from the cache
+		def clear
+			evict(0)
+		end
+
+	private
+		def entry_path(key)
+			File.join(@dir, key + EXT)
+		end
+
+		def entries
+			Dir.glob(File.join(@dir, '*' + EXT))
+		end
+	end
+end
@@ -0,0 +1,66 @@
+class NodeMarshal
+	# Shared dictionary of symbols and literals for many compiled files
+	# of one project (the class itself is implemented in the C extension).
+	# Symbols like +:each+ or literals like <tt>"utf-8"</tt> are saved
+	# to the dictionary once; dumps made by
+	# <tt>NodeMarshal#to_bin(:shared_dict => dict)</tt> contain only their
+	# ordinals. The dictionary is loaded (and its symbols are interned)
+	# once per process and is shared by all such dumps.
+	#
+	# Usage:
+	#   dict = NodeMarshal::Dictionary.build(Dir['lib/**/*.rb'])
+	#   dict.save('project.nmdict')
+	#   NodeMarshal.compile_rb_file('out.rb', 'lib/file.rb', :shared_dict => 'project.nmdict')
+	class Dictionary
+		# call-seq:
+		#   NodeMarshal::Dictionary.build(sources, opts)
+		#
+		# Makes the dictionary from symbols and literals that are used in
+		# several sources.
+		# - +sources+ -- array of NodeMarshal objects or names of Ruby source files
+		# - +opts+ -- Hash with options: +:min_count+ is the minimal number of
+		#   sources that use the entry (default is 2), +:max_entries+ is
+		#   the maximal number of symbols and of literals (the most frequent
+		#   entries are taken)
+		def self.build(sources, opts = {})
+			min_count = opts.fetch(:min_count, 2)
+			max_entries = opts[:max_entries]
+			syms_count, lits_count = Hash.new(0), Hash.new(0)
+			lits_values = {}
+			sources.each do |src|
+				node = src.is_a?(NodeMarshal) ? src : NodeMarshal.new(:srcfile, src)
+				hash = node.to_hash
+				hash[:symbols].grep(String).uniq.each {|sym| syms_count[sym] += 1 }
+				hash[:literals].map {|lit| [literal_key(lit), lit] }.uniq(&:first).each do |key, lit|
+					lits_count[key] += 1
+					lits_values[key] ||= lit
+				end
+			end
+			syms = frequent_entries(syms_count, min_count, max_entries)
+			lits = frequent_entries(lits_count, min_count, max_entries).map {|key| lits_values[key] }
+			new(syms, lits)
+		end
+
+		# call-seq:
+		#   obj.save(filename)
+		#
+		# Saves the dictionary to the file
+		def save(filename)
+			File.binwrite(filename, to_bin)
+		end
+
+		# Literals are equal if they are saved identically
+		def self.literal_key(lit)
+			(lit.is_a?(String)) ? [String, lit, lit.encoding, lit.frozen?] : [lit.class, lit]
+		end
+
+		# Entries sorted by descending number of sources (the first entry is
+		# used for equal numbers)
+		def self.frequent_entries(counts, min_count, max_entries)
+			entries = counts.each_with_index.select {|(key, num), ind| num >= min_count }
+			entries = entries.sort_by {|(key, num), ind| [-num, ind] }.map {|(key, num), ind| key }
+			(max_entries) ? entries.first(max_entries) : entries
+		end
+		private_class_method :literal_key, :frequent_entries
+	end
+end
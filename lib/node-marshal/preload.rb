@@ -0,0 +1,151 @@
+require 'etc'
+
+class NodeMarshal
+	# Preloading of node dumps in the master process of pre-forking servers.
+	# Dumps are decoded and compiled once in the master; the forked workers
+	# inherit the compiled instruction sequences and evaluate them without
+	# decoding (the pages of the master heap stay shared by copy-on-write).
+	# Node trees are not kept after the compilation and the garbage
+	# collection is started only once, after all dumps are preloaded, so the
+	# garbage of decoding is not collected (and pages are not touched) by
+	# each worker.
+	#
+	# Usage:
+	#   NodeMarshal.preload('app.nmbundle', :require => ['app/main'])
+	#   fork do
+	#     require 'app/main' # Compiled in the master
+	#     p NodeMarshal::Preload.memory_report[:shared_pages]
+	#   end
+	module Preload
+		# Compiled instruction sequences: feature path => RubyVM::InstructionSequence
+		@iseqs = {}
+		# Number of evaluated preloaded sequences
+		@hits = 0
+
+		class << self
+			attr_reader :iseqs, :hits
+		end
+
+		# call-seq:
+		#   NodeMarshal::Preload.preload(source, opts) => Hash
+		#
+		# Loads and compiles the node dumps.
+		# - +source+ -- NodeMarshal::Bundle, name of the bundle file or array
+		#   of names of files with dumps (see NodeMarshal#to_bin); a Hash
+		#   maps feature paths to names of dump files
+		# - +opts+ -- Hash with options: +:install+ (default is +true+) adds the
+		#   bundle to the require hook (see NodeMarshal::Bundle#install),
+		#   +:require+ is +true+ (all entries) or an array of logical paths of
+		#   bundle entries required in the master, <tt>:gc => false</tt> skips
+		#   the garbage collection after preloading
+		#
+		# Bundle entries are registered by their feature paths (see
+		# NodeMarshal::Bundle#feature_path) and are used by the require hook;
+		# dump files are registered by their absolute names (see
+		# NodeMarshal::Preload.eval). Returns the Hash with the number of
+		# entries (+:entries+), loaded nodes (+:nodes+) and the time
+		# of preloading in seconds (+:time+)
+		def self.preload(source, opts = {})
+			t = Time.now
+			source = NodeMarshal::Bundle.open(source) if source.is_a?(String)
+			ans = {:entries => 0, :nodes => 0}
+			each_entry(source) do |feature, node|
+				node.filename = node.filepath = feature
+				@iseqs[feature] = node.compile
+				ans[:entries] += 1
+				ans[:nodes] += node.stats[:tables][:nodes_len]
+			end
+			if source.is_a?(NodeMarshal::Bundle)
+				source.install if opts.fetch(:install, true)
+				paths = (opts[:require] == true) ? source.paths : (opts[:require] || [])
+				paths.each {|path| NodeMarshal::Bundle.require(path) }
+			end
+			GC.start if opts.fetch(:gc, true)
+			ans[:time] = Time.now - t
+			ans
+		end
+
+		# Yields feature paths and loaded nodes of the source
+		# (see NodeMarshal::Preload.preload)
+		def self.each_entry(source)
+			if source.is_a?(NodeMarshal::Bundle)
+				source.paths.each {|path| yield(source.feature_path(path), source[path]) }
+			else
+				source = source.map {|name| [name, name] } if !source.is_a?(Hash)
+				source.each do |feature, name|
+					yield(File.expand_path(feature), NodeMarshal.new(:binmmap, name, :gc_start => false))
+				end
+			end
+		end
+		private_class_method :each_entry
+
+		# call-seq:
+		#   NodeMarshal::Preload[feature] => RubyVM::InstructionSequence or nil
+		#
+		# Returns the preloaded instruction sequence
+		def self.[](feature)
+			@iseqs[feature]
+		end
+
+		# call-seq:
+		#   NodeMarshal::Preload.eval(feature) => result
+		#
+		# Evaluates the preloaded instruction sequence (the name of the dump
+		# file is expanded). Raises LoadError if it was not preloaded
+		def self.eval(feature)
+			iseq = @iseqs[feature] || @iseqs[File.expand_path(feature)]
+			raise LoadError, "#{feature} is not preloaded" if iseq.nil?
+			@hits += 1
+			iseq.eval
+		end
+
+		# call-seq:
+		#   NodeMarshal::Preload.include?(feature)
+		#
+		# Returns +true+ if the feature was preloaded
+		def self.include?(feature)
+			@iseqs.has_key?(feature)
+		end
+
+		# Removes all preloaded instruction sequences
+		def self.clear
+			@iseqs.clear
+			@hits = 0
+		end
+
+		# call-seq:
+		#   NodeMarshal::Preload.memory_report(pid) => Hash or nil
+		#
+		# Returns the memory of the process (current by default) from
+		# <tt>/proc/pid/smaps</tt>: +:rss+, +:pss+, +:shared_clean+,
+		# +:shared_dirty+, +:private_clean+ and +:private_dirty+ (kB)
+		# and the numbers of +:shared_pages+ and +:private_pages+. Pages of
+		# the forked worker are shared while they are not changed by the worker
+		# or by the master. Returns +nil+ if the file is absent (non-Linux systems)
+		def self.memory_report(pid = Process.pid)
+			filename = "/proc/#{pid}/smaps"
+			return nil if !File.readable?(filename)
+			keys = {'Rss' => :rss, 'Pss' => :pss, 'Shared_Clean' => :shared_clean,
+				'Shared_Dirty' => :shared_dirty, 'Private_Clean' => :private_clean,
+				'Private_Dirty' => :private_dirty}
+			ans = Hash[keys.values.map {|key| [key, 0] }]
+			File.foreach(filename) do |line|
+				key = (line =~ /\A(\w+):\s+(\d+) kB/) ? keys[$1] : nil
+				ans[key] += $2.to_i if key
+			end
+			page_kb = Etc.sysconf(Etc::SC_PAGESIZE) / 1024
+			ans[:shared_pages] = (ans[:shared_clean] + ans[:shared_dirty]) / page_kb
+			ans[:private_pages] = (ans[:private_clean] + ans[:private_dirty]) / page_kb
+			ans
+		end
+	end
+
+	# call-seq:
+	#   NodeMarshal.preload(source, opts) => Hash
+	#
+	# Decodes and compiles the dumps from the bundle or dump files in the
+	# master process before forking (see NodeMarshal::Preload.preload)
+	def self.preload(source, opts = {})
+		Preload.preload(source, opts)
+	end
+end
@@ -0,0 +1,90 @@
+class NodeMarshal
+	# Global collector of statistics of node loading, parsing and dumping.
+	# Statistics of each operation are also available by NodeMarshal#stats;
+	# the collector receives them from all NodeMarshal objects (including
+	# nodes loaded by compiled files and by NodeMarshal::LazyLoader).
+	#
+	# Usage:
+	#   NodeMarshal::Stats.enable # Accumulate totals
+	#   sub = NodeMarshal::Stats.subscribe do |operation, node, phases|
+	#     metrics.timing("nodemarshal.#{operation}", phases[:total][:time])
+	#   end
+	#   ...
+	#   NodeMarshal::Stats.totals[:load][:phases][:symbols][:time]
+	#   NodeMarshal::Stats.unsubscribe(sub)
+	module Stats
+		@subscribers = []
+		@totals = nil
+
+		# call-seq:
+		#   NodeMarshal::Stats.subscribe {|operation, node, phases| ... }
+		#
+		# Adds the block that is called after each operation (<tt>:load</tt>,
+		# <tt>:parse</tt>, <tt>:to_hash</tt>, <tt>:to_bin</tt>) with the NodeMarshal
+		# object and the Hash of phases (see NodeMarshal#stats).
+		# Returns the subscriber for NodeMarshal::Stats.unsubscribe
+		def self.subscribe(&block)
+			raise ArgumentError, 'Block is required' if block.nil?
+			@subscribers << block
+			update_listener
+			block
+		end
+
+		# Removes the subscriber added by NodeMarshal::Stats.subscribe
+		def self.unsubscribe(subscriber)
+			@subscribers.delete(subscriber)
+			update_listener
+		end
+
+		# Enables accumulation of totals (see NodeMarshal::Stats.totals)
+		def self.enable
+			@totals ||= {}
+			update_listener
+		end
+
+		# Disables accumulation of totals and removes them
+		def self.disable
+			@totals = nil
+			update_listener
+		end
+
+		def self.enabled?
+			!@totals.nil?
+		end
+
+		# call-seq:
+		#   NodeMarshal::Stats.totals
+		#
+		# Returns the Hash with accumulated statistics (since
+		# NodeMarshal::Stats.enable or NodeMarshal::Stats.reset):
+		# <tt>{operation => {:count => n, :phases => {phase => {:time => seconds, :allocs => number}}}}</tt>
+		def self.totals
+			@totals
+		end
+
+		# Clears accumulated statistics
+		def self.reset
+			@totals = {} if @totals
+		end
+
+		# Receives statistics from the C extension (see NodeMarshal.stats_listener=)
+		def self.call(operation, node, phases)
+			if @totals
+				op = (@totals[operation] ||= {:count => 0, :phases => {}})
+				op[:count] += 1
+				phases.each do |name, value|
+					phase = (op[:phases][name] ||= {:time => 0.0, :allocs => 0})
+					phase[:time] += value[:time]
+					phase[:allocs] += value[:allocs]
+				end
+			end
+			@subscribers.each {|sub| sub.call(operation, node, phases) }
+		end
+
+		def self.update_listener
+			active = @totals || @subscribers.size > 0
+			NodeMarshal.stats_listener = active ? self : nil
+		end
+		private_class_method :update_listener
+	end
+end
@@ -2,6 +2,7 @@
 
 require_relative '../lib/node-marshal.rb'
 require 'test/unit'
+require 'stringio'
 
 # This unit test case contains several very simple "smoke tests"
 # for NodeMarshal class
@@ -138,7 +139,7 @@ EOS
 		assert_equal("ABCD", base85_pass.("ABCD"))
 		assert_equal("ABCDE", base85_pass.("ABCDE"))
 		# Random strings
-		rnd = Random.new
+		rnd = Random.new(20170512)
 		20.times do
 			len, str = rnd.rand(4096), ""
 			len.times { str += rnd.rand(255).chr }
@@ -146,6 +147,38 @@ EOS
 		end
 	end
 
+	# Test: incremental Base85r encoder and decoder (chunks of arbitrary
+	# size must give the same result as one-pass functions)
+	def test_base85r_stream
+		rnd = Random.new(20170512)
+		[0, 1, 55, 56, 57, 1000, 100001].each do |len|
+			str = (0...len).map { rnd.rand(256).chr }.join
+			txt = NodeMarshal.base85r_encode(str)
+			enc = NodeMarshal::Base85r::Encoder.new(len)
+			dec = NodeMarshal::Base85r::Decoder.new
+			pos = 0
+			while pos < len
+				n = rnd.rand(1..200)
+				enc << str[pos, n]
+				pos += n
+			end
+			assert_equal(txt, enc.finish)
+			txt.each_char.each_slice(rnd.rand(1..100)) {|chars| dec << chars.join }
+			assert_equal(str, dec.finish)
+			# IO-to-IO variant
+			out = StringIO.new(String.new)
+			assert_equal(len, NodeMarshal::Base85r.encode_io(StringIO.new(str), out))
+			assert_equal(txt, out.string)
+			out = StringIO.new(String.new)
+			NodeMarshal::Base85r.decode_io(StringIO.new(txt.gsub("\n", "\r\n")), out)
+			assert_equal(str.b, out.string.b)
+		end
+		enc = NodeMarshal::Base85r::Encoder.new(3)
+		assert_raise(ArgumentError) { enc << "abcd" }
+		assert_raise(ArgumentError) { enc.finish }
+		assert_raise(ArgumentError) { NodeMarshal::Base85r::Decoder.new.finish }
+	end
+
 	# Test regular expressions (NODE_MATCH3 node issue)
 	def test_node_match3
 		program = <<-EOS
@@ -190,6 +223,21 @@ EOS
 		assert_node_compiler(program)
 	end
 
+	# Deep trees (long NODE_BLOCK chains) must be processed without
+	# the C stack overflow; obj.attr += 1 also checks NODE_OP_ASGN2
+	def test_deep_tree
+		program = "x = 0\n" + "x += 1\n" * 100000 + "x"
+		node = NodeMarshal.new(:srcmemory, program)
+		assert_equal(Array, node.to_a.class)
+		bin = node.to_bin
+		assert_equal(100000, NodeMarshal.new(:binmemory, bin).compile.eval)
+		program = "s = Struct.new(:a).new(1)\n" + "s.a += 1\n" * 100 + "s.a"
+		node = NodeMarshal.new(:srcmemory, program)
+		assert_match(/NODE_OP_ASGN2/, node.dump_tree_short)
+		assert_equal(Array, node.to_a.class)
+		assert_node_compiler(program)
+	end
+
 	# Check the reaction on the parsing errors during the node creation
 	# In the case of syntax error ArgumentError exception should be generated
 	def test_syntax_error
@@ -0,0 +1,56 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the batch compilation of directory trees
+# (NodeMarshal::BatchCompiler and noderbc --tree)
+class TestBatchCompiler < Test::Unit::TestCase
+	SRC_DIR = '_batch_src'
+	OUT_DIR = '_batch_out'
+	SO_PATH = "require '#{File.expand_path('../ext/node-marshal/nodemarshal.so', File.dirname(__FILE__))}'"
+
+	def setup
+		FileUtils.mkdir_p(File.join(SRC_DIR, 'sub'))
+		(1..5).each do |i|
+			dir = (i.odd?) ? SRC_DIR : File.join(SRC_DIR, 'sub')
+			File.open(File.join(dir, "file#{i}.rb"), 'w') {|fp| fp << "[#{i}, (1..#{i}).to_a]" }
+		end
+		File.open(File.join(SRC_DIR, 'broken.rb'), 'w') {|fp| fp << "a = 1; a++" }
+		File.open(File.join(SRC_DIR, 'readme.txt'), 'w') {|fp| fp << "Not a source" }
+	end
+
+	def teardown
+		FileUtils.rm_rf(SRC_DIR)
+		FileUtils.rm_rf(OUT_DIR)
+	end
+
+	# Serial and parallel compilation must give the same set of working files
+	def test_compile_tree
+		[1, 3].each do |jobs|
+			FileUtils.rm_rf(OUT_DIR)
+			bc = NodeMarshal::BatchCompiler.new(SRC_DIR, OUT_DIR, :jobs => jobs, :so_path => SO_PATH)
+			names = []
+			bc.run {|res| names << res.inpfile }
+			assert_equal(bc.files.sort, names.sort)
+			assert_equal(6, bc.results.size)
+			assert_equal(['broken.rb'], bc.errors.map(&:inpfile))
+			assert_equal(false, File.exist?(File.join(OUT_DIR, 'broken.rb')))
+			(bc.files - ['broken.rb']).each do |name|
+				i = name[/\d+/].to_i
+				assert_equal([i, (1..i).to_a], eval(File.read(File.join(OUT_DIR, name))))
+			end
+		end
+		assert_raise(ArgumentError) { NodeMarshal::BatchCompiler.new(SRC_DIR, OUT_DIR, :jobs => 0) }
+	end
+
+	# Failed encoding must not damage the output of the previous run
+	def test_failed_encoding
+		NodeMarshal::BatchCompiler.new(SRC_DIR, OUT_DIR, :so_path => SO_PATH).run
+		outfile = File.join(OUT_DIR, 'file1.rb')
+		good = File.binread(outfile)
+		bc = NodeMarshal::BatchCompiler.new(SRC_DIR, OUT_DIR, :so_path => SO_PATH, :level => 42)
+		bc.run
+		assert_equal(bc.files.sort, bc.errors.map(&:inpfile).sort)
+		assert_equal(good, File.binread(outfile))
+		assert_equal([], Dir.glob(File.join(OUT_DIR, '**', '*.tmp')))
+	end
+end
@@ -0,0 +1,243 @@
+# encoding: UTF-8
+
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the binary container format (NODEMARSHAL12) produced by
+# NodeMarshal#to_bin and for compatibility with Marshal-based dumps
+# (NODEMARSHAL11)
+class TestBinFormat < Test::Unit::TestCase
+	PROGRAM = <<-EOS
+# encoding: UTF-8
+class BinFormatTest
+	attr_reader :значение
+	def initialize(x, y = 2.5, *rest, z: :sym, &blk)
+		@значение = [x, y, rest, z, "строка", 'bin'.b, 1e100, (1..10), /ab+c/i, 2**70]
+	end
+end
+$global_var = BinFormatTest.new(1, 3.25, 4, 5, z: :zzz).значение
+[$global_var, "frozen".freeze]
+EOS
+
+	# Binary container must be loaded and give the same result as
+	# the original program
+	def test_roundtrip
+		bin = NodeMarshal.new(:srcmemory, PROGRAM).to_bin
+		assert_equal("NODEMARSHAL12", bin[0, 13])
+		node = NodeMarshal.new(:binmemory, bin)
+		assert_equal(eval(PROGRAM), node.compile.eval)
+		assert_equal(Encoding::UTF_8, node.symbols.find {|s| s == :значение }.encoding)
+		Object.send(:remove_const, :BinFormatTest)
+	end
+
+	# Dumps in the form of the Marshal-serialized Hash must be loadable
+	def test_hash_compatibility
+		hash = NodeMarshal.new(:srcmemory, PROGRAM).to_hash
+		assert_equal("NODEMARSHAL11", hash[:MAGIC])
+		node = NodeMarshal.new(:binmemory, Marshal.dump(hash))
+		assert_equal(eval(PROGRAM), node.compile.eval)
+		Object.send(:remove_const, :BinFormatTest)
+	end
+
+	# Symbols renamed in the preparsed hash must be saved to the container
+	def test_changed_symbols
+		node = NodeMarshal.new(:srcmemory, "def my_func; 5; end; my_func")
+		node.to_hash
+		node.change_symbol("my_func", "renamed_func")
+		bin = node.to_bin
+		assert_equal(5, NodeMarshal.new(:binmemory, bin).compile.eval)
+		assert_equal(true, Object.private_method_defined?(:renamed_func))
+	end
+
+	# Symbols of loaded dumps are interned with lengths and encodings
+	# and are found by the process-wide memo in the next dumps
+	def test_symbols_memo
+		node = NodeMarshal.new(:srcmemory, "o = Object.new; def o.memo_meth; :символ; end; [o.memo_meth, o.singleton_methods]")
+		node.to_hash
+		node.change_symbol("memo_meth", "memo\0meth")
+		bin = node.to_bin
+		assert_equal([:символ, [:"memo\0meth"]], NodeMarshal.new(:binmemory, bin).compile.eval)
+		stats = NodeMarshal.symbols_memo_stats
+		loaded = NodeMarshal.new(:binmemory, bin)
+		assert_equal(stats[:entries], NodeMarshal.symbols_memo_stats[:entries])
+		assert_equal(stats[:hits] + loaded.symbols.size + 1, NodeMarshal.symbols_memo_stats[:hits])
+		assert_equal([:символ, [:"memo\0meth"]], NodeMarshal.new(:binmemory, Marshal.dump(node.to_hash)).compile.eval)
+		# The table is made once
+		assert_equal(true, loaded.symbols.frozen?)
+		assert_same(loaded.symbols, loaded.symbols)
+		assert_equal(true, loaded.symbols.include?(:"memo\0meth"))
+		# ... and is made again after changes of the tree or the symbols
+		syms = loaded.symbols
+		loaded.to_hash
+		assert_not_same(syms, loaded.symbols)
+		syms = loaded.symbols
+		loaded.change_symbol("memo\0meth", "memo_meth2")
+		assert_not_same(syms, loaded.symbols)
+		syms = loaded.symbols
+		loaded.replace_symbols("memo_meth2" => "memo_meth3")
+		assert_not_same(syms, loaded.symbols)
+		syms = loaded.symbols
+		loaded.dedup_nodes
+		assert_not_same(syms, loaded.symbols)
+	end
+
+	# Children of NODE_ARRAY chains that refer to other elements (arrays,
+	# hashes and strings with interpolation) and NODE_OP_ASGN2 are resolved
+	# by the classification pass of count_num_of_nodes
+	def test_array_chains
+		src = <<-EOS
+			x, y = 3, 'q'
+			s = Struct.new(:attr).new(1)
+			s.attr += 2
+			list = (1..5).map {|n| (1..n).to_a }
+			[[x], [x, y], [x, y, x], [[x, [y]], {}], list,
+			 {:a => x}, {:a => x, 'b' => [y, y]}, {1 => {2 => {3 => [x, y]}}, 4 => 5},
+			 "\#{x}", "a\#{x}", "a\#{x}b\#{y}c", "\#{x}\#{y}\#{[x, "\#{y}"]}", :"s\#{x}", s.attr]
+		EOS
+		node = NodeMarshal.new(:srcmemory, src)
+		[node.to_bin, Marshal.dump(node.to_hash),
+		 NodeMarshal.new(:srcmemory, src).to_bin(:dedup_nodes => true)].each do |bin|
+			assert_equal(eval(src), NodeMarshal.new(:binmemory, bin).compile.eval)
+		end
+	end
+
+	# Columnar layout of the nodes section
+	def test_columnar
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		bin = node.to_bin(:nodes_layout => :columnar)
+		assert_not_equal(node.to_bin, bin)
+		assert_equal(1, bin[16, 4].unpack('V')[0])
+		assert_equal(eval(PROGRAM), NodeMarshal.new(:binmemory, bin).compile.eval)
+		Object.send(:remove_const, :BinFormatTest)
+		[bin[0, bin.length / 2], bin[0, bin.length - 1]].each do |str|
+			assert_raise(ArgumentError) { NodeMarshal.new(:binmemory, str) }
+		end
+		assert_raise(ArgumentError) { node.to_bin(:nodes_layout => :unknown) }
+	end
+
+	# Multithreaded loading of the nodes saved in the columnar layout
+	# (large tree is required for the usage of several threads)
+	def test_columnar_threads
+		src = File.read('lifegame.rb') * 60
+		bin = NodeMarshal.new(:srcmemory, src).to_bin(:nodes_layout => :columnar)
+		disasm = NodeMarshal.new(:binmemory, bin).compile.disasm
+		[2, 4].each do |n|
+			node = NodeMarshal.new(:binmemory, bin, :threads => n)
+			assert_equal(disasm, node.compile.disasm)
+		end
+		assert_raise(ArgumentError) { NodeMarshal.new(:binmemory, bin, :threads => 0) }
+	end
+
+	# Containers and Marshal-based dumps must be loadable from
+	# the memory mapped files
+	def test_mmap
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		[node.to_bin, Marshal.dump(node.to_hash)].each do |bin|
+			File.binwrite('node.bin', bin)
+			node_mmap = NodeMarshal.new(:binmmap, 'node.bin')
+			GC.start
+			assert_equal(eval(PROGRAM), node_mmap.compile.eval)
+			Object.send(:remove_const, :BinFormatTest)
+		end
+		File.binwrite('node.bin', '')
+		assert_raise(ArgumentError) { NodeMarshal.new(:binmmap, 'node.bin') }
+		File.delete('node.bin')
+		assert_raise(Errno::ENOENT) { NodeMarshal.new(:binmmap, 'node.bin') }
+	end
+
+	# Dumps inside of other files: [filename, offset, length]
+	def test_file_part
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		[node.to_bin, Marshal.dump(node.to_hash)].each do |bin|
+			File.binwrite('node.bin', 'header' + bin + 'tail')
+			[:binmmap, :binfile].each do |source|
+				loaded = NodeMarshal.new(source, ['node.bin', 6, bin.bytesize])
+				assert_equal(eval(PROGRAM), loaded.compile.eval)
+				Object.send(:remove_const, :BinFormatTest)
+				assert_raise(ArgumentError, TypeError) { NodeMarshal.new(source, ['node.bin', 7, bin.bytesize]) }
+				assert_raise(ArgumentError) { NodeMarshal.new(source, ['node.bin', 11, bin.bytesize]) }
+				assert_raise(ArgumentError) { NodeMarshal.new(source, ['node.bin', -1, 5]) }
+				assert_raise(ArgumentError) { NodeMarshal.new(source, ['node.bin', 6]) }
+			end
+		end
+		File.delete('node.bin')
+	end
+
+	# Companion ISeq binary: it must be used only for the same file path
+	def test_iseq
+		path = File.expand_path('_iseq_test.rb')
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		bin = node.to_bin(:iseq => path)
+		assert_equal(2, bin[16, 4].unpack('V')[0])
+		expected = eval(PROGRAM)
+		[[path, true], ['other.rb', false]].each do |filepath, iseq_used|
+			loaded = NodeMarshal.new(:binmemory, bin)
+			loaded.filepath = filepath
+			assert_equal(expected, loaded.compile.eval)
+			assert_equal(iseq_used, loaded.instance_variable_get(:@iseq_used))
+			Object.send(:remove_const, :BinFormatTest)
+		end
+		# Compiled Ruby file
+		node.to_compiled_rb('_iseq_test.rb', :iseq => true)
+		load '_iseq_test.rb'
+		assert_equal(expected[0], $global_var)
+		Object.send(:remove_const, :BinFormatTest)
+		File.delete('_iseq_test.rb')
+		assert_raise(ArgumentError) { node.to_bin(:iseq => true, :lazy => true) }
+	end
+
+	# Loading without forced garbage collection
+	def test_no_gc_start
+		bin = NodeMarshal.new(:srcmemory, PROGRAM, :gc_start => false).to_bin
+		node = NodeMarshal.new(:binmemory, bin, :gc_start => false)
+		GC.start
+		assert_equal(eval(PROGRAM), node.compile.eval)
+		Object.send(:remove_const, :BinFormatTest)
+		assert_raise(TypeError) { NodeMarshal.new(:binmemory, bin, 5) }
+	end
+
+	# Garbage collector stays enabled during the loading: partially
+	# loaded trees must survive GC runs
+	def test_gc_during_loading
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		expected = eval(PROGRAM)
+		[node.to_bin, node.to_bin(:nodes_layout => :columnar), Marshal.dump(node.to_hash)].each do |bin|
+			GC.stress = true
+			begin
+				loaded = NodeMarshal.new(:binmemory, bin)
+			ensure
+				GC.stress = false
+			end
+			assert_equal(false, GC.enable)
+			assert_equal(false, loaded.stats[:load].has_key?(:gc))
+			assert_equal(expected, loaded.compile.eval)
+			Object.send(:remove_const, :BinFormatTest)
+		end
+		assert_equal(true, NodeMarshal.new(:binmemory, node.to_bin, :gc_start => true).stats[:load].has_key?(:gc))
+		# The option is applied to parsing of all source types
+		[[:srcmemory, PROGRAM], [:srcfile, 'lifegame.rb']].each do |source, info|
+			assert_equal(true, NodeMarshal.new(source, info, :gc_start => true).stats[:parse].has_key?(:gc))
+			assert_equal(false, NodeMarshal.new(source, info).stats[:parse].has_key?(:gc))
+		end
+		# Other threads run GC while nodes are decoded without GVL
+		src = File.read('lifegame.rb') * 60
+		bin = NodeMarshal.new(:srcmemory, src).to_bin(:nodes_layout => :columnar)
+		disasm = NodeMarshal.new(:binmemory, bin).compile.disasm
+		stop = false
+		gc_thread = Thread.new { GC.start until stop }
+		begin
+			3.times { assert_equal(disasm, NodeMarshal.new(:binmemory, bin, :threads => 2).compile.disasm) }
+		ensure
+			stop = true
+			gc_thread.join
+		end
+	end
+
+	# Corrupted containers must be rejected without crashes
+	def test_corrupted
+		bin = NodeMarshal.new(:srcmemory, PROGRAM).to_bin
+		[bin[0, 20], bin[0, bin.length / 2], bin[0, bin.length - 1]].each do |str|
+			assert_raise(ArgumentError) { NodeMarshal.new(:binmemory, str) }
+		end
+	end
+end
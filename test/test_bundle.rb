@@ -0,0 +1,97 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the bundles of node dumps (NodeMarshal::Bundle)
+# and the require hook
+class TestBundle < Test::Unit::TestCase
+	SRC_DIR = '_bundle_src'
+	BUNDLE = '_bundle_test.nmbundle'
+
+	def setup
+		FileUtils.mkdir_p(File.join(SRC_DIR, 'bundletest'))
+		File.open(File.join(SRC_DIR, 'bundletest', 'main.rb'), 'w') do |fp|
+			fp << "require_relative 'helper'\nrequire 'bundletest/helper'\n" +
+				"module BundleTest; def self.main; [helper(2), __FILE__]; end; end\n"
+		end
+		File.open(File.join(SRC_DIR, 'bundletest', 'helper.rb'), 'w') do |fp|
+			fp << "module BundleTest; @count = (@count || 0) + 1\n" +
+				"def self.count; @count; end\ndef self.helper(x); (1..x).map {|i| 'value ' + i.to_s }; end; end\n"
+		end
+		File.open(File.join(SRC_DIR, 'top.rb'), 'w') {|fp| fp << "[1, 'value 1', :value]" }
+	end
+
+	def teardown
+		FileUtils.rm_rf(SRC_DIR)
+		FileUtils.rm_f(BUNDLE)
+		NodeMarshal::Bundle.installed.clear
+	end
+
+	def test_build
+		[{}, {:shared_dict => true}, {:compress => true, :level => 9},
+		 {:lazy => true, :shared_dict => true}].each do |opts|
+			paths = NodeMarshal::Bundle.build(BUNDLE, SRC_DIR, opts)
+			assert_equal(['bundletest/helper', 'bundletest/main', 'top'], paths)
+			bundle = NodeMarshal::Bundle.open(BUNDLE)
+			assert_equal(paths, bundle.paths)
+			assert_equal(3, bundle.size)
+			assert_equal(opts[:shared_dict] == true, !bundle.dictionary.nil?)
+			assert_equal(true, bundle.include?('top'))
+			assert_equal(nil, bundle['absent'])
+			assert_equal([1, 'value 1', :value], bundle['top'].compile.eval)
+			assert_equal(paths, bundle.map {|path, node| path })
+			# The same data from the memory
+			bundle = NodeMarshal::Bundle.new(File.binread(BUNDLE))
+			assert_equal([1, 'value 1', :value], bundle['top'].compile.eval)
+		end
+	end
+
+	def test_require
+		NodeMarshal::Bundle.build(BUNDLE, SRC_DIR)
+		bundle = NodeMarshal::Bundle.open(BUNDLE).install
+		FileUtils.rm_rf(SRC_DIR) # The sources are not used
+		assert_equal(true, require('bundletest/main'))
+		assert_equal(false, require('bundletest/main.rb'))
+		assert_equal(1, BundleTest.count)
+		assert_equal(['value 1', 'value 2'], BundleTest.main[0])
+		assert_equal(true, $LOADED_FEATURES.include?(bundle.feature_path('bundletest/helper')))
+		assert_raise(LoadError) { require 'bundletest/absent' }
+		bundle.uninstall
+		assert_equal(false, require('test/unit'))
+	end
+
+	# Threads that require the same entry must wait for the end of its loading
+	def test_concurrent_require
+		File.open(File.join(SRC_DIR, 'slow.rb'), 'w') do |fp|
+			fp << "sleep 0.2\nmodule BundleSlow; @count = (@count || 0) + 1; def self.count; @count; end; end\n"
+		end
+		NodeMarshal::Bundle.build(BUNDLE, SRC_DIR)
+		NodeMarshal::Bundle.open(BUNDLE).install
+		threads = (1..3).map { Thread.new { [require('slow'), defined?(BundleSlow) && BundleSlow.count] } }
+		assert_equal([[false, 1], [false, 1], [true, 1]], threads.map(&:value).sort_by {|ans, count| ans ? 1 : 0 })
+	end
+
+	# require_relative of files outside the bundles uses the original method
+	def test_require_relative_fallback
+		NodeMarshal::Bundle.build(BUNDLE, SRC_DIR)
+		NodeMarshal::Bundle.open(BUNDLE).install
+		filename = File.join(File.dirname(File.realpath(__FILE__)), '_bundle_rel.rb')
+		File.open(filename, 'w') {|fp| fp << "$bundle_rel = ($bundle_rel || 0) + 1\n" }
+		assert_equal(true, require_relative('_bundle_rel'))
+		assert_equal(false, require_relative('_bundle_rel.rb'))
+		assert_equal(1, $bundle_rel)
+		assert_equal(true, $LOADED_FEATURES.include?(filename))
+		assert_raise(LoadError) { require_relative('_bundle_absent') }
+	ensure
+		FileUtils.rm_f(filename)
+	end
+
+	def test_corrupted
+		NodeMarshal::Bundle.build(BUNDLE, SRC_DIR)
+		bin = File.binread(BUNDLE)
+		assert_raise(ArgumentError) { NodeMarshal::Bundle.new(bin[0, 40]) }
+		assert_raise(ArgumentError) { NodeMarshal::Bundle.new('NODEMARSHAL12') }
+		bad = bin.dup
+		bad[53, 4] = [bin.bytesize].pack('L<') # Offset of the first entry (bundletest/helper)
+		assert_raise(ArgumentError) { NodeMarshal::Bundle.new(bad) }
+	end
+end
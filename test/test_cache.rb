@@ -0,0 +1,91 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the compile cache (NodeMarshal::CompileCache) used
+# by the :srcfile source type
+class TestCompileCache < Test::Unit::TestCase
+	CACHE_DIR = '_cache_tmp'
+
+	def setup
+		File.open('_cache_tmp.rb', 'w') {|fp| fp << "[__FILE__, 2 + 3]" }
+	end
+
+	def teardown
+		FileUtils.rm_rf(CACHE_DIR)
+		File.delete('_cache_tmp.rb')
+	end
+
+	# The first loading must save the dump, the next one must use it
+	# without parsing
+	def test_hit_and_miss
+		node = NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache_dir => CACHE_DIR)
+		assert_equal(['_cache_tmp.rb', 5], node.compile.eval)
+		cache = NodeMarshal::CompileCache.new(CACHE_DIR)
+		key = cache.file_key('_cache_tmp.rb')
+		assert_equal(node.to_bin, cache[key])
+		# Replace the entry: the loader must take it
+		cache[key] = NodeMarshal.new(:srcmemory, "[:from_cache]").to_bin
+		node = NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache => cache)
+		assert_equal([:from_cache], node.compile.eval)
+		assert_equal(cache[key], node.to_bin)
+		# Changed sources have another key
+		File.open('_cache_tmp.rb', 'w') {|fp| fp << "[__FILE__, 2 * 3]" }
+		assert_not_equal(key, cache.file_key('_cache_tmp.rb'))
+		node = NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache => cache)
+		assert_equal(['_cache_tmp.rb', 6], node.compile.eval)
+	end
+
+	# Truncated or corrupted entries must be treated as missing ones
+	def test_corrupted_entry
+		bin = NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache_dir => CACHE_DIR).to_bin
+		cache = NodeMarshal::CompileCache.new(CACHE_DIR)
+		key = cache.file_key('_cache_tmp.rb')
+		[bin[0, bin.bytesize / 2], bin[0, 16], 'garbage', ''].each do |bad|
+			cache[key] = bad
+			node = NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache => cache, :gc_start => true)
+			assert_equal(['_cache_tmp.rb', 5], node.compile.eval)
+			assert_equal(bin, node.to_bin)
+			assert_equal(bin, cache[key])
+		end
+		assert_equal(true, cache.delete(key))
+		assert_equal(false, cache.delete(key))
+		assert_equal(nil, cache[key])
+	end
+
+	# Cached dump must not be used after renaming of symbols
+	def test_changed_node
+		NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache_dir => CACHE_DIR)
+		node = NodeMarshal.new(:srcfile, '_cache_tmp.rb', :cache_dir => CACHE_DIR)
+		bin = node.to_bin
+		node.filename = 'renamed.rb'
+		assert_not_equal(bin, node.to_bin)
+		assert_equal('renamed.rb', NodeMarshal.new(:binmemory, node.to_bin).filename)
+	end
+
+	# Size-bounded eviction of the least recently used entries
+	def test_eviction
+		cache = NodeMarshal::CompileCache.new(CACHE_DIR, :max_size => 2500)
+		t = Time.now - 100
+		(1..3).each do |i|
+			cache["key#{i}"] = 'x' * 1000
+			File.utime(t + i, t + i, File.join(CACHE_DIR, "key#{i}.nmbin"))
+		end
+		assert_equal(nil, cache['key1'])
+		assert_equal('x' * 1000, cache['key3'])
+		assert_equal(2000, cache.total_size)
+		cache.clear
+		assert_equal(0, cache.total_size)
+	end
+
+	# Compilation of files by means of the cache
+	def test_compile_rb_file
+		txt = (1..2).map do
+			NodeMarshal.compile_rb_file('_cache_out.rb', 'lifegame.rb', :cache_dir => CACHE_DIR)
+			File.read('_cache_out.rb')
+		end
+		File.delete('_cache_out.rb')
+		assert_equal(1, Dir.glob(File.join(CACHE_DIR, '*.nmbin')).size)
+		# The second output is made from the cached dump
+		assert_equal(txt[0], txt[1])
+	end
+end
@@ -0,0 +1,178 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the native compression stage (NodeMarshal::Codec)
+# and the fused base85r -> decompression -> node loading
+class TestCodec < Test::Unit::TestCase
+	SO_PATH = "require '#{File.expand_path('../ext/node-marshal/nodemarshal.so', File.dirname(__FILE__))}'"
+	OUT_DIR = '_codec_out'
+	PROGRAM = <<-EOS
+		class CodecTest
+			def initialize(n); @n = n; end
+			def values; (1..@n).map {|x| "value \#{x}" }; end
+		end
+		CodecTest.new(3).values.join(",")
+	EOS
+
+	def teardown
+		FileUtils.rm_rf(OUT_DIR)
+	end
+
+	def test_roundtrip
+		bin = NodeMarshal.new(:srcmemory, PROGRAM).to_bin
+		NodeMarshal::Codec.codecs.each do |codec|
+			[1, 9].each do |level|
+				frame = NodeMarshal::Codec.compress(bin, :codec => codec, :level => level)
+				info = NodeMarshal::Codec.frame_info(frame)
+				assert_equal(codec, info[:codec])
+				assert_equal(level, info[:level])
+				assert_equal(bin.bytesize, info[:size])
+				assert_equal(bin, NodeMarshal::Codec.decompress(frame))
+				# Frames are accepted by the loader directly
+				node = NodeMarshal.new(:binmemory, frame)
+				assert_equal(eval(PROGRAM), node.compile.eval)
+			end
+		end
+		# Data without the frame header is not changed
+		assert_equal(bin, NodeMarshal::Codec.decompress(bin))
+		assert_equal(nil, NodeMarshal::Codec.frame_info(bin))
+		assert_raise(ArgumentError) { NodeMarshal::Codec.compress(bin, :codec => :lzma) }
+	end
+
+	def test_corrupted_frames
+		bin = NodeMarshal.new(:srcmemory, PROGRAM).to_bin
+		frame = NodeMarshal::Codec.compress(bin)
+		[16, 20, frame.bytesize / 2, frame.bytesize - 1].each do |len|
+			assert_raise(ArgumentError) { NodeMarshal::Codec.decompress(frame[0, len]) }
+		end
+		bad = frame.dup
+		bad[20, 4] = [bin.bytesize + 1].pack('L')
+		assert_raise(ArgumentError) { NodeMarshal::Codec.decompress(bad) }
+		# The declared size is checked before allocation of the output
+		[frame.bytesize * 2000, 0xFFFFFFF0].each do |size|
+			bad[12, 4] = [size].pack('V')
+			assert_raise_message(/declared size \d+ is too large/) { NodeMarshal::Codec.decompress(bad) }
+		end
+	end
+
+	def test_base85r
+		bin = NodeMarshal.new(:srcmemory, PROGRAM).to_bin
+		frame = NodeMarshal::Codec.compress(bin)
+		txt = NodeMarshal.base85r_encode(frame)
+		assert_equal(bin, NodeMarshal::Codec.decode_base85r(txt))
+		assert_equal(bin, NodeMarshal::Codec.decode_base85r(NodeMarshal.base85r_encode(bin)))
+		node = NodeMarshal.new(:base85r, txt)
+		assert_equal(eval(PROGRAM), node.compile.eval)
+	end
+
+	# Long texts, frames and node sections are decoded without GVL
+	def test_large_dumps
+		src = (1..1000).map {|i| "def codec_big#{i}(a, b = #{i}); [a, b, 'str#{i}'].map(&:to_s); end\n" }.join
+		src << "codec_big7(1)"
+		bin = NodeMarshal.new(:srcmemory, src).to_bin
+		frame = NodeMarshal::Codec.compress(bin)
+		txt = NodeMarshal.base85r_encode(frame)
+		assert_operator(txt.bytesize, :>, 65536)
+		results = (1..3).map { Thread.new { NodeMarshal::Codec.decode_base85r(txt) } }.map(&:value)
+		assert_equal([bin] * 3, results)
+		assert_equal(frame, NodeMarshal.base85r_decode(txt))
+		assert_equal(['1', '7', 'str7'], NodeMarshal.new(:base85r, txt).compile.eval)
+		assert_operator(NodeMarshal.new(:binmemory, bin).stats[:tables][:nodes_len], :>, 16384)
+		# The loaded dump is not changed by the caller
+		dump = bin.dup
+		node = NodeMarshal.new(:binmemory, dump)
+		dump.replace('x')
+		assert_equal(['1', '7', 'str7'], node.compile.eval)
+		# Errors
+		bad = txt.dup
+		bad[0] = 'Z'
+		assert_raise(ArgumentError) { NodeMarshal.base85r_decode(bad) }
+		assert_raise(ArgumentError) { NodeMarshal::Codec.decode_base85r(bad) }
+		bad = frame.dup
+		bad[frame.bytesize / 2, 16] = 'x' * 16
+		assert_raise(ArgumentError) { NodeMarshal::Codec.decompress(bad) }
+		bad = frame.dup
+		bad[8, 4] = [0x12345678].pack('L')
+		assert_raise(ArgumentError) { NodeMarshal::Codec.decode_base85r(NodeMarshal.base85r_encode(bad)) }
+		bad = bin.dup
+		bad[-200, 200] = [0xFF].pack('C') * 200
+		assert_raise(ArgumentError) { NodeMarshal.new(:binmemory, bad) }
+	end
+
+	def test_dictionary
+		samples = (1..8).map do |i|
+			NodeMarshal.new(:srcmemory, PROGRAM.sub('CodecTest', "CodecTest#{i}")).to_bin
+		end
+		dict = NodeMarshal::Codec.train_dictionary(samples, 4096)
+		assert_operator(dict.bytesize, :<=, 4096)
+		bin = NodeMarshal.new(:srcmemory, PROGRAM).to_bin
+		plain = NodeMarshal::Codec.compress(bin, :level => 9)
+		frame = NodeMarshal::Codec.compress(bin, :level => 9, :dictionary => dict)
+		assert_operator(frame.bytesize, :<, plain.bytesize)
+		dict_id = NodeMarshal::Codec.frame_info(frame)[:dict_id]
+		assert_not_equal(0, dict_id)
+		# The unknown dictionary
+		other = frame.dup
+		other[8, 4] = [dict_id ^ 1].pack('L')
+		assert_raise(ArgumentError) { NodeMarshal::Codec.decompress(other) }
+		assert_equal(dict_id, NodeMarshal::Codec.add_dictionary(dict))
+		assert_equal(bin, NodeMarshal::Codec.decompress(frame))
+	end
+
+	# Raw dumps after __END__ (:payload => :raw)
+	def test_raw_payload
+		FileUtils.mkdir_p(OUT_DIR)
+		srcfile = File.join(OUT_DIR, 'src.rb')
+		File.open(srcfile, 'w') {|fp| fp << PROGRAM }
+		outfile = File.join(OUT_DIR, 'out_raw.rb')
+		sizes = {}
+		(NodeMarshal::Codec.codecs + [false]).each do |codec|
+			[:raw, :base85r].each do |payload|
+				opts = {:compress => codec, :payload => payload, :so_path => SO_PATH}
+				NodeMarshal.compile_rb_file(outfile, srcfile, opts)
+				sizes[payload] = File.size(outfile)
+				assert_equal(eval(PROGRAM), eval(File.binread(outfile), nil, outfile))
+			end
+			assert_operator(sizes[:raw], :<, sizes[:base85r])
+		end
+		# The compiled file is required from the other directory (the offset
+		# of the payload is independent of the path)
+		NodeMarshal.compile_rb_file(outfile, srcfile, :payload => :raw, :lazy => true, :so_path => SO_PATH)
+		assert_equal(true, require(File.expand_path(outfile)))
+		assert_equal(eval(PROGRAM), CodecTest.new(3).values.join(","))
+		text = NodeMarshal.new(:srcmemory, PROGRAM).to_compiled_rb(nil, :payload => :raw)
+		assert_equal(Encoding::BINARY, text.encoding)
+		assert_equal(true, text.include?("\n__END__\n"))
+		assert_raise(ArgumentError) { NodeMarshal.new(:srcmemory, PROGRAM).to_compiled_rb(nil, :payload => :text) }
+		# The text is returned also when it is written to the file
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		text = node.to_compiled_rb(outfile, :payload => :raw, :so_path => SO_PATH)
+		assert_equal(File.binread(outfile), text)
+		assert_equal(outfile, node.write_compiled_rb_file(outfile, :so_path => SO_PATH))
+		assert_equal(node.to_compiled_rb(nil, :so_path => SO_PATH), File.binread(outfile))
+		# Invalid options don't damage the existing file
+		good = File.binread(outfile)
+		[{:level => 42}, {:payload => :bogus}].each do |opts|
+			assert_raise(ArgumentError) { node.to_compiled_rb(outfile, opts) }
+			assert_raise(ArgumentError) { node.write_compiled_rb_file(outfile, opts) }
+			assert_equal(good, File.binread(outfile))
+		end
+		assert_equal([], Dir.glob(outfile + '*.tmp'))
+	end
+
+	def test_compiled_rb
+		FileUtils.mkdir_p(File.join(OUT_DIR, 'sub'))
+		srcfile = File.join(OUT_DIR, 'src.rb')
+		File.open(srcfile, 'w') {|fp| fp << PROGRAM }
+		dictfile = File.join(OUT_DIR, 'nodes.dict')
+		NodeMarshal.train_dictionary(dictfile, [srcfile], 4096)
+		NodeMarshal::Codec.codecs.each do |codec|
+			[{:compress => codec, :level => 3}, {:compress => false},
+			 {:compress => codec, :dictionary => dictfile}].each do |opts|
+				outfile = File.join(OUT_DIR, 'sub', 'out.rb')
+				NodeMarshal.compile_rb_file(outfile, srcfile, opts.merge(:so_path => SO_PATH))
+				assert_equal(eval(PROGRAM), eval(File.read(outfile), nil, outfile))
+			end
+		end
+	end
+end
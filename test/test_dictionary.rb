@@ -0,0 +1,80 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the shared dictionaries of symbols and literals
+# (NodeMarshal::Dictionary and to_bin(:shared_dict => dict))
+class TestDictionary < Test::Unit::TestCase
+	SO_PATH = "require '#{File.expand_path('../ext/node-marshal/nodemarshal.so', File.dirname(__FILE__))}'"
+	OUT_DIR = '_dict_out'
+	PROGRAMS = (1..3).map do |i|
+		<<-EOS
+			class DictTest#{i}
+				def initialize(n); @n = n; end
+				def values; (1..@n).map {|x| "value \#{x} " + 'utf-8' + :sym_#{i}.to_s }; end
+			end
+			[DictTest#{i}.new(#{i}).values, 1.25, 12345678901234567890123, /ab+c/]
+		EOS
+	end
+
+	def teardown
+		FileUtils.rm_rf(OUT_DIR)
+	end
+
+	def test_build
+		nodes = PROGRAMS.map {|src| NodeMarshal.new(:srcmemory, src) }
+		dict = NodeMarshal::Dictionary.build(nodes)
+		assert_equal(true, dict.symbols.include?(:values))
+		assert_equal(false, dict.symbols.include?(:sym_1))
+		assert_equal(true, dict.literals.include?('utf-8'))
+		assert_equal(true, dict.literals.include?(12345678901234567890123))
+		assert_equal(true, NodeMarshal::Dictionary.load(dict.to_bin).equal?(dict))
+		assert_equal(true, NodeMarshal::Dictionary[dict.id].equal?(dict))
+		assert_equal(dict.symbols.size, NodeMarshal::Dictionary.build(nodes, :min_count => 1).symbols.size - 3)
+		assert_equal(2, NodeMarshal::Dictionary.build(nodes, :max_entries => 2).symbols.size)
+	end
+
+	def test_load
+		dict = NodeMarshal::Dictionary.build(PROGRAMS.map {|src| NodeMarshal.new(:srcmemory, src) })
+		PROGRAMS.each do |src|
+			node = NodeMarshal.new(:srcmemory, src)
+			bin = node.to_bin(:shared_dict => dict)
+			assert_operator(bin.bytesize, :<, node.to_bin.bytesize)
+			[{}, {:lazy => true}, {:nodes_layout => :columnar}].each do |opts|
+				bin = NodeMarshal.new(:srcmemory, src).to_bin(opts.merge(:shared_dict => dict))
+				assert_equal(eval(src), NodeMarshal.new(:binmemory, bin).compile.eval)
+			end
+		end
+		assert_raise(ArgumentError) { NodeMarshal.new(:srcmemory, '1').to_bin(:shared_dict => 'file') }
+	end
+
+	def test_errors
+		dict = NodeMarshal::Dictionary.new([:dict_errors_test], ['dict errors test'])
+		bin = dict.to_bin
+		bad = bin.dup
+		bad[-1] = (bad[-1].ord ^ 1).chr
+		assert_raise(ArgumentError) { NodeMarshal::Dictionary.load(bad) }
+		assert_raise(ArgumentError) { NodeMarshal::Dictionary.load(bin[0, 30]) }
+		assert_raise(ArgumentError) { NodeMarshal::Dictionary.load('NODEMARSHAL12') }
+		# The dump refers to the dictionary that is not loaded
+		dump = NodeMarshal.new(:srcmemory, 'dict_errors_test = "dict errors test"').to_bin(:shared_dict => dict)
+		dump[28, 4] = [dict.id ^ 1].pack('L<')
+		assert_raise(ArgumentError) { NodeMarshal.new(:binmemory, dump) }
+	end
+
+	def test_compiled_rb
+		FileUtils.mkdir_p(File.join(OUT_DIR, 'sub'))
+		srcfiles = PROGRAMS.each_with_index.map do |src, i|
+			name = File.join(OUT_DIR, "src#{i}.rb")
+			File.open(name, 'w') {|fp| fp << src }
+			name
+		end
+		dictfile = File.join(OUT_DIR, 'project.nmdict')
+		NodeMarshal::Dictionary.build(srcfiles).save(dictfile)
+		srcfiles.each_with_index do |name, i|
+			outfile = File.join(OUT_DIR, 'sub', "out#{i}.rb")
+			NodeMarshal.compile_rb_file(outfile, name, :shared_dict => dictfile, :so_path => SO_PATH)
+			assert_equal(true, File.read(outfile).include?('project.nmdict'))
+			assert_equal(eval(PROGRAMS[i]), eval(File.read(outfile), nil, outfile))
+		end
+	end
+end
@@ -0,0 +1,29 @@
+require_relative '../bench/fuzz.rb'
+require 'test/unit'
+
+# Tests for validation of corrupted dumps by the loaders (see bench/fuzz.rb)
+class TestFuzz < Test::Unit::TestCase
+	def test_fuzz
+		corpus = NodeMarshalFuzz.seeds
+		corpus.each {|name, kind, data| assert_nothing_raised { NodeMarshalFuzz.load(kind, data) } }
+		res = NodeMarshalFuzz.run(2000, 1, corpus)
+		assert_equal([], res[:errors])
+		assert_equal(2000, res[:loaded] + res[:rejected])
+		assert_operator(res[:rejected], :>, 0)
+	end
+
+	def test_corrupted_hash
+		hash = NodeMarshal.new(:srcmemory, "def fuzz_func(a); $g = a; end").to_hash
+		load_hash = lambda {|key, val| NodeMarshal.new(:binmemory, Marshal.dump(hash.merge(key => val))) }
+		assert_equal(true, load_hash.call(:nodename, 'fuzz').is_a?(NodeMarshal))
+		# Global entry without the name of the global variable
+		syms = hash[:symbols].map {|sym| (sym == '$g') ? 'g; $h' : sym }
+		assert_raise(ArgumentError) { load_hash.call(:symbols, syms) }
+		assert_raise(ArgumentError) { load_hash.call(:global_entries, [hash[:symbols].size]) }
+		# Ordinals of symbols and lengths of tables
+		assert_raise(ArgumentError) { load_hash.call(:id_tables, hash[:id_tables].map {|t| [1000] }) }
+		assert_raise(TypeError) { load_hash.call(:id_tables, hash[:id_tables].map {|t| 'str' }) }
+		assert_raise(ArgumentError) { load_hash.call(:num_of_nodes, hash[:nodes].bytesize) }
+		assert_raise(RangeError) { load_hash.call(:num_of_nodes, 2**40) }
+	end
+end
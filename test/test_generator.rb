@@ -0,0 +1,59 @@
+require_relative '../bench/scaling.rb'
+require 'test/unit'
+
+# Tests for the generator of synthetic programs and the scaling benchmark
+# (see bench/generator.rb and bench/scaling.rb)
+class TestGenerator < Test::Unit::TestCase
+	Generator = NodeMarshalBench::Generator
+
+	def setup
+		@verbose, $VERBOSE = $VERBOSE, nil
+	end
+
+	def teardown
+		$VERBOSE = @verbose
+	end
+
+	# The programs must contain all node types of nodes_child_info
+	# that are produced by the parser
+	def test_coverage
+		types = {}
+		Generator::SHAPES.each do |shape|
+			types.merge!(NodeMarshal.new(:srcmemory, Generator.source(shape, 1000)).node_type_counts)
+		end
+		expected = Generator.node_types - Generator.unreachable_types
+		assert_operator(expected.size, :>, 90)
+		assert_equal([], expected - types.keys.map(&:to_s))
+	end
+
+	# Loaded programs of all shapes must give the same results as the original ones
+	def test_shapes
+		Generator::SHAPES.each do |shape|
+			src = Generator.source(shape, 2000)
+			node = NodeMarshal.new(:srcmemory, src)
+			assert_in_delta(2000, node.to_hash[:num_of_nodes], 2000 * 0.8, shape.to_s)
+			expected = TOPLEVEL_BINDING.eval(src)
+			[node.to_bin, Marshal.dump(node.to_hash),
+			 NodeMarshal.new(:srcmemory, src).to_bin(:nodes_layout => :columnar)].each do |bin|
+				assert_equal(expected, NodeMarshal.new(:binmemory, bin).compile.eval, shape.to_s)
+			end
+		end
+		assert_raise(ArgumentError) { Generator.source(:unknown, 1000) }
+	end
+
+	# Only the sizes and the roundtrip are checked here: times are
+	# measured by bench/scaling.rb
+	def test_scaling
+		assert_in_delta(1.0, NodeMarshalBench::Scaling.slope(1000, 2.0, 10000, 20.0), 1e-9)
+		results = [1000, 10000].map {|n| NodeMarshalBench::Scaling.run_entry(:wide, n, 1) }
+		results.zip([1000, 10000]).each do |res, n|
+			assert_in_delta(n, res[:nodes], n * 0.8)
+			assert_equal([:to_hash, :to_bin, :load_bin], res[:times].keys)
+		end
+		assert_operator(results[1][:bin_bytes], :>, results[0][:bin_bytes])
+		assert_operator(results[1][:memory], :>, results[0][:memory])
+		src = NodeMarshalBench::Generator.source(:wide, 10000)
+		bin = NodeMarshal.new(:srcmemory, src).to_bin
+		assert_equal(TOPLEVEL_BINDING.eval(src), NodeMarshal.new(:binmemory, bin).compile.eval)
+	end
+end
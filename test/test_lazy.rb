@@ -0,0 +1,121 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the lazy container (NodeMarshal#to_bin(:lazy => true)):
+# methods are loaded and compiled at the first call
+class TestLazy < Test::Unit::TestCase
+	SRC = <<-'EOS'
+		LAZY_TOP = 5
+		module LazyTestModule
+			K = 10
+			class Base
+				def describe(prefix); "#{prefix}:#{self.class.name}:#{[1, 2, 3].size}"; end
+			end
+			class Calc < Base
+				attr_reader :a
+				def initialize(a); @a = a; end
+				def calc(x, y = 2, *rest, k: 3, &blk)
+					v = x + y + rest.size + k + K + LAZY_TOP + @a
+					v = blk.call(v) if blk
+					[v, __method__]
+				end
+				def describe(prefix); super(prefix.upcase) + "!" * (1 + 0 * 2); end
+				def self.make(n); new(n * 2 + 0 * 3 - 0); end
+				def unused; raise "Never called" + [1, 2, 3].inspect; end
+				private
+				def secret; [1, 2, 3, 4, 5, 6, 7, 8]; end
+				public
+				def open_secret; secret.map { |x| x * 2 } + [@a, @a]; end
+			end
+		end
+		def lazy_top_fn(a); [a, a * 2, a * 3, a * 4, a * 5]; end
+		c = LazyTestModule::Calc.make(1)
+		[c.calc(1, k: 4) { |v| v * 10 }, c.calc(1, 2, 3), c.open_secret,
+			lazy_top_fn(2), c.describe('x'), (c.secret rescue :private)]
+	EOS
+	SO_PATH = "require '#{File.expand_path('../ext/node-marshal/nodemarshal.so', File.dirname(__FILE__))}'"
+	RESULT = [[240, :calc], [24, :calc], [2, 4, 6, 8, 10, 12, 14, 16, 2, 2],
+		[2, 4, 6, 8, 10], "X:LazyTestModule::Calc:3!", :private]
+
+	# Methods must work as original ones; uncalled methods must be
+	# left in sections
+	def test_lazy_methods
+		node = NodeMarshal.new(:srcmemory, SRC)
+		bin = node.to_bin(:lazy => 4)
+		assert_not_equal(node.to_bin[0, 16], bin[0, 16])
+		assert_equal(RESULT, NodeMarshal.new(:binmemory, bin).compile.eval)
+		stats = NodeMarshal::LazyLoader.stats.values.last
+		assert_equal(9, stats[0])
+		assert_equal(8, stats[1]) # Calc#unused is not loaded
+		# Methods of the source node must be restored after making the stubs
+		Object.send(:remove_const, :LazyTestModule)
+		Object.send(:remove_const, :LAZY_TOP)
+		assert_equal(RESULT, node.compile.eval)
+		assert_equal(stats, NodeMarshal::LazyLoader.stats.values.last)
+	ensure
+		Object.send(:remove_const, :LazyTestModule) if defined?(LazyTestModule)
+		Object.send(:remove_const, :LAZY_TOP) if defined?(LAZY_TOP)
+	end
+
+	# The name of the container is derived from its content; released
+	# containers are not kept by the loader
+	def test_lazy_id
+		node = NodeMarshal.new(:srcmemory, SRC)
+		bin = node.to_bin(:lazy => 4)
+		assert_equal(bin, NodeMarshal.new(:srcmemory, SRC).to_bin(:lazy => 4))
+		assert_not_equal(bin, node.to_bin(:lazy => 5))
+		id = bin[24, bin[20, 4].unpack('V')[0]]
+		assert_match(/\Anmlazy_[0-9a-f]{16}\z/, id)
+		assert_equal(RESULT, NodeMarshal.new(:binmemory, bin).compile.eval)
+		assert_equal(true, NodeMarshal::LazyLoader.stats.has_key?(id.to_sym))
+		assert_equal(true, NodeMarshal::LazyLoader.release(id))
+		assert_equal(false, NodeMarshal::LazyLoader.stats.has_key?(id.to_sym))
+		assert_equal(false, NodeMarshal::LazyLoader.release(id))
+		# Loaded methods keep working, stubs of other methods raise
+		assert_equal([24, :calc], LazyTestModule::Calc.make(1).calc(1, 2, 3))
+		assert_raise(ArgumentError) { LazyTestModule::Calc.new(1).unused }
+	ensure
+		Object.send(:remove_const, :LazyTestModule) if defined?(LazyTestModule)
+		Object.send(:remove_const, :LAZY_TOP) if defined?(LAZY_TOP)
+	end
+
+	# Ends of the range literal that can be dumped only once
+	# (by the first dump of the whole tree)
+	class OnceDumped
+		@dumps = 0
+		class << self; attr_accessor :dumps; end
+		def self._load(str); new; end
+		def <=>(other); 0; end
+		def _dump(level)
+			OnceDumped.dumps += 1
+			raise ArgumentError, 'OnceDumped' if OnceDumped.dumps > 2
+			''
+		end
+	end
+
+	# Exceptions during making of the container must not leave
+	# the garbage collector disabled
+	def test_lazy_gc_enabled
+		node = NodeMarshal.new(:srcmemory, "def lazy_lit_fn; [(1..2), 1, 2, 3, 4]; end; lazy_lit_fn")
+		node.to_hash
+		node.change_literal(1..2, OnceDumped.new..OnceDumped.new)
+		assert_raise_message('OnceDumped') { node.to_bin(:lazy => 4) }
+		assert_operator(OnceDumped.dumps, :>, 2)
+		assert_equal(false, GC.enable)
+	end
+
+	# Memory mapped file and the compiled Ruby file
+	def test_lazy_file
+		node = NodeMarshal.new(:srcmemory, SRC)
+		File.binwrite('_lazy.bin', node.to_bin(:lazy => true))
+		assert_equal(RESULT, NodeMarshal.new(:binmmap, '_lazy.bin').compile.eval)
+		Object.send(:remove_const, :LazyTestModule)
+		Object.send(:remove_const, :LAZY_TOP)
+		node.to_compiled_rb('_lazy.rb', :lazy => true, :so_path => SO_PATH)
+		assert_equal(RESULT, eval(File.read('_lazy.rb')))
+	ensure
+		Object.send(:remove_const, :LazyTestModule) if defined?(LazyTestModule)
+		Object.send(:remove_const, :LAZY_TOP) if defined?(LAZY_TOP)
+		['_lazy.bin', '_lazy.rb'].each {|name| File.delete(name) if File.exist?(name) }
+	end
+end
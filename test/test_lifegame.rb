@@ -10,6 +10,8 @@ class TestLifeGame < Test::Unit::TestCase
 	def test_compile
 		compile_with_opts(nil)
 		compile_with_opts(:compress=>true)
+		compile_with_opts(:compress=>true, :gc_start=>false)
+		compile_with_opts(:compress=>false, :nodes_layout=>:columnar)
 	end
 	# Test life game with glider gun configuration
 	def test_glider_gun
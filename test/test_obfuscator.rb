@@ -33,4 +33,93 @@ class TestObfuscator < Test::Unit::TestCase
 		75.times {g.send(make_step_name)}
 		puts g.to_ascii
 	end
+
+	# Bulk renaming of symbols by the index of the table of symbols
+	def test_change_symbols
+		node = NodeMarshal.new(:srcmemory, "def obf_first; 1; end; def obf_second; 2; end; [obf_first, obf_second]")
+		node.to_hash
+		bin = node.to_bin
+		sections = node.stats[:sections]
+		# Symbols may be swapped, absent symbols are ignored
+		assert_equal(2, node.change_symbols("obf_first" => "obf_second", "obf_second" => "obf_first",
+			"obf_absent" => "obf_other"))
+		assert_raise(ArgumentError) { node.change_symbols("obf_first" => "obf_second") }
+		assert_raise(ArgumentError) { node.change_symbols("obf_first" => "x", "obf_second" => "x") }
+		assert_raise(ArgumentError) { node.change_symbols(:obf_first => "x") }
+		assert_raise(ArgumentError) { node.change_symbol("obf_first", "obf_second") }
+		assert_equal(nil, node.change_symbol("obf_absent", "obf_other"))
+		assert_equal(node, node.change_symbol("obf_first", "obf_third"))
+		# Direct changes of the table are noticed by the index
+		syms = node.to_hash[:symbols]
+		syms[syms.index("obf_third")] = "obf_fourth"
+		assert_equal(nil, node.change_symbol("obf_third", "obf_renamed1"))
+		node.to_hash[:symbols] = syms.dup
+		assert_equal(node, node.change_symbol("obf_fourth", "obf_renamed1"))
+		assert_equal(1, node.change_symbols("obf_second" => "obf_renamed2"))
+		# Only symbols and literals are encoded again
+		new_bin = node.to_bin
+		assert_not_equal(bin, new_bin)
+		[:literals, :id_tables, :args, :nodes].each {|name| assert_equal(sections[name], node.stats[:sections][name]) }
+		assert_equal(sections[:symbols] + 5, node.stats[:sections][:symbols])
+		assert_equal(node.stats[:to_bin].keys, [:encode, :total])
+		assert_equal([1, 2], NodeMarshal.new(:binmemory, new_bin).compile.eval)
+		assert_equal(true, Object.private_method_defined?(:obf_renamed1))
+		assert_equal(node.to_bin(:nodes_layout => :columnar), node.to_bin(:nodes_layout => :columnar))
+	end
+
+	def test_change_literals
+		node = NodeMarshal.new(:srcmemory, "['secret', 'secret', 1000000000000000000000000000000, /ab+c/]")
+		assert_equal(2, node.change_literals("secret" => "public"))
+		assert_equal(node, node.change_literal(10**30, 12345678901234567890123))
+		assert_equal(nil, node.change_literal("absent", "other"))
+		assert_raise(ArgumentError) { node.change_literal("public", :public) }
+		assert_raise(ArgumentError) { node.change_literals }
+		assert_equal(1, node.change_literals {|lit, ord| lit.is_a?(Regexp) ? /xy+z/ : lit })
+		res = NodeMarshal.new(:binmemory, node.to_bin).compile.eval
+		assert_equal(['public', 'public', 12345678901234567890123, /xy+z/], res)
+	end
+
+	def test_dedup_literals
+		src = "a = ['str', 'str', 'str'.freeze, /re/, /re/, (1..2), (1..2), 1000000000000000000000000000000, 1000000000000000000000000000000]; " +
+			"a[0] << '!'; a + [a[1].frozen?]"
+		node = NodeMarshal.new(:srcmemory, src)
+		ref = node.compile.eval
+		nlits = node.to_hash[:literals].length
+		assert(node.dedup_literals > 0)
+		assert_equal(0, node.dedup_literals)
+		assert(node.to_hash[:literals].length < nlits)
+		node2 = NodeMarshal.new(:srcmemory, src)
+		bin = node2.to_bin(:dedup_literals => true)
+		assert_equal(node.to_hash[:literals].length, node2.to_hash[:literals].length)
+		[node.to_bin, bin, node.to_bin(:nodes_layout => :columnar)].each do |b|
+			assert_equal(ref, NodeMarshal.new(:binmemory, b).compile.eval)
+		end
+		assert_raise(ArgumentError) { node.to_bin(:dedup_literals => true, :lazy => true) }
+	end
+
+	def test_dedup_nodes
+		src = (1..20).map {|i| "def m#{i}(a, b = [1, 2], c: [1, 2]); [[1, 2, 'x'], {:k => [1, 2]}, [3], nil, a, b, c]; end\n" }.join +
+			"[m1(0), m20(1, 2, c: 3), [1, 2], [[3], [3]]]"
+		node = NodeMarshal.new(:srcmemory, src)
+		ref = node.compile.eval
+		num = node.to_hash[:num_of_nodes]
+		assert_operator(node.dedup_nodes, :>, 0)
+		stats = node.stats[:dedup_nodes]
+		assert_equal(num, stats[:nodes])
+		assert_equal(node.to_hash[:num_of_nodes], stats[:unique])
+		assert_in_delta(1.0 - stats[:unique].to_f / num, stats[:ratio], 1e-9)
+		assert_equal(0, node.dedup_nodes)
+		assert_equal(0.0, node.stats[:dedup_nodes][:ratio])
+		node2 = NodeMarshal.new(:srcmemory, src)
+		bin = node2.to_bin(:dedup_literals => true, :dedup_nodes => true)
+		assert_operator(bin.size, :<, NodeMarshal.new(:srcmemory, src).to_bin.size)
+		[node.to_bin, bin, node.to_bin(:nodes_layout => :columnar), Marshal.dump(node2.to_hash)].each do |b|
+			loaded = NodeMarshal.new(:binmemory, b)
+			assert_equal(ref, loaded.compile.eval)
+			# Shared subtrees are saved once by the next dump too
+			assert_equal(ref, NodeMarshal.new(:binmemory, loaded.to_bin).compile.eval)
+		end
+		assert_operator(NodeMarshal.new(:binmemory, bin).stats[:tables][:nodes_len], :<, node2.stats[:dedup_nodes][:nodes])
+		assert_raise(ArgumentError) { node.to_bin(:dedup_nodes => true, :lazy => true) }
+	end
 end
@@ -0,0 +1,87 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for preloading of dumps in the master process (NodeMarshal.preload)
+class TestPreload < Test::Unit::TestCase
+	SRC_DIR = '_preload_src'
+	BUNDLE = '_preload_test.nmbundle'
+	DUMP = '_preload_test.bin'
+
+	def setup
+		FileUtils.mkdir_p(File.join(SRC_DIR, 'preloadtest'))
+		File.open(File.join(SRC_DIR, 'preloadtest', 'main.rb'), 'w') do |fp|
+			fp << "require 'preloadtest/helper'\n" +
+				"module PreloadTest; def self.main; [helper(3), $$]; end; end\n"
+		end
+		File.open(File.join(SRC_DIR, 'preloadtest', 'helper.rb'), 'w') do |fp|
+			fp << "module PreloadTest; def self.helper(x); (1..x).map {|i| 'item ' + i.to_s }; end; end\n"
+		end
+	end
+
+	def teardown
+		FileUtils.rm_rf(SRC_DIR)
+		FileUtils.rm_f([BUNDLE, DUMP])
+		NodeMarshal::Bundle.installed.clear
+		NodeMarshal::Preload.clear
+	end
+
+	# Runs the block in the forked process and returns its result
+	def in_worker
+		rd, wr = IO.pipe
+		pid = fork do
+			rd.close
+			wr.write(Marshal.dump(yield))
+			wr.close
+			exit!(0)
+		end
+		wr.close
+		ans = Marshal.load(rd.read)
+		rd.close
+		Process.wait(pid)
+		ans
+	end
+
+	def test_bundle
+		omit('fork is not supported') if !Process.respond_to?(:fork)
+		NodeMarshal::Bundle.build(BUNDLE, SRC_DIR)
+		res = NodeMarshal.preload(BUNDLE)
+		assert_equal(2, res[:entries])
+		assert_operator(res[:nodes], :>, 0)
+		bundle = NodeMarshal::Bundle.installed[0]
+		assert_equal(true, NodeMarshal::Preload.include?(bundle.feature_path('preloadtest/main')))
+		assert_equal(false, defined?(PreloadTest) != nil)
+		FileUtils.rm_f(BUNDLE)
+		ans = in_worker do
+			require 'preloadtest/main'
+			report = NodeMarshal::Preload.memory_report
+			[PreloadTest.main, NodeMarshal::Preload.hits, report && report[:shared_pages]]
+		end
+		assert_equal(['item 1', 'item 2', 'item 3'], ans[0][0])
+		assert_not_equal($$, ans[0][1])
+		assert_equal(2, ans[1])
+		assert_operator(ans[2], :>, 0) if ans[2]
+	end
+
+	# Entries are required by the master
+	def test_require
+		NodeMarshal::Bundle.build(BUNDLE, SRC_DIR)
+		NodeMarshal.preload(NodeMarshal::Bundle.open(BUNDLE), :require => ['preloadtest/main'], :gc => false)
+		assert_equal(['item 1'], PreloadTest.main[0][0, 1])
+		assert_equal(2, NodeMarshal::Preload.hits)
+		assert_equal(false, require('preloadtest/helper'))
+	end
+
+	def test_dump_files
+		File.binwrite(DUMP, NodeMarshal.new(:srcmemory, "[1, 2].map {|x| x * 10 }").to_bin)
+		res = NodeMarshal.preload([DUMP])
+		assert_equal(1, res[:entries])
+		assert_equal([10, 20], NodeMarshal::Preload.eval(DUMP))
+		assert_raise(LoadError) { NodeMarshal::Preload.eval('_absent.bin') }
+		report = NodeMarshal::Preload.memory_report
+		if report
+			assert_operator(report[:rss], :>, 0)
+			assert_equal(report[:shared_pages] * Etc.sysconf(Etc::SC_PAGESIZE) / 1024,
+				report[:shared_clean] + report[:shared_dirty])
+		end
+	end
+end
@@ -0,0 +1,44 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for queries of the syntax tree (node_type_counts, each_node,
+# find_calls, max_depth)
+class TestQuery < Test::Unit::TestCase
+	SRC = "def qfunc(a, b = qcall(1)); a.qcall(b) + qcall + a&.qcall; end; " +
+		"x = [1, 2]; x.qcall = 3; qfunc(1, 2)"
+
+	def test_node_type_counts
+		node = NodeMarshal.new(:srcmemory, SRC)
+		counts = node.node_type_counts
+		assert_equal(counts.values.inject(:+), node.stats[:tables][:nodes_len])
+		assert_equal(counts, node.stats[:node_types])
+		assert_equal(node.each_node(:NODE_CALL).count, counts[:NODE_CALL])
+		# Loaded node has the same tree
+		node2 = NodeMarshal.new(:binmemory, node.to_bin)
+		assert_equal(counts, node2.node_type_counts)
+		assert_equal(node.max_depth, node2.max_depth)
+	end
+
+	def test_each_node
+		node = NodeMarshal.new(:srcmemory, SRC)
+		assert_kind_of(Enumerator, node.each_node)
+		assert_equal([:NODE_SCOPE, 1, 1], node.each_node.first)
+		assert_equal(node.each_node(:DEFN).to_a, node.each_node("NODE_DEFN").to_a)
+		assert_equal([[:NODE_DEFN, 1, 4]], node.each_node(:DEFN).to_a)
+		assert_equal(node.max_depth, node.each_node.map {|type, line, depth| depth }.max)
+		assert_raise(ArgumentError) { node.each_node(:NODE_ABSENT).to_a }
+	end
+
+	def test_find_calls
+		node = NodeMarshal.new(:srcmemory, SRC)
+		calls = [[:NODE_FCALL, 1], [:NODE_CALL, 1], [:NODE_VCALL, 1], [:NODE_QCALL, 1]]
+		assert_equal(calls.sort, node.find_calls(:qcall).sort)
+		assert_equal([[:NODE_ATTRASGN, 1]], node.find_calls("qcall="))
+		assert_equal([], node.find_calls("qcall_absent_method"))
+	end
+
+	def test_deep_tree
+		node = NodeMarshal.new(:srcmemory, "x = " + "[" * 5000 + "]" * 5000)
+		assert(node.max_depth > 5000)
+	end
+end
@@ -0,0 +1,99 @@
+require_relative '../lib/node-marshal.rb'
+require 'test/unit'
+
+# Tests for the instrumentation of loading and dumping
+# (NodeMarshal#stats and NodeMarshal::Stats)
+class TestStats < Test::Unit::TestCase
+	PROGRAM = <<-EOS
+		$stats_gvar = 5
+		def stats_test(a, b = 2); [a, b, "str", 1..a, :sym]; end
+		stats_test(3) { |x| x * 2 }
+	EOS
+	LOAD_PHASES = [:symbols, :literals, :global_entries, :id_tables, :alloc_nodes, :nodes, :total]
+
+	def teardown
+		NodeMarshal::Stats.disable
+	end
+
+	# Phases, tables and histogram of the parsed and the loaded node
+	def test_node_stats
+		node = NodeMarshal.new(:srcmemory, PROGRAM, :gc_start => false)
+		bin = node.to_bin
+		st = node.stats
+		assert_equal([:parse, :total], st[:parse].keys)
+		assert_equal([:count_nodes, :dump_nodes, :encode, :total], st[:to_bin].keys)
+		st[:to_bin].each_value do |phase|
+			assert_kind_of(Float, phase[:time])
+			assert_kind_of(Integer, phase[:allocs])
+		end
+		nodes_len = node.to_hash[:num_of_nodes]
+		assert_equal(nodes_len, st[:tables][:nodes_len])
+		assert_equal(1, st[:tables][:gvars_len])
+		assert_equal(nodes_len, st[:node_types].values.inject(:+))
+		assert_equal(1, st[:node_types][:NODE_DEFN])
+		# Sections of the written container
+		assert_equal([:encodings, :symbols, :literals, :global_entries, :id_tables, :args, :nodes],
+			st[:sections].keys)
+		assert_operator(st[:sections].values.inject(:+), :<, bin.bytesize)
+		# Loaded nodes have the same tables
+		[bin, Marshal.dump(node.to_hash), NodeMarshal::Codec.compress(bin)].each do |dump|
+			loaded = NodeMarshal.new(:binmemory, dump, :gc_start => false)
+			lst = loaded.stats
+			assert_equal(LOAD_PHASES, LOAD_PHASES & lst[:load].keys)
+			assert_equal(st[:tables], lst[:tables])
+			assert_equal(st[:node_types], lst[:node_types])
+			assert_equal(false, lst[:load].has_key?(:gc))
+			assert_operator(lst[:load][:total][:allocs], :>=, lst[:load][:alloc_nodes][:allocs])
+		end
+		assert_equal(true, NodeMarshal.new(:binmemory, NodeMarshal::Codec.compress(bin)).stats[:load].has_key?(:decompress))
+		text = NodeMarshal.base85r_encode(bin)
+		assert_equal(:decode, NodeMarshal.new(:base85r, text).stats[:load].keys.first)
+	end
+
+	# Global collector: subscribers and accumulated totals
+	def test_collector
+		events = []
+		sub = NodeMarshal::Stats.subscribe {|op, node, phases| events << [op, node, phases[:total][:time]] }
+		assert_equal(NodeMarshal::Stats, NodeMarshal.stats_listener)
+		NodeMarshal::Stats.enable
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		bin = node.to_bin
+		2.times { NodeMarshal.new(:binmemory, bin, :gc_start => false) }
+		assert_equal([:parse, :to_bin, :load, :load], events.map(&:first))
+		assert_same(node, events[0][1])
+		totals = NodeMarshal::Stats.totals
+		assert_equal(2, totals[:load][:count])
+		assert_in_delta(events[2][2] + events[3][2], totals[:load][:phases][:total][:time], 1e-9)
+		# Unsubscribed collector doesn't receive statistics
+		NodeMarshal::Stats.unsubscribe(sub)
+		NodeMarshal::Stats.reset
+		NodeMarshal.new(:binmemory, bin)
+		assert_equal(4, events.size)
+		assert_equal(1, NodeMarshal::Stats.totals[:load][:count])
+		NodeMarshal::Stats.disable
+		assert_equal(nil, NodeMarshal.stats_listener)
+		assert_raise(ArgumentError) { NodeMarshal.stats_listener = 5 }
+	end
+
+	# Native memory of the parsed and the loaded node (see also ObjectSpace.memsize_of)
+	def test_memory
+		require 'objspace'
+		node = NodeMarshal.new(:srcmemory, PROGRAM)
+		bin = node.to_bin
+		mem = node.stats[:memory]
+		assert_equal([:tables, :id_tables, :args, :nodes], mem.keys)
+		assert_operator(ObjectSpace.memsize_of(node.instance_variable_get(:@nodeinfo)), :>=, mem[:tables])
+		loaded = NodeMarshal.new(:binmemory, bin)
+		lmem = loaded.stats[:memory]
+		[:id_tables, :args, :nodes].each {|key| assert_equal(mem[key], lmem[key]) }
+		assert_operator(lmem[:id_tables], :>, 0)
+		assert_operator(lmem[:args], :>, 0)
+		assert_operator(ObjectSpace.memsize_of(loaded.instance_variable_get(:@obj_addresses)), :>=, lmem[:tables])
+		# Interrupted loading: tables that are not passed to nodes are freed with relocations
+		hash = node.to_hash.dup
+		hash[:nodes] = hash[:nodes][0, hash[:nodes].size / 2]
+		assert_raise(ArgumentError) { NodeMarshal.new(:binmemory, Marshal.dump(hash)) }
+		GC.start
+		assert_equal(eval(PROGRAM), NodeMarshal.new(:binmemory, bin).compile.eval)
+	end
+end